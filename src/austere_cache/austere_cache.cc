@@ -1,15 +1,23 @@
 #include "austere_cache.h"
 #include "common/env.h"
 #include "common/config.h"
+#include "common/index_geometry.h"
 
 #include "manage/dirtylist.h"
+#include "metadata/metadata_cache.h"
+#include "metadata/meta_journal.h"
+#include "metadata/warm_restart.h"
+#include "metadata/index_checkpoint.h"
+#include "metadata/metadata_module.h"
 #include "metadata/cachededup/cdarc_fpindex.h"
+#include "io/device_model.h"
  
 
 #include <unistd.h>
 
 #include <vector>
 #include <thread>
+#include <condition_variable>
 #include <cassert>
 #include <csignal>
 #include <chrono>
@@ -19,12 +27,55 @@
 namespace cache {
     AustereCache::AustereCache()
     {
+      // The configuration is final from here on, fix the index geometry
+      IndexGeometry::getInstance();
+      if (MetadataCache::getInstance().isEnabled()) {
+        std::cout << "Metadata cache: " << MetadataCache::getInstance().getMemoryUsage()
+                  << " bytes" << std::endl;
+      }
       IOModule::getInstance().addCacheDevice(Config::getInstance().getCacheDeviceName());
       IOModule::getInstance().addPrimaryDevice(Config::getInstance().getPrimaryDeviceName());
+      if (Config::getInstance().getnChunkWorkers() > 0) {
+        // Chunks processed in parallel rely on the bucket locks
+        if (Config::getInstance().isMultiThreadingEnabled()) {
+          chunkWorkers_ = std::make_unique<AThreadPool>(Config::getInstance().getnChunkWorkers());
+        } else {
+          std::cout << "Chunk workers need multiThreading, "
+                    << "processing the chunks of a request one after another" << std::endl;
+        }
+      }
+#ifdef ACDC
+      // Reads and clears the checkpoint block of the cache device, whether
+      // the checkpoint is enabled or not
+      IndexCheckpoint::getInstance().recover();
+#endif
+      // The metadata region catches up with the journal before the indexes are used
+      if (MetaJournal::getInstance().isEnabled()) {
+        MetaJournal::getInstance().recover();
+      }
+#ifdef ACDC
+      if (WarmRestart::getInstance().isEnabled()) {
+        WarmRestart::getInstance().recover();
+      }
+#endif
     }
 
     AustereCache::~AustereCache() {
+      chunkWorkers_.reset();
+      if (MetaJournal::getInstance().isEnabled()) {
+        MetaJournal::getInstance().flush();
+      }
       Stats::getInstance().dump();
+#ifdef ACDC
+      // Not part of the statistics of the run
+      if (WarmRestart::getInstance().isEnabled()) {
+        WarmRestart::getInstance().shutdown();
+      }
+      if (IndexCheckpoint::getInstance().isEnabled()) {
+        IndexCheckpoint::getInstance().save(*MetadataModule::getInstance().fpIndex_,
+                                            *MetadataModule::getInstance().lbaIndex_);
+      }
+#endif
       Stats::getInstance().release();
       Config::getInstance().release();
       if (Config::getInstance().getCacheMode() == tWriteBack) {
@@ -43,26 +94,94 @@ namespace cache {
     void AustereCache::read(uint64_t addr, void *buf, uint32_t len)
     {
       Stats::getInstance().setCurrentRequestType(0);
+      uint32_t chunkSize = Config::getInstance().getChunkSize();
+      if (chunkWorkers_ != nullptr && addr / chunkSize != (addr + len - 1) / chunkSize) {
+        parallelProcess(addr, buf, len, false);
+        return;
+      }
       Chunker chunker = ChunkModule::getInstance().createChunker(addr, buf, len);
 
       alignas(512) Chunk chunk;
       while (chunker.next(chunk)) {
         internalRead(chunk);
-        chunk.fpBucketLock_.reset();
-        chunk.lbaBucketLock_.reset();
+        releaseLocks(chunk);
       }
     }
 
     void AustereCache::write(uint64_t addr, void *buf, uint32_t len)
     {
       Stats::getInstance().setCurrentRequestType(1);
+      uint32_t chunkSize = Config::getInstance().getChunkSize();
+      if (chunkWorkers_ != nullptr && addr / chunkSize != (addr + len - 1) / chunkSize) {
+        parallelProcess(addr, buf, len, true);
+        return;
+      }
       Chunker chunker = ChunkModule::getInstance().createChunker(addr, buf, len);
       alignas(512) Chunk c;
 
       while ( chunker.next(c) ) {
         internalWrite(c);
-        c.fpBucketLock_.reset();
-        c.lbaBucketLock_.reset();
+        releaseLocks(c);
+      }
+    }
+
+    void AustereCache::releaseLocks(Chunk &chunk)
+    {
+      chunk.fpBucketLock_.unlock();
+      chunk.lbaBucketLock_.unlock();
+#ifdef ACDC
+      // Reference count updates that found their bucket lock busy
+      MetadataModule::getInstance().fpIndex_->applyDeferredReferenceCounts();
+#endif
+    }
+
+    void AustereCache::parallelProcess(uint64_t addr, void *buf, uint32_t len, bool isWrite)
+    {
+      uint32_t chunkSize = Config::getInstance().getChunkSize();
+      uint32_t nChunks = (addr + len - 1) / chunkSize - addr / chunkSize + 1;
+      Chunker chunker = ChunkModule::getInstance().createChunker(addr, buf, len);
+      std::vector<Chunk> chunks(nChunks);
+      for (Chunk &chunk : chunks) {
+        chunker.next(chunk);
+      }
+
+      // Every chunk starts at the virtual time of the request, the request
+      // completes with the last of them
+      VirtualClock &clock = VirtualClock::getInstance();
+      uint64_t start = clock.now();
+      std::vector<uint64_t> ends(nChunks, start);
+
+      std::mutex mutex;
+      std::condition_variable allDone;
+      uint32_t nPending = nChunks - 1;
+      auto process = [this, isWrite](Chunk &chunk) {
+        if (isWrite) {
+          internalWrite(chunk);
+        } else {
+          internalRead(chunk);
+        }
+        releaseLocks(chunk);
+      };
+      for (uint32_t i = 0; i + 1 < nChunks; ++i) {
+        chunkWorkers_->doJob([&, i]() {
+          clock.setNow(start);
+          process(chunks[i]);
+          ends[i] = clock.now();
+          std::lock_guard<std::mutex> l(mutex);
+          if (--nPending == 0) {
+            allDone.notify_one();
+          }
+        });
+      }
+      // The last chunk on the calling thread meanwhile
+      process(chunks[nChunks - 1]);
+      ends[nChunks - 1] = clock.now();
+      {
+        std::unique_lock<std::mutex> l(mutex);
+        allDone.wait(l, [&nPending]() { return nPending == 0; });
+      }
+      for (uint64_t end : ends) {
+        clock.advanceTo(end);
       }
     }
 }
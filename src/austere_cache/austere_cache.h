@@ -65,6 +65,21 @@ class AustereCache {
  private:
   void internalRead(Chunk &chunk);
   void internalWrite(Chunk &chunk);
+  // Release the bucket locks of a processed chunk, then apply the updates
+  // deferred while holding them
+  void releaseLocks(Chunk &chunk);
+  /**
+   * @brief Process the chunks of a request spanning several chunks on the
+   *        chunk workers, returning once all of them are done
+   *
+   * A request never holds the same LBA twice, and returns before the next
+   * one of its caller starts: each LBA still sees its requests in order.
+   */
+  void parallelProcess(uint64_t addr, void *buf, uint32_t len, bool isWrite);
+
+  // Chunk workers, nullptr if the chunks of a request are processed one
+  // after another (Config::getnChunkWorkers())
+  std::unique_ptr<AThreadPool> chunkWorkers_;
 
   // Statistics
   Stats* stats_;
@@ -8,18 +8,24 @@ namespace cache {
 // Will deal with it in compression module
     void AustereCache::internalRead(Chunk &chunk) {
       // construct compressed buffer for chunk chunk
-      // When the cache is hit, compressedBuf stores the data retrieved from ssd
-      alignas(512) uint8_t compressedBuf[Config::getInstance().getChunkSize()];
-      chunk.compressedBuf_ = compressedBuf;
+      // When the cache is hit, compressedBuf stores the data retrieved from ssd,
+      // behind room for the metadata block read along with it (colocated layout)
+      alignas(512) uint8_t compressedBuf[Config::getInstance().getMetadataSize() + Config::getInstance().getChunkSize()];
+      chunk.compressedBuf_ = compressedBuf + Config::getInstance().getMetadataSize();
 
       // look up index
       DeduplicationModule::lookup(chunk);
+      // read from ssd or hdd according to the lookup result
+      ManageModule::getInstance().read(chunk);
+      if (!DeduplicationModule::validateLookup(chunk)) {
+        // the buckets changed during a lock-free lookup (multithreading),
+        // read again with the result looked up under the bucket locks
+        ManageModule::getInstance().read(chunk);
+      }
       {
         // record status
         Stats::getInstance().addReadLookupStatistics(chunk);
       }
-      // read from ssd or hdd according to the lookup result
-      ManageModule::getInstance().read(chunk);
       if (chunk.lookupResult_ == HIT) {
         // hit the cache
         CompressionModule::decompress(chunk);
@@ -0,0 +1,1052 @@
+/* File: benchmark/index_bench.cc
+ * Description:
+ *   Micro benchmarks of the in-memory index structures.
+ *
+ *   lookup: bucket signature scan on 128-slot LBA and FP buckets: the
+ *           slot-by-slot reference scan and the vector scan over the
+ *           bit-packed layout, and the vector scan over the byte-aligned
+ *           (struct-of-arrays) layout. Exits with 1 if a vector scan does
+ *           not find what the reference scan does.
+ *   alloc:  heap allocations and time per LBAIndex/FPIndex operation, counted
+ *           by replacing the global operator new. With the default (compact)
+ *           cache policies every operation should report 0 allocations; the
+ *           list-based LRU allocates list nodes on promotion by design,
+ *           CLOCK does not. Then the memory of both indexes and of their
+ *           cache policies.
+ *   scale:  FPIndex lookup throughput of 1-8 threads on a shared index with
+ *           1 in 16 operations promoting the slot, once with every lookup
+ *           under the bucket writer lock and once with lock-free lookups
+ *           validated against the bucket version; for per-bucket, striped,
+ *           and embedded bucket locks, with the memory taken by the locks.
+ *   placement: FP index occupancy with one and two bucket choices per
+ *           fingerprint at the same index memory: the fraction of the slots in
+ *           use at the first eviction, and once as many slots as the index
+ *           has were inserted (1 and 1-4 slots per chunk).
+ *   refcount: sketch reference counter throughput of 1-8 threads, each
+ *           referencing and dereferencing its own random fingerprints, once
+ *           with distinct fingerprints and once with 256 hot ones whose
+ *           counters saturate and go through the overflow table; and the
+ *           mean overestimate of the sketch with as many live keys as the
+ *           LBA index has slots. Then FPIndex::reference/dereference of
+ *           resident fingerprints (one thread) with the counts in the sketch
+ *           and embedded in the FP slots.
+ *
+ *   flatmap: std::map against FlatHashMap with 1M random keys, as used by
+ *           MapReferenceCounter (uint64_t counts: reference, query, dereference)
+ *           and the CacheDedup fingerprint indexes (insert, hit and miss
+ *           lookups, erase), with the bytes per key.
+ *
+ *   checkpoint: (ACDC) four AustereCache runs on the same cache device, each
+ *           in a child process: with the index checkpoint, again with it
+ *           (loaded), without it, and with it again, which has to reject the
+ *           checkpoint as the cache device was used since. Exits with 1 if a
+ *           run does not print what is expected.
+ *   journal: (ACDC) a crash after the metadata blocks of an epoch of the
+ *           MetaJournal are applied but before the epoch is closed, then a
+ *           restart replaying its records onto them, with plain and compact
+ *           metadata: every metadata block must have the LBAs of its chunk
+ *           once, in write order. Exits with 1 otherwise.
+ *
+ *   codec:  compact metadata blocks (MetadataCodec) encoded and decoded back:
+ *           LBAs of every alignment, far apart (10-byte varints), a list
+ *           filling the block to the byte and one LBA past it, full rotated
+ *           lists, and random lists. Every block must decode to the newest
+ *           LBAs that fit, in order. Exits with 1 otherwise.
+ *
+ *   Usage: ./index_bench [lookup|alloc|scale|placement|refcount|flatmap|checkpoint|journal|codec]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+#include "utils/utils.h"
+#include "common/config.h"
+#include "metadata/bitmap.h"
+#include "metadata/signature_scan.h"
+#include "metadata/index.h"
+#include "metadata/reference_counter.h"
+#include "metadata/cachededup/dlru_fpindex.h"
+#include "common/flat_hash_map.h"
+#include "common/index_geometry.h"
+#include "metadata/metadata_codec.h"
+#ifdef ACDC
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <functional>
+#include "austere_cache/austere_cache.h"
+#include "io/io_module.h"
+#include "metadata/meta_journal.h"
+#endif
+
+static uint64_t nAllocations = 0, nAllocatedBytes = 0;
+
+void *operator new(size_t size)
+{
+  ++nAllocations;
+  nAllocatedBytes += size;
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+namespace cache {
+
+  class IndexBench {
+    public:
+      static constexpr uint32_t kBuckets = 4096;
+      static constexpr uint32_t kSlots = 128;
+      static constexpr uint32_t kQueries = 4 * 1024 * 1024;
+
+      /**
+       * Fill kBuckets buckets of (nBitsPerKey + nBitsPerValue)-bit slots,
+       * ~90% of the slots valid. Keys come in runs of 1-4 slots to mimic
+       * compressed chunks in the FP index.
+       */
+      IndexBench(uint32_t nBitsPerKey, uint32_t nBitsPerValue) :
+        nBitsPerKey_(nBitsPerKey), nBitsPerSlot_(nBitsPerKey + nBitsPerValue),
+        nBytesPerBucket_((nBitsPerSlot_ * kSlots + 7) / 8),
+        nBytesPerBucketForValid_((kSlots + 7) / 8),
+        nBytesPerAlignedKeys_(nBitsPerKey / 8 * kSlots),
+        data_(nBytesPerBucket_ * kBuckets + sizeof(uint32_t)),
+        alignedKeys_(nBytesPerAlignedKeys_ * kBuckets),
+        valid_(nBytesPerBucketForValid_ * kBuckets + 1)
+      {
+        std::mt19937 rng(7);
+        uint32_t keyMask = (1u << nBitsPerKey_) - 1;
+        for (uint32_t bucketId = 0; bucketId < kBuckets; ++bucketId) {
+          Bitmap::Manipulator data(data_.data() + nBytesPerBucket_ * bucketId);
+          Bitmap::Manipulator valid(valid_.data() + nBytesPerBucketForValid_ * bucketId);
+          for (uint32_t slotId = 0; slotId < kSlots; ) {
+            uint32_t key = rng() & keyMask, run = 1 + rng() % 4;
+            bool isValid = rng() % 10 != 0;
+            for ( ; run > 0 && slotId < kSlots; --run, ++slotId) {
+              data.storeBits(slotId * nBitsPerSlot_, slotId * nBitsPerSlot_ + nBitsPerKey_, key);
+              if (nBitsPerKey_ % 8 == 0) {
+                // Little-endian: the low nBitsPerKey / 8 bytes of key
+                memcpy(alignedKeys_.data() + nBytesPerAlignedKeys_ * bucketId
+                    + slotId * nBitsPerKey_ / 8, &key, nBitsPerKey_ / 8);
+              }
+              if (isValid) valid.set(slotId);
+            }
+          }
+        }
+        // Half of the queries hit, half are random signatures
+        for (uint32_t i = 0; i < kQueries; ++i) {
+          uint32_t bucketId = rng() % kBuckets, key = rng() & keyMask;
+          if (i & 1) {
+            uint32_t slotId = rng() % kSlots;
+            key = Bitmap::Manipulator(data_.data() + nBytesPerBucket_ * bucketId)
+              .getBits(slotId * nBitsPerSlot_, slotId * nBitsPerSlot_ + nBitsPerKey_);
+          }
+          queries_.emplace_back(bucketId, key);
+        }
+      }
+
+      template <typename Scan>
+      uint64_t scan(Scan scanFn)
+      {
+        uint64_t checksum = 0;
+        for (auto &query : queries_) {
+          uint32_t runLength = 0;
+          uint32_t slotId = scanFn(data_.data() + nBytesPerBucket_ * query.first,
+              valid_.data() + nBytesPerBucketForValid_ * query.first,
+              kSlots, nBitsPerSlot_, nBitsPerKey_, query.second, runLength);
+          checksum = checksum * 31 + slotId + runLength;
+        }
+        return checksum;
+      }
+
+      template <typename KeyT>
+      uint64_t scanAligned()
+      {
+        uint64_t checksum = 0;
+        for (auto &query : queries_) {
+          uint32_t runLength = 0;
+          uint32_t slotId = SignatureScan::findAligned<KeyT>(
+              alignedKeys_.data() + nBytesPerAlignedKeys_ * query.first,
+              valid_.data() + nBytesPerBucketForValid_ * query.first,
+              kSlots, query.second, runLength);
+          checksum = checksum * 31 + slotId + runLength;
+        }
+        return checksum;
+      }
+
+      // Whether the vector and aligned scans found what the scalar scan did
+      bool runLookup(const char *name)
+      {
+        long long elapsedScalar = 0, elapsedVector = 0, elapsedAligned = 0;
+        uint64_t checksumScalar = 0, checksumVector = 0, checksumAligned = 0;
+        PERF_FUNCTION(elapsedScalar, checksumScalar = scan, SignatureScan::findScalar);
+        PERF_FUNCTION(elapsedVector, checksumVector = scan, SignatureScan::find);
+        printf("%-4s bucket (%u slots x %u bits): packed scalar %.2f ns/lookup, packed vector %.2f ns/lookup (%.2fx)",
+            name, kSlots, nBitsPerSlot_,
+            elapsedScalar * 1000.0 / kQueries, elapsedVector * 1000.0 / kQueries,
+            (double)elapsedScalar / elapsedVector);
+        if (nBitsPerKey_ == 8 || nBitsPerKey_ == 16 || nBitsPerKey_ == 32) {
+          if (nBitsPerKey_ == 8) {
+            PERF_FUNCTION(elapsedAligned, checksumAligned = scanAligned<uint8_t>);
+          } else if (nBitsPerKey_ == 16) {
+            PERF_FUNCTION(elapsedAligned, checksumAligned = scanAligned<uint16_t>);
+          } else {
+            PERF_FUNCTION(elapsedAligned, checksumAligned = scanAligned<uint32_t>);
+          }
+          printf(", aligned vector %.2f ns/lookup (%.2fx)",
+              elapsedAligned * 1000.0 / kQueries, (double)elapsedScalar / elapsedAligned);
+        } else {
+          checksumAligned = checksumScalar;
+        }
+        bool match = checksumScalar == checksumVector && checksumScalar == checksumAligned;
+        printf("%s\n", match ? "" : " (MISMATCH)");
+        return match;
+      }
+
+    private:
+      uint32_t nBitsPerKey_, nBitsPerSlot_;
+      uint32_t nBytesPerBucket_, nBytesPerBucketForValid_, nBytesPerAlignedKeys_;
+      std::vector<uint8_t> data_;
+      // Key arrays of the byte-aligned layout (only for 8/16/32-bit keys)
+      std::vector<uint8_t> alignedKeys_;
+      std::vector<uint8_t> valid_;
+      std::vector<std::pair<uint32_t, uint32_t>> queries_;
+  };
+
+
+  class IndexAllocBench {
+    public:
+      static constexpr uint32_t kOps = 1024 * 1024;
+
+      IndexAllocBench()
+      {
+        std::mt19937_64 rng(11);
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        for (uint32_t i = 0; i < kOps; ++i) {
+          lbaHashes_.push_back(((rng() % geometry.nLbaBuckets_) << geometry.nBitsPerLbaSignature_)
+              | (rng() & geometry.lbaSignatureMask_));
+          fpHashes_.push_back(((rng() % geometry.nFpBuckets_) << geometry.nBitsPerFpSignature_)
+              | (rng() & geometry.fpSignatureMask_));
+          nSubchunks_.push_back(1 + rng() % 4);
+        }
+      }
+
+      template <typename Op>
+      void measure(const char *name, Op op)
+      {
+        long long elapsed = 0;
+        uint64_t before = nAllocations;
+        PERF_FUNCTION(elapsed, runOps, op);
+        uint64_t n = nAllocations - before;
+        printf("  %-16s %8.2f ns/op, %8.4f allocations/op (%lu total)\n",
+            name, elapsed * 1000.0 / kOps, (double)n / kOps, n);
+      }
+
+      void run(const char *policyName)
+      {
+        auto fpIndex = std::make_shared<FPIndex>();
+        auto lbaIndex = std::make_shared<LBAIndex>(fpIndex);
+        uint64_t cachedataLocation, metadataLocation, fpHash;
+        uint32_t nSubchunks;
+        printf("%s\n", policyName);
+
+        // Populate and warm up before counting
+        runOps([&](uint32_t i) {
+          fpIndex->update(fpHashes_[i], nSubchunks_[i], cachedataLocation, metadataLocation);
+          lbaIndex->update(lbaHashes_[i], fpHashes_[i]);
+        });
+        measure("FP update", [&](uint32_t i) {
+          fpIndex->update(fpHashes_[i], nSubchunks_[i], cachedataLocation, metadataLocation);
+        });
+        measure("FP lookup", [&](uint32_t i) {
+          fpIndex->lookup(fpHashes_[i], nSubchunks, cachedataLocation, metadataLocation);
+        });
+        // Promotion follows a hit, as in the data path
+        measure("FP hit+promote", [&](uint32_t i) {
+          if (fpIndex->lookup(fpHashes_[i], nSubchunks, cachedataLocation, metadataLocation)) {
+            fpIndex->promote(fpHashes_[i]);
+          }
+        });
+        measure("LBA update", [&](uint32_t i) {
+          lbaIndex->update(lbaHashes_[i], fpHashes_[i]);
+        });
+        measure("LBA lookup", [&](uint32_t i) {
+          lbaIndex->lookup(lbaHashes_[i], fpHash);
+        });
+        measure("LBA hit+promote", [&](uint32_t i) {
+          if (lbaIndex->lookup(lbaHashes_[i], fpHash)) {
+            lbaIndex->promote(lbaHashes_[i]);
+          }
+        });
+        printf("  index memory: LBA %lu + %lu bytes of policy, FP %lu + %lu bytes of policy\n",
+            lbaIndex->getMemoryUsage(), lbaIndex->getPolicyMemoryUsage(),
+            fpIndex->getMemoryUsage(), fpIndex->getPolicyMemoryUsage());
+      }
+
+    private:
+      template <typename Op>
+      void runOps(Op op)
+      {
+        for (uint32_t i = 0; i < kOps; ++i) {
+          op(i);
+        }
+      }
+
+      std::vector<uint64_t> lbaHashes_, fpHashes_;
+      std::vector<uint32_t> nSubchunks_;
+  };
+
+
+  class IndexScaleBench {
+    public:
+      static constexpr uint32_t kOps = 4 * 1024 * 1024;
+      static constexpr uint32_t kPromoteEvery = 16;
+
+      explicit IndexScaleBench(const char *locksName)
+      {
+        std::mt19937_64 rng(13);
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        fpIndex_ = std::make_shared<FPIndex>();
+        uint64_t cachedataLocation, metadataLocation;
+        for (uint32_t i = 0; i < kOps; ++i) {
+          fpHashes_.push_back(((rng() % geometry.nFpBuckets_) << geometry.nBitsPerFpSignature_)
+              | (rng() & geometry.fpSignatureMask_));
+          BucketLock lock = fpIndex_->lock(fpHashes_[i]);
+          fpIndex_->update(fpHashes_[i], 1 + rng() % 4, cachedataLocation, metadataLocation);
+        }
+        printf("%s: %lu bytes of locks, %lu bytes of index\n", locksName,
+            fpIndex_->getLockMemoryUsage(), fpIndex_->getMemoryUsage());
+      }
+
+      void run(bool optimistic)
+      {
+        if (optimistic && !fpIndex_->hasVersionedLocks()) {
+          return;
+        }
+        printf("%s\n", optimistic ? "Lock-free lookups:" : "Locked lookups:");
+        for (uint32_t nThreads = 1; nThreads <= 8; nThreads *= 2) {
+          auto begin = std::chrono::steady_clock::now();
+          std::vector<std::thread> threads;
+          for (uint32_t t = 0; t < nThreads; ++t) {
+            threads.emplace_back([this, optimistic, t, nThreads]() {
+              for (uint32_t i = t; i < kOps; i += nThreads) {
+                optimistic ? lookupOptimistic(i) : lookupLocked(i);
+              }
+            });
+          }
+          for (auto &thread : threads) {
+            thread.join();
+          }
+          double elapsed = std::chrono::duration<double>(
+              std::chrono::steady_clock::now() - begin).count();
+          printf("  %u threads %8.2f Mops/s\n", nThreads, kOps / elapsed / 1e6);
+        }
+      }
+
+    private:
+      void lookupLocked(uint32_t i)
+      {
+        uint32_t nSubchunks;
+        uint64_t cachedataLocation, metadataLocation;
+        BucketLock lock = fpIndex_->lock(fpHashes_[i]);
+        if (fpIndex_->lookup(fpHashes_[i], nSubchunks, cachedataLocation, metadataLocation)
+            && i % kPromoteEvery == 0) {
+          fpIndex_->promote(fpHashes_[i]);
+        }
+      }
+
+      void lookupOptimistic(uint32_t i)
+      {
+        uint32_t nSubchunks, version;
+        uint64_t cachedataLocation, metadataLocation;
+        bool hit;
+        do {
+          version = fpIndex_->readBegin(fpHashes_[i]);
+          hit = fpIndex_->lookup(fpHashes_[i], nSubchunks, cachedataLocation, metadataLocation);
+        } while (!fpIndex_->readValidate(fpHashes_[i], version));
+        if (hit && i % kPromoteEvery == 0) {
+          BucketLock lock = fpIndex_->lock(fpHashes_[i]);
+          fpIndex_->promote(fpHashes_[i]);
+        }
+      }
+
+      std::shared_ptr<FPIndex> fpIndex_;
+      std::vector<uint64_t> fpHashes_;
+  };
+
+
+  class ReferenceCounterBench {
+    public:
+      static constexpr uint32_t kOps = 4 * 1024 * 1024;
+      // References held by a thread before it starts dereferencing
+      static constexpr uint32_t kWindow = 4096;
+
+      // nHotKeys: number of distinct keys, 0 for all distinct
+      explicit ReferenceCounterBench(uint32_t nHotKeys)
+      {
+        std::mt19937_64 rng(19);
+        for (uint32_t i = 0; i < kOps; ++i) {
+          keys_.push_back(nHotKeys == 0 ? rng() : rng() % nHotKeys * 0x9E3779B97F4A7C15ull);
+        }
+      }
+
+      void run()
+      {
+        for (uint32_t nThreads = 1; nThreads <= 8; nThreads *= 2) {
+          auto begin = std::chrono::steady_clock::now();
+          std::vector<std::thread> threads;
+          for (uint32_t t = 0; t < nThreads; ++t) {
+            threads.emplace_back([this, t, nThreads]() {
+              ReferenceCounter &referenceCounter = ReferenceCounter::getInstance();
+              for (uint32_t i = t; i < kOps; i += nThreads) {
+                referenceCounter.reference(keys_[i]);
+                if (i >= kWindow * nThreads) {
+                  referenceCounter.dereference(keys_[i - kWindow * nThreads]);
+                }
+              }
+              for (uint32_t i = t + kOps - kWindow * nThreads; i < kOps; i += nThreads) {
+                referenceCounter.dereference(keys_[i]);
+              }
+            });
+          }
+          for (auto &thread : threads) {
+            thread.join();
+          }
+          double elapsed = std::chrono::duration<double>(
+              std::chrono::steady_clock::now() - begin).count();
+          printf("  %u threads %8.2f Mops/s\n", nThreads, 2.0 * kOps / elapsed / 1e6);
+        }
+      }
+
+      static void measureError()
+      {
+        ReferenceCounter &referenceCounter = ReferenceCounter::getInstance();
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        uint32_t nKeys = geometry.nLbaBuckets_ * geometry.nSlotsPerLbaBucket_;
+        std::mt19937_64 rng(23);
+        std::vector<std::pair<uint64_t, uint32_t>> counts;
+        for (uint32_t i = 0; i < nKeys; ++i) {
+          counts.emplace_back(rng(), 1 + rng() % 4);
+          for (uint32_t j = 0; j < counts.back().second; ++j) {
+            referenceCounter.reference(counts.back().first);
+          }
+        }
+        uint64_t overestimate = 0, nOverestimated = 0;
+        for (auto &count : counts) {
+          uint32_t estimate = referenceCounter.query(count.first);
+          overestimate += estimate - count.second;
+          nOverestimated += estimate != count.second;
+        }
+        printf("%u live keys: mean overestimate %.4f, %.2f%% of the keys overestimated\n",
+            nKeys, (double)overestimate / nKeys, 100.0 * nOverestimated / nKeys);
+        for (auto &count : counts) {
+          for (uint32_t j = 0; j < count.second; ++j) {
+            referenceCounter.dereference(count.first);
+          }
+        }
+      }
+
+      // References through FPIndex to random fingerprints of a full index
+      static void runFPIndex(const char *name)
+      {
+        auto fpIndex = std::make_shared<FPIndex>();
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        std::mt19937_64 rng(29);
+        std::vector<uint64_t> fpHashes;
+        uint64_t cachedataLocation, metadataLocation;
+        for (uint32_t i = 0; i < geometry.nFpBuckets_ * geometry.nSlotsPerFpBucket_; ++i) {
+          fpHashes.push_back(((rng() % geometry.nFpBuckets_) << geometry.nBitsPerFpSignature_)
+              | (rng() & geometry.fpSignatureMask_));
+          fpIndex->update(fpHashes.back(), 1, cachedataLocation, metadataLocation);
+        }
+        std::vector<uint64_t> keys;
+        for (uint32_t i = 0; i < kOps; ++i) {
+          keys.push_back(fpHashes[rng() % fpHashes.size()]);
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kOps; ++i) {
+          fpIndex->reference(keys[i]);
+          if (i >= kWindow) {
+            fpIndex->dereference(keys[i - kWindow], keys[i]);
+          }
+        }
+        for (uint32_t i = kOps - kWindow; i < kOps; ++i) {
+          fpIndex->dereference(keys[i], keys[i]);
+        }
+        double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - begin).count();
+        printf("  %-28s %8.2f Mops/s\n", name, 2.0 * kOps / elapsed / 1e6);
+      }
+
+    private:
+      std::vector<uint64_t> keys_;
+  };
+
+  class IndexPlacementBench {
+    public:
+      explicit IndexPlacementBench(uint32_t maxSubchunks)
+      {
+        std::mt19937_64 rng(17);
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        std::set<uint64_t> distinct;
+        nSlots_ = geometry.nFpBuckets_ * geometry.nSlotsPerFpBucket_;
+        for (uint64_t nSlotsInserted = 0; nSlotsInserted < nSlots_; ) {
+          uint64_t fpHash = ((rng() % geometry.nFpBuckets_) << geometry.nBitsPerFpSignature_)
+              | (rng() & geometry.fpSignatureMask_);
+          if (!distinct.insert(fpHash).second) continue;
+          fpHashes_.push_back(fpHash);
+          nSubchunks_.push_back(1 + rng() % maxSubchunks);
+          nSlotsInserted += nSubchunks_.back();
+        }
+      }
+
+      void run(const char *name)
+      {
+        auto fpIndex = std::make_shared<FPIndex>();
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        uint64_t cachedataLocation, metadataLocation, nValid = 0;
+        double loadAtFirstEviction = 0;
+        for (uint32_t i = 0; i < fpHashes_.size(); ++i) {
+          fpIndex->update(fpHashes_[i], nSubchunks_[i], cachedataLocation, metadataLocation);
+          uint64_t nValidAfter = 0;
+          for (uint32_t bucketId = 0; bucketId < geometry.nFpBuckets_; ++bucketId) {
+            nValidAfter += fpIndex->getFPBucket(bucketId).countValid();
+          }
+          if (loadAtFirstEviction == 0 && nValidAfter < nValid + nSubchunks_[i]) {
+            loadAtFirstEviction = (double)nValid / nSlots_;
+          }
+          nValid = nValidAfter;
+        }
+        printf("  %-12s first eviction at %6.2f%% of the slots, %6.2f%% in use after %lu chunks\n",
+            name, loadAtFirstEviction * 100, (double)nValid / nSlots_ * 100, fpHashes_.size());
+      }
+
+    private:
+      uint64_t nSlots_;
+      std::vector<uint64_t> fpHashes_;
+      std::vector<uint32_t> nSubchunks_;
+  };
+}
+
+#ifdef ACDC
+namespace cache {
+  // AustereCache runs in child processes on one cache device, each with
+  // the singletons of a fresh start
+  class CacheRunCheck {
+    public:
+      CacheRunCheck()
+      {
+        char dir[] = "/tmp/index_bench_XXXXXX";
+        dir_ = mkdtemp(dir);
+      }
+
+      ~CacheRunCheck()
+      {
+        for (const char *name : {"/cache_device", "/primary_device", "/checkpoint", "/log"}) {
+          unlink((dir_ + name).c_str());
+        }
+        rmdir(dir_.c_str());
+      }
+
+    protected:
+      /**
+       * Run body in a child process and check that it exits with 0 and that
+       * its output has the expected line, if any
+       */
+      bool runChild(const char *name, const std::function<int()> &body, const char *expected)
+      {
+        std::string log = dir_ + "/log";
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+          int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          dup2(fd, STDOUT_FILENO);
+          int ret = body();
+          std::cout.flush();
+          _exit(ret);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        std::stringstream output;
+        output << std::ifstream(log).rdbuf();
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+          && (expected == nullptr || output.str().find(expected) != std::string::npos);
+        printf("  %-32s %s\n", name, ok ? "ok" : "FAILED");
+        if (!ok) {
+          printf("%s", output.str().c_str());
+        }
+        return ok;
+      }
+
+      // The devices in dir_, fake I/O off so that the data is hashed
+      void configure()
+      {
+        Config &config = Config::getInstance();
+        cacheDeviceName_ = dir_ + "/cache_device";
+        primaryDeviceName_ = dir_ + "/primary_device";
+        config.setCacheDeviceName(&cacheDeviceName_[0]);
+        config.setPrimaryDeviceName(&primaryDeviceName_[0]);
+        config.setCacheDeviceSize(32ull * 1024 * 1024);
+        config.setPrimaryDeviceSize(128ull * 1024 * 1024);
+        config.setWorkingSetSize(128ull * 1024 * 1024);
+        config.enableTraceReplay(false);
+        config.enableFakeIO(false);
+      }
+
+      std::string dir_, cacheDeviceName_, primaryDeviceName_;
+  };
+
+  class IndexCheckpointCheck : public CacheRunCheck {
+    public:
+      static constexpr uint32_t kChunks = 256;
+
+      // Write kChunks distinct chunks, with or without the checkpoint
+      bool run(const char *name, bool checkpoint, const char *expected)
+      {
+        return runChild(name, [&]() { runCache(checkpoint); return 0; }, expected);
+      }
+
+    private:
+      void runCache(bool checkpoint)
+      {
+        configure();
+        Config &config = Config::getInstance();
+        config.setIndexCheckpoint(checkpoint ? (dir_ + "/checkpoint").c_str() : "");
+
+        AustereCache austereCache;
+        uint32_t chunkSize = config.getChunkSize();
+        std::vector<uint8_t> chunk(chunkSize);
+        std::mt19937_64 rng(23);
+        for (uint32_t i = 0; i < kChunks; ++i) {
+          for (auto &byte : chunk) byte = rng();
+          austereCache.write((uint64_t)i * chunkSize, chunk.data(), chunkSize);
+        }
+      }
+  };
+
+  class MetaJournalCheck : public CacheRunCheck {
+    public:
+      static constexpr uint32_t kChunks = 16;
+
+      /**
+       * Chunk 0 is written at 70 LBAs, more than a plain metadata block
+       * keeps, chunk i > 0 at 1 + 3i, round-robin
+       */
+      MetaJournalCheck()
+      {
+        uint64_t chunkSize = Config::getInstance().getChunkSize();
+        for (uint32_t round = 0, lba = 0; round < 70; ++round) {
+          for (uint32_t i = 0; i < kChunks; ++i) {
+            if (round < (i == 0 ? 70 : 1 + 3 * i)) {
+              writes_.emplace_back(i, lba++ * chunkSize);
+            }
+          }
+        }
+      }
+
+      /**
+       * A crash after the blocks of an epoch of tAddLba records are applied
+       * and before the epoch is closed, then a restart replaying it
+       */
+      bool run(MetadataFormatEnum format)
+      {
+        unlink((dir_ + "/cache_device").c_str());
+        return runChild("crash after applying the blocks", [&]() { crashAfterApply(format); return 0; }, nullptr)
+          && runChild("restart", [&]() { return checkRecovered(format); }, "Meta journal: replayed");
+      }
+
+    private:
+      void configureJournal(MetadataFormatEnum format)
+      {
+        configure();
+        Config::getInstance().enableMetaJournal(true);
+        Config::getInstance().setMetadataFormat(format);
+      }
+
+      void writeChunk(AustereCache &austereCache, uint32_t chunkId, uint64_t lba)
+      {
+        std::vector<uint8_t> chunk(Config::getInstance().getChunkSize());
+        std::mt19937_64 rng(chunkId + 1);
+        for (auto &byte : chunk) byte = rng();
+        austereCache.write(lba, chunk.data(), chunk.size());
+      }
+
+      void crashAfterApply(MetadataFormatEnum format)
+      {
+        configureJournal(format);
+        // Never destroyed, the process ends as if it crashed
+        auto austereCache = new AustereCache();
+        // The tNewFingerprint records in an epoch of their own
+        for (auto &write : writes_) {
+          if (write.second / Config::getInstance().getChunkSize() < kChunks) {
+            writeChunk(*austereCache, write.first, write.second);
+          }
+        }
+        MetaJournal::getInstance().flush();
+        for (auto &write : writes_) {
+          if (write.second / Config::getInstance().getChunkSize() >= kChunks) {
+            writeChunk(*austereCache, write.first, write.second);
+          }
+        }
+        // The first batch of the epoch, where the apply closes it
+        alignas(512) uint8_t batch[MetaJournal::kBatchSize];
+        IOModule::getInstance().read(JOURNAL, 0, batch, sizeof(batch));
+        MetaJournal::getInstance().flush();
+        IOModule::getInstance().write(JOURNAL, 0, batch, sizeof(batch));
+      }
+
+      // 0 if every metadata block has the LBAs of its chunk, in order and once
+      int checkRecovered(MetadataFormatEnum format)
+      {
+        configureJournal(format);
+        AustereCache austereCache;
+        const IndexGeometry &geometry = IndexGeometry::getInstance();
+        std::vector<std::vector<uint64_t>> expected(kChunks);
+        std::map<uint64_t, uint32_t> chunkOfLba;
+        for (auto &write : writes_) {
+          expected[write.first].push_back(write.second);
+          chunkOfLba[write.second] = write.first;
+        }
+        uint32_t nFound = 0;
+        alignas(512) MetadataBlock block;
+        Metadata metadata;
+        for (uint64_t offset = 0; offset < geometry.metadataRegionSize_; offset += sizeof(block)) {
+          IOModule::getInstance().read(CACHE_DEVICE, offset, &block, sizeof(block));
+          if (!MetadataCodec::decode(block, metadata) || metadata.numLBAs_ == 0) {
+            continue;
+          }
+          uint32_t first = metadata.numLBAs_ == geometry.nMaxLBAsPerChunk_ ? metadata.nextEvict_ : 0;
+          std::vector<uint64_t> LBAs;
+          for (uint32_t j = 0; j < metadata.numLBAs_; ++j) {
+            LBAs.push_back(metadata.LBAs_[(first + j) % geometry.nMaxLBAsPerChunk_]);
+          }
+          uint32_t chunkId = chunkOfLba[LBAs.back()];
+          std::vector<uint64_t> &chunkLBAs = expected[chunkId];
+          uint32_t nKept = std::min((uint32_t)chunkLBAs.size(), geometry.nMaxLBAsPerChunk_);
+          if (LBAs != std::vector<uint64_t>(chunkLBAs.end() - nKept, chunkLBAs.end())) {
+            std::cout << "Chunk " << chunkId << ": " << LBAs.size() << " LBAs, not the "
+                      << nKept << " written last in order" << std::endl;
+            return 1;
+          }
+          ++nFound;
+        }
+        if (nFound != kChunks) {
+          std::cout << nFound << " metadata blocks, " << kChunks << " expected" << std::endl;
+          return 1;
+        }
+        return 0;
+      }
+
+      // (chunk, LBA) in write order
+      std::vector<std::pair<uint32_t, uint64_t>> writes_;
+  };
+}
+#endif
+
+namespace cache {
+  class MetadataCodecCheck {
+    public:
+      static constexpr uint32_t kRandomLists = 10000;
+      static constexpr uint32_t kCompressedLen = 12345;
+
+      MetadataCodecCheck() :
+        chunkSize_(IndexGeometry::getInstance().chunkSize_),
+        nMaxLBAs_(IndexGeometry::getInstance().nMaxLBAsPerChunk_)
+      {}
+
+      bool run()
+      {
+        std::vector<uint64_t> LBAs;
+        bool ok = true;
+        for (uint32_t i = 0; i < nMaxLBAs_; ++i) {
+          LBAs.push_back((1ull << 40u) + 1ull * i * chunkSize_);
+        }
+        ok = check("adjacent chunks", LBAs, 0, 0) && ok;
+        ok = check("adjacent chunks, rotated ring", LBAs, 100, 0) && ok;
+        for (uint32_t i = 0; i < nMaxLBAs_; ++i) {
+          LBAs[i] += i % 3 == 1 ? 4096 : i % 3 == 2 ? 512 : 0;
+        }
+        ok = check("4 KiB and 512-byte aligned", LBAs, 0, -1) && ok;
+        LBAs[nMaxLBAs_ / 2] += 1;
+        ok = check("one odd LBA", LBAs, 7, -1) && ok;
+        std::mt19937_64 rng(29);
+        for (auto &lba : LBAs) lba = rng() & ~(uint64_t)(chunkSize_ - 1);
+        ok = check("far apart", LBAs, 0, 1) && ok;
+        for (auto &lba : LBAs) lba = rng();
+        ok = check("far apart, unaligned, rotated ring", LBAs, 239, 1) && ok;
+
+        // 24 header bytes, 2 of the compressed length, 1 of the first LBA,
+        // 161 deltas of 3 bytes and one of 2: 512 bytes
+        LBAs.assign(1, chunkSize_);
+        for (uint32_t i = 0; i < 162; ++i) {
+          LBAs.push_back(LBAs.back() + (i < 161 ? 100000ull : 1000ull) * chunkSize_);
+        }
+        ok = check("a block filled to the byte", LBAs, 0, 0) && ok;
+        // 1 more byte, the oldest LBA makes room for it
+        LBAs.push_back(LBAs.back() + chunkSize_);
+        ok = check("one byte past the block", LBAs, 0, 1) && ok;
+
+        uint32_t nFailed = 0;
+        for (uint32_t i = 0; i < kRandomLists; ++i) {
+          uint32_t shift = std::vector<uint32_t>{0, 9, 12, 15}[rng() % 4],
+                   magnitude = 16 + rng() % 49;
+          LBAs.resize(1 + rng() % nMaxLBAs_);
+          uint64_t base = rng();
+          for (auto &lba : LBAs) {
+            lba = (base + (rng() & ((magnitude == 64 ? 0 : 1ull << magnitude) - 1))) & ~((1ull << shift) - 1);
+          }
+          nFailed += !check(nullptr, LBAs, rng() % nMaxLBAs_, -1);
+        }
+        printf("  %-36s %u of %u failed\n", "random lists", nFailed, kRandomLists);
+        return ok && nFailed == 0;
+      }
+
+    private:
+      /**
+       * Encode LBAs (oldest first, a ring starting at rotation when full) and
+       * decode them back, both as they are and once MetaVerification::update
+       * dropped the ones overflowing. overflow: 0 if all have to fit, 1 if
+       * some must not, -1 either way.
+       */
+      bool check(const char *name, const std::vector<uint64_t> &LBAs, uint32_t rotation, int overflow)
+      {
+        uint32_t n = LBAs.size();
+        Metadata metadata;
+        for (uint32_t i = 0; i < 20; ++i) metadata.fingerprint_[i] = i * 7;
+        metadata.compressedLen_ = kCompressedLen;
+        metadata.numLBAs_ = n;
+        metadata.nextEvict_ = n == nMaxLBAs_ ? rotation : 0;
+        for (uint32_t j = 0; j < n; ++j) {
+          metadata.LBAs_[(metadata.nextEvict_ + j) % nMaxLBAs_] = LBAs[j];
+        }
+        uint32_t nDropped = MetadataCodec::nLBAsOverflowing(metadata);
+        std::vector<uint64_t> expected(LBAs.begin() + nDropped, LBAs.end());
+        bool ok = (overflow == -1 || (nDropped > 0) == (overflow == 1))
+          && roundTrip(metadata, expected);
+        MetadataCodec::dropOldest(metadata, nDropped);
+        ok = ok && MetadataCodec::nLBAsOverflowing(metadata) == 0 && roundTrip(metadata, expected);
+        if (name != nullptr) {
+          printf("  %-36s %3u LBAs, %3u kept %s\n", name, n, n - nDropped, ok ? "ok" : "FAILED");
+        }
+        return ok;
+      }
+
+      static bool roundTrip(const Metadata &metadata, const std::vector<uint64_t> &expected)
+      {
+        MetadataBlock block;
+        Metadata decoded;
+        MetadataCodec::encode(metadata, block);
+        if (!MetadataCodec::decode(block, decoded) || decoded.numLBAs_ != expected.size()
+            || decoded.nextEvict_ != 0 || decoded.compressedLen_ != kCompressedLen
+            || memcmp(decoded.fingerprint_, metadata.fingerprint_, sizeof(decoded.fingerprint_)) != 0) {
+          return false;
+        }
+        return std::equal(expected.begin(), expected.end(), decoded.LBAs_);
+      }
+
+      uint32_t chunkSize_, nMaxLBAs_;
+  };
+
+  class FlatHashMapBench {
+    public:
+      static constexpr uint32_t kKeys = 1024 * 1024;
+
+      FlatHashMapBench()
+      {
+        std::mt19937_64 rng(31);
+        for (uint32_t i = 0; i < kKeys; ++i) {
+          keys_.push_back(rng());
+          Fingerprint fp, missingFp;
+          for (uint32_t j = 0; j < 20; ++j) {
+            fp.v_[j] = rng();
+            missingFp.v_[j] = rng();
+          }
+          fingerprints_.push_back(fp);
+          missingFingerprints_.push_back(missingFp);
+        }
+      }
+
+      template <typename Map>
+      void runCounter(const char *name)
+      {
+        Map map;
+        uint64_t count = 0, bytesBefore = nAllocatedBytes;
+        double referenceNs = measure([&](uint32_t i) { count += map[keys_[i]] += 1; }),
+               bytesPerKey = (double)getMemoryUsage(map, nAllocatedBytes - bytesBefore) / kKeys,
+               queryNs = measure([&](uint32_t i) {
+                 auto it = map.find(keys_[i]);
+                 count += it == map.end() ? 0 : it->second;
+               }),
+               dereferenceNs = measure([&](uint32_t i) {
+                 auto it = map.find(keys_[i]);
+                 if ((it->second -= 1) == 0) {
+                   map.erase(it);
+                 }
+               });
+        printf("  %-14s reference %6.1f ns, query %6.1f ns, dereference %6.1f ns, %6.1f bytes/key (%lu)\n",
+            name, referenceNs, queryNs, dereferenceNs, bytesPerKey, count % 2);
+      }
+
+      template <typename Map>
+      void runFingerprintIndex(const char *name)
+      {
+        Map map;
+        uint64_t found = 0, bytesBefore = nAllocatedBytes;
+        double insertNs = measure([&](uint32_t i) { map[fingerprints_[i]].cachedataLocation_ = i; }),
+               bytesPerKey = (double)getMemoryUsage(map, nAllocatedBytes - bytesBefore) / kKeys,
+               hitNs = measure([&](uint32_t i) { found += map.find(fingerprints_[i]) != map.end(); }),
+               missNs = measure([&](uint32_t i) { found += map.find(missingFingerprints_[i]) != map.end(); }),
+               eraseNs = measure([&](uint32_t i) { map.erase(map.find(fingerprints_[i])); });
+        printf("  %-14s insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, erase %6.1f ns, %6.1f bytes/key (%lu)\n",
+            name, insertNs, hitNs, missNs, eraseNs, bytesPerKey, found);
+      }
+
+    private:
+      template <typename Op>
+      double measure(Op op)
+      {
+        auto begin = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < kKeys; ++i) {
+          op(i);
+        }
+        return std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - begin).count() / kKeys;
+      }
+
+      // std::map allocates a node per key, count what it allocated
+      template <typename Key, typename Value>
+      static uint64_t getMemoryUsage(std::map<Key, Value> &map, uint64_t nBytesAllocated)
+      {
+        return nBytesAllocated;
+      }
+      template <typename Key, typename Value>
+      static uint64_t getMemoryUsage(FlatHashMap<Key, Value> &map, uint64_t nBytesAllocated)
+      {
+        return map.getMemoryUsage();
+      }
+
+      std::vector<uint64_t> keys_;
+      std::vector<Fingerprint> fingerprints_, missingFingerprints_;
+  };
+}
+
+int main(int argc, char **argv)
+{
+  const char *bench = argc > 1 ? argv[1] : "lookup";
+
+  if (strcmp(bench, "lookup") == 0) {
+    // Default geometry: 16-bit signatures; LBA slots carry a (16 + 12)-bit
+    // fingerprint hash, FP slots 4 reserved bits.
+    bool match = cache::IndexBench(16, 28).runLookup("LBA");
+    match = cache::IndexBench(16, 4).runLookup("FP") && match;
+    match = cache::IndexBench(8, 4).runLookup("FP8") && match;
+    match = cache::IndexBench(12, 4).runLookup("FP12") && match;
+    if (!match) {
+      return 1;
+    }
+  } else if (strcmp(bench, "alloc") == 0) {
+    // 1 GiB cache device and 4 GiB working set: 1024 FP and 1024 LBA buckets
+    cache::Config::getInstance().setCacheDeviceSize(1024ull * 1024 * 1024);
+    cache::Config::getInstance().setWorkingSetSize(4ull * 1024 * 1024 * 1024);
+    cache::IndexAllocBench bench;
+    bench.run("Compact cache policies (BucketAwareLRU / LeastReferenceCount):");
+    cache::Config::getInstance().enableRankedBucketAwareLRU(true);
+    bench.run("Compact cache policies, ranked BucketAwareLRU:");
+    cache::Config::getInstance().enableRankedBucketAwareLRU(false);
+    cache::Config::getInstance().enableCompactCachePolicy(false);
+    bench.run("List-based LRU:");
+    cache::Config::getInstance().enableClockCachePolicy(true);
+    bench.run("CLOCK:");
+  } else if (strcmp(bench, "scale") == 0) {
+    cache::Config::getInstance().setCacheDeviceSize(1024ull * 1024 * 1024);
+    cache::Config::getInstance().setWorkingSetSize(4ull * 1024 * 1024 * 1024);
+    cache::Config::getInstance().enableMultiThreading(true);
+    {
+      cache::IndexScaleBench bench("Per-bucket sequence locks");
+      bench.run(false);
+      bench.run(true);
+    }
+    cache::Config::getInstance().setnLockStripes(64);
+    {
+      cache::IndexScaleBench bench("64 striped sequence locks");
+      bench.run(false);
+      bench.run(true);
+    }
+    cache::Config::getInstance().setBucketLock(cache::tEmbeddedLock);
+    {
+      cache::IndexScaleBench bench("Embedded bit locks");
+      bench.run(false);
+      bench.run(true);
+    }
+  } else if (strcmp(bench, "placement") == 0) {
+    cache::Config::getInstance().setCacheDeviceSize(1024ull * 1024 * 1024);
+    cache::Config::getInstance().setWorkingSetSize(4ull * 1024 * 1024 * 1024);
+    for (uint32_t maxSubchunks : {1u, 4u}) {
+      printf("%s:\n", maxSubchunks == 1 ? "1 slot per chunk" : "1-4 slots per chunk");
+      cache::IndexPlacementBench bench(maxSubchunks);
+      cache::Config::getInstance().enableTwoChoiceFPPlacement(false);
+      bench.run("One choice");
+      cache::Config::getInstance().enableTwoChoiceFPPlacement(true);
+      bench.run("Two choices");
+    }
+  } else if (strcmp(bench, "refcount") == 0) {
+    cache::Config::getInstance().setCacheDeviceSize(1024ull * 1024 * 1024);
+    cache::Config::getInstance().setWorkingSetSize(4ull * 1024 * 1024 * 1024);
+    cache::Config::getInstance().enableMultiThreading(true);
+    printf("Sketch reference counter (reference + dereference), distinct keys:\n");
+    cache::ReferenceCounterBench(0).run();
+    printf("256 hot keys:\n");
+    cache::ReferenceCounterBench(256).run();
+    cache::ReferenceCounterBench::measureError();
+    printf("%lu bytes of sketch and overflow table\n",
+        cache::SketchReferenceCounter::getInstance().getMemoryUsage());
+    cache::Config::getInstance().enableMultiThreading(false);
+    printf("FPIndex reference + dereference, 1 thread:\n");
+    cache::ReferenceCounterBench::runFPIndex("Sketch");
+    cache::Config::getInstance().enableEmbeddedRF(true);
+    cache::ReferenceCounterBench::runFPIndex("Embedded in the FP slots");
+  } else if (strcmp(bench, "codec") == 0) {
+    cache::Config::getInstance().setMetadataFormat(cache::tCompactMetadata);
+    printf("Compact metadata blocks, encoded and decoded back:\n");
+    return cache::MetadataCodecCheck().run() ? 0 : 1;
+  } else if (strcmp(bench, "flatmap") == 0) {
+    cache::FlatHashMapBench bench;
+    printf("uint64_t -> uint32_t counts (MapReferenceCounter), %u keys:\n", bench.kKeys);
+    bench.runCounter<std::map<uint64_t, uint32_t>>("std::map");
+    bench.runCounter<cache::FlatHashMap<uint64_t, uint32_t>>("FlatHashMap");
+    printf("Fingerprint -> DLRUFPIndex::DP (CacheDedup fingerprint indexes), %u keys:\n", bench.kKeys);
+    bench.runFingerprintIndex<std::map<cache::Fingerprint, cache::DLRUFPIndex::DP>>("std::map");
+    bench.runFingerprintIndex<cache::FlatHashMap<cache::Fingerprint, cache::DLRUFPIndex::DP>>("FlatHashMap");
+#ifdef ACDC
+  } else if (strcmp(bench, "checkpoint") == 0) {
+    cache::IndexCheckpointCheck check;
+    printf("Index checkpoint across runs on one cache device:\n");
+    bool ok = check.run("first run", true, "Index checkpoint: none at")
+      && check.run("restart", true, "Index checkpoint: loaded from")
+      && check.run("run without the checkpoint", false, nullptr)
+      && check.run("restart", true, "the cache device was used since");
+    return ok ? 0 : 1;
+  } else if (strcmp(bench, "journal") == 0) {
+    cache::MetaJournalCheck check;
+    printf("Meta journal replay onto applied blocks, plain metadata:\n");
+    bool ok = check.run(cache::tPlainMetadata);
+    printf("Compact metadata:\n");
+    ok = check.run(cache::tCompactMetadata) && ok;
+    return ok ? 0 : 1;
+#endif
+  }
+  return 0;
+}
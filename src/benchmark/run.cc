@@ -7,6 +7,8 @@
 #include "utils/gen_zipf.h"
 #include "utils/cJSON.h"
 #include "austere_cache/austere_cache.h"
+#include "io/io_module.h"
+#include "io/device_model.h"
 #include "metadata/cachededup/cdarc_fpindex.h"
 #include "metadata/cachededup/darc_fpindex.h"
 
@@ -82,10 +84,10 @@ namespace cache {
         Config::getInstance().setPrimaryDeviceSize(300LL * 1024 * 1024 * 1024);
         chunkSize_ = 32768;
 
-        char source[2000 + 1];
+        char source[4096 + 1];
         FILE *fp = fopen(argv[1], "r");
         if (fp != NULL) {
-          size_t newLen = fread(source, sizeof(char), 1001, fp);
+          size_t newLen = fread(source, sizeof(char), 4096, fp);
           if ( ferror( fp ) != 0 ) {
             fputs("Error reading file", stderr);
           } else {
@@ -133,13 +135,51 @@ namespace cache {
             Config::getInstance().enableSynthenticCompression(valuell);
           } else if (strcmp(name, "compactCachePolicy") == 0) { // CompactCache Replacement Policies
             Config::getInstance().enableCompactCachePolicy(valuell);
+          } else if (strcmp(name, "clockCachePolicy") == 0) {
+            Config::getInstance().enableClockCachePolicy(valuell);
+          } else if (strcmp(name, "rankedBucketAwareLRU") == 0) {
+            Config::getInstance().enableRankedBucketAwareLRU(valuell);
+          } else if (strcmp(name, "twoChoiceFPPlacement") == 0) {
+            Config::getInstance().enableTwoChoiceFPPlacement(valuell);
           } else if (strcmp(name, "sketchBasedReferenceCounter") == 0) { // Sketch
             Config::getInstance().enableSketchRF(valuell);
+          } else if (strcmp(name, "embeddedReferenceCounter") == 0) {
+            Config::getInstance().enableEmbeddedRF(valuell);
           // Configurations for Techniques (Implementation)
           } else if (strcmp(name, "multiThreading") == 0) { // Concurrency
             Config::getInstance().enableMultiThreading(valuell);
           } else if (strcmp(name, "nThreads") == 0) {
             Config::getInstance().setnThreads(valuell);
+          } else if (strcmp(name, "bucketLock") == 0) {
+            if (strcmp(valuestring, "Sequence") == 0) {
+              Config::getInstance().setBucketLock(BucketLockEnum::tSequenceLock);
+            } else if (strcmp(valuestring, "Embedded") == 0) {
+              Config::getInstance().setBucketLock(BucketLockEnum::tEmbeddedLock);
+            }
+          } else if (strcmp(name, "nLockStripes") == 0) {
+            Config::getInstance().setnLockStripes(valuell);
+          } else if (strcmp(name, "nChunkWorkers") == 0) {
+            Config::getInstance().setnChunkWorkers(valuell);
+          } else if (strcmp(name, "metadataCacheSize") == 0) { // DRAM metadata cache
+            Config::getInstance().setMetadataCacheSize(valuell);
+          } else if (strcmp(name, "metaJournal") == 0) { // Journaled metadata updates
+            Config::getInstance().enableMetaJournal(valuell);
+          } else if (strcmp(name, "warmRestart") == 0) { // Rebuild the indexes at startup
+            Config::getInstance().enableWarmRestart(valuell);
+          } else if (strcmp(name, "indexCheckpoint") == 0) { // Index checkpoint file
+            Config::getInstance().setIndexCheckpoint(valuestring);
+          } else if (strcmp(name, "cacheLayout") == 0) { // On-SSD layout
+            if (strcmp(valuestring, "Separate") == 0) {
+              Config::getInstance().setCacheLayout(CacheLayoutEnum::tSeparateMetadata);
+            } else if (strcmp(valuestring, "Colocated") == 0) {
+              Config::getInstance().setCacheLayout(CacheLayoutEnum::tColocatedMetadata);
+            }
+          } else if (strcmp(name, "metadataFormat") == 0) { // Metadata block encoding
+            if (strcmp(valuestring, "Plain") == 0) {
+              Config::getInstance().setMetadataFormat(MetadataFormatEnum::tPlainMetadata);
+            } else if (strcmp(valuestring, "Compact") == 0) {
+              Config::getInstance().setMetadataFormat(MetadataFormatEnum::tCompactMetadata);
+            }
           } else if (strcmp(name, "weuSize") == 0) { // Write Buffer
             Config::getInstance().setWeuSize(valuell);
           } else if (strcmp(name, "cacheMode") == 0) { // Write Back and Write Through
@@ -151,6 +191,36 @@ namespace cache {
           // Configurations related to trace replay
           } else if (strcmp(name, "directIO") == 0) {
             Config::getInstance().enableDirectIO(valuell);
+          } else if (strcmp(name, "ioBackend") == 0) {
+            if (strcmp(valuestring, "Sync") == 0) {
+              Config::getInstance().setIOBackend(IOBackendEnum::tSyncIO);
+            } else if (strcmp(valuestring, "Uring") == 0) {
+              Config::getInstance().setIOBackend(IOBackendEnum::tUringIO);
+            } else if (strcmp(valuestring, "Memory") == 0) {
+              Config::getInstance().setIOBackend(IOBackendEnum::tMemoryIO);
+            }
+          } else if (strcmp(name, "memoryDeviceHugepages") == 0) {
+            Config::getInstance().enableMemoryDeviceHugepages(valuell);
+          } else if (strcmp(name, "uringQueueDepth") == 0) {
+            Config::getInstance().setUringQueueDepth(valuell);
+          } else if (strcmp(name, "cacheDeviceModel") == 0) { // Emulated device latency
+            Config::getInstance().setCacheDeviceModel(parseDeviceModel(valuestring));
+          } else if (strcmp(name, "primaryDeviceModel") == 0) {
+            Config::getInstance().setPrimaryDeviceModel(parseDeviceModel(valuestring));
+          } else if (strcmp(name, "ssdReadLatency") == 0) {
+            Config::getInstance().setSSDReadLatency(valuell);
+          } else if (strcmp(name, "ssdWriteLatency") == 0) {
+            Config::getInstance().setSSDWriteLatency(valuell);
+          } else if (strcmp(name, "ssdBandwidth") == 0) {
+            Config::getInstance().setSSDBandwidth(valuell);
+          } else if (strcmp(name, "ssdChannels") == 0) {
+            Config::getInstance().setSSDChannels(valuell);
+          } else if (strcmp(name, "hddSeekTime") == 0) {
+            Config::getInstance().setHDDSeekTime(valuell);
+          } else if (strcmp(name, "hddRpm") == 0) {
+            Config::getInstance().setHDDRpm(valuell);
+          } else if (strcmp(name, "hddBandwidth") == 0) {
+            Config::getInstance().setHDDBandwidth(valuell);
           } else if (strcmp(name, "traceReplay") == 0) {
             Config::getInstance().enableTraceReplay(valuell);
           } else if (strcmp(name, "fakeIO") == 0) {
@@ -173,6 +243,15 @@ namespace cache {
       }
 
 
+      DeviceModelEnum parseDeviceModel(const char *model) {
+        if (strcmp(model, "SSD") == 0) {
+          return DeviceModelEnum::tSSDModel;
+        } else if (strcmp(model, "HDD") == 0) {
+          return DeviceModelEnum::tHDDModel;
+        }
+        return DeviceModelEnum::tNoDeviceModel;
+      }
+
       /**
        * Duplicate 40 bytes to chunkSize_ 
        */
@@ -224,6 +303,7 @@ namespace cache {
         printf("%s: Go through %lu operations, selected %lu\n", fileName, cnt, reqs_.size());
 
         fclose(f);
+        return 0;
       }
 
       void sendRequest(Request &req) {
@@ -248,11 +328,18 @@ namespace cache {
           }
         }
 
+        VirtualClock &virtualClock = VirtualClock::getInstance();
+        if (virtualClock.isEnabled()) {
+          virtualClock.beginRequest();
+        }
         if (req.isRead_) {
           AustereCache_->read(begin, rwdata, len);
         } else {
           AustereCache_->write(begin, rwdata, len);
         }
+        if (virtualClock.isEnabled()) {
+          virtualClock.endRequest(len);
+        }
       }
 
       /**
@@ -280,6 +367,8 @@ namespace cache {
           nThreads = Config::getInstance().getMaxNumGlobalThreads();
         }
 
+        // Only the replay is projected, not the startup I/O
+        IOModule::getInstance().resetDeviceModels();
         AThreadPool *threadPool = new AThreadPool(nThreads);
         char sha1[23];
         for (uint32_t i = 0; i < reqs_.size(); ++i) {
@@ -403,6 +492,9 @@ int main(int argc, char **argv)
   std::cout << "total MBs: " << (double)total_bytes / (1024 * 1024) << std::endl;
   std::cout << "elapsed: " << elapsed << " us" << std::endl;
   std::cout << "Throughput: " << (double)total_bytes / elapsed << " MBytes/s" << std::endl;
+  if (cache::VirtualClock::getInstance().isEnabled()) {
+    cache::VirtualClock::getInstance().dump();
+  }
 
   run_system.clear();
   return 0;
@@ -1,5 +1,6 @@
 #include "chunk_module.h"
 #include "common/config.h"
+#include "common/index_geometry.h"
 #include "common/stats.h"
 #include "utils/xxhash.h"
 #include "utils/utils.h"
@@ -9,6 +10,41 @@
 
 namespace cache {
 
+  Metadata::Metadata() : LBAs_(plainLBAs_)
+  {
+    if (IndexGeometry::getInstance().compactMetadata_) {
+      compactLBAs_.reset(new uint64_t[MAX_NUM_LBAS_PER_CACHED_CHUNK]);
+      LBAs_ = compactLBAs_.get();
+    }
+    clear();
+  }
+
+  Metadata::Metadata(const Metadata &other) : Metadata()
+  {
+    *this = other;
+  }
+
+  Metadata &Metadata::operator=(const Metadata &other)
+  {
+    if (this != &other) {
+      memcpy(LBAs_, other.LBAs_, IndexGeometry::getInstance().nMaxLBAsPerChunk_ * sizeof(uint64_t));
+      memcpy(fingerprint_, other.fingerprint_, sizeof(fingerprint_));
+      nextEvict_ = other.nextEvict_;
+      numLBAs_ = other.numLBAs_;
+      compressedLen_ = other.compressedLen_;
+    }
+    return *this;
+  }
+
+  void Metadata::clear()
+  {
+    memset(LBAs_, 0, IndexGeometry::getInstance().nMaxLBAsPerChunk_ * sizeof(uint64_t));
+    memset(fingerprint_, 0, sizeof(fingerprint_));
+    nextEvict_ = 0;
+    numLBAs_ = 0;
+    compressedLen_ = 0;
+  }
+
   void Chunk::computeFingerprint() {
     BEGIN_TIMER();
     assert(len_ == Config::getInstance().getChunkSize());
@@ -36,21 +72,23 @@ namespace cache {
   }
 
   uint64_t Chunk::computeFingerprintHash(uint8_t *fingerprint) {
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
     uint32_t signature, bucketId;
     bucketId = XXH32(fingerprint, Config::getInstance().getFingerprintLength(), 2);
     signature = XXH32(fingerprint, Config::getInstance().getFingerprintLength(), 101);
-    return ((uint64_t)(bucketId % Config::getInstance().getnFpBuckets()) << Config::getInstance().getnBitsPerFpSignature())
-      | (uint64_t)((signature & ((1u << Config::getInstance().getnBitsPerFpSignature()) - 1u)));
+    return ((uint64_t)(bucketId % geometry.nFpBuckets_) << geometry.nBitsPerFpSignature_)
+      | (uint64_t)(signature & geometry.fpSignatureMask_);
   }
 
   uint64_t Chunk::computeLBAHash(uint64_t addr)
   {
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
     uint64_t lbaHash = XXH64(&addr, 8, 3);
-    lbaHash >>= 64 - (Config::getInstance().getnBitsPerLbaSignature() + Config::getInstance().getnBitsPerLbaBucketId());
+    lbaHash >>= geometry.lbaHashShift_;
     return
-      ((uint64_t)((lbaHash >> Config::getInstance().getnBitsPerLbaSignature()) % Config::getInstance().getnLbaBuckets())
-      << Config::getInstance().getnBitsPerLbaSignature()) |
-      (lbaHash & ((1u << Config::getInstance().getnBitsPerLbaSignature()) - 1u));
+      ((uint64_t)((lbaHash >> geometry.nBitsPerLbaSignature_) % geometry.nLbaBuckets_)
+      << geometry.nBitsPerLbaSignature_) |
+      (lbaHash & geometry.lbaSignatureMask_);
   }
 
   Chunker::Chunker(uint64_t addr, void *buf, uint32_t len) :
@@ -70,6 +108,7 @@ namespace cache {
     c.len_ = next_addr - addr_;
     c.buf_ = buf_;
     c.hasFingerprint_ = false;
+    c.hasCachedata_ = false;
 
     c.lbaHash_ = ~0ull;
     c.fingerprintHash_ = ~0ull;
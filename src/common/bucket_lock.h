@@ -0,0 +1,263 @@
+/* File: common/bucket_lock.h
+ * Description:
+ *   This file contains the bucket locks of LBAIndex and FPIndex.
+ *
+ *   1. Sequence locks (tSequenceLock, the default). A 32-bit version guards
+ *      a bucket. A writer (update, promote, evict) makes the version odd while
+ *      it modifies the bucket and even again when it releases the bucket, so
+ *      each write bumps the version by two.
+ *      Readers never write the version. They record it before touching the
+ *      bucket (readBegin) and compare it afterwards (readValidate); a changed
+ *      version means a writer interleaved and what was read must be discarded.
+ *      The bucket bytes are read with plain loads, which formally race with
+ *      the writer: the vectorized signature scans (metadata/signature_scan.h)
+ *      have no atomic form. This is the usual sequence lock reader, a torn
+ *      read is never acted upon, as readValidate orders the loads before the
+ *      version check with an acquire fence. ThreadSanitizer reports them.
+ *      A reader that goes on to modify what it has read upgrades its recorded
+ *      version with tryUpgrade, which only succeeds if no writer came in
+ *      between, so the earlier lock-free read stays valid under the lock.
+ *      By default every bucket has its own version; with nLockStripes set,
+ *      bucket i shares version (i % nLockStripes) with the other buckets of
+ *      its stripe, which only adds false conflicts.
+ *   2. Embedded bit locks (tEmbeddedLock). Bit nSlotsPerBucket of a bucket's
+ *      valid bitmap is a spinlock bit, so the locks take no memory of their
+ *      own unless the slot count is a multiple of 8 (one more byte per bucket).
+ *      A bit carries no version, so lookups have to take the lock as well
+ *      (isVersioned() is false and lock-free lookups are disabled).
+ *      The lock byte may hold valid bits of the last slots. Those are only
+ *      written by the lock holder, and other threads only touch the byte with
+ *      atomic compare-and-swaps that fail while the lock bit is set.
+ *   3. BucketLock is the RAII handle of a held writer lock, it is kept in the
+ *      Chunk for as long as the chunk works on the bucket.
+ */
+#ifndef __BUCKET_LOCK_H__
+#define __BUCKET_LOCK_H__
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace cache {
+  class BucketLock {
+    public:
+      BucketLock() = default;
+      explicit BucketLock(std::atomic<uint32_t> *version) : version_(version) {}
+      BucketLock(uint8_t *lockByte, uint8_t lockMask) :
+        lockByte_(lockByte), lockMask_(lockMask) {}
+      BucketLock(BucketLock &&other) noexcept :
+        version_(other.version_), lockByte_(other.lockByte_), lockMask_(other.lockMask_)
+      {
+        other.version_ = nullptr;
+        other.lockByte_ = nullptr;
+      }
+      BucketLock& operator=(BucketLock &&other) noexcept
+      {
+        if (this != &other) {
+          unlock();
+          version_ = other.version_;
+          lockByte_ = other.lockByte_;
+          lockMask_ = other.lockMask_;
+          other.version_ = nullptr;
+          other.lockByte_ = nullptr;
+        }
+        return *this;
+      }
+      BucketLock(const BucketLock &) = delete;
+      BucketLock& operator=(const BucketLock &) = delete;
+      ~BucketLock() { unlock(); }
+
+      inline bool ownsLock() const { return version_ != nullptr || lockByte_ != nullptr; }
+      inline void unlock()
+      {
+        if (version_ != nullptr) {
+          version_->fetch_add(1, std::memory_order_release);
+          version_ = nullptr;
+        } else if (lockByte_ != nullptr) {
+          __atomic_fetch_and(lockByte_, (uint8_t)~lockMask_, __ATOMIC_RELEASE);
+          lockByte_ = nullptr;
+        }
+      }
+    private:
+      std::atomic<uint32_t> *version_ = nullptr;
+      uint8_t *lockByte_ = nullptr;
+      uint8_t lockMask_ = 0;
+  };
+
+  class BucketLockTable {
+    public:
+      /**
+       * @brief Sequence locks, one per bucket or nStripes shared ones
+       */
+      BucketLockTable(uint32_t nBuckets, uint32_t nStripes) :
+        nStripes_(nStripes == 0 || nStripes > nBuckets ? nBuckets : nStripes),
+        versions_(new std::atomic<uint32_t>[nStripes_])
+      {
+        for (uint32_t i = 0; i < nStripes_; ++i) {
+          versions_[i].store(0, std::memory_order_relaxed);
+        }
+        nBytesForLocks_ = sizeof(std::atomic<uint32_t>) * nStripes_;
+      }
+
+      /**
+       * @brief Bit locks embedded in the valid bitmaps of the buckets
+       *
+       * @param valid the valid bitmaps, nBytesPerBucketForValid bytes per
+       *        bucket with room for bit nSlotsPerBucket
+       */
+      BucketLockTable(uint8_t *valid, uint32_t nBuckets,
+          uint32_t nBytesPerBucketForValid, uint32_t nSlotsPerBucket) :
+        valid_(valid), nBytesPerBucketForValid_(nBytesPerBucketForValid),
+        lockByteOffset_(nSlotsPerBucket >> 3u),
+        lockMask_((uint8_t)(1u << (nSlotsPerBucket & 7u)))
+      {
+        nBytesForLocks_ = 1ull * nBuckets *
+          ((nSlotsPerBucket + 1 + 7) / 8 - (nSlotsPerBucket + 7) / 8);
+      }
+
+      inline bool isVersioned() const { return valid_ == nullptr; }
+      // The lock guarding a bucket, shared by the buckets of a stripe
+      inline uint32_t getStripe(uint32_t bucketId) const
+      {
+        return isVersioned() ? bucketId % nStripes_ : bucketId;
+      }
+      // Memory taken by the locks on top of the index
+      inline uint64_t getMemoryUsage() const { return nBytesForLocks_; }
+
+      /**
+       * @brief Take the writer lock of a bucket, spinning while another writer holds it
+       */
+      BucketLock lock(uint32_t bucketId)
+      {
+        if (!isVersioned()) {
+          return lockEmbedded(bucketId);
+        }
+        std::atomic<uint32_t> &version = versions_[bucketId % nStripes_];
+        for (uint32_t nSpins = 0; ; ++nSpins) {
+          uint32_t v = version.load(std::memory_order_relaxed);
+          if ((v & 1u) == 0 &&
+              version.compare_exchange_weak(v, v + 1,
+                std::memory_order_acquire, std::memory_order_relaxed)) {
+            // Bucket stores must not become visible before the odd version
+            std::atomic_thread_fence(std::memory_order_release);
+            return BucketLock(&version);
+          }
+          backoff(nSpins);
+        }
+      }
+
+      /**
+       * @brief Start a lock-free read of a bucket, waiting out a writer in progress
+       *        (sequence locks only)
+       *
+       * @return the version to pass to readValidate or tryUpgrade
+       */
+      uint32_t readBegin(uint32_t bucketId) const
+      {
+        for (uint32_t nSpins = 0; ; ++nSpins) {
+          uint32_t v = versions_[bucketId % nStripes_].load(std::memory_order_acquire);
+          if ((v & 1u) == 0) {
+            return v;
+          }
+          backoff(nSpins);
+        }
+      }
+
+      /**
+       * @brief Check that no writer modified the bucket since readBegin
+       *        (sequence locks only)
+       */
+      bool readValidate(uint32_t bucketId, uint32_t version) const
+      {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return versions_[bucketId % nStripes_].load(std::memory_order_relaxed) == version;
+      }
+
+      /**
+       * @brief Take the writer lock only if the bucket is unchanged since readBegin
+       *        (sequence locks only)
+       *
+       * @return an empty lock if a writer came in between
+       */
+      BucketLock tryUpgrade(uint32_t bucketId, uint32_t version)
+      {
+        std::atomic<uint32_t> &v = versions_[bucketId % nStripes_];
+        if (v.compare_exchange_strong(version, version + 1,
+              std::memory_order_acquire, std::memory_order_relaxed)) {
+          std::atomic_thread_fence(std::memory_order_release);
+          return BucketLock(&v);
+        }
+        return BucketLock();
+      }
+
+      /**
+       * @brief Take the writer lock of a bucket, giving up after maxSpins
+       *        attempts, for a thread that may hold another bucket lock
+       *
+       * @return an empty lock if the bucket stayed locked
+       */
+      BucketLock tryLock(uint32_t bucketId, uint32_t maxSpins)
+      {
+        for (uint32_t nSpins = 0; nSpins < maxSpins; ++nSpins) {
+          if (!isVersioned()) {
+            uint8_t *lockByte = valid_ + 1ull * nBytesPerBucketForValid_ * bucketId + lockByteOffset_;
+            uint8_t v = __atomic_load_n(lockByte, __ATOMIC_RELAXED);
+            if ((v & lockMask_) == 0 &&
+                __atomic_compare_exchange_n(lockByte, &v, (uint8_t)(v | lockMask_),
+                  false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+              return BucketLock(lockByte, lockMask_);
+            }
+          } else {
+            std::atomic<uint32_t> &version = versions_[bucketId % nStripes_];
+            uint32_t v = version.load(std::memory_order_relaxed);
+            if ((v & 1u) == 0 &&
+                version.compare_exchange_strong(v, v + 1,
+                  std::memory_order_acquire, std::memory_order_relaxed)) {
+              std::atomic_thread_fence(std::memory_order_release);
+              return BucketLock(&version);
+            }
+          }
+          backoff(nSpins);
+        }
+        return BucketLock();
+      }
+
+    private:
+      BucketLock lockEmbedded(uint32_t bucketId)
+      {
+        uint8_t *lockByte = valid_ + 1ull * nBytesPerBucketForValid_ * bucketId + lockByteOffset_;
+        for (uint32_t nSpins = 0; ; ++nSpins) {
+          uint8_t v = __atomic_load_n(lockByte, __ATOMIC_RELAXED);
+          if ((v & lockMask_) == 0 &&
+              __atomic_compare_exchange_n(lockByte, &v, (uint8_t)(v | lockMask_),
+                true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return BucketLock(lockByte, lockMask_);
+          }
+          backoff(nSpins);
+        }
+      }
+
+      static inline void backoff(uint32_t nSpins)
+      {
+        if (nSpins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+          __builtin_ia32_pause();
+#endif
+        } else {
+          std::this_thread::yield();
+        }
+      }
+
+      // Sequence locks
+      uint32_t nStripes_ = 0;
+      std::unique_ptr< std::atomic<uint32_t>[] > versions_;
+      // Embedded bit locks
+      uint8_t *valid_ = nullptr;
+      uint32_t nBytesPerBucketForValid_ = 0;
+      uint32_t lockByteOffset_ = 0;
+      uint8_t lockMask_ = 0;
+
+      uint64_t nBytesForLocks_ = 0;
+  };
+}
+#endif
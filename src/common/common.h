@@ -6,6 +6,7 @@
 #include <memory>
 #include <mutex>
 #include <iostream>
+#include "common/bucket_lock.h"
 #include "common/config.h"
 #include "common/env.h"
 #include "utils/utils.h"
@@ -18,15 +19,40 @@ namespace cache {
  * @brief Metadata is an on-ssd data structure storing Full-CA and Full-LBAs
  *        When a chunk matches both LBA index and CA index for prefix matching,
  *        metadata is fetched from SSD to verify if the chunk is duplicate or not.
+ *        This is the decoded form, the SSD holds a MetadataBlock
+ *        (see metadata/metadata_codec.h).
  */
 struct Metadata {
-  uint64_t LBAs_[MAX_NUM_LBAS_PER_CACHED_CHUNK]; // 4 * 32
+  // Up to IndexGeometry::nMaxLBAsPerChunk_ of them, a ring once full. They
+  // are kept in plainLBAs_, or with compact metadata in a buffer of
+  // MAX_NUM_LBAS_PER_CACHED_CHUNK, so that a Chunk only carries the 60 of
+  // a plain metadata block otherwise.
+  uint64_t *LBAs_;
   uint8_t  fingerprint_[20];
   uint32_t nextEvict_;
   uint32_t numLBAs_;
   // If the data is compressed, the compressed_len is valid, otherwise, it is 0.
   // For CDARC - it is 32768 if it is not compressed
   uint32_t compressedLen_;
+
+  // Zeroed, once IndexGeometry is fixed
+  Metadata();
+  Metadata(const Metadata &other);
+  Metadata &operator=(const Metadata &other);
+  // Zero the LBAs and the fields, in place of a memset
+  void clear();
+
+ private:
+  uint64_t plainLBAs_[MAX_NUM_LBAS_PER_PLAIN_METADATA];
+  std::unique_ptr<uint64_t[]> compactLBAs_;
+};
+
+/**
+ * @brief A metadata block as stored on the cache device (and in the
+ *        MetadataCache and MetaJournal), encoded by MetadataCodec
+ */
+struct MetadataBlock {
+  uint8_t bytes_[512];
 };
 
 enum DedupResult {
@@ -84,6 +110,9 @@ struct Chunk {
     //   Write chunks have their fingerprints computed at the beginning
     //   while Read chunks only have their fingerprints computed if they miss in the cache
     bool     hasFingerprint_;
+    // hasCachedata_ tells that a lookup already read the cached data along with
+    //   the metadata into compressedBuf_ (colocated layout, see MetaVerification::verify)
+    bool     hasCachedata_;
 
     uint64_t cachedataLocation_;
     uint64_t metadataLocation_;
@@ -97,8 +126,12 @@ struct Chunk {
 
     // For multithreading, indexing update must be serialized
     // Bucket-level locks are used to guarantee the consistency of index
-    std::unique_ptr<std::lock_guard<std::mutex>> lbaBucketLock_;
-    std::unique_ptr<std::lock_guard<std::mutex>> fpBucketLock_;
+    BucketLock lbaBucketLock_;
+    BucketLock fpBucketLock_;
+    // Bucket versions recorded by a lock-free lookup, validated before the
+    // result is used (see MetadataModule::validateLookup)
+    uint32_t lbaBucketVersion_;
+    uint32_t fpBucketVersion_;
 
 #ifdef CDARC
     uint32_t weuId_;
@@ -113,6 +146,7 @@ struct Chunk {
       buf_ = c.buf_;
 
       hasFingerprint_ = false;
+      hasCachedata_ = false;
       hitLBAIndex_ = false;
       hitFPIndex_ = false;
       verficationResult_ = VERIFICATION_UNKNOWN;
@@ -7,6 +7,7 @@
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <string>
 #include <cassert>
 namespace cache {
     struct Fingerprint {
@@ -40,6 +41,32 @@ namespace cache {
         tWriteThrough, tWriteBack
     };
 
+    // Bucket locks of the ACDC indexes, see common/bucket_lock.h
+    enum BucketLockEnum {
+        tSequenceLock, tEmbeddedLock
+    };
+
+    // Where the metadata blocks live on the cache device, see common/index_geometry.h
+    enum CacheLayoutEnum {
+        tSeparateMetadata, tColocatedMetadata
+    };
+
+    // How a metadata block is encoded, see metadata/metadata_codec.h
+    enum MetadataFormatEnum {
+        tPlainMetadata, tCompactMetadata
+    };
+
+    // How the block devices perform I/O, see io/device/uring_device.h
+    // and MemoryBlockDevice in io/device/device.h
+    enum IOBackendEnum {
+        tSyncIO, tUringIO, tMemoryIO
+    };
+
+    // Latency model of an emulated device, see io/device_model.h
+    enum DeviceModelEnum {
+        tNoDeviceModel, tSSDModel, tHDDModel
+    };
+
     class Config
     {
     public:
@@ -107,11 +134,36 @@ namespace cache {
         }
 
         uint32_t getMaxNumGlobalThreads() { return maxNumGlobalThreads_; }
+        BucketLockEnum getBucketLock() { return bucketLock_; }
+        // 0: one lock per bucket
+        uint32_t getnLockStripes() { return nLockStripes_; }
 
         char *getCacheDeviceName() { return cacheDeviceName_; }
         char *getPrimaryDeviceName() { return primaryDeviceName_; }
+        // Index checkpoint file, empty if disabled, see metadata/index_checkpoint.h
+        const std::string &getIndexCheckpoint() { return indexCheckpoint_; }
 
         uint32_t getWeuSize() { return weuSize_; }
+        CacheLayoutEnum getCacheLayout() { return cacheLayout_; }
+        MetadataFormatEnum getMetadataFormat() { return metadataFormat_; }
+        IOBackendEnum getIOBackend() { return ioBackend_; }
+        // Workers processing the chunks of a multi-chunk request in parallel,
+        // 0 processes them one after another (see AustereCache::read)
+        uint32_t getnChunkWorkers() { return nChunkWorkers_; }
+        // Requests in flight per device with the io_uring backend
+        uint32_t getUringQueueDepth() { return uringQueueDepth_; }
+        DeviceModelEnum getCacheDeviceModel() { return cacheDeviceModel_; }
+        DeviceModelEnum getPrimaryDeviceModel() { return primaryDeviceModel_; }
+        // Device model parameters: latencies in us, bandwidths in MB/s
+        uint32_t getSSDReadLatency() { return ssdReadLatency_; }
+        uint32_t getSSDWriteLatency() { return ssdWriteLatency_; }
+        uint32_t getSSDBandwidth() { return ssdBandwidth_; }
+        uint32_t getSSDChannels() { return ssdChannels_; }
+        uint32_t getHDDSeekTime() { return hddSeekTime_; }
+        uint32_t getHDDRpm() { return hddRpm_; }
+        uint32_t getHDDBandwidth() { return hddBandwidth_; }
+        // DRAM budget of the metadata cache in bytes, 0 disables it, see metadata/metadata_cache.h
+        uint64_t getMetadataCacheSize() { return metadataCacheSize_; }
 
         // setters
         void setFingerprintLength(uint32_t ca_length) { fingerprintLen_ = ca_length; }
@@ -134,9 +186,27 @@ namespace cache {
         void setSubchunkSize(uint32_t v) { subchunkSize_ = v; }
         void setChunkSize(uint32_t v) { chunkSize_ = v; }
         void setnThreads(uint32_t v) { maxNumGlobalThreads_ = v; }
+        void setBucketLock(BucketLockEnum v) { bucketLock_ = v; }
+        void setnLockStripes(uint32_t v) { nLockStripes_ = v; }
+        void setnChunkWorkers(uint32_t v) { nChunkWorkers_ = v; }
+        void setMetadataCacheSize(uint64_t v) { metadataCacheSize_ = v; }
+        void setCacheLayout(CacheLayoutEnum v) { cacheLayout_ = v; }
+        void setMetadataFormat(MetadataFormatEnum v) { metadataFormat_ = v; }
+        void setIOBackend(IOBackendEnum v) { ioBackend_ = v; }
+        void setUringQueueDepth(uint32_t v) { uringQueueDepth_ = v; }
+        void setCacheDeviceModel(DeviceModelEnum v) { cacheDeviceModel_ = v; }
+        void setPrimaryDeviceModel(DeviceModelEnum v) { primaryDeviceModel_ = v; }
+        void setSSDReadLatency(uint32_t v) { ssdReadLatency_ = v; }
+        void setSSDWriteLatency(uint32_t v) { ssdWriteLatency_ = v; }
+        void setSSDBandwidth(uint32_t v) { ssdBandwidth_ = v; }
+        void setSSDChannels(uint32_t v) { ssdChannels_ = v; }
+        void setHDDSeekTime(uint32_t v) { hddSeekTime_ = v; }
+        void setHDDRpm(uint32_t v) { hddRpm_ = v; }
+        void setHDDBandwidth(uint32_t v) { hddBandwidth_ = v; }
 
         void setCacheDeviceName(char *cache_device_name) { cacheDeviceName_ = cache_device_name; }
         void setPrimaryDeviceName(char *primary_device_name) { primaryDeviceName_ = primary_device_name; }
+        void setIndexCheckpoint(const char *path) { indexCheckpoint_ = path; }
 
         void setWeuSize(uint32_t v) { weuSize_ = v; }
 
@@ -144,19 +214,39 @@ namespace cache {
         void enableMultiThreading(bool v) { enableMultiThreading_ = v; }
         void enableDirectIO(bool v) { enableDirectIO_ = v; }
         void enableFakeIO(bool v) { enableFakeIO_ = v; }
+        void enableMemoryDeviceHugepages(bool v) { enableMemoryDeviceHugepages_ = v; }
         void enableSynthenticCompression(bool v) { enableSynthenticCompression_ = v; }
         void enableTraceReplay(bool v) { enableTraceReplay_ = v; }
         void enableSketchRF(bool v) { enableSketchRF_ = v; }
+        void enableEmbeddedRF(bool v) { enableEmbeddedRF_ = v; }
+        void enableMetaJournal(bool v) { enableMetaJournal_ = v; }
+        void enableWarmRestart(bool v) { enableWarmRestart_ = v; }
         void enableCompactCachePolicy(bool v) { enableCompactCachePolicy_ = v; }
+        void enableClockCachePolicy(bool v) { enableClockCachePolicy_ = v; }
+        void enableRankedBucketAwareLRU(bool v) { enableRankedBucketAwareLRU_ = v; }
+        void enableTwoChoiceFPPlacement(bool v) { enableTwoChoiceFPPlacement_ = v; }
         void setCacheMode(CacheModeEnum v) { cacheMode_ = v; }
 
         bool isMultiThreadingEnabled() { return enableMultiThreading_; }
         bool isDirectIOEnabled() { return enableDirectIO_; }
         bool isFakeIOEnabled() { return enableFakeIO_; }
+        bool isMemoryDeviceHugepagesEnabled() { return enableMemoryDeviceHugepages_; }
         bool isTraceReplayEnabled() { return enableTraceReplay_; }
         bool isSynthenticCompressionEnabled() { return enableSynthenticCompression_; }
         bool isSketchRFEnabled() { return enableSketchRF_; }
+        // Reference counts in the value bits of the FP slots, see metadata/index.h
+        bool isEmbeddedRFEnabled() { return enableEmbeddedRF_; }
+        // Metadata block updates go through a journal, see metadata/meta_journal.h
+        bool isMetaJournalEnabled() { return enableMetaJournal_; }
+        // Indexes rebuilt from the cache device at startup, see metadata/warm_restart.h
+        bool isWarmRestartEnabled() { return enableWarmRestart_; }
         bool isCompactCachePolicyEnabled() { return enableCompactCachePolicy_; }
+        // CLOCK instead of the list-based LRU when the compact policies are disabled
+        bool isClockCachePolicyEnabled() { return enableClockCachePolicy_; }
+        // Rank-array BucketAwareLRU for the LBA index (compact policies, <= 256 slots)
+        bool isRankedBucketAwareLRUEnabled() { return enableRankedBucketAwareLRU_; }
+        // Fingerprints go to the less loaded of two FP buckets, see metadata/index.h
+        bool isTwoChoiceFPPlacementEnabled() { return enableTwoChoiceFPPlacement_; }
         CacheModeEnum getCacheMode() { return cacheMode_; }
 
         void setFingerprint(uint64_t lba, char *fingerprint) {
@@ -218,28 +308,53 @@ namespace cache {
 #endif
 
         bool enableSketchRF_ = true;
+        bool enableEmbeddedRF_ = false;
+        bool enableMetaJournal_ = false;
+        bool enableWarmRestart_ = false;
 
         // Multi threading related
         uint32_t maxNumGlobalThreads_ = 8;
         bool     enableMultiThreading_;
+        BucketLockEnum bucketLock_ = tSequenceLock;
+        uint32_t nLockStripes_ = 0;
+        uint32_t nChunkWorkers_ = 0;
 
         // io related
         char *primaryDeviceName_;
         char *cacheDeviceName_;
+        std::string indexCheckpoint_;
         uint64_t primaryDeviceSize_;
         uint64_t workingSetSize_;
         uint64_t cacheDeviceSize_;
         uint32_t weuSize_ = 0;
+        uint64_t metadataCacheSize_ = 0;
+        CacheLayoutEnum cacheLayout_ = tSeparateMetadata;
+        MetadataFormatEnum metadataFormat_ = tPlainMetadata;
+        IOBackendEnum ioBackend_ = tSyncIO;
+        uint32_t uringQueueDepth_ = 64;
+        DeviceModelEnum cacheDeviceModel_ = tNoDeviceModel;
+        DeviceModelEnum primaryDeviceModel_ = tNoDeviceModel;
+        uint32_t ssdReadLatency_ = 80;
+        uint32_t ssdWriteLatency_ = 20;
+        uint32_t ssdBandwidth_ = 2000;
+        uint32_t ssdChannels_ = 8;
+        uint32_t hddSeekTime_ = 8500;
+        uint32_t hddRpm_ = 7200;
+        uint32_t hddBandwidth_ = 150;
 
 
         // Trace replay related
         bool enableDirectIO_ = false;
         bool enableFakeIO_ = true;
+        bool enableMemoryDeviceHugepages_ = false;
         bool enableSynthenticCompression_ = false;
         bool enableTraceReplay_ = true;
         CacheModeEnum cacheMode_ = tWriteThrough;
 
         bool enableCompactCachePolicy_ = true;
+        bool enableClockCachePolicy_ = false;
+        bool enableRankedBucketAwareLRU_ = false;
+        bool enableTwoChoiceFPPlacement_ = false;
 
         // Used when replaying trace, for each request, we would fill in the fingerprint value
         // specified in the trace rather than the computed one.
@@ -2,4 +2,7 @@
 //#define CACHE_DEDUP
 //#define DARC
 //#define DLRU
-#define MAX_NUM_LBAS_PER_CACHED_CHUNK 60u
+// LBAs of a chunk held by a decoded compact Metadata, and by a plain one
+// (and its metadata block), see Metadata in common/common.h
+#define MAX_NUM_LBAS_PER_CACHED_CHUNK 240u
+#define MAX_NUM_LBAS_PER_PLAIN_METADATA 60u
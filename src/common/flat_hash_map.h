@@ -0,0 +1,335 @@
+/* File: common/flat_hash_map.h
+ * Description:
+ *   This file contains FlatHashMap, an open-addressing hash map in the style of
+ *   Swiss tables, used where std::map was only used for exact-match lookups
+ *   (MapReferenceCounter and the CacheDedup indexes).
+ *
+ *   1. Entries live in one flat array, divided into groups of kGroupSize slots.
+ *      Every slot has a control byte: kEmpty, kDeleted, or, when the slot is
+ *      full, the low 7 bits of the hash of its key (H2). The remaining bits (H1)
+ *      pick the first group to probe, the following ones are visited with
+ *      triangular steps, which reach every group of a power-of-two table.
+ *   2. A lookup compares H2 with the control bytes of a whole group at once
+ *      (one SSE2 compare, a byte loop without SSE2), so keys are only compared
+ *      for the slots whose H2 matches, about 1 in 128 of the others. It stops at
+ *      the first group that has an empty slot.
+ *   3. Erasing leaves a tombstone (kDeleted), unless the group of the slot still
+ *      has an empty slot: then no probe sequence went past the group and the slot
+ *      becomes empty again. Full slots and tombstones are kept below 7/8 of the
+ *      slots; a rehash drops the tombstones and doubles the table if at least
+ *      7/16 of the slots are full.
+ *   4. Inserting may rehash, which invalidates all iterators and references.
+ *      Erasing only invalidates the erased entry. Iteration order is unspecified.
+ *      There is no synchronization, users lock as they did around std::map.
+ */
+#ifndef __FLAT_HASH_MAP_H__
+#define __FLAT_HASH_MAP_H__
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include "common/config.h"
+#include "utils/xxhash.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace cache {
+  /**
+   * @brief Hash of the keys of a FlatHashMap, all 64 bits of it are used
+   */
+  template <typename Key>
+  struct FlatHash;
+
+  template <>
+  struct FlatHash<uint64_t> {
+    // Lbas are far from uniform, mix them (the finalizer of MurmurHash3)
+    uint64_t operator()(uint64_t key) const
+    {
+      key ^= key >> 33u;
+      key *= 0xff51afd7ed558ccdull;
+      key ^= key >> 33u;
+      key *= 0xc4ceb9fe1a85ec53ull;
+      key ^= key >> 33u;
+      return key;
+    }
+  };
+
+  template <>
+  struct FlatHash<uint32_t> {
+    uint64_t operator()(uint32_t key) const
+    {
+      return FlatHash<uint64_t>()(key);
+    }
+  };
+
+  template <>
+  struct FlatHash<Fingerprint> {
+    uint64_t operator()(const Fingerprint &fp) const
+    {
+      return XXH64(fp.v_, sizeof(fp.v_), 0);
+    }
+  };
+
+  template <typename Key, typename Value, typename Hash = FlatHash<Key>>
+  class FlatHashMap {
+    public:
+      using value_type = std::pair<Key, Value>;
+      static constexpr uint32_t kGroupSize = 16;
+
+      class iterator {
+        public:
+          iterator() = default;
+          value_type &operator*() const { return map_->slots_[slotId_]; }
+          value_type *operator->() const { return &map_->slots_[slotId_]; }
+          iterator &operator++()
+          {
+            ++slotId_;
+            skipFree();
+            return *this;
+          }
+          bool operator==(const iterator &other) const { return slotId_ == other.slotId_; }
+          bool operator!=(const iterator &other) const { return slotId_ != other.slotId_; }
+        private:
+          friend class FlatHashMap;
+          iterator(FlatHashMap *map, uint64_t slotId) : map_(map), slotId_(slotId) {}
+          void skipFree()
+          {
+            while (slotId_ < map_->capacity_ && !isFull(map_->ctrl_[slotId_])) {
+              ++slotId_;
+            }
+          }
+
+          FlatHashMap *map_ = nullptr;
+          uint64_t slotId_ = 0;
+      };
+
+      FlatHashMap() = default;
+      FlatHashMap(const FlatHashMap &) = delete;
+      FlatHashMap &operator=(const FlatHashMap &) = delete;
+      ~FlatHashMap()
+      {
+        destroyAll();
+        delete[] ctrl_;
+        ::operator delete(slots_);
+      }
+
+      iterator begin()
+      {
+        iterator it(this, 0);
+        it.skipFree();
+        return it;
+      }
+      iterator end() { return iterator(this, capacity_); }
+      uint64_t size() const { return size_; }
+      bool empty() const { return size_ == 0; }
+
+      iterator find(const Key &key)
+      {
+        return iterator(this, findSlot(key, hash_(key)));
+      }
+
+      /**
+       * @brief The value of key, inserted value-initialized if key is absent
+       */
+      Value &operator[](const Key &key)
+      {
+        uint64_t hash = hash_(key);
+        uint64_t slotId = findSlot(key, hash);
+        if (slotId != capacity_) {
+          return slots_[slotId].second;
+        }
+        if (size_ + nDeleted_ + 1 > capacity_ / 8 * 7) {
+          rehash(capacity_ == 0 ? kGroupSize :
+              (size_ + 1 > capacity_ / 16 * 7 ? capacity_ * 2 : capacity_));
+        }
+        slotId = findFreeSlot(hash);
+        if (ctrl_[slotId] == kDeleted) {
+          --nDeleted_;
+        }
+        ctrl_[slotId] = getH2(hash);
+        new (&slots_[slotId]) value_type(key, Value());
+        ++size_;
+        return slots_[slotId].second;
+      }
+
+      void erase(iterator it)
+      {
+        uint64_t slotId = it.slotId_;
+        slots_[slotId].~value_type();
+        if (matchByte(ctrl_ + slotId / kGroupSize * kGroupSize, kEmpty) != 0) {
+          ctrl_[slotId] = kEmpty;
+        } else {
+          ctrl_[slotId] = kDeleted;
+          ++nDeleted_;
+        }
+        --size_;
+      }
+
+      uint64_t erase(const Key &key)
+      {
+        iterator it = find(key);
+        if (it == end()) {
+          return 0;
+        }
+        erase(it);
+        return 1;
+      }
+
+      void clear()
+      {
+        destroyAll();
+        if (capacity_ != 0) {
+          memset(ctrl_, kEmpty, capacity_);
+        }
+        size_ = 0;
+        nDeleted_ = 0;
+      }
+
+      // Exchange the entries (and the storage) of two maps
+      void swap(FlatHashMap &other)
+      {
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(nDeleted_, other.nDeleted_);
+        std::swap(hash_, other.hash_);
+      }
+
+      /**
+       * @brief Make room for n entries without rehashing
+       */
+      void reserve(uint64_t n)
+      {
+        uint64_t capacity = kGroupSize;
+        while (capacity / 8 * 7 < n) {
+          capacity <<= 1u;
+        }
+        if (capacity > capacity_) {
+          rehash(capacity);
+        }
+      }
+
+      // Bytes of the slots and control bytes
+      uint64_t getMemoryUsage() const
+      {
+        return capacity_ * (sizeof(value_type) + 1);
+      }
+
+    private:
+      static constexpr uint8_t kEmpty = 0x80;
+      static constexpr uint8_t kDeleted = 0xfe;
+
+      static inline bool isFull(uint8_t ctrl) { return (ctrl & 0x80u) == 0; }
+      static inline uint8_t getH2(uint64_t hash) { return hash & 0x7fu; }
+      inline uint64_t getFirstGroup(uint64_t hash) const
+      {
+        return (hash >> 7u) & (capacity_ / kGroupSize - 1);
+      }
+
+      // Bit i is set if control byte i of the group equals ctrl
+      static inline uint32_t matchByte(const uint8_t *group, uint8_t ctrl)
+      {
+#if defined(__SSE2__)
+        __m128i ctrls = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8((char)ctrl)));
+#else
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < kGroupSize; ++i) {
+          mask |= (uint32_t)(group[i] == ctrl) << i;
+        }
+        return mask;
+#endif
+      }
+
+      // Bit i is set if slot i of the group is empty or deleted
+      static inline uint32_t matchFree(const uint8_t *group)
+      {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group)));
+#else
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < kGroupSize; ++i) {
+          mask |= (uint32_t)(group[i] >> 7u) << i;
+        }
+        return mask;
+#endif
+      }
+
+      // Slot of key, capacity_ if key is absent
+      uint64_t findSlot(const Key &key, uint64_t hash)
+      {
+        if (size_ == 0) {
+          return capacity_;
+        }
+        uint64_t groupMask = capacity_ / kGroupSize - 1;
+        uint8_t h2 = getH2(hash);
+        for (uint64_t group = getFirstGroup(hash), step = 1; ;
+             group = (group + step++) & groupMask) {
+          const uint8_t *ctrl = ctrl_ + group * kGroupSize;
+          for (uint32_t m = matchByte(ctrl, h2); m != 0; m &= m - 1) {
+            uint64_t slotId = group * kGroupSize + __builtin_ctz(m);
+            if (slots_[slotId].first == key) {
+              return slotId;
+            }
+          }
+          if (matchByte(ctrl, kEmpty) != 0) {
+            return capacity_;
+          }
+        }
+      }
+
+      // First empty or deleted slot on the probe sequence of hash,
+      // there is one as the slots in use stay below 7/8
+      uint64_t findFreeSlot(uint64_t hash)
+      {
+        uint64_t groupMask = capacity_ / kGroupSize - 1;
+        for (uint64_t group = getFirstGroup(hash), step = 1; ;
+             group = (group + step++) & groupMask) {
+          uint32_t m = matchFree(ctrl_ + group * kGroupSize);
+          if (m != 0) {
+            return group * kGroupSize + __builtin_ctz(m);
+          }
+        }
+      }
+
+      void rehash(uint64_t capacity)
+      {
+        uint8_t *oldCtrl = ctrl_;
+        value_type *oldSlots = slots_;
+        uint64_t oldCapacity = capacity_;
+
+        ctrl_ = new uint8_t[capacity];
+        memset(ctrl_, kEmpty, capacity);
+        slots_ = static_cast<value_type *>(::operator new(sizeof(value_type) * capacity));
+        capacity_ = capacity;
+        nDeleted_ = 0;
+        for (uint64_t i = 0; i < oldCapacity; ++i) {
+          if (!isFull(oldCtrl[i])) continue;
+          uint64_t hash = hash_(oldSlots[i].first);
+          uint64_t slotId = findFreeSlot(hash);
+          ctrl_[slotId] = getH2(hash);
+          new (&slots_[slotId]) value_type(std::move(oldSlots[i]));
+          oldSlots[i].~value_type();
+        }
+        delete[] oldCtrl;
+        ::operator delete(oldSlots);
+      }
+
+      void destroyAll()
+      {
+        for (uint64_t i = 0; i < capacity_; ++i) {
+          if (isFull(ctrl_[i])) {
+            slots_[i].~value_type();
+          }
+        }
+      }
+
+      uint8_t *ctrl_ = nullptr;
+      value_type *slots_ = nullptr;
+      uint64_t capacity_ = 0, size_ = 0, nDeleted_ = 0;
+      Hash hash_;
+  };
+}
+#endif
@@ -0,0 +1,116 @@
+/* File: common/index_geometry.h
+ * Description:
+ *   This file contains IndexGeometry, the immutable shape of the LBA and FP
+ *   indexes and of the cache device layout they address.
+ *
+ *   1. It is computed once from Config on first use (AustereCache touches it
+ *      right after the configuration is parsed) and never changes afterwards,
+ *      so the hot paths (hashing, bucket addressing, cache device locations)
+ *      read plain precomputed fields instead of going through Config getters
+ *      that recompute bucket counts and bit widths on every call.
+ *   2. Fixed bucket shapes for the common geometries live in metadata/index.h,
+ *      where LBAIndex/FPIndex pick a specialized instantiation at startup.
+ *   3. The cache device layout (Config::getCacheLayout()) is fixed when the
+ *      cache device is formatted, i.e., created and sized by IOModule:
+ *      - separate: the metadata region (one metadata block per FP slot)
+ *        followed by the cached data (one subchunk per FP slot).
+ *      - colocated: one extent of metadataSize_ + subchunkSize_ per FP slot,
+ *        the metadata block first, so that a hit reads the metadata and the
+ *        data of a chunk in one I/O. The data of a chunk spanning n slots
+ *        runs over the (unused) metadata blocks of its n - 1 other slots,
+ *        which leaves room to spare as every slot brings one more block.
+ *      Two more blocks follow the slots, before the MetaJournal region, so
+ *      that every configuration of the same FP geometry finds them: the
+ *      WarmRestart block records whether the indexes can be rebuilt from the
+ *      cache device (metadata/warm_restart.h), the IndexCheckpoint block
+ *      which checkpoint file matches it (metadata/index_checkpoint.h).
+ *   4. The metadata blocks are plain or compact (Config::getMetadataFormat()),
+ *      which bounds the LBAs kept per chunk, see metadata/metadata_codec.h.
+ */
+#ifndef __INDEX_GEOMETRY_H__
+#define __INDEX_GEOMETRY_H__
+#include <cstdint>
+#include "config.h"
+#include "env.h"
+
+namespace cache {
+  class IndexGeometry {
+    public:
+      static const IndexGeometry& getInstance() {
+        static IndexGeometry instance;
+        return instance;
+      }
+
+      // Chunk / subchunk / metadata sizes
+      uint32_t chunkSize_, subchunkSize_, metadataSize_;
+
+      // LBA index: lbaHash = (bucketId << nBitsPerLbaSignature_) | signature
+      uint32_t nBitsPerLbaSignature_, nBitsPerLbaBucketId_;
+      uint32_t nLbaBuckets_, nSlotsPerLbaBucket_;
+      uint32_t lbaSignatureMask_;
+      // Right shift of the 64-bit lba hash keeping (signature + bucket id) bits
+      uint32_t lbaHashShift_;
+      uint32_t lbaSlotSeperator_;
+
+      // FP index: fpHash = (bucketId << nBitsPerFpSignature_) | signature
+      uint32_t nBitsPerFpSignature_, nBitsPerFpBucketId_;
+      uint32_t nFpBuckets_, nSlotsPerFpBucket_;
+      uint32_t fpSignatureMask_;
+
+      // Cache device layout, see 3.; the metadata region is empty when colocated
+      bool colocatedMetadata_;
+      uint64_t slotStride_;
+      uint64_t metadataRegionSize_;
+      // The WarmRestart and IndexCheckpoint blocks follow the cached data
+      uint64_t restartBlockOffset_, checkpointBlockOffset_;
+      // Then the MetaJournal region, empty without the journal
+      uint64_t journalRegionOffset_, journalRegionSize_;
+      uint64_t cacheDeviceSize_;
+
+      // Metadata block format, see 4.
+      bool compactMetadata_;
+      uint32_t nMaxLBAsPerChunk_;
+
+    private:
+      IndexGeometry() {
+        Config &config = Config::getInstance();
+        chunkSize_ = config.getChunkSize();
+        subchunkSize_ = config.getSubchunkSize();
+        metadataSize_ = config.getMetadataSize();
+
+        nBitsPerLbaSignature_ = config.getnBitsPerLbaSignature();
+        nBitsPerLbaBucketId_ = config.getnBitsPerLbaBucketId();
+        nLbaBuckets_ = config.getnLbaBuckets();
+        nSlotsPerLbaBucket_ = config.getnLBASlotsPerBucket();
+        lbaSignatureMask_ = (1u << nBitsPerLbaSignature_) - 1u;
+        lbaHashShift_ = 64 - (nBitsPerLbaSignature_ + nBitsPerLbaBucketId_);
+        lbaSlotSeperator_ = config.getLBASlotSeperator();
+
+        nBitsPerFpSignature_ = config.getnBitsPerFpSignature();
+        nBitsPerFpBucketId_ = config.getnBitsPerFpBucketId();
+        nFpBuckets_ = config.getnFpBuckets();
+        nSlotsPerFpBucket_ = config.getnFPSlotsPerBucket();
+        fpSignatureMask_ = (1u << nBitsPerFpSignature_) - 1u;
+
+        uint64_t nFpSlots = 1ull * nFpBuckets_ * nSlotsPerFpBucket_;
+        colocatedMetadata_ = config.getCacheLayout() == tColocatedMetadata;
+        if (colocatedMetadata_) {
+          slotStride_ = metadataSize_ + subchunkSize_;
+          metadataRegionSize_ = 0;
+        } else {
+          slotStride_ = subchunkSize_;
+          metadataRegionSize_ = nFpSlots * metadataSize_;
+        }
+        restartBlockOffset_ = metadataRegionSize_ + nFpSlots * slotStride_;
+        checkpointBlockOffset_ = restartBlockOffset_ + metadataSize_;
+        journalRegionOffset_ = checkpointBlockOffset_ + metadataSize_;
+        journalRegionSize_ = config.isMetaJournalEnabled() ? 20 * 1024 * 1024ull : 0;
+        cacheDeviceSize_ = journalRegionOffset_ + journalRegionSize_;
+
+        compactMetadata_ = config.getMetadataFormat() == tCompactMetadata;
+        nMaxLBAsPerChunk_ = compactMetadata_ ?
+          MAX_NUM_LBAS_PER_CACHED_CHUNK : MAX_NUM_LBAS_PER_PLAIN_METADATA;
+      }
+  };
+}
+#endif
@@ -47,6 +47,9 @@ struct Stats {
       std::cout << "IO statistics: " << std::endl
                 << "    Num bytes metadata written to ssd: " <<          _n_metadata_bytes_written_to_ssd << std::endl
                 << "    Num bytes metadata read from ssd: " << _n_metadata_bytes_read_from_ssd << std::endl
+                << "    Num metadata cache hits: " << _n_metadata_cache_hit << std::endl
+                << "    Num metadata cache misses: " << _n_metadata_cache_miss << std::endl
+                << "    Num bytes journal written to ssd: " << _n_journal_bytes_written_to_ssd << std::endl
                 << "    Num total bytes data should written to ssd: " << _n_total_bytes_written_to_ssd << std::endl
                 << "    Num bytes data written to ssd: " << _n_data_bytes_written_to_ssd << std::endl
                 << "    Num bytes data read from ssd: " << _n_data_bytes_read_from_ssd << std::endl
@@ -234,6 +237,11 @@ struct Stats {
     std::atomic<uint64_t> _n_metadata_bytes_written_to_ssd;
     std::atomic<uint64_t> _n_metadata_bytes_read_from_ssd;
 
+    // metadata reads served by (hit) or missing in (miss) the DRAM metadata cache
+    std::atomic<uint64_t> _n_metadata_cache_hit;
+    std::atomic<uint64_t> _n_metadata_cache_miss;
+    std::atomic<uint64_t> _n_journal_bytes_written_to_ssd;
+
     std::atomic<uint64_t> _n_bytes_written_to_hdd;
     std::atomic<uint64_t> _n_bytes_read_from_hdd;
 
@@ -246,6 +254,9 @@ struct Stats {
 
     inline void add_metadata_bytes_written_to_ssd(uint64_t v) {   _n_metadata_bytes_written_to_ssd  .fetch_add(v, std::memory_order_relaxed); }
     inline void add_metadata_bytes_read_from_ssd(uint64_t v) {    _n_metadata_bytes_read_from_ssd   .fetch_add(v, std::memory_order_relaxed); }
+    inline void add_metadata_cache_hit() {  _n_metadata_cache_hit .fetch_add(1, std::memory_order_relaxed); }
+    inline void add_metadata_cache_miss() { _n_metadata_cache_miss.fetch_add(1, std::memory_order_relaxed); }
+    inline void add_journal_bytes_written_to_ssd(uint64_t v) { _n_journal_bytes_written_to_ssd.fetch_add(v, std::memory_order_relaxed); }
 
     inline void add_bytes_written_to_hdd(uint64_t v) { _n_bytes_written_to_hdd.fetch_add(v, std::memory_order_relaxed); }
     inline void add_bytes_read_from_hdd(uint64_t v) {  _n_bytes_read_from_hdd .fetch_add(v, std::memory_order_relaxed); }
@@ -274,6 +285,9 @@ struct Stats {
       _n_total_bytes_written_to_ssd.store(0, std::memory_order_relaxed);
       _n_metadata_bytes_written_to_ssd.store(0, std::memory_order_relaxed);
       _n_metadata_bytes_read_from_ssd.store(0, std::memory_order_relaxed);
+      _n_metadata_cache_hit.store(0, std::memory_order_relaxed);
+      _n_metadata_cache_miss.store(0, std::memory_order_relaxed);
+      _n_journal_bytes_written_to_ssd.store(0, std::memory_order_relaxed);
       _n_data_bytes_written_to_ssd.store(0, std::memory_order_relaxed);
       _n_data_bytes_read_from_ssd.store(0, std::memory_order_relaxed);
       _n_bytes_written_to_hdd.store(0, std::memory_order_relaxed);
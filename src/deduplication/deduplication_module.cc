@@ -20,4 +20,13 @@ namespace cache {
     END_TIMER(lookup);
   }
 
+  bool DeduplicationModule::validateLookup(Chunk &chunk)
+  {
+    bool valid;
+    BEGIN_TIMER();
+    valid = MetadataModule::getInstance().validateLookup(chunk);
+    END_TIMER(lookup);
+    return valid;
+  }
+
 }
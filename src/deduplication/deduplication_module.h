@@ -14,6 +14,9 @@ namespace cache {
     // return deduplication flag: duplicate_content, or not duplicate
     static void dedup(Chunk &chunk);
     static void lookup(Chunk &chunk);
+    // confirm the lookup after the cached data was read,
+    // false if the chunk was looked up again and must be re-read
+    static bool validateLookup(Chunk &chunk);
   };
 }
 
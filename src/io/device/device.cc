@@ -48,6 +48,11 @@ namespace cache {
         return len;
     }
 
+    return do_write(addr, buf, len);
+  }
+
+  int BlockDevice::do_write(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
     int n_written_bytes = 0;
     while (1) {
       int n = ::pwrite(_fd, buf, len, addr);
@@ -92,6 +97,19 @@ namespace cache {
         return len;
     }
 
+    int n_read_bytes = do_read(addr, buf, len);
+#if defined(CDARC)
+    // if enabled direct io, the request must be aligned with the disk
+    if (Config::getInstance().isDirectIOEnabled()) {
+      memmove(buf, buf + realAddr - addr, realLen);
+      n_read_bytes = realLen;
+    }
+#endif
+    return n_read_bytes;
+  }
+
+  int BlockDevice::do_read(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
     int n_read_bytes = 0;
     while (1) {
       int n = ::pread(_fd, buf, len, addr);
@@ -108,13 +126,6 @@ namespace cache {
         len -= n;
       }
     }
-#if defined(CDARC)
-    // if enabled direct io, the request must be aligned with the disk
-    if (Config::getInstance().isDirectIOEnabled()) {
-      memmove(buf, buf + realAddr - addr, realLen);
-      n_read_bytes = realLen;
-    }
-#endif
     return n_read_bytes;
   }
 
@@ -182,11 +193,78 @@ namespace cache {
       else
         size = get_size(fd);
     }
+    // A file created for a smaller layout grows to it, reads past its
+    // end would come back short
+    if (S_ISREG(statbuf->st_mode) && (uint64_t)statbuf->st_size < size) {
+      if (::ftruncate(fd, size) < 0) {
+        std::cout << "BlockDevice::open_existing_device " << std::strerror(errno) << std::endl;
+        return -1;
+      }
+    }
     _size = size;
     _fd = fd;
     return 0;
   }
 
+  MemoryBlockDevice::MemoryBlockDevice()
+  {
+    _fd = -1;
+  }
+
+  MemoryBlockDevice::~MemoryBlockDevice()
+  {
+    if (_data != nullptr) {
+      ::munmap(_data, _mapped_size);
+    }
+  }
+
+  int MemoryBlockDevice::open(char *filename, uint64_t size)
+  {
+    if (size == 0) {
+      return -1;
+    }
+    void *data = MAP_FAILED;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (Config::getInstance().isMemoryDeviceHugepagesEnabled()) {
+      // hugetlbfs mappings are a multiple of the (2 MiB) huge page size, and
+      // reserve their pages up front: without enough of them, the mapping
+      // fails here rather than faulting later
+      _mapped_size = (size + (2ull << 20) - 1) / (2ull << 20) * (2ull << 20);
+      data = ::mmap(nullptr, _mapped_size, PROT_READ | PROT_WRITE,
+                    (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+      if (data == MAP_FAILED) {
+        std::cout << "MemoryBlockDevice: no huge pages reserved, using transparent huge pages" << std::endl;
+      }
+    }
+    if (data == MAP_FAILED) {
+      _mapped_size = size;
+      data = ::mmap(nullptr, _mapped_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (data == MAP_FAILED) {
+        std::cout << "MemoryBlockDevice::open " << std::strerror(errno) << std::endl;
+        return -1;
+      }
+      if (Config::getInstance().isMemoryDeviceHugepagesEnabled()) {
+        ::madvise(data, _mapped_size, MADV_HUGEPAGE);
+      }
+    }
+    std::cout << "MemoryBlockDevice::Open " << size << " bytes in memory!" << std::endl;
+    _data = static_cast<uint8_t *>(data);
+    _size = size;
+    return 0;
+  }
+
+  int MemoryBlockDevice::do_read(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
+    memcpy(buf, _data + addr, len);
+    return len;
+  }
+
+  int MemoryBlockDevice::do_write(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
+    memcpy(_data + addr, buf, len);
+    return len;
+  }
+
   int BlockDevice::get_size(int fd)
   {
     uint32_t offset = 1024;
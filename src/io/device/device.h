@@ -24,22 +24,40 @@ class BlockDevice : public Device {
   ~BlockDevice();
   int read(uint64_t addr, uint8_t* buf, uint32_t len);
   int write(uint64_t addr, uint8_t* buf, uint32_t len);
-  int open(char *filename, uint64_t size);
-  void sync();
+  virtual int open(char *filename, uint64_t size);
+  virtual void sync();
+ protected:
+  // The I/O of a request once checked and clipped, pread/pwrite until done
+  virtual int do_read(uint64_t addr, uint8_t* buf, uint32_t len);
+  virtual int do_write(uint64_t addr, uint8_t* buf, uint32_t len);
  private:
   int open_new_device(char *filename, uint64_t size);
   int open_existing_device(char *filename, uint64_t size, struct stat *statbuf);
   int get_size(int fd);
 };
 
-//class MemoryBlockDevice : public Device {
-// public:
-//  memoryblockdevice();
-//  ~memoryblockdevice();
-//  int read(uint64_t addr, uint8_t* buf, uint32_t len);
-//  int write(uint64_t addr, uint8_t* buf, uint32_t len);
-//  int open(uint64_t size);
-//};
+/**
+ * @brief A block device held in memory (Config::getIOBackend() tMemoryIO),
+ *        to run the whole data path, fakeIO off, at memory speed.
+ *        The memory is an anonymous mapping of the device size, reserved
+ *        lazily: a block never written reads as zeros, as a new device file.
+ *        With Config::isMemoryDeviceHugepagesEnabled(), it is mapped on
+ *        hugetlbfs pages if some are reserved, else on transparent huge pages.
+ *        The content is lost at exit, the filename is ignored.
+ */
+class MemoryBlockDevice : public BlockDevice {
+ public:
+  MemoryBlockDevice();
+  ~MemoryBlockDevice();
+  int open(char *filename, uint64_t size) override;
+  void sync() override {}
+ protected:
+  int do_read(uint64_t addr, uint8_t* buf, uint32_t len) override;
+  int do_write(uint64_t addr, uint8_t* buf, uint32_t len) override;
+ private:
+  uint8_t *_data = nullptr;
+  uint64_t _mapped_size = 0;
+};
 
 }
 
@@ -0,0 +1,296 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "common/config.h"
+#include "uring_device.h"
+
+namespace cache {
+  constexpr uint32_t UringBlockDevice::kSegmentSize;
+
+  namespace {
+    inline int io_uring_setup(uint32_t entries, struct io_uring_params *params)
+    {
+      return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    inline int io_uring_enter(int fd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags)
+    {
+      return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    inline int io_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nArgs)
+    {
+      return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nArgs);
+    }
+  }
+
+  UringBlockDevice::UringBlockDevice() {}
+
+  UringBlockDevice::~UringBlockDevice()
+  {
+    teardown_ring();
+  }
+
+  int UringBlockDevice::open(char *filename, uint64_t size)
+  {
+    int ret = BlockDevice::open(filename, size);
+    if (ret != 0) {
+      return ret;
+    }
+    enabled_ = setup_ring(Config::getInstance().getUringQueueDepth());
+    if (!enabled_) {
+      std::cout << "UringBlockDevice: cannot set up io_uring (" << std::strerror(errno)
+                << "), falling back to pread/pwrite" << std::endl;
+    }
+    return 0;
+  }
+
+  bool UringBlockDevice::setup_ring(uint32_t queueDepth)
+  {
+    queueDepth = std::max(1u, queueDepth);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd_ = io_uring_setup(queueDepth, &params);
+    if (ringFd_ < 0) {
+      return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+      sqRing_ = nullptr;
+      teardown_ring();
+      return false;
+    }
+    if (singleMmap) {
+      cqRing_ = sqRing_;
+    } else {
+      cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+      if (cqRing_ == MAP_FAILED) {
+        cqRing_ = nullptr;
+        teardown_ring();
+        return false;
+      }
+    }
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      teardown_ring();
+      return false;
+    }
+    sqes_ = reinterpret_cast<struct io_uring_sqe *>(sqes);
+
+    uint8_t *sq = reinterpret_cast<uint8_t *>(sqRing_), *cq = reinterpret_cast<uint8_t *>(cqRing_);
+    sqTail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+    sqMask_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+    cqHead_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+    cqMask_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // The submission ring may be larger (a power of two), the slots
+    // bound the entries in flight, see 3.
+    queueDepth_ = std::min(queueDepth, params.sq_entries);
+    if (!probe_opcodes() || io_uring_register(ringFd_, IORING_REGISTER_FILES, &_fd, 1) < 0) {
+      teardown_ring();
+      return false;
+    }
+    freeSlots_.resize(queueDepth_);
+    for (uint32_t i = 0; i < queueDepth_; ++i) {
+      freeSlots_[i] = queueDepth_ - 1 - i;
+    }
+    return true;
+  }
+
+  bool UringBlockDevice::probe_opcodes()
+  {
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::vector<uint8_t> bytes(probeSize, 0);
+    struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(bytes.data());
+    if (io_uring_register(ringFd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+      return false;
+    }
+    for (uint8_t opcode : {(uint8_t)IORING_OP_READ, (uint8_t)IORING_OP_WRITE}) {
+      if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+        errno = EOPNOTSUPP;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void UringBlockDevice::teardown_ring()
+  {
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqesSize_);
+      sqes_ = nullptr;
+    }
+    if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+      munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = nullptr;
+    if (sqRing_ != nullptr) {
+      munmap(sqRing_, sqRingSize_);
+      sqRing_ = nullptr;
+    }
+    // Closing the ring unregisters the file
+    if (ringFd_ >= 0) {
+      close(ringFd_);
+      ringFd_ = -1;
+    }
+    enabled_ = false;
+  }
+
+  int UringBlockDevice::do_read(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
+    if (!enabled_) {
+      return BlockDevice::do_read(addr, buf, len);
+    }
+    return submit(IORING_OP_READ, addr, buf, len);
+  }
+
+  int UringBlockDevice::do_write(uint64_t addr, uint8_t* buf, uint32_t len)
+  {
+    if (!enabled_) {
+      return BlockDevice::do_write(addr, buf, len);
+    }
+    return submit(IORING_OP_WRITE, addr, buf, len);
+  }
+
+  int UringBlockDevice::submit(uint8_t opcode, uint64_t addr, uint8_t *buf, uint32_t len)
+  {
+    std::vector<Segment> segments((len + kSegmentSize - 1) / kSegmentSize);
+    for (uint32_t i = 0; i < segments.size(); ++i) {
+      uint32_t offset = i * kSegmentSize;
+      segments[i] = {addr + offset, buf + offset, std::min(kSegmentSize, len - offset), 0, 0, false};
+    }
+
+    // Segments the device did not complete in full, finished with pread/pwrite
+    std::vector<Segment *> shortSegments;
+    uint32_t nQueuedSegments = 0, nHandledSegments = 0;
+    std::unique_lock<std::mutex> l(mutex_);
+    while (nHandledSegments < segments.size()) {
+      bool progress = false;
+      while (nQueuedSegments < segments.size() && !freeSlots_.empty()) {
+        queue_segment(opcode, segments[nQueuedSegments++]);
+        progress = true;
+      }
+      submit_queued();
+
+      for (uint32_t i = 0; i < nQueuedSegments; ++i) {
+        Segment &segment = segments[i];
+        if (!segment.completed_ || segment.slot_ == ~0u) continue;
+        if (segment.res_ < 0) {
+          std::cout << "addr: " << segment.addr_ << " len: " << segment.len_ << std::endl;
+          std::cout << (opcode == IORING_OP_READ ? "UringBlockDevice::read " : "UringBlockDevice::write ")
+                    << std::strerror(-segment.res_) << std::endl;
+          exit(-1);
+        }
+        if ((uint32_t)segment.res_ < segment.len_) {
+          shortSegments.push_back(&segment);
+        }
+        freeSlots_.push_back(segment.slot_);
+        segment.slot_ = ~0u;
+        ++nHandledSegments;
+        progress = true;
+      }
+      if (progress) {
+        // Others may wait for a slot
+        completed_.notify_all();
+        continue;
+      }
+
+      if (!reaping_ && nInFlight_ > 0) {
+        reaping_ = true;
+        l.unlock();
+        int ret = io_uring_enter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR) {
+          std::cout << "UringBlockDevice::io_uring_enter " << std::strerror(errno) << std::endl;
+          exit(-1);
+        }
+        l.lock();
+        reap_completions();
+        reaping_ = false;
+        completed_.notify_all();
+      } else {
+        completed_.wait(l);
+      }
+    }
+    l.unlock();
+
+    for (Segment *segment : shortSegments) {
+      uint32_t done = segment->res_;
+      if (opcode == IORING_OP_READ) {
+        BlockDevice::do_read(segment->addr_ + done, segment->buf_ + done, segment->len_ - done);
+      } else {
+        BlockDevice::do_write(segment->addr_ + done, segment->buf_ + done, segment->len_ - done);
+      }
+    }
+    return len;
+  }
+
+  void UringBlockDevice::queue_segment(uint8_t opcode, Segment &segment)
+  {
+    segment.slot_ = freeSlots_.back();
+    freeSlots_.pop_back();
+
+    // Only this thread, holding the lock, moves the tail
+    uint32_t tail = *sqTail_, index = tail & *sqMask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    // Index of the registered file
+    sqe->fd = 0;
+    sqe->off = segment.addr_;
+    sqe->addr = reinterpret_cast<uint64_t>(segment.buf_);
+    sqe->len = segment.len_;
+    sqe->user_data = reinterpret_cast<uint64_t>(&segment);
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    ++nQueued_;
+  }
+
+  void UringBlockDevice::submit_queued()
+  {
+    while (nQueued_ > 0) {
+      int ret = io_uring_enter(ringFd_, nQueued_, 0, 0);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        std::cout << "UringBlockDevice::io_uring_enter " << std::strerror(errno) << std::endl;
+        exit(-1);
+      }
+      nQueued_ -= ret;
+      nInFlight_ += ret;
+    }
+  }
+
+  void UringBlockDevice::reap_completions()
+  {
+    uint32_t head = *cqHead_, tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      struct io_uring_cqe *cqe = &cqes_[head & *cqMask_];
+      Segment *segment = reinterpret_cast<Segment *>(cqe->user_data);
+      segment->res_ = cqe->res;
+      segment->completed_ = true;
+      --nInFlight_;
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+  }
+
+}
@@ -0,0 +1,98 @@
+/* File: io/device/uring_device.h
+ * Description:
+ *   This file contains UringBlockDevice, a BlockDevice performing its I/O
+ *   through io_uring (Config::getIOBackend()), so that the worker threads
+ *   together keep many requests in flight on the device instead of one each.
+ *
+ *   1. One ring per device, set up with raw syscalls (no liburing), with
+ *      Config::getUringQueueDepth() entries. The device file is registered
+ *      with the ring. Every request is split into segments of at most
+ *      kSegmentSize bytes, read or written with IORING_OP_READ/WRITE straight
+ *      from the buffer of the caller: no copy, and no buffer to register, as
+ *      the callers' buffers are not known in advance.
+ *   2. A request queues as many of its segments as there are free slots
+ *      (getUringQueueDepth() of them), and submits all the queued entries in
+ *      one io_uring_enter, those queued meanwhile by other threads included.
+ *   3. One waiting thread at a time reaps completions (reaping_): it waits
+ *      in io_uring_enter without the lock, then drains the completion queue
+ *      and wakes the others, whose segments may have completed. Slots and
+ *      completion entries never run out: a segment holds its slot until
+ *      reaped, and the completion queue is twice the depth.
+ *   4. Checks and fake I/O stay in BlockDevice::read/write, only do_read()
+ *      and do_write() differ. If the ring cannot be set up (old kernel,
+ *      memlock limit, no IORING_OP_READ/WRITE before Linux 5.6), the device
+ *      falls back to pread/pwrite.
+ */
+#ifndef __URING_DEVICE_H__
+#define __URING_DEVICE_H__
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <linux/io_uring.h>
+#include "device.h"
+
+namespace cache {
+
+class UringBlockDevice : public BlockDevice {
+ public:
+  UringBlockDevice();
+  ~UringBlockDevice();
+  int open(char *filename, uint64_t size) override;
+
+  static constexpr uint32_t kSegmentSize = 128 * 1024;
+
+ protected:
+  int do_read(uint64_t addr, uint8_t* buf, uint32_t len) override;
+  int do_write(uint64_t addr, uint8_t* buf, uint32_t len) override;
+
+ private:
+  struct Segment {
+    uint64_t addr_;
+    uint8_t *buf_;
+    uint32_t len_;
+    uint32_t slot_;
+    // Result of the completion, valid once completed_
+    int32_t res_;
+    bool completed_;
+  };
+
+  bool setup_ring(uint32_t queueDepth);
+  // Whether the kernel has IORING_OP_READ and IORING_OP_WRITE
+  bool probe_opcodes();
+  void teardown_ring();
+  int submit(uint8_t opcode, uint64_t addr, uint8_t *buf, uint32_t len);
+  // Queue a segment on a free slot, with the lock held
+  void queue_segment(uint8_t opcode, Segment &segment);
+  // Submit all queued entries, with the lock held
+  void submit_queued();
+  // Drain the completion queue, with the lock held
+  void reap_completions();
+
+  bool enabled_ = false;
+  int ringFd_ = -1;
+  uint32_t queueDepth_ = 0;
+
+  // Rings mapped from ringFd_
+  void *sqRing_ = nullptr, *cqRing_ = nullptr;
+  size_t sqRingSize_ = 0, cqRingSize_ = 0;
+  struct io_uring_sqe *sqes_ = nullptr;
+  size_t sqesSize_ = 0;
+  uint32_t *sqTail_, *sqMask_, *sqArray_;
+  uint32_t *cqHead_, *cqTail_, *cqMask_;
+  struct io_uring_cqe *cqes_;
+  // Entries queued in the submission ring and not submitted yet, and
+  // submitted entries not reaped yet
+  uint32_t nQueued_ = 0, nInFlight_ = 0;
+
+  // Slots of the segments in flight, see 2.
+  std::vector<uint32_t> freeSlots_;
+
+  std::mutex mutex_;
+  std::condition_variable completed_;
+  bool reaping_ = false;
+};
+
+}
+
+#endif //__URING_DEVICE_H__
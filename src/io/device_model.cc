@@ -0,0 +1,150 @@
+#include "device_model.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace cache {
+
+namespace {
+  // Virtual time of the calling thread, and the start of its current request
+  thread_local uint64_t threadNow = 0;
+  thread_local uint64_t requestStart = 0;
+
+  // Transfer time in nanoseconds of len bytes at bandwidth MB/s
+  inline uint64_t transferTime(uint32_t len, uint64_t bandwidth)
+  {
+    return (uint64_t)len * 1000 / bandwidth;
+  }
+}
+
+std::unique_ptr<DeviceModel> DeviceModel::create(DeviceModelEnum model)
+{
+  if (model == tSSDModel) {
+    return std::make_unique<SSDModel>();
+  } else if (model == tHDDModel) {
+    return std::make_unique<HDDModel>();
+  }
+  return nullptr;
+}
+
+DeviceModel::DeviceModel(uint32_t nChannels) : freeAt_(std::max(1u, nChannels), 0) {}
+
+void DeviceModel::charge(bool isWrite, uint64_t addr, uint32_t len)
+{
+  VirtualClock &clock = VirtualClock::getInstance();
+  uint64_t now = clock.now(), end;
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    auto channel = std::min_element(freeAt_.begin(), freeAt_.end());
+    end = std::max(now, *channel) + serviceTime(isWrite, addr, len);
+    *channel = end;
+  }
+  clock.advanceTo(end);
+}
+
+void DeviceModel::reset()
+{
+  std::lock_guard<std::mutex> l(mutex_);
+  std::fill(freeAt_.begin(), freeAt_.end(), 0);
+}
+
+SSDModel::SSDModel() : DeviceModel(Config::getInstance().getSSDChannels())
+{
+  Config &config = Config::getInstance();
+  readLatency_ = config.getSSDReadLatency() * 1000ull;
+  writeLatency_ = config.getSSDWriteLatency() * 1000ull;
+  bandwidth_ = std::max(1u, config.getSSDBandwidth());
+}
+
+uint64_t SSDModel::serviceTime(bool isWrite, uint64_t addr, uint32_t len)
+{
+  return (isWrite ? writeLatency_ : readLatency_) + transferTime(len, bandwidth_);
+}
+
+HDDModel::HDDModel() : DeviceModel(1)
+{
+  Config &config = Config::getInstance();
+  // Average seek plus half a rotation
+  positioningTime_ = config.getHDDSeekTime() * 1000ull
+    + (config.getHDDRpm() == 0 ? 0 : 30ull * 1000000000 / config.getHDDRpm());
+  bandwidth_ = std::max(1u, config.getHDDBandwidth());
+}
+
+uint64_t HDDModel::serviceTime(bool isWrite, uint64_t addr, uint32_t len)
+{
+  uint64_t time = transferTime(len, bandwidth_);
+  if (addr != headPosition_) {
+    time += positioningTime_;
+  }
+  headPosition_ = addr + len;
+  return time;
+}
+
+VirtualClock& VirtualClock::getInstance()
+{
+  static VirtualClock instance;
+  return instance;
+}
+
+VirtualClock::VirtualClock()
+{
+  Config &config = Config::getInstance();
+  enabled_ = config.getCacheDeviceModel() != tNoDeviceModel
+    || config.getPrimaryDeviceModel() != tNoDeviceModel;
+}
+
+uint64_t VirtualClock::now()
+{
+  return threadNow;
+}
+
+void VirtualClock::advanceTo(uint64_t time)
+{
+  threadNow = std::max(threadNow, time);
+}
+
+void VirtualClock::setNow(uint64_t time)
+{
+  threadNow = time;
+}
+
+void VirtualClock::beginRequest()
+{
+  requestStart = threadNow;
+}
+
+void VirtualClock::endRequest(uint32_t len)
+{
+  std::lock_guard<std::mutex> l(mutex_);
+  latencies_.push_back(threadNow - requestStart);
+  nBytes_ += len;
+  end_ = std::max(end_, threadNow);
+}
+
+void VirtualClock::dump()
+{
+  std::lock_guard<std::mutex> l(mutex_);
+  if (latencies_.empty()) {
+    return;
+  }
+  uint64_t sum = 0;
+  for (uint64_t latency : latencies_) {
+    sum += latency;
+  }
+  auto percentile = [this](double p) {
+    size_t k = std::min(latencies_.size() - 1, (size_t)(p * latencies_.size()));
+    std::nth_element(latencies_.begin(), latencies_.begin() + k, latencies_.end());
+    return latencies_[k] / 1000.0;
+  };
+  double p50 = percentile(0.5), p99 = percentile(0.99);
+
+  std::cout << std::fixed << std::setprecision(2) << "Projected with the device models: " << std::endl
+            << "    Projected elapsed: " << end_ / 1000.0 << " us" << std::endl
+            << "    Projected throughput: " << (end_ == 0 ? 0.0 : nBytes_ * 1000.0 / end_) << " MBytes/s" << std::endl
+            << "    Projected request latency (mean): " << sum / 1000.0 / latencies_.size() << " us" << std::endl
+            << "    Projected request latency (p50): " << p50 << " us" << std::endl
+            << "    Projected request latency (p99): " << p99 << " us" << std::endl;
+  std::cout << std::defaultfloat;
+}
+
+}
@@ -0,0 +1,108 @@
+/* File: io/device_model.h
+ * Description:
+ *   This file contains the latency models of the emulated devices
+ *   (Config::getCacheDeviceModel(), Config::getPrimaryDeviceModel()), which
+ *   project what a replay would take on real devices. With fakeIO on, the
+ *   replay itself runs at memory speed whatever the models say.
+ *
+ *   1. Every I/O IOModule sends to a device, skipped by fake I/O or not, is
+ *      charged to the model of the device (DeviceModel::charge()): its
+ *      service time starts once both the calling thread and a channel of the
+ *      device are free, on the virtual clock of the thread (VirtualClock).
+ *   2. SSDModel: a fixed read or write latency plus the transfer time, on
+ *      nChannels channels serving I/Os in parallel.
+ *   3. HDDModel: one head; an I/O not starting where the previous one ended
+ *      pays the average seek time plus half a rotation, then the transfer.
+ *   4. A replay request runs from the end of the previous request of the
+ *      same thread (a closed loop), so its projected latency is the device
+ *      time it waited for. The threads only share the device channels, not a
+ *      clock: with several threads the projection is approximate. The chunks
+ *      of a request processed by chunk workers start at the time of the
+ *      request, which completes with the last of them.
+ *   5. VirtualClock::dump() reports the projected elapsed time, throughput
+ *      and request latencies (mean, p50, p99).
+ */
+#ifndef __DEVICE_MODEL_H__
+#define __DEVICE_MODEL_H__
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "common/config.h"
+
+namespace cache {
+
+class DeviceModel {
+ public:
+  virtual ~DeviceModel() = default;
+  // nullptr for tNoDeviceModel
+  static std::unique_ptr<DeviceModel> create(DeviceModelEnum model);
+
+  /**
+   * @brief Charge an I/O to the device, advancing the virtual clock of the
+   *        calling thread to its completion
+   */
+  void charge(bool isWrite, uint64_t addr, uint32_t len);
+  // All channels free at the start of the replay
+  void reset();
+
+ protected:
+  explicit DeviceModel(uint32_t nChannels);
+  // Service time of an I/O in nanoseconds, called with the lock held
+  virtual uint64_t serviceTime(bool isWrite, uint64_t addr, uint32_t len) = 0;
+
+ private:
+  std::mutex mutex_;
+  // Virtual time each channel is busy until
+  std::vector<uint64_t> freeAt_;
+};
+
+class SSDModel : public DeviceModel {
+ public:
+  SSDModel();
+ protected:
+  uint64_t serviceTime(bool isWrite, uint64_t addr, uint32_t len) override;
+ private:
+  uint64_t readLatency_, writeLatency_, bandwidth_;
+};
+
+class HDDModel : public DeviceModel {
+ public:
+  HDDModel();
+ protected:
+  uint64_t serviceTime(bool isWrite, uint64_t addr, uint32_t len) override;
+ private:
+  uint64_t positioningTime_, bandwidth_;
+  uint64_t headPosition_ = ~0ull;
+};
+
+class VirtualClock {
+ public:
+  static VirtualClock& getInstance();
+  inline bool isEnabled() const { return enabled_; }
+
+  // Virtual time of the calling thread in nanoseconds
+  uint64_t now();
+  void advanceTo(uint64_t time);
+  // Move the virtual time of the calling thread, backwards included: a chunk
+  // worker takes on the time of the request it processes a chunk of
+  void setNow(uint64_t time);
+  // Around each replay request of the calling thread
+  void beginRequest();
+  void endRequest(uint32_t len);
+  void dump();
+
+ private:
+  VirtualClock();
+
+  bool enabled_;
+  std::mutex mutex_;
+  std::vector<uint64_t> latencies_;
+  uint64_t nBytes_ = 0;
+  // Completion of the last request
+  uint64_t end_ = 0;
+};
+
+}
+
+#endif //__DEVICE_MODEL_H__
@@ -1,6 +1,8 @@
 #include "io_module.h"
 #include "device/device.h"
+#include "device/uring_device.h"
 #include "common/config.h"
+#include "common/index_geometry.h"
 #include "utils/utils.h"
 #include <csignal>
 #include <memory>
@@ -30,14 +32,24 @@ IOModule &IOModule::getInstance() {
 }
 
 
+std::unique_ptr<BlockDevice> IOModule::createBlockDevice()
+{
+  if (Config::getInstance().getIOBackend() == tUringIO) {
+    return std::make_unique<UringBlockDevice>();
+  } else if (Config::getInstance().getIOBackend() == tMemoryIO) {
+    return std::make_unique<MemoryBlockDevice>();
+  }
+  return std::make_unique<BlockDevice>();
+}
+
 uint32_t IOModule::addCacheDevice(char *filename)
 {
-  // a temporary size for cache device
-  // 32 MiB cache device
-  uint64_t size = Config::getInstance().getCacheDeviceSize();
-  cacheDevice_ = std::make_unique<BlockDevice>();
+  // The cached data plus the metadata blocks, laid out as configured
+  uint64_t size = IndexGeometry::getInstance().cacheDeviceSize_;
+  cacheDevice_ = createBlockDevice();
   cacheDevice_->_direct_io = Config::getInstance().isDirectIOEnabled();
-  cacheDevice_->open(filename, size + 1ull * Config::getInstance().getnFpBuckets() * Config::getInstance().getnFPSlotsPerBucket() * Config::getInstance().getMetadataSize());
+  cacheDevice_->open(filename, size);
+  cacheModel_ = DeviceModel::create(Config::getInstance().getCacheDeviceModel());
   return 0;
 }
 
@@ -46,16 +58,24 @@ uint32_t IOModule::addPrimaryDevice(char *filename)
   // a temporary size for primary device
   // 128 MiB primary device
   uint64_t size = Config::getInstance().getPrimaryDeviceSize();
-  primaryDevice_ = std::make_unique<BlockDevice>();
+  primaryDevice_ = createBlockDevice();
   primaryDevice_->_direct_io = Config::getInstance().isDirectIOEnabled();
   primaryDevice_->open(filename, size);
+  primaryModel_ = DeviceModel::create(Config::getInstance().getPrimaryDeviceModel());
   return 0;
 }
 
+void IOModule::resetDeviceModels()
+{
+  if (primaryModel_) primaryModel_->reset();
+  if (cacheModel_) cacheModel_->reset();
+}
+
 uint32_t IOModule::read(DeviceType deviceType, uint64_t addr, void *buf, uint32_t len)
 {
   uint32_t ret = 0;
   if (deviceType == PRIMARY_DEVICE) {
+    if (primaryModel_) primaryModel_->charge(false, addr, len);
     BEGIN_TIMER();
     ret = primaryDevice_->read(addr, static_cast<uint8_t *>(buf), len);
     END_TIMER(io_hdd);
@@ -64,13 +84,29 @@ uint32_t IOModule::read(DeviceType deviceType, uint64_t addr, void *buf, uint32_
     if (len == 512) {
       Stats::getInstance().add_metadata_bytes_read_from_ssd(512);
     }
+    if (cacheModel_) cacheModel_->charge(false, addr, len);
 
     BEGIN_TIMER();
     Stats::getInstance().add_bytes_read_from_ssd(len);
     ret = cacheDevice_->read(addr, static_cast<uint8_t *>(buf), len);
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    if (Config::getInstance().isFakeIOEnabled() && len != 512
+        && geometry.colocatedMetadata_ && addr % geometry.slotStride_ == 0) {
+      // Fake I/O only keeps the metadata blocks, also the one in front of
+      // the data of a colocated read
+      cacheDevice_->read(addr, static_cast<uint8_t *>(buf), 512);
+    }
     END_TIMER(io_ssd);
   } else if (deviceType == IN_MEM_BUFFER) {
     inMemBuffer_.read(addr, static_cast<uint8_t *>(buf), len);
+  } else if (deviceType == JOURNAL) {
+    // addr is an offset in the journal region, read back by MetaJournal::recover
+    uint64_t journalAddr = IndexGeometry::getInstance().journalRegionOffset_ + addr;
+    if (cacheModel_) cacheModel_->charge(false, journalAddr, len);
+    BEGIN_TIMER();
+    Stats::getInstance().add_bytes_read_from_ssd(len);
+    ret = cacheDevice_->read(journalAddr, static_cast<uint8_t *>(buf), len);
+    END_TIMER(io_ssd);
   }
   return ret;
 }
@@ -78,6 +114,7 @@ uint32_t IOModule::read(DeviceType deviceType, uint64_t addr, void *buf, uint32_
 uint32_t IOModule::write(DeviceType deviceType, uint64_t addr, void *buf, uint32_t len)
 {
   if (deviceType == PRIMARY_DEVICE) {
+    if (primaryModel_) primaryModel_->charge(true, addr, len);
     BEGIN_TIMER();
     primaryDevice_->write(addr, (uint8_t*)buf, len);
     END_TIMER(io_hdd);
@@ -86,6 +123,7 @@ uint32_t IOModule::write(DeviceType deviceType, uint64_t addr, void *buf, uint32
     if (len == 512) {
       Stats::getInstance().add_metadata_bytes_written_to_ssd(512);
     }
+    if (cacheModel_) cacheModel_->charge(true, addr, len);
     BEGIN_TIMER();
     Stats::getInstance().add_bytes_written_to_ssd(len);
     cacheDevice_->write(addr, (uint8_t *) buf, len);
@@ -93,25 +131,59 @@ uint32_t IOModule::write(DeviceType deviceType, uint64_t addr, void *buf, uint32
   } else if (deviceType == IN_MEM_BUFFER) {
     inMemBuffer_.write(addr, (uint8_t*)buf, len);
   } else if (deviceType == JOURNAL) {
-    std::lock_guard<std::mutex> l(mutex_);
-    if (journalOffset_ + len >= 512) {
-      journalOffset_ = 8;
-      journal_[0] = journalId_++;
-      cacheDevice_->write(journalDiskOffset_ + journalDiskStart_, journal_, 512);
-      journalDiskOffset_ += 512;
-      if (journalDiskOffset_ >= journalSize_) {
-        journalDiskOffset_ = 0;
-      }
+    // addr is an offset in the journal region, MetaJournal batches the writes
+    if (cacheModel_) cacheModel_->charge(true, IndexGeometry::getInstance().journalRegionOffset_ + addr, len);
+    BEGIN_TIMER();
+    Stats::getInstance().add_journal_bytes_written_to_ssd(len);
+    cacheDevice_->write(IndexGeometry::getInstance().journalRegionOffset_ + addr, (uint8_t *) buf, len);
+    END_TIMER(io_ssd);
+  }
+  return 0;
+}
+
+uint32_t IOModule::writeMetadata(uint64_t addr, void *buf, uint32_t len)
+{
+  Stats::getInstance().add_metadata_bytes_written_to_ssd(len);
+  if (cacheModel_) cacheModel_->charge(true, addr, len);
+  BEGIN_TIMER();
+  Stats::getInstance().add_bytes_written_to_ssd(len);
+  if (Config::getInstance().isFakeIOEnabled()) {
+    // Fake I/O only keeps the I/Os of single metadata blocks
+    for (uint32_t offset = 0; offset < len; offset += 512) {
+      cacheDevice_->write(addr + offset, (uint8_t *) buf + offset, 512);
     }
-    memcpy(journal_ + journalOffset_, buf, len);
-    journalOffset_ += len;
+  } else {
+    cacheDevice_->write(addr, (uint8_t *) buf, len);
   }
+  END_TIMER(io_ssd);
   return 0;
 }
 
+uint32_t IOModule::readMetadata(uint64_t addr, void *buf, uint32_t len)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  // Metadata blocks are adjacent, or one per slot stride when colocated
+  uint64_t blockStride = geometry.colocatedMetadata_ ? geometry.slotStride_ : geometry.metadataSize_;
+  Stats::getInstance().add_metadata_bytes_read_from_ssd((len + blockStride - 1) / blockStride * 512);
+  if (cacheModel_) cacheModel_->charge(false, addr, len);
+  BEGIN_TIMER();
+  Stats::getInstance().add_bytes_read_from_ssd(len);
+  if (Config::getInstance().isFakeIOEnabled()) {
+    // Fake I/O only keeps the I/Os of single metadata blocks
+    for (uint64_t offset = 0; offset < len; offset += blockStride) {
+      cacheDevice_->read(addr + offset, (uint8_t *) buf + offset, 512);
+    }
+  } else {
+    cacheDevice_->read(addr, (uint8_t *) buf, len);
+  }
+  END_TIMER(io_ssd);
+  return len;
+}
+
 void IOModule::flush(uint64_t addr, uint64_t bufferOffset, uint32_t len)
 {
   Stats::getInstance().add_bytes_written_to_ssd(len);
+  if (cacheModel_) cacheModel_->charge(true, addr, len);
   cacheDevice_->write(addr, inMemBuffer_.buf_ + bufferOffset, len);
 }
 
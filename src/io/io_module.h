@@ -13,6 +13,7 @@
 #include "common/common.h"
 #include "common/stats.h"
 #include "device/device.h"
+#include "device_model.h"
 #include "utils/thread_pool.h"
 
 namespace cache {
@@ -27,12 +28,23 @@ namespace cache {
       uint32_t addPrimaryDevice(char *filename);
       uint32_t read(DeviceType deviceType, uint64_t addr, void *buf, uint32_t len);
       uint32_t write(DeviceType deviceType, uint64_t addr, void *buf, uint32_t len);
+      // Adjacent metadata blocks of the cache device in one write
+      uint32_t writeMetadata(uint64_t addr, void *buf, uint32_t len);
+      // A range of the cache device read for the metadata blocks in it (WarmRestart)
+      uint32_t readMetadata(uint64_t addr, void *buf, uint32_t len);
       void flush(uint64_t addr, uint64_t bufferOffset, uint32_t len);
       inline void sync() { primaryDevice_->sync(); cacheDevice_->sync(); }
+      // Start the device models afresh, before a replay
+      void resetDeviceModels();
     private:
+      // As configured, see io/device/uring_device.h
+      static std::unique_ptr<BlockDevice> createBlockDevice();
       // Currently, we assume that only one cache and one primary
       std::unique_ptr< BlockDevice > primaryDevice_;
       std::unique_ptr< BlockDevice > cacheDevice_;
+      // Latency models of the emulated devices, null if none
+      std::unique_ptr< DeviceModel > primaryModel_;
+      std::unique_ptr< DeviceModel > cacheModel_;
       Stats *stats_{};
 
       struct {
@@ -47,14 +59,6 @@ namespace cache {
           memcpy(buf_ + addr, buf, len);
         }
       } inMemBuffer_{};
-
-      uint8_t journal_[512];
-      uint32_t journalId_ = 0;
-      uint32_t journalOffset_ = 0;
-      uint64_t journalDiskOffset_ = 0;
-      uint64_t journalDiskStart_ = 0;
-      uint64_t journalSize_ = 20 * 1024 * 1024u;
-      std::mutex mutex_;
   };
 
 }
@@ -1,5 +1,6 @@
 #ifdef ACDC
 #include "dirtylist.h"
+#include "metadata/meta_verification.h"
  
 
 namespace cache {
@@ -29,7 +30,7 @@ namespace cache {
             uint32_t len = pr.second.second;
 
           // Read chunk metadata (compressed length)
-          IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &metadata, Config::getInstance().getMetadataSize());
+          MetaVerification::readMetadata(metadataLocation, metadata);
           // Read cached data
           if (len == Config::getInstance().getChunkSize()) {
             IOModule::getInstance().read(CACHE_DEVICE, cachedataLocation, uncompressedData, len);
@@ -103,7 +104,7 @@ namespace cache {
       lbasToFlush.clear();
 
       // Read chunk metadata (compressed length)
-      IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &metadata, Config::getInstance().getMetadataSize());
+      MetaVerification::readMetadata(metadataLocation, metadata);
       std::set<uint64_t> lbas;
       for (int i = 0; i < metadata.numLBAs_; ++i) {
         uint64_t lba = metadata.LBAs_[i];
@@ -1,7 +1,9 @@
 #include "manage_module.h"
 #include "common/stats.h"
+#include "metadata/metadata_codec.h"
 #include "utils/utils.h"
 #include <cassert>
+#include <cstring>
 
 namespace cache {
   ManageModule& ManageModule::getInstance() {
@@ -61,7 +63,7 @@ namespace cache {
         buf = chunk.buf_;
       }
       addr = chunk.cachedataLocation_;
-      len = (chunk.nSubchunks_ + 1) * Config::getInstance().getSubchunkSize();
+      len = chunk.nSubchunks_ * Config::getInstance().getSubchunkSize();
 #endif
     } else {
       deviceType = PRIMARY_DEVICE;
@@ -77,12 +79,31 @@ namespace cache {
     uint64_t addr;
     uint8_t *buf;
     uint32_t len;
+    if (chunk.lookupResult_ == HIT && chunk.hasCachedata_) {
+      // Uncompressed data is not decompressed into buf_
+      if (chunk.compressedLen_ == 0) {
+        memcpy(chunk.buf_, chunk.compressedBuf_, chunk.len_);
+      }
+      return 0;
+    }
     generateReadRequest(chunk, deviceType, addr, buf, len);
     IOModule::getInstance().read(deviceType, addr, buf, len);
 
     return 0;
   }
 
+  void ManageModule::readWithMetadata(Chunk &chunk, MetadataBlock &block)
+  {
+    uint32_t metadataSize = Config::getInstance().getMetadataSize();
+    uint8_t *buf = chunk.compressedBuf_ - metadataSize;
+    uint32_t len = metadataSize + chunk.nSubchunks_ * Config::getInstance().getSubchunkSize();
+    IOModule::getInstance().read(CACHE_DEVICE, chunk.metadataLocation_, buf, len);
+    Stats::getInstance().add_metadata_bytes_read_from_ssd(metadataSize);
+    memcpy(&block, buf, sizeof(MetadataBlock));
+    MetadataCodec::decode(block, chunk.metadata_);
+    chunk.hasCachedata_ = true;
+  }
+
   bool ManageModule::generatePrimaryWriteRequest(
       Chunk &chunk, DeviceType &deviceType,
       uint64_t &addr, uint8_t *&buf, uint32_t &len)
@@ -111,7 +132,7 @@ namespace cache {
 #if !defined(CACHE_DEDUP)
       addr = chunk.cachedataLocation_;
       buf = chunk.compressedBuf_;
-      len = (chunk.nSubchunks_ + 1) * Config::getInstance().getSubchunkSize();
+      len = chunk.nSubchunks_ * Config::getInstance().getSubchunkSize();
 #else
 #if defined(DLRU) || defined(DARC) || defined(BUCKETDLRU)
       addr = chunk.cachedataLocation_;
@@ -14,6 +14,14 @@ class ManageModule {
  public:
   static ManageModule& getInstance();
   int read(Chunk &chunk);
+  /**
+   * @brief Read the metadata block and the cached data of a looked up chunk
+   *        in one I/O (colocated layout, see common/index_geometry.h)
+   *        The data goes to compressedBuf_, which has room for the metadata
+   *        block in front of it, and a later read() of the chunk only copies it.
+   *        The metadata block is also copied, as read, to block.
+   */
+  void readWithMetadata(Chunk &chunk, MetadataBlock &block);
   int write(Chunk &chunk);
   void updateMetadata(Chunk &chunk);
  private:
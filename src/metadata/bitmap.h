@@ -69,7 +69,10 @@ namespace cache {
               shift += 8;
               ++base;
             }
-            v |= (data_[base] & ((1u << shift_e) - 1)) << shift;
+            // Do not touch the byte past the range when it ends on a byte boundary
+            if (shift_e) {
+              v |= (data_[base] & ((1u << shift_e) - 1)) << shift;
+            }
           }
           return v;
         }
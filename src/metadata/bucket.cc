@@ -8,44 +8,14 @@
 #include "cache_policies/cache_policy.h"
 #include "reference_counter.h"
 #include "common/stats.h"
+#include "common/index_geometry.h"
 #include "manage/dirtylist.h"
 
 namespace cache {
-    Bucket::Bucket(uint32_t nBitsPerKey, uint32_t nBitsPerValue, uint32_t nSlots,
-                   uint8_t *data, uint8_t *valid, CachePolicy *cachePolicy, uint32_t slotId) :
-      nBitsPerKey_(nBitsPerKey), nBitsPerValue_(nBitsPerValue),
-      nBitsPerSlot_(nBitsPerKey + nBitsPerValue), nSlots_(nSlots),
-      data_(data), valid_(valid), bucketId_(slotId)
-    {
-      if (cachePolicy != nullptr) {
-        cachePolicyExecutor_ = cachePolicy->getExecutor(this);
-      } else {
-        cachePolicyExecutor_ = nullptr;
-      }
-    }
-
-    Bucket::~Bucket() {
-      if (cachePolicyExecutor_ != nullptr) {
-        free(cachePolicyExecutor_);
-      }
-    }
-
-    uint32_t LBABucket::lookup(uint32_t lbaSignature, uint64_t &fpHash) {
-      for (uint32_t slotId = 0; slotId < nSlots_; slotId++) {
-        if (!isValid(slotId)) continue;
-        uint32_t _lbaSignature = getKey(slotId);
-        if (_lbaSignature == lbaSignature) {
-          fpHash = getValue(slotId);
-          return slotId;
-        }
-      }
-      return ~((uint32_t)0);
-    }
-
     void LBABucket::promote(uint32_t lbaSignature) {
       uint64_t fingerprintHash = 0;
       uint32_t slotId = lookup(lbaSignature, fingerprintHash);
-      cachePolicyExecutor_->promote(slotId);
+      cachePolicy_->promote(this, slotId);
     }
 
     // If the request modified an existing chunk,
@@ -62,23 +32,23 @@ namespace cache {
           setEvictedSignature(getValue(slotId));
           if (Config::getInstance().getCachePolicyForFPIndex() ==
               CachePolicyEnum::tRecencyAwareLeastReferenceCount &&
-              slotId >= Config::getInstance().getLBASlotSeperator()) {
-            ReferenceCounter::getInstance().dereference(getValue(slotId));
+              cachePolicy_->isCoreSlot(this, slotId)) {
+            fingerprintIndex->dereference(getValue(slotId), fingerprintHash);
           }
           setInvalid(slotId);
         }
       }
 
-      slotId = cachePolicyExecutor_->allocate();
+      slotId = cachePolicy_->allocate(this);
       setKey(slotId, lbaSignature);
       setValue(slotId, fingerprintHash);
       setValid(slotId);
       if (Config::getInstance().getCachePolicyForFPIndex() ==
           CachePolicyEnum::tRecencyAwareLeastReferenceCount &&
-          slotId >= Config::getInstance().getLBASlotSeperator()) {
-        ReferenceCounter::getInstance().reference(fingerprintHash);
+          cachePolicy_->isCoreSlot(this, slotId)) {
+        fingerprintIndex->reference(fingerprintHash);
       }
-      cachePolicyExecutor_->promote(slotId);
+      cachePolicy_->promote(this, slotId);
       return evictedSignature_;
     }
 
@@ -91,38 +61,19 @@ namespace cache {
     }
 
 
-    /*
-     * memory is byte addressable
-     * alignment issue needs to be dealed for each element
-     *
-     */
-    uint32_t FPBucket::lookup(uint64_t fpSignature, uint32_t &nSlotsOccupied)
-    {
-      uint32_t slotId = 0;
-      nSlotsOccupied = 0;
-      for ( ; slotId < nSlots_; ) {
-        if (!isValid(slotId)
-            || fpSignature != getKey(slotId)) {
-          ++slotId;
-          continue;
-        }
-        while (slotId < nSlots_
-               && isValid(slotId)
-               && fpSignature == getKey(slotId)) {
-          ++nSlotsOccupied;
-          ++slotId;
-        }
-        return slotId - nSlotsOccupied;
-      }
-      return ~((uint32_t)0);
-    }
-
     void FPBucket::promote(uint64_t fpSignature)
     {
       uint32_t slot_id = 0, compressibility_level = 0, n_slots_occupied;
       slot_id = lookup(fpSignature, n_slots_occupied);
 
-      cachePolicyExecutor_->promote(slot_id, n_slots_occupied);
+      cachePolicy_->promote(this, slot_id, n_slots_occupied);
+    }
+
+    void FPBucket::promote(uint64_t fpSignature, bool inAlternateBucket)
+    {
+      uint32_t nSlotsOccupied = 0;
+      uint32_t slotId = lookup(fpSignature, inAlternateBucket, nSlotsOccupied);
+      cachePolicy_->promote(this, slotId, nSlotsOccupied);
     }
 
     uint32_t FPBucket::update(uint64_t fpSignature, uint32_t nSlotsToOccupy)
@@ -130,37 +81,89 @@ namespace cache {
       uint32_t nSlotsOccupied = 0;
       uint32_t slotId = lookup(fpSignature, nSlotsOccupied);
       if (slotId != ~((uint32_t)0)) {
-        if (Config::getInstance().getCacheMode() == tWriteBack) {
-          DirtyList::getInstance().addEvictedChunk(
-            /* Compute ssd location of the evicted data */
-            /* Actually, full Fingerprint and address is sufficient. */
-            FPIndex::computeCachedataLocation(bucketId_, slotId),
-            nSlotsOccupied * Config::getInstance().getSubchunkSize()
-          );
-        }
+        invalidateEntry(slotId, nSlotsOccupied);
+      }
 
-        for (uint32_t _slotId = slotId;
-             _slotId < slotId + nSlotsOccupied;
-             ++_slotId) {
-          setInvalid(_slotId);
-        }
+      slotId = cachePolicy_->allocate(this, nSlotsToOccupy);
+      for (uint32_t _slotId = slotId;
+           _slotId < slotId + nSlotsToOccupy;
+           ++_slotId) {
+        setKey(_slotId, fpSignature);
+        setValid(_slotId);
       }
 
-      slotId = cachePolicyExecutor_->allocate(nSlotsToOccupy);
+      return slotId;
+    }
+
+    uint32_t FPBucket::update(uint64_t fpSignature, uint32_t nSlotsToOccupy, bool inAlternateBucket)
+    {
+      remove(fpSignature, inAlternateBucket);
+
+      uint32_t slotId = cachePolicy_->allocate(this, nSlotsToOccupy);
       for (uint32_t _slotId = slotId;
            _slotId < slotId + nSlotsToOccupy;
            ++_slotId) {
         setKey(_slotId, fpSignature);
+        setValue(_slotId, inAlternateBucket ? 1 : 0);
         setValid(_slotId);
       }
 
       return slotId;
     }
 
+    void FPBucket::remove(uint64_t fpSignature, bool inAlternateBucket)
+    {
+      uint32_t nSlotsOccupied = 0;
+      uint32_t slotId = lookup(fpSignature, inAlternateBucket, nSlotsOccupied);
+      if (slotId != ~((uint32_t)0)) {
+        invalidateEntry(slotId, nSlotsOccupied);
+      }
+    }
+
+    uint32_t FPBucket::lookupSlow(uint64_t fpSignature, bool inAlternateBucket,
+        uint32_t firstSlotId, uint32_t &nSlotsOccupied)
+    {
+      for (uint32_t slotId = firstSlotId; slotId < nSlots_; ++slotId) {
+        if (!isValid(slotId) || getKey(slotId) != fpSignature
+            || isInAlternateBucket(slotId) != inAlternateBucket) {
+          continue;
+        }
+        nSlotsOccupied = 0;
+        while (slotId + nSlotsOccupied < nSlots_
+               && isValid(slotId + nSlotsOccupied)
+               && getKey(slotId + nSlotsOccupied) == fpSignature
+               && isInAlternateBucket(slotId + nSlotsOccupied) == inAlternateBucket) {
+          ++nSlotsOccupied;
+        }
+        return slotId;
+      }
+      nSlotsOccupied = 0;
+      return ~((uint32_t)0);
+    }
+
+    void FPBucket::invalidateEntry(uint32_t slotId, uint32_t nSlotsOccupied)
+    {
+      if (Config::getInstance().getCacheMode() == tWriteBack) {
+        DirtyList::getInstance().addEvictedChunk(
+          /* Compute ssd location of the evicted data */
+          /* Actually, full Fingerprint and address is sufficient. */
+          FPIndex::computeCachedataLocation(bucketId_, slotId),
+          nSlotsOccupied * IndexGeometry::getInstance().subchunkSize_
+        );
+      }
+
+      for (uint32_t _slotId = slotId;
+           _slotId < slotId + nSlotsOccupied;
+           ++_slotId) {
+        setInvalid(_slotId);
+      }
+    }
+
     void FPBucket::evict(uint64_t fpSignature) {
-      for (uint32_t index = 0; index < nSlots_; index++) {
-        if (getKey(index) == fpSignature) {
-          setInvalid(index);
+      for (uint32_t base = 0; base < nSlots_; base += 64) {
+        uint64_t hits = matchGroup(base, std::min(64u, nSlots_ - base), fpSignature);
+        for ( ; hits != 0; hits &= hits - 1) {
+          setInvalid(base + __builtin_ctzll(hits));
         }
       }
     }
@@ -8,7 +8,14 @@
  *      to the caller.
  *   3. In the current implementation, buckets **do not hold memory**.
  *      The ownership of the memory of all slots belongs to Index, which instantiate
- *      a bucket manipulator with the corresponding memory.
+ *      a bucket manipulator with the corresponding memory. Buckets are small
+ *      views built on the stack for each access.
+ *   4. Slots are laid out in one of two ways, picked from the key width:
+ *      - tByteAligned (8/16/32-bit keys): struct-of-arrays, a naturally aligned
+ *        key array followed by the bit-packed values, so that signature scans
+ *        are plain vector compares;
+ *      - tBitPacked (other widths): (key, value) slots packed bit by bit.
+ *      Both take the same number of bits per slot.
  */
 #ifndef __BUCKET_H__
 #define __BUCKET_H__
@@ -18,17 +25,53 @@
 #include <mutex>
 #include <set>
 #include "bitmap.h"
+#include "signature_scan.h"
 namespace cache {
   // Bucket is an abstraction of multiple key-value pairs (mapping)
   class FPIndex;
   class CachePolicy;
-  class CachePolicyExecutor;
+
+  enum BucketLayoutEnum {
+    tBitPacked, tByteAligned
+  };
+
   class Bucket {
     public:
+      // Defined inline so that the shape of a bucket built with constants
+      // (see the specialized lookups of LBAIndex/FPIndex) folds into the
+      // slot accessors and the signature scan
       Bucket(uint32_t nBitsPerKey, uint32_t nBitsPerValue, uint32_t nSlots,
-          uint8_t *data, uint8_t *valid, CachePolicy *cachePolicy, uint32_t slotId);
-      virtual ~Bucket();
+          uint8_t *data, uint8_t *valid, CachePolicy *cachePolicy, uint32_t slotId) :
+        data_(data), values_(data), valid_(valid), cachePolicy_(cachePolicy),
+        nBitsPerSlot_(nBitsPerKey + nBitsPerValue), nSlots_(nSlots),
+        nBitsPerKey_(nBitsPerKey), nBitsPerValue_(nBitsPerValue),
+        nBytesPerKey_(getLayout(nBitsPerKey) == tByteAligned ? nBitsPerKey / 8 : 0),
+        bucketId_(slotId)
+      {
+        // Byte-aligned layout: values follow the key array
+        values_.data_ = data + nBytesPerKey_ * nSlots;
+      }
 
+      static constexpr BucketLayoutEnum getLayout(uint32_t nBitsPerKey)
+      {
+        return (nBitsPerKey == 8 || nBitsPerKey == 16 || nBitsPerKey == 32) ?
+          tByteAligned : tBitPacked;
+      }
+      /**
+       * @brief Number of bytes of slot data per bucket. For the byte-aligned
+       *        layout it is rounded up to the key size so that the key array
+       *        of every bucket is naturally aligned.
+       */
+      static constexpr uint32_t computeBytesPerBucket(uint32_t nBitsPerKey,
+          uint32_t nBitsPerValue, uint32_t nSlots)
+      {
+        if (getLayout(nBitsPerKey) == tByteAligned) {
+          uint32_t nBytesPerKey = nBitsPerKey / 8;
+          uint32_t nBytes = nBytesPerKey * nSlots + (nBitsPerValue * nSlots + 7) / 8;
+          return (nBytes + nBytesPerKey - 1) / nBytesPerKey * nBytesPerKey;
+        }
+        return ((nBitsPerKey + nBitsPerValue) * nSlots + 7) / 8;
+      }
 
       inline void initKey(uint32_t index, uint32_t &b, uint32_t &e)
       {
@@ -37,47 +80,96 @@ namespace cache {
       }
       inline uint32_t getKey(uint32_t index)
       {
+        switch (nBytesPerKey_) {
+          case 1: return data_.data_[index];
+          case 2: { uint16_t k; memcpy(&k, data_.data_ + index * 2, 2); return k; }
+          case 4: { uint32_t k; memcpy(&k, data_.data_ + index * 4, 4); return k; }
+          default: break;
+        }
         uint32_t b, e;
         initKey(index, b, e);
         return data_.getBits(b, e);
       }
       inline void setKey(uint32_t index, uint32_t v)
       {
+        switch (nBytesPerKey_) {
+          case 1: data_.data_[index] = (uint8_t)v; return;
+          case 2: { uint16_t k = v; memcpy(data_.data_ + index * 2, &k, 2); return; }
+          case 4: memcpy(data_.data_ + index * 4, &v, 4); return;
+          default: break;
+        }
         uint32_t b, e;
         initKey(index, b, e);
         data_.storeBits(b, e, v);
       }
+      // Bit range of the value of slot index within values_
       inline void initValue(uint32_t index, uint32_t &b, uint32_t &e)
       {
-        b = index * nBitsPerSlot_ + nBitsPerKey_;
+        if (nBytesPerKey_ != 0) {
+          b = index * nBitsPerValue_;
+        } else {
+          b = index * nBitsPerSlot_ + nBitsPerKey_;
+        }
         e = b + nBitsPerValue_;
       }
       inline uint64_t getValue(uint32_t index)
       {
-        //uint32_t b, e; initValue(index, b, e);
-        //return data_.getBits(b, e);
         uint32_t b, e;
         initValue(index, b, e);
         uint64_t v = 0;
         if (e - b > 32) {
-          v = data_.getBits(b, b + 32);
-          v |= (uint64_t) data_.getBits(b + 32, e) << 32u;
+          v = values_.getBits(b, b + 32);
+          v |= (uint64_t) values_.getBits(b + 32, e) << 32u;
         } else {
-          v = data_.getBits(b, e);
+          v = values_.getBits(b, e);
         }
         return v;
       }
       inline void setValue(uint32_t index, uint64_t v)
       {
-        //uint32_t b, e; initValue(index, b, e);
-        //data_.storeBits(b, e, v);
         uint32_t b, e;
         initValue(index, b, e);
         if (e - b > 32) {
-          data_.storeBits(b, b + 32, v & 0xffffffff);
-          data_.storeBits(b + 32, e, v >> 32u);
+          values_.storeBits(b, b + 32, v & 0xffffffff);
+          values_.storeBits(b + 32, e, v >> 32u);
         } else {
-          data_.storeBits(b, e, v);
+          values_.storeBits(b, e, v);
+        }
+      }
+
+      /**
+       * @brief Match key against the keys of slots [firstSlot, firstSlot + nSlots),
+       *        nSlots <= 64, regardless of validity
+       *
+       * @return a mask with bit i set if slot firstSlot + i holds key
+       */
+      inline uint64_t matchGroup(uint32_t firstSlot, uint32_t nSlots, uint32_t key)
+      {
+        switch (nBytesPerKey_) {
+          case 1: return SignatureScan::matchGroupAligned<uint8_t>(data_.data_, firstSlot, nSlots, key);
+          case 2: return SignatureScan::matchGroupAligned<uint16_t>(data_.data_, firstSlot, nSlots, key);
+          case 4: return SignatureScan::matchGroupAligned<uint32_t>(data_.data_, firstSlot, nSlots, key);
+          default:
+            return SignatureScan::matchGroup(data_.data_, firstSlot, nSlots,
+                nBitsPerSlot_, nBitsPerKey_, key);
+        }
+      }
+      /**
+       * @brief Find the first valid slot holding key
+       *
+       * @param runLength number of contiguous valid slots holding key
+       *
+       * @return ~0 if no valid slot holds key, otherwise the first such slot
+       */
+      inline uint32_t find(uint32_t key, uint32_t &runLength)
+      {
+        switch (nBytesPerKey_) {
+          case 1: return SignatureScan::findAligned<uint8_t>(data_.data_, valid_.data_, nSlots_, key, runLength);
+          case 2: return SignatureScan::findAligned<uint16_t>(data_.data_, valid_.data_, nSlots_, key, runLength);
+          case 4: return SignatureScan::findAligned<uint32_t>(data_.data_, valid_.data_, nSlots_, key, runLength);
+          default:
+            return SignatureScan::find(data_.data_, valid_.data_, nSlots_,
+                nBitsPerSlot_, nBitsPerKey_, key, runLength);
         }
       }
       inline uint32_t get32bits(uint32_t index)
@@ -97,19 +189,66 @@ namespace cache {
       inline uint32_t getValid32bits(uint32_t index) { return valid_.get32bits(index); }
       inline void setValid32bits(uint32_t index, uint32_t v) { valid_.set32bits(index, v); }
 
+      inline uint32_t countValid()
+      {
+        uint32_t nValid = 0;
+        for (uint32_t base = 0; base < nSlots_; base += 64) {
+          nValid += __builtin_popcountll(SignatureScan::validGroup(
+                valid_.data_, base, std::min(64u, nSlots_ - base)));
+        }
+        return nValid;
+      }
+
+      /**
+       * @brief Find nSlotsToOccupy contiguous empty slots on the valid bitmap
+       *
+       * @return the first of the slots, ~0 if there is no such run
+       */
+      inline uint32_t findFreeSlots(uint32_t nSlotsToOccupy)
+      {
+        // Empty slots at the end of the previous group, a run may start there
+        uint32_t nFreeBefore = 0;
+        for (uint32_t base = 0; base < nSlots_; base += 64) {
+          uint32_t n = std::min(64u, nSlots_ - base);
+          uint64_t empty = ~SignatureScan::validGroup(valid_.data_, base, n);
+          if (n < 64) empty &= (1ull << n) - 1;
+          if (nFreeBefore + SignatureScan::countTrailingOnes(empty) >= nSlotsToOccupy) {
+            return base - nFreeBefore;
+          }
+          // Bit i of runs is set if slots [base + i, base + i + nSlotsToOccupy) are empty
+          uint64_t runs = empty;
+          for (uint32_t i = 1; i < nSlotsToOccupy && runs != 0; ++i) {
+            runs &= empty >> i;
+          }
+          if (runs != 0) {
+            return base + __builtin_ctzll(runs);
+          }
+          uint64_t top = ~(empty << (64 - n));
+          uint32_t nFreeAtEnd = top == 0 ? n : __builtin_clzll(top);
+          nFreeBefore = nFreeAtEnd == n ? nFreeBefore + n : nFreeAtEnd;
+        }
+        return ~0u;
+      }
+
       inline uint32_t getnSlots() { return nSlots_; }
       inline uint32_t getBucketId() { return bucketId_; }
       inline void setEvictedSignature(uint64_t signature) {
         evictedSignature_ = signature;
       }
 
+      // data_: keys (and values if bit-packed); values_: values
       Bitmap::Manipulator data_;
+      Bitmap::Manipulator values_;
       Bitmap::Manipulator valid_;
-      CachePolicyExecutor* cachePolicyExecutor_;
+      // Not owned; nullptr for read-only (lookup) buckets
+      CachePolicy *cachePolicy_;
       uint32_t nBitsPerSlot_, nSlots_,
                nBitsPerKey_, nBitsPerValue_;
+      // 0 for the bit-packed layout
+      uint32_t nBytesPerKey_;
       uint32_t bucketId_;
       uint64_t evictedSignature_ = ~0ull;
+
   };
 
   /**
@@ -139,7 +278,15 @@ namespace cache {
        *
        * @return ~0 if the lba signature does not exist, otherwise the corresponding index
        */
-      uint32_t lookup(uint32_t lbaSignature, uint64_t &fpHash);
+      inline uint32_t lookup(uint32_t lbaSignature, uint64_t &fpHash)
+      {
+        uint32_t nSlotsOccupied = 0;
+        uint32_t slotId = find(lbaSignature, nSlotsOccupied);
+        if (slotId != ~((uint32_t)0)) {
+          fpHash = getValue(slotId);
+        }
+        return slotId;
+      }
       void promote(uint32_t lbaSignature);
       /**
        * @brief Update the lba index structure
@@ -186,9 +333,43 @@ namespace cache {
        *
        * @return ~0 if the lba signature does not exist, otherwise the corresponding index
        */
-      uint32_t lookup(uint64_t fpSignature, uint32_t &nSlotsOccupied);
+      inline uint32_t lookup(uint64_t fpSignature, uint32_t &nSlotsOccupied)
+      {
+        // The contiguous run of slots holding the signature is the space
+        // occupied by the (compressed) chunk; it comes out of the same scan.
+        return find(fpSignature, nSlotsOccupied);
+      }
+
+      /**
+       * @brief Lookup under two-choice placement (see FPIndex), where value bit 0
+       *        of a slot is set if the entry sits in the alternate bucket of its
+       *        fingerprint, so that the fingerprint with the same signature
+       *        placed here from the other side is not mistaken for it
+       *
+       * @param inAlternateBucket whether this is the alternate bucket of the fingerprint
+       */
+      inline uint32_t lookup(uint64_t fpSignature, bool inAlternateBucket, uint32_t &nSlotsOccupied)
+      {
+        uint32_t slotId = find(fpSignature, nSlotsOccupied);
+        if (slotId == ~((uint32_t)0)) {
+          return slotId;
+        }
+        if (isInAlternateBucket(slotId) != inAlternateBucket) {
+          return lookupSlow(fpSignature, inAlternateBucket, slotId + 1, nSlotsOccupied);
+        }
+        // The entry of the other fingerprint may directly follow
+        for (uint32_t i = 1; i < nSlotsOccupied; ++i) {
+          if (isInAlternateBucket(slotId + i) != inAlternateBucket) {
+            nSlotsOccupied = i;
+            break;
+          }
+        }
+        return slotId;
+      }
+      inline bool isInAlternateBucket(uint32_t slotId) { return getValue(slotId) & 1u; }
 
       void promote(uint64_t fpSignature);
+      void promote(uint64_t fpSignature, bool inAlternateBucket);
       /**
        * @brief Update the lba index structure
        *
@@ -196,11 +377,18 @@ namespace cache {
        * @param size
        */
       uint32_t update(uint64_t fpSignature, uint32_t nSlotsToOccupy);
+      uint32_t update(uint64_t fpSignature, uint32_t nSlotsToOccupy, bool inAlternateBucket);
+      // Two-choice placement: drop the entry of a fingerprint, if it is here
+      void remove(uint64_t fpSignature, bool inAlternateBucket);
       // Delete an entry for a certain ca signature
       // This is required for hit but verification-failed chunk.
       void evict(uint64_t fpSignature);
 
       void getFingerprints(std::set<uint64_t> &fpSet);
+    private:
+      uint32_t lookupSlow(uint64_t fpSignature, bool inAlternateBucket,
+          uint32_t firstSlotId, uint32_t &nSlotsOccupied);
+      void invalidateEntry(uint32_t slotId, uint32_t nSlotsOccupied);
   };
 }
 #endif
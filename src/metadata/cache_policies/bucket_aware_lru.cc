@@ -1,14 +1,18 @@
 //
 //
 
+#include <cassert>
 #include <common/stats.h>
 #include "bucket_aware_lru.h"
 #include "common/config.h"
+#include "common/index_geometry.h"
 #include "metadata/reference_counter.h"
+#include "metadata/signature_scan.h"
 namespace cache {
 
-    BucketAwareLRUExecutor::BucketAwareLRUExecutor(Bucket *bucket) :
-      CachePolicyExecutor(bucket)
+    BucketAwareLRUExecutor::BucketAwareLRUExecutor(Bucket *bucket, BucketAwareLRU *lru) :
+      CachePolicyExecutor(bucket),
+      fpIndex_(lru->fpIndex_.get())
     {}
 
     void BucketAwareLRUExecutor::promote(uint32_t slotId, uint32_t nSlotsToOccupy)
@@ -19,10 +23,11 @@ namespace cache {
       uint64_t v = bucket_->getValue(slotId);
       if (Config::getInstance().getCachePolicyForFPIndex() ==
           CachePolicyEnum::tRecencyAwareLeastReferenceCount) {
-        if (prevSlotId < Config::getInstance().getLBASlotSeperator()) {
-          ReferenceCounter::getInstance().reference(v);
-          if (bucket_->isValid(Config::getInstance().getLBASlotSeperator())) {
-            ReferenceCounter::getInstance().dereference(bucket_->getValue(Config::getInstance().getLBASlotSeperator()));
+        uint32_t lbaSlotSeperator = IndexGeometry::getInstance().lbaSlotSeperator_;
+        if (prevSlotId < lbaSlotSeperator) {
+          fpIndex_->reference(v);
+          if (bucket_->isValid(lbaSlotSeperator)) {
+            fpIndex_->dereference(bucket_->getValue(lbaSlotSeperator), v);
           }
         }
       }
@@ -102,10 +107,139 @@ namespace cache {
       return slotId - nSlotsToOccupy;
     }
 
-    BucketAwareLRU::BucketAwareLRU() = default;
-    CachePolicyExecutor* BucketAwareLRU::getExecutor(Bucket *bucket)
+    BucketAwareLRU::BucketAwareLRU(std::shared_ptr<FPIndex> fpIndex) :
+      CachePolicy(tBucketAwareLRUPolicy),
+      fpIndex_(std::move(fpIndex))
+    {}
+
+    RankedBucketAwareLRUExecutor::RankedBucketAwareLRUExecutor(Bucket *bucket, RankedBucketAwareLRU *lru) :
+      CachePolicyExecutor(bucket),
+      ranks_(lru->ranks_.get() + lru->nSlotsPerBucket_ * bucket->getBucketId()),
+      fpIndex_(lru->fpIndex_.get())
+    {}
+
+    void RankedBucketAwareLRUExecutor::promote(uint32_t slotId, uint32_t nSlotsToOccupy)
+    {
+      if (slotId >= bucket_->getnSlots()) return;
+      for (uint32_t i = slotId; i < slotId + nSlotsToOccupy; ++i) {
+        promoteSlot(i);
+      }
+    }
+
+    void RankedBucketAwareLRUExecutor::promoteSlot(uint32_t slotId)
+    {
+      uint32_t nSlots = bucket_->getnSlots();
+      uint8_t rank = ranks_[slotId];
+      if (Config::getInstance().getCachePolicyForFPIndex() ==
+          CachePolicyEnum::tRecencyAwareLeastReferenceCount) {
+        uint32_t lbaSlotSeperator = IndexGeometry::getInstance().lbaSlotSeperator_;
+        // Entering the core slots pushes the slot of rank lbaSlotSeperator out
+        if (rank < lbaSlotSeperator) {
+          fpIndex_->reference(bucket_->getValue(slotId));
+          uint32_t demotedSlotId = findSlotOfRank(lbaSlotSeperator);
+          if (bucket_->isValid(demotedSlotId)) {
+            fpIndex_->dereference(bucket_->getValue(demotedSlotId), bucket_->getValue(slotId));
+          }
+        }
+      }
+      // Branch-free so that the compiler vectorizes it (a few vector
+      // operations for 128 slots)
+      for (uint32_t i = 0; i < nSlots; ++i) {
+        ranks_[i] -= (ranks_[i] > rank);
+      }
+      ranks_[slotId] = nSlots - 1;
+    }
+
+    uint32_t RankedBucketAwareLRUExecutor::findSlotOfRank(uint32_t rank)
+    {
+      uint32_t nSlots = bucket_->getnSlots();
+      for (uint32_t base = 0; base < nSlots; base += 64) {
+        uint64_t hits = SignatureScan::matchGroupAligned<uint8_t>(
+            ranks_, base, std::min(64u, nSlots - base), rank);
+        if (hits != 0) {
+          return base + __builtin_ctzll(hits);
+        }
+      }
+      return ~0u;
+    }
+
+    bool RankedBucketAwareLRUExecutor::isCoreSlot(uint32_t slotId)
+    {
+      return ranks_[slotId] >= IndexGeometry::getInstance().lbaSlotSeperator_;
+    }
+
+    uint32_t RankedBucketAwareLRUExecutor::allocate(uint32_t nSlotsToOccupy)
+    {
+      uint32_t nSlots = bucket_->getnSlots();
+      while (true) {
+        uint32_t slotId = 0, nSlotsAvailable = 0;
+        if (nSlotsToOccupy == 1) {
+          // The least recently used empty slot
+          uint32_t rank = nSlots;
+          for (uint32_t i = 0; i < nSlots; ++i) {
+            if (!bucket_->isValid(i) && ranks_[i] < rank) {
+              rank = ranks_[i];
+              slotId = i;
+              nSlotsAvailable = 1;
+            }
+          }
+          if (nSlotsAvailable == 1) return slotId;
+        } else {
+          for ( ; slotId < nSlots; ++slotId) {
+            if (nSlotsAvailable == nSlotsToOccupy)
+              break;
+            // find an empty slot
+            if (!bucket_->isValid(slotId)) {
+              ++nSlotsAvailable;
+            } else {
+              nSlotsAvailable = 0;
+            }
+          }
+          if (nSlotsAvailable == nSlotsToOccupy) return slotId - nSlotsToOccupy;
+        }
+
+        // Evict the least recently used slot
+        for (uint32_t rank = 0; rank < nSlots; ++rank) {
+          slotId = findSlotOfRank(rank);
+          if (bucket_->isValid(slotId)) break;
+        }
+        bucket_->setEvictedSignature(bucket_->getValue(slotId));
+        bucket_->setInvalid(slotId);
+      }
+    }
+
+    RankedBucketAwareLRU::RankedBucketAwareLRU(uint32_t nBuckets, uint32_t nSlotsPerBucket,
+        std::shared_ptr<FPIndex> fpIndex) :
+      CachePolicy(tRankedBucketAwareLRUPolicy),
+      nBuckets_(nBuckets),
+      nSlotsPerBucket_(nSlotsPerBucket),
+      fpIndex_(std::move(fpIndex))
+    {
+      assert(nSlotsPerBucket <= 256);
+      ranks_ = std::make_unique<uint8_t[]>(1ull * nBuckets * nSlotsPerBucket);
+      // Same initial order as the shifting version: the slot order
+      for (uint64_t i = 0; i < 1ull * nBuckets * nSlotsPerBucket; ++i) {
+        ranks_[i] = i % nSlotsPerBucket;
+      }
+    }
+
+    void RankedBucketAwareLRU::saveState(std::vector<uint8_t> &state)
+    {
+      appendState(state, ranks_.get(), 1ull * nBuckets_ * nSlotsPerBucket_);
+    }
+
+    bool RankedBucketAwareLRU::restoreState(const uint8_t *state, uint64_t len)
+    {
+      if (len != 1ull * nBuckets_ * nSlotsPerBucket_) {
+        return false;
+      }
+      memcpy(ranks_.get(), state, len);
+      return true;
+    }
+
+    uint64_t RankedBucketAwareLRU::getMemoryUsage()
     {
-      return new BucketAwareLRUExecutor(bucket);
+      return 1ull * nBuckets_ * nSlotsPerBucket_;
     }
 
 }
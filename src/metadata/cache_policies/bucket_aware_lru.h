@@ -7,24 +7,63 @@
 #include "cache_policy.h"
 
 namespace cache {
+    class BucketAwareLRU;
     struct BucketAwareLRUExecutor : public CachePolicyExecutor {
-        explicit BucketAwareLRUExecutor(Bucket *bucket);
+        BucketAwareLRUExecutor(Bucket *bucket, BucketAwareLRU *lru);
 
-        void promote(uint32_t slotId, uint32_t nSlotsToOccupy) override;
+        void promote(uint32_t slotId, uint32_t nSlotsToOccupy);
 
         // Only LBA Index would call this function
         // LBA signature only takes one slot.
         // So there is no need to care about the entry may take contiguous slots.
-        void clearObsolete(std::shared_ptr<FPIndex> fpIndex) override;
+        void clearObsolete(std::shared_ptr<FPIndex> fpIndex);
 
-        uint32_t allocate(uint32_t nSlotsToOccupy) override;
+        uint32_t allocate(uint32_t nSlotsToOccupy);
+
+        // References of the fingerprints in the core slots
+        FPIndex *fpIndex_;
     };
 
     class BucketAwareLRU : public CachePolicy {
     public:
-        BucketAwareLRU();
+        explicit BucketAwareLRU(std::shared_ptr<FPIndex> fpIndex);
+
+        std::shared_ptr<FPIndex> fpIndex_;
+    };
+
+    // BucketAwareLRU that keeps the recency order in a per-bucket rank array
+    // instead of in the slot order. ranks_[slotId] is the position the slot
+    // would have in the shifting version (0 is the least recently used, the
+    // core slots are ranks [lbaSlotSeperator, nSlots)), so a promotion only
+    // decrements the ranks above the promoted one rather than moving every
+    // following key, value and valid bit. Ranks are bytes, nSlots <= 256.
+    class RankedBucketAwareLRU;
+    struct RankedBucketAwareLRUExecutor : public CachePolicyExecutor {
+        RankedBucketAwareLRUExecutor(Bucket *bucket, RankedBucketAwareLRU *lru);
+
+        void promote(uint32_t slotId, uint32_t nSlotsToOccupy);
+        uint32_t allocate(uint32_t nSlotsToOccupy);
+        bool isCoreSlot(uint32_t slotId);
+
+        uint8_t *ranks_;
+        FPIndex *fpIndex_;
+    private:
+        void promoteSlot(uint32_t slotId);
+        uint32_t findSlotOfRank(uint32_t rank);
+    };
+
+    class RankedBucketAwareLRU : public CachePolicy {
+    public:
+        RankedBucketAwareLRU(uint32_t nBuckets, uint32_t nSlotsPerBucket,
+            std::shared_ptr<FPIndex> fpIndex);
+        // The ranks
+        void saveState(std::vector<uint8_t> &state);
+        bool restoreState(const uint8_t *state, uint64_t len);
+        uint64_t getMemoryUsage();
 
-        CachePolicyExecutor* getExecutor(Bucket *bucket) override;
+        uint32_t nBuckets_, nSlotsPerBucket_;
+        std::shared_ptr<FPIndex> fpIndex_;
+        std::unique_ptr<uint8_t[]> ranks_;
     };
 }
 
@@ -1,9 +1,122 @@
-
 #include "cache_policy.h"
+#include "lru.h"
+#include "bucket_aware_lru.h"
+#include "least_reference_count.h"
+#include "clock.h"
 
 namespace cache {
     CachePolicyExecutor::CachePolicyExecutor(Bucket *bucket) :
       bucket_(bucket)
     {}
-    CachePolicy::CachePolicy() = default;
+    CachePolicy::CachePolicy(CachePolicyTypeEnum type) :
+      type_(type)
+    {}
+
+    void CachePolicy::promote(Bucket *bucket, uint32_t slotId, uint32_t nSlotsToOccupy)
+    {
+      switch (type_) {
+        case tLRUPolicy:
+          LRUExecutor(bucket, static_cast<LRU *>(this)).promote(slotId, nSlotsToOccupy);
+          break;
+        case tBucketAwareLRUPolicy:
+          BucketAwareLRUExecutor(bucket, static_cast<BucketAwareLRU *>(this)).promote(slotId, nSlotsToOccupy);
+          break;
+        case tLeastReferenceCountPolicy:
+          LeastReferenceCountExecutor(bucket, static_cast<LeastReferenceCount *>(this)).promote(slotId, nSlotsToOccupy);
+          break;
+        case tClockPolicy:
+          ClockExecutor(bucket, static_cast<Clock *>(this)).promote(slotId, nSlotsToOccupy);
+          break;
+        case tRankedBucketAwareLRUPolicy:
+          RankedBucketAwareLRUExecutor(bucket, static_cast<RankedBucketAwareLRU *>(this)).promote(slotId, nSlotsToOccupy);
+          break;
+      }
+    }
+
+    uint32_t CachePolicy::allocate(Bucket *bucket, uint32_t nSlotsToOccupy)
+    {
+      switch (type_) {
+        case tLRUPolicy:
+          return LRUExecutor(bucket, static_cast<LRU *>(this)).allocate(nSlotsToOccupy);
+        case tBucketAwareLRUPolicy:
+          return BucketAwareLRUExecutor(bucket, static_cast<BucketAwareLRU *>(this)).allocate(nSlotsToOccupy);
+        case tLeastReferenceCountPolicy:
+          return LeastReferenceCountExecutor(bucket, static_cast<LeastReferenceCount *>(this)).allocate(nSlotsToOccupy);
+        case tClockPolicy:
+          return ClockExecutor(bucket, static_cast<Clock *>(this)).allocate(nSlotsToOccupy);
+        case tRankedBucketAwareLRUPolicy:
+          return RankedBucketAwareLRUExecutor(bucket, static_cast<RankedBucketAwareLRU *>(this)).allocate(nSlotsToOccupy);
+      }
+      return ~0u;
+    }
+
+    void CachePolicy::saveState(std::vector<uint8_t> &state)
+    {
+      switch (type_) {
+        case tLRUPolicy:
+          static_cast<LRU *>(this)->saveState(state);
+          break;
+        case tBucketAwareLRUPolicy:
+          // The recency order is the slot order
+          break;
+        case tLeastReferenceCountPolicy:
+          static_cast<LeastReferenceCount *>(this)->saveState(state);
+          break;
+        case tClockPolicy:
+          static_cast<Clock *>(this)->saveState(state);
+          break;
+        case tRankedBucketAwareLRUPolicy:
+          static_cast<RankedBucketAwareLRU *>(this)->saveState(state);
+          break;
+      }
+    }
+
+    bool CachePolicy::restoreState(const uint8_t *state, uint64_t len)
+    {
+      switch (type_) {
+        case tLRUPolicy:
+          return static_cast<LRU *>(this)->restoreState(state, len);
+        case tBucketAwareLRUPolicy:
+          return len == 0;
+        case tLeastReferenceCountPolicy:
+          return static_cast<LeastReferenceCount *>(this)->restoreState(state, len);
+        case tClockPolicy:
+          return static_cast<Clock *>(this)->restoreState(state, len);
+        case tRankedBucketAwareLRUPolicy:
+          return static_cast<RankedBucketAwareLRU *>(this)->restoreState(state, len);
+      }
+      return false;
+    }
+
+    uint64_t CachePolicy::getMemoryUsage()
+    {
+      switch (type_) {
+        case tLRUPolicy:
+          return static_cast<LRU *>(this)->getMemoryUsage();
+        case tBucketAwareLRUPolicy:
+          // The recency order is the slot order
+          return 0;
+        case tLeastReferenceCountPolicy:
+          return static_cast<LeastReferenceCount *>(this)->getMemoryUsage();
+        case tClockPolicy:
+          return static_cast<Clock *>(this)->getMemoryUsage();
+        case tRankedBucketAwareLRUPolicy:
+          return static_cast<RankedBucketAwareLRU *>(this)->getMemoryUsage();
+      }
+      return 0;
+    }
+
+    void CachePolicy::appendState(std::vector<uint8_t> &state, const void *bytes, uint64_t len)
+    {
+      const uint8_t *begin = reinterpret_cast<const uint8_t *>(bytes);
+      state.insert(state.end(), begin, begin + len);
+    }
+
+    bool CachePolicy::isCoreSlot(Bucket *bucket, uint32_t slotId)
+    {
+      if (type_ == tRankedBucketAwareLRUPolicy) {
+        return RankedBucketAwareLRUExecutor(bucket, static_cast<RankedBucketAwareLRU *>(this)).isCoreSlot(slotId);
+      }
+      return slotId >= IndexGeometry::getInstance().lbaSlotSeperator_;
+    }
 }
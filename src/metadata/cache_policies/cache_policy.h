@@ -5,24 +5,45 @@
 #define AUSTERECACHE_CACHEPOLICY_H
 
 #include <metadata/index.h>
+#include <vector>
 
 namespace cache {
+    enum CachePolicyTypeEnum {
+        tLRUPolicy, tBucketAwareLRUPolicy, tLeastReferenceCountPolicy, tClockPolicy,
+        tRankedBucketAwareLRUPolicy
+    };
+
+    // An executor applies a policy to one bucket. Executors are built on the
+    // stack for each bucket operation and dispatched on the policy type by
+    // CachePolicy, so that accessing a bucket never allocates.
     struct CachePolicyExecutor {
         explicit CachePolicyExecutor(Bucket *bucket);
 
-        virtual void promote(uint32_t slotId, uint32_t nSlotsToOccupy = 1) = 0;
-
-        virtual uint32_t allocate(uint32_t nSlotsToOccupy = 1) = 0;
-
-        virtual void clearObsolete(std::shared_ptr <FPIndex> fpIndex) = 0;
-
         Bucket *bucket_;
     };
     class CachePolicy {
     public:
-        virtual CachePolicyExecutor* getExecutor(Bucket *bucket) = 0;
-
-        CachePolicy();
+        explicit CachePolicy(CachePolicyTypeEnum type);
+        virtual ~CachePolicy() = default;
+
+        void promote(Bucket *bucket, uint32_t slotId, uint32_t nSlotsToOccupy = 1);
+        uint32_t allocate(Bucket *bucket, uint32_t nSlotsToOccupy = 1);
+        // Whether an LBA slot is one of the core (referenced) slots, the
+        // slots at or above lbaSlotSeperator in recency order
+        bool isCoreSlot(Bucket *bucket, uint32_t slotId);
+
+        // Index checkpoint (metadata/index_checkpoint.h): append the state of
+        // the policy to state, and restore it, false if it does not fit
+        void saveState(std::vector<uint8_t> &state);
+        bool restoreState(const uint8_t *state, uint64_t len);
+        // Bytes the policy keeps besides the slots and valid bitmaps of the index
+        uint64_t getMemoryUsage();
+
+        CachePolicyTypeEnum getType() { return type_; }
+    protected:
+        static void appendState(std::vector<uint8_t> &state, const void *bytes, uint64_t len);
+
+        CachePolicyTypeEnum type_;
     };
 }
 
@@ -0,0 +1,120 @@
+#include "clock.h"
+#include <cassert>
+
+namespace cache {
+
+    ClockExecutor::ClockExecutor(Bucket *bucket, Clock *clock) :
+      CachePolicyExecutor(bucket),
+      referenced_(bucket->valid_.data_ + clock->referenceBitsOffset_),
+      hand_(&clock->hands_[bucket->getBucketId()]),
+      forLbaIndex_(clock->forLbaIndex_)
+    {}
+
+    void ClockExecutor::promote(uint32_t slotId, uint32_t nSlotsToOccupy)
+    {
+      if (slotId >= bucket_->getnSlots()) return;
+      for (uint32_t i = slotId; i < slotId + nSlotsToOccupy; ++i) {
+        referenced_.set(i);
+      }
+    }
+
+    uint32_t ClockExecutor::allocate(uint32_t nSlotsToOccupy)
+    {
+      uint32_t slotId = 0, nSlotsAvailable = 0,
+        nSlots = bucket_->getnSlots();
+      for ( ; slotId < nSlots; ++slotId) {
+        if (nSlotsAvailable == nSlotsToOccupy)
+          break;
+        // find an empty slot
+        if (!bucket_->isValid(slotId)) {
+          ++nSlotsAvailable;
+        } else {
+          nSlotsAvailable = 0;
+        }
+      }
+      if (nSlotsAvailable == nSlotsToOccupy) {
+        return slotId - nSlotsToOccupy;
+      }
+
+      // Sweep the hand over windows of nSlotsToOccupy slots, giving the
+      // referenced slots a second chance. All reference bits are clear
+      // after one revolution, so the sweep ends within two.
+      uint32_t hand = *hand_;
+      for (uint32_t nSteps = 0; nSteps < 2 * nSlots; ++nSteps) {
+        if (hand + nSlotsToOccupy > nSlots) hand = 0;
+        bool referenced = false;
+        for (uint32_t i = hand; i < hand + nSlotsToOccupy; ++i) {
+          if (referenced_.get(i)) {
+            referenced_.clear(i);
+            referenced = true;
+          }
+        }
+        if (!referenced) break;
+        ++hand;
+      }
+      if (hand + nSlotsToOccupy > nSlots) hand = 0;
+
+      // Entries of the FP index take contiguous slots with the same key,
+      // evict the entries overlapping the window as a whole
+      uint32_t begin = hand, end = hand + nSlotsToOccupy;
+      if (bucket_->isValid(begin)) {
+        uint32_t key = bucket_->getKey(begin);
+        while (begin > 0 && bucket_->isValid(begin - 1)
+               && bucket_->getKey(begin - 1) == key) {
+          --begin;
+        }
+      }
+      if (bucket_->isValid(end - 1)) {
+        uint32_t key = bucket_->getKey(end - 1);
+        while (end < nSlots && bucket_->isValid(end)
+               && bucket_->getKey(end) == key) {
+          ++end;
+        }
+      }
+      for (uint32_t i = begin; i < end; ++i) {
+        if (bucket_->isValid(i)) {
+          // An evicted LBA slot tells the FP index which fingerprint it
+          // pointed to (see BucketAwareLRU), an FP slot has nothing to pass on
+          if (forLbaIndex_) {
+            bucket_->setEvictedSignature(bucket_->getValue(i));
+          }
+          bucket_->setInvalid(i);
+        }
+        referenced_.clear(i);
+      }
+
+      *hand_ = (hand + nSlotsToOccupy) % nSlots;
+      return hand;
+    }
+
+    Clock::Clock(uint32_t nBuckets, uint32_t nSlotsPerBucket, uint32_t referenceBitsOffset,
+        bool forLbaIndex) :
+      CachePolicy(tClockPolicy),
+      nBuckets_(nBuckets),
+      referenceBitsOffset_(referenceBitsOffset),
+      forLbaIndex_(forLbaIndex)
+    {
+      assert(nSlotsPerBucket <= 65536);
+      hands_ = std::make_unique<uint16_t[]>(nBuckets);
+    }
+
+    void Clock::saveState(std::vector<uint8_t> &state)
+    {
+      // The reference bits are saved with the valid bitmaps
+      appendState(state, hands_.get(), sizeof(uint16_t) * nBuckets_);
+    }
+
+    bool Clock::restoreState(const uint8_t *state, uint64_t len)
+    {
+      if (len != sizeof(uint16_t) * nBuckets_) {
+        return false;
+      }
+      memcpy(hands_.get(), state, sizeof(uint16_t) * nBuckets_);
+      return true;
+    }
+
+    uint64_t Clock::getMemoryUsage()
+    {
+      return sizeof(uint16_t) * 1ull * nBuckets_;
+    }
+}
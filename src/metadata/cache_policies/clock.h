@@ -0,0 +1,50 @@
+//
+//
+
+#ifndef AUSTERECACHE_CLOCK_H
+#define AUSTERECACHE_CLOCK_H
+
+#include "cache_policy.h"
+#include "metadata/bitmap.h"
+
+namespace cache {
+
+    class Clock;
+    // CLOCK (second chance) on one bucket: promotion sets the reference bits
+    // of the slots, allocation sweeps the bucket's hand, clearing reference
+    // bits until it reaches a run of unreferenced slots to evict.
+    class ClockExecutor : public CachePolicyExecutor {
+    public:
+        ClockExecutor(Bucket *bucket, Clock *clock);
+
+        uint32_t allocate(uint32_t nSlotsToOccupy);
+        void promote(uint32_t slotId, uint32_t nSlotsToOccupy);
+    private:
+        Bitmap::Manipulator referenced_;
+        uint16_t *hand_;
+        bool forLbaIndex_;
+    };
+
+    // CLOCK policy, an O(1)-promotion alternative to the list-based LRU.
+    // It keeps one reference bit per slot and a 16-bit hand per bucket. The
+    // reference bits are stored by the index in the valid bitmap of each
+    // bucket, referenceBitsOffset bytes in, so they share its cache line and
+    // are checkpointed with it.
+    class Clock : public CachePolicy {
+      public:
+        Clock(uint32_t nBuckets, uint32_t nSlotsPerBucket, uint32_t referenceBitsOffset,
+            bool forLbaIndex);
+        // The hands, the reference bits are counted with the valid bitmaps
+        uint64_t getMemoryUsage();
+        // The hands
+        void saveState(std::vector<uint8_t> &state);
+        bool restoreState(const uint8_t *state, uint64_t len);
+
+        uint32_t nBuckets_, referenceBitsOffset_;
+        // Evicted LBA slots pass their fingerprint hash on (setEvictedSignature)
+        bool forLbaIndex_;
+        std::unique_ptr<uint16_t[]> hands_;
+    };
+}
+
+#endif //AUSTERECACHE_CLOCK_H
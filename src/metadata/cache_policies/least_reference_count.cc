@@ -1,12 +1,19 @@
+#include <algorithm>
 #include <metadata/reference_counter.h>
+#include <metadata/signature_scan.h>
 #include <common/stats.h>
 #include <manage/dirtylist.h>
+#include <common/index_geometry.h>
 #include "least_reference_count.h"
  
 
 namespace cache {
-    LeastReferenceCountExecutor::LeastReferenceCountExecutor(Bucket *bucket)
-      : CachePolicyExecutor(bucket) {}
+    LeastReferenceCountExecutor::LeastReferenceCountExecutor(Bucket *bucket, LeastReferenceCount *lrc)
+      : CachePolicyExecutor(bucket),
+        referenceCounts_(lrc->referenceCounts_ == nullptr ? nullptr :
+            lrc->referenceCounts_.get() + 1ull * lrc->nSlotsPerBucket_ * bucket->getBucketId()),
+        embeddedCountShift_(lrc->embeddedCountShift_)
+    {}
 
     void LeastReferenceCountExecutor::promote(uint32_t slotId, uint32_t nSlotsToOccupy) {}
 
@@ -14,60 +21,27 @@ namespace cache {
 
     uint32_t LeastReferenceCountExecutor::allocate(uint32_t nSlotsToOccupy)
     {
-
-      std::vector<std::pair<uint32_t, std::pair<uint32_t, uint32_t>>> slotsToReferenceCounts;
-      uint32_t slotId = 0, nSlotsAvailable = 0,
-        nSlots = bucket_->getnSlots();
-
-      for (slotId = 0; slotId < nSlots; ) {
-        if (!bucket_->isValid(slotId)) {
-          ++slotId;
-          continue;
-        }
-
-        uint32_t nSlotsOccupied = 0;
-        uint32_t slotId_ = slotId;
-        uint64_t key = bucket_->getKey(slotId);
-        uint64_t bucketId = bucket_->bucketId_;
-        uint64_t fpHash = (bucketId << Config::getInstance().getnBitsPerFpSignature()) | key;
-        uint32_t refCount = ReferenceCounter::getInstance().query(fpHash);
-        while (slotId < nSlots && bucket_->isValid(slotId)
-               && key == bucket_->getKey(slotId)) {
-          ++slotId;
-          nSlotsOccupied += 1;
-        }
-
-        slotsToReferenceCounts.emplace_back(slotId_, std::make_pair(refCount, nSlotsOccupied));
-      }
-
-      std::sort(slotsToReferenceCounts.begin(),
-          slotsToReferenceCounts.end(),
-          [](auto &left, auto &right) {
-          uint32_t refCount1 = left.second.first, refCount2 = right.second.first;
-          uint32_t nOccupied1 = left.second.second, nOccupied2 = right.second.second;
-          return refCount1 < refCount2;
-          });
+      uint32_t nSlots = bucket_->getnSlots();
 
       while (true) {
         // check whether there is a contiguous space
-        // try to evict those zero referenced fingerprint first
-        slotId = 0;
-        nSlotsAvailable = 0;
-        for (; slotId < nSlots; ++slotId) {
-          if (nSlotsAvailable >= nSlotsToOccupy)
-            break;
-          // find an empty slot
-          if (!bucket_->isValid(slotId)) {
-            ++nSlotsAvailable;
-          } else {
-            nSlotsAvailable = 0;
+        uint32_t slotId = bucket_->findFreeSlots(nSlotsToOccupy);
+        if (slotId != ~0u) return slotId;
+
+        // Evict the least referenced entry (the first one among equals)
+        uint32_t minReferenceCount = ~0u;
+        for (uint32_t i = 0; i < nSlots; ++i) {
+          if (bucket_->isValid(i) && getReferenceCount(i) < minReferenceCount) {
+            minReferenceCount = getReferenceCount(i);
+            slotId = i;
           }
         }
-
-        if (nSlotsAvailable >= nSlotsToOccupy) break;
-        // Evict the least RF entry
-        slotId = slotsToReferenceCounts[0].first;
         uint64_t key = bucket_->getKey(slotId);
+        while (slotId > 0 && bucket_->isValid(slotId - 1)
+               && key == bucket_->getKey(slotId - 1)) {
+          --slotId;
+        }
+        uint32_t evictedSlotId = slotId;
         while (slotId < nSlots && bucket_->isValid(slotId)
                && key == bucket_->getKey(slotId)) {
           bucket_->setInvalid(slotId);
@@ -78,21 +52,71 @@ namespace cache {
           DirtyList::getInstance().addEvictedChunk(
             /* Compute ssd location of the evicted data */
             /* Actually, full Fingerprint and address is sufficient. */
-            FPIndex::computeCachedataLocation(bucket_->getBucketId(), slotsToReferenceCounts[0].first),
-            (slotId - slotsToReferenceCounts[0].first) * Config::getInstance().getSubchunkSize()
+            FPIndex::computeCachedataLocation(bucket_->getBucketId(), evictedSlotId),
+            (slotId - evictedSlotId) * IndexGeometry::getInstance().subchunkSize_
           );
         }
+      }
+    }
 
- 
-        slotsToReferenceCounts.erase(slotsToReferenceCounts.begin());
+    LeastReferenceCount::LeastReferenceCount(uint32_t nBuckets, uint32_t nSlotsPerBucket) :
+      CachePolicy(tLeastReferenceCountPolicy),
+      nBuckets_(nBuckets),
+      nSlotsPerBucket_(nSlotsPerBucket)
+    {
+      uint64_t nCounts = 1ull * nBuckets * nSlotsPerBucket;
+      referenceCounts_ = std::make_unique<std::atomic<uint8_t>[]>(nCounts);
+      for (uint64_t i = 0; i < nCounts; ++i) {
+        referenceCounts_[i].store(0, std::memory_order_relaxed);
       }
+    }
 
-      return slotId - nSlotsAvailable;
+    LeastReferenceCount::LeastReferenceCount(uint32_t nBuckets, uint32_t nSlotsPerBucket,
+        uint32_t embeddedCountShift) :
+      CachePolicy(tLeastReferenceCountPolicy),
+      nBuckets_(nBuckets),
+      nSlotsPerBucket_(nSlotsPerBucket),
+      embeddedCountShift_(embeddedCountShift)
+    {}
+
+    void LeastReferenceCount::setReferenceCount(uint32_t bucketId, uint32_t slotId,
+        uint32_t nSlotsOccupied, uint32_t referenceCount)
+    {
+      std::atomic<uint8_t> *referenceCounts = referenceCounts_.get() + 1ull * nSlotsPerBucket_ * bucketId;
+      // Saturate, the order among heavily referenced entries does not matter
+      uint8_t count = std::min(referenceCount, 255u);
+      for (uint32_t i = slotId; i < slotId + nSlotsOccupied; ++i) {
+        referenceCounts[i].store(count, std::memory_order_relaxed);
+      }
     }
 
-    LeastReferenceCount::LeastReferenceCount() = default;
+    void LeastReferenceCount::saveState(std::vector<uint8_t> &state)
+    {
+      if (referenceCounts_ != nullptr) {
+        uint64_t nCounts = 1ull * nBuckets_ * nSlotsPerBucket_;
+        state.reserve(state.size() + nCounts);
+        for (uint64_t i = 0; i < nCounts; ++i) {
+          state.push_back(referenceCounts_[i].load(std::memory_order_relaxed));
+        }
+      }
+    }
+
+    bool LeastReferenceCount::restoreState(const uint8_t *state, uint64_t len)
+    {
+      if (referenceCounts_ == nullptr) {
+        return len == 0;
+      }
+      if (len != 1ull * nBuckets_ * nSlotsPerBucket_) {
+        return false;
+      }
+      for (uint64_t i = 0; i < len; ++i) {
+        referenceCounts_[i].store(state[i], std::memory_order_relaxed);
+      }
+      return true;
+    }
 
-    CachePolicyExecutor* LeastReferenceCount::getExecutor(Bucket *bucket) {
-      return new LeastReferenceCountExecutor(bucket);
+    uint64_t LeastReferenceCount::getMemoryUsage()
+    {
+      return referenceCounts_ == nullptr ? 0 : 1ull * nBuckets_ * nSlotsPerBucket_;
     }
 }
@@ -3,25 +3,61 @@
 
 #ifndef AUSTERECACHE_LEASTREFERENCECOUNT_H
 #define AUSTERECACHE_LEASTREFERENCECOUNT_H
+#include <atomic>
 #include "cache_policy.h"
 namespace cache {
+    class LeastReferenceCount;
     struct LeastReferenceCountExecutor : public CachePolicyExecutor {
-        explicit LeastReferenceCountExecutor(Bucket *bucket);
+        LeastReferenceCountExecutor(Bucket *bucket, LeastReferenceCount *lrc);
 
-        void promote(uint32_t slotId, uint32_t nSlotsToOccupy) override;
+        void promote(uint32_t slotId, uint32_t nSlotsToOccupy);
         // Only LBA Index would call this function
         // LBA signature only takes one slot.
         // So there is no need to care about the entry may take contiguous slots.
-        void clearObsolete(std::shared_ptr<FPIndex> fpIndex) override;
-        uint32_t allocate(uint32_t nSlotsToOccupy) override;
-    };
+        void clearObsolete(std::shared_ptr<FPIndex> fpIndex);
+        uint32_t allocate(uint32_t nSlotsToOccupy);
+
+        inline uint32_t getReferenceCount(uint32_t slotId)
+        {
+          if (referenceCounts_ == nullptr) {
+            return bucket_->getValue(slotId) >> embeddedCountShift_;
+          }
+          return referenceCounts_[slotId].load(std::memory_order_relaxed);
+        }
 
+        // Cached reference counts of the bucket's slots,
+        // nullptr if they are embedded in the value bits
+        std::atomic<uint8_t> *referenceCounts_;
+        uint32_t embeddedCountShift_;
+    };
 
+    // Evicts the entries with the least reference counts. The count of each
+    // slot is cached next to the index (one saturating byte per slot): it is
+    // set from the ReferenceCounter when the entry is inserted and kept
+    // current by FPIndex::reference/dereference, so that victim selection
+    // neither queries the ReferenceCounter nor sorts the bucket.
+    // The LBA index references fingerprints without holding their FP bucket
+    // lock, so the counts are atomics, read and written relaxed: a count only
+    // steers victim selection and needs no ordering with the bucket.
+    // With embedded reference counts FPIndex keeps the counts in the value
+    // bits of the slots instead, and victim selection reads them from there.
     class LeastReferenceCount : public CachePolicy {
     public:
-        LeastReferenceCount();
+        LeastReferenceCount(uint32_t nBuckets, uint32_t nSlotsPerBucket);
+        // Counts embedded in the value bits above the first embeddedCountShift ones
+        LeastReferenceCount(uint32_t nBuckets, uint32_t nSlotsPerBucket,
+            uint32_t embeddedCountShift);
+
+        void setReferenceCount(uint32_t bucketId, uint32_t slotId,
+            uint32_t nSlotsOccupied, uint32_t referenceCount);
+        // The cached counts, nothing if they are embedded
+        void saveState(std::vector<uint8_t> &state);
+        bool restoreState(const uint8_t *state, uint64_t len);
+        uint64_t getMemoryUsage();
 
-        CachePolicyExecutor* getExecutor(Bucket *bucket) override;
+        uint32_t nBuckets_, nSlotsPerBucket_;
+        uint32_t embeddedCountShift_ = 0;
+        std::unique_ptr<std::atomic<uint8_t>[]> referenceCounts_;
     };
 }
 
@@ -2,10 +2,9 @@
 
 namespace cache {
 
-    LRUExecutor::LRUExecutor(
-        Bucket *bucket, std::list<uint32_t> *list) :
+    LRUExecutor::LRUExecutor(Bucket *bucket, LRU *lru) :
       CachePolicyExecutor(bucket) {
-      list_ = list;
+      list_ = &lru->lists_[bucket->getBucketId()];
     }
 
     void LRUExecutor::promote(uint32_t slotId, uint32_t nSlotsToOccupy) {
@@ -46,11 +45,52 @@ namespace cache {
       return slotId - nSlotsToOccupy;
     }
 
-    CachePolicyExecutor* LRU::getExecutor(Bucket *bucket) {
-      return new LRUExecutor(bucket, &lists_[bucket->getBucketId()]);
+    LRU::LRU(uint32_t nBuckets) :
+      CachePolicy(tLRUPolicy), nBuckets_(nBuckets) {
+      lists_ = std::make_unique<std::list<uint32_t>[]>(nBuckets);
     }
 
-    LRU::LRU(uint32_t nBuckets) {
-      lists_ = std::make_unique<std::list<uint32_t>[]>(nBuckets);
+    void LRU::saveState(std::vector<uint8_t> &state)
+    {
+      for (uint32_t i = 0; i < nBuckets_; ++i) {
+        uint32_t nSlots = lists_[i].size();
+        appendState(state, &nSlots, sizeof(nSlots));
+        for (uint32_t slotId : lists_[i]) {
+          appendState(state, &slotId, sizeof(slotId));
+        }
+      }
+    }
+
+    bool LRU::restoreState(const uint8_t *state, uint64_t len)
+    {
+      uint64_t offset = 0;
+      for (uint32_t i = 0; i < nBuckets_; ++i) {
+        uint32_t nSlots, slotId;
+        if (offset + sizeof(nSlots) > len) {
+          return false;
+        }
+        memcpy(&nSlots, state + offset, sizeof(nSlots));
+        offset += sizeof(nSlots);
+        if (offset + 1ull * nSlots * sizeof(slotId) > len) {
+          return false;
+        }
+        lists_[i].clear();
+        for (uint32_t j = 0; j < nSlots; ++j) {
+          memcpy(&slotId, state + offset, sizeof(slotId));
+          offset += sizeof(slotId);
+          lists_[i].push_back(slotId);
+        }
+      }
+      return offset == len;
+    }
+
+    uint64_t LRU::getMemoryUsage()
+    {
+      // A node holds the two list pointers and the slot id
+      uint64_t memoryUsage = sizeof(std::list<uint32_t>) * 1ull * nBuckets_;
+      for (uint32_t i = 0; i < nBuckets_; ++i) {
+        memoryUsage += lists_[i].size() * (2 * sizeof(void *) + sizeof(uint64_t));
+      }
+      return memoryUsage;
     }
 }
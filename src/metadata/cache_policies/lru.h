@@ -9,9 +9,10 @@
 #include <map>
 namespace cache {
 
+    class LRU;
     class LRUExecutor : public CachePolicyExecutor {
     public:
-        explicit LRUExecutor(Bucket *bucket, std::list<uint32_t> *list);
+        LRUExecutor(Bucket *bucket, LRU *lru);
 
         std::list<uint32_t> *list_;
 
@@ -25,7 +26,13 @@ namespace cache {
     class LRU : public CachePolicy {
       public:
         LRU(uint32_t nBuckets);
-        CachePolicyExecutor* getExecutor(Bucket *bucket) override;
+        // Per bucket: the number of listed slots, then the slots from the front
+        void saveState(std::vector<uint8_t> &state);
+        bool restoreState(const uint8_t *state, uint64_t len);
+        // The lists and their nodes
+        uint64_t getMemoryUsage();
+
+        uint32_t nBuckets_;
         std::unique_ptr<std::list<uint32_t> []> lists_;
     };
 }
@@ -54,10 +54,7 @@ namespace cache {
 
       uint32_t weu_id = it->second.weuId_;
 
-      if (weuReferenceCount_.find(weu_id) == weuReferenceCount_.end()) {
-        weuReferenceCount_[weu_id] = 0;
-      }
-
+      // A new WEU starts at 0
       if ( (weuReferenceCount_[weu_id] += 1) == 1 ) {
         zeroReferenceList_.remove(weu_id);
       }
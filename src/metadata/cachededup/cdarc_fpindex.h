@@ -26,8 +26,8 @@ namespace cache {
         void clearObsolete();
 
     private:
-        std::map<Fingerprint, DP> mp_;
-        std::map<uint32_t, uint32_t> weuReferenceCount_; // reference count for each weu
+        FlatHashMap<Fingerprint, DP> mp_;
+        FlatHashMap<uint32_t, uint32_t> weuReferenceCount_; // reference count for each weu
         std::list<uint32_t> zeroReferenceList_; // weu_ids
         WEUAllocator weuAllocator_;
     };
@@ -10,6 +10,9 @@
  *
  *   To ease the implementation of SSD space allocation for FingerprintIndex,
  *   struct SpaceAllocator (WEUAllocator in CD-ARC) is used.
+ *
+ *   The indexes map lbas and fingerprints with FlatHashMap (common/flat_hash_map.h),
+ *   none of them needs the keys in order.
  */
 #ifndef __CACHEDEDUP_INDEX__
 #define __CACHEDEDUP_INDEX__
@@ -22,6 +25,7 @@
 #include <cassert>
 #include "utils/xxhash.h"
 #include "common/config.h"
+#include "common/flat_hash_map.h"
 #include <csignal>
 
 namespace cache {
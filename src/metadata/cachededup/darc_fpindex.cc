@@ -88,12 +88,13 @@ namespace cache {
         _fp = zeroReferenceList_.back();
         zeroReferenceList_.pop_back();
 
-        spaceAllocator_.recycle(mp_[_fp].cachedataLocation_);
+        auto it = mp_.find(_fp);
+        spaceAllocator_.recycle(it->second.cachedataLocation_);
         if (Config::getInstance().getCacheMode() == tWriteBack) {
-          DirtyList::getInstance().addEvictedChunk(mp_[_fp].cachedataLocation_,
+          DirtyList::getInstance().addEvictedChunk(it->second.cachedataLocation_,
                                                    Config::getInstance().getChunkSize());
         }
-        mp_.erase(_fp);
+        mp_.erase(it);
 
         memcpy(_fp.v_, fp, Config::getInstance().getFingerprintLength());
  
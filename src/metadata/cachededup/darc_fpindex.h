@@ -30,7 +30,7 @@ namespace cache {
         uint32_t capacity_{};
         void dumpStats();
     private:
-        std::map<Fingerprint, DP> mp_;
+        FlatHashMap<Fingerprint, DP> mp_;
         std::list<Fingerprint> zeroReferenceList_;
         std::list<Fingerprint> list_;
         SpaceAllocator spaceAllocator_{};
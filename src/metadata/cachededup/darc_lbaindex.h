@@ -68,7 +68,7 @@ namespace cache {
           return 1.0 * mp_.size() / tmp.size();
         }
 
-        std::map<uint64_t, FP> mp_;
+        FlatHashMap<uint64_t, FP> mp_;
         std::list<uint64_t> t1_, t2_, b1_, b2_, b3_;
         uint32_t p_, x_;
         uint32_t capacity_;
@@ -58,6 +58,7 @@ namespace cache {
 
         bool inRecencyList = true;
         bool find = false;
+        FlatHashMap<Fingerprint, DP>::iterator it;
         // current cache is full, evict an old entry and
         // allocate its ssd location to the new one
         do {
@@ -70,22 +71,22 @@ namespace cache {
             zeroReferenceList_.pop_back();
             inRecencyList = false;
           }
-        } while (mp_.find(_fp) == mp_.end());
+        } while ((it = mp_.find(_fp)) == mp_.end());
         // assign the evicted free ssd location to the newly inserted data
         if (Config::getInstance().getCacheMode() == tWriteBack) {
-          DirtyList::getInstance().addEvictedChunk(mp_[_fp].cachedataLocation_,
+          DirtyList::getInstance().addEvictedChunk(it->second.cachedataLocation_,
                                                    Config::getInstance().getChunkSize());
         }
         if (inRecencyList) {
-          if (mp_[_fp].zeroReferenceListIter_ != zeroReferenceList_.end()) {
-            zeroReferenceList_.erase(mp_[_fp].zeroReferenceListIter_);
+          if (it->second.zeroReferenceListIter_ != zeroReferenceList_.end()) {
+            zeroReferenceList_.erase(it->second.zeroReferenceListIter_);
           }
         } else {
-          list_.erase(mp_[_fp].it_);
+          list_.erase(it->second.it_);
         }
 //#endif
-        spaceAllocator_.recycle(mp_[_fp].cachedataLocation_);
-        mp_.erase(_fp);
+        spaceAllocator_.recycle(it->second.cachedataLocation_);
+        mp_.erase(it);
  
       }
       _dp.cachedataLocation_ = spaceAllocator_.allocate();
@@ -110,14 +111,16 @@ namespace cache {
     void DLRUFPIndex::reference(uint8_t *fp) {
       Fingerprint _fp;
       memcpy(_fp.v_, fp, Config::getInstance().getFingerprintLength());
-      if (mp_.find(_fp) == mp_.end()) {
+      auto it = mp_.find(_fp);
+      if (it == mp_.end()) {
         return ;
       }
-      mp_[_fp].referenceCount_ += 1;
-      if (mp_[_fp].referenceCount_ == 1) {
-        if (mp_[_fp].zeroReferenceListIter_ != zeroReferenceList_.end()) {
-          zeroReferenceList_.erase(mp_[_fp].zeroReferenceListIter_);
-          mp_[_fp].zeroReferenceListIter_ = zeroReferenceList_.end();
+      DP &dp = it->second;
+      dp.referenceCount_ += 1;
+      if (dp.referenceCount_ == 1) {
+        if (dp.zeroReferenceListIter_ != zeroReferenceList_.end()) {
+          zeroReferenceList_.erase(dp.zeroReferenceListIter_);
+          dp.zeroReferenceListIter_ = zeroReferenceList_.end();
         }
       }
     }
@@ -125,14 +128,16 @@ namespace cache {
     void DLRUFPIndex::dereference(uint8_t *fp) {
       Fingerprint _fp;
       memcpy(_fp.v_, fp, Config::getInstance().getFingerprintLength());
-      if (mp_.find(_fp) == mp_.end()) {
+      auto it = mp_.find(_fp);
+      if (it == mp_.end()) {
         return ;
       }
-      if (mp_[_fp].referenceCount_ != 0) {
-        mp_[_fp].referenceCount_ -= 1;
-        if (mp_[_fp].referenceCount_ == 0) {
+      DP &dp = it->second;
+      if (dp.referenceCount_ != 0) {
+        dp.referenceCount_ -= 1;
+        if (dp.referenceCount_ == 0) {
           zeroReferenceList_.push_front(_fp);
-          mp_[_fp].zeroReferenceListIter_ = zeroReferenceList_.begin();
+          dp.zeroReferenceListIter_ = zeroReferenceList_.begin();
         }
       }
     }
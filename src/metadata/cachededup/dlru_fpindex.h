@@ -39,7 +39,7 @@ namespace cache {
 
         uint32_t capacity_;
     private:
-        std::map<Fingerprint, DP> mp_; // mapping from Fingerprint to list
+        FlatHashMap<Fingerprint, DP> mp_; // mapping from Fingerprint to list
         std::list<Fingerprint> list_;
         std::list<Fingerprint> zeroReferenceList_;
         SpaceAllocator spaceAllocator_;
@@ -33,11 +33,11 @@ namespace cache {
      * move the accessed index to the front
      */
     void DLRULBAIndex::promote(uint64_t lba) {
-      auto it = mp_.find(lba)->second.it_;
-      list_.erase(it);
+      auto it = mp_.find(lba);
+      list_.erase(it->second.it_);
       list_.push_front(lba);
       // renew the iterator stored in the mapping
-      mp_[lba].it_ = list_.begin();
+      it->second.it_ = list_.begin();
     }
 
     /**
@@ -47,11 +47,12 @@ namespace cache {
       bool evicted = false;
       FP _fp;
       memcpy(_fp.v_, fp, Config::getInstance().getFingerprintLength());
-      if (mp_.find(lba) != mp_.end()) {
-        memcpy(oldFP, mp_[lba].v_, Config::getInstance().getFingerprintLength());
+      auto it = mp_.find(lba);
+      if (it != mp_.end()) {
+        memcpy(oldFP, it->second.v_, Config::getInstance().getFingerprintLength());
         evicted = true;
 
-        list_.erase(mp_[lba].it_);
+        list_.erase(it->second.it_);
         list_.push_front(lba);
         _fp.it_ = list_.begin();
       } else {
@@ -30,7 +30,7 @@ namespace cache {
           return 1.0 * mp_.size() / tmp.size();
         }
     private:
-        std::map <uint64_t, FP> mp_; // mapping from lba to ca and list iter
+        FlatHashMap<uint64_t, FP> mp_; // mapping from lba to ca and list iter
         std::list <uint64_t> list_;
     };
 
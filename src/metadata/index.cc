@@ -1,12 +1,14 @@
 #include "index.h"
 
 #include <utility>
+#include <vector>
 #include "common/config.h"
 #include "common/stats.h"
 #include "reference_counter.h"
 #include "cache_policies/lru.h"
 #include "cache_policies/bucket_aware_lru.h"
 #include "cache_policies/least_reference_count.h"
+#include "cache_policies/clock.h"
 
 namespace cache {
 
@@ -14,48 +16,169 @@ namespace cache {
 
   LBAIndex::~LBAIndex() = default;
   FPIndex::~FPIndex() = default;
+  constexpr uint32_t FPIndex::kBucketsPerPlacementGroup;
+  constexpr uint32_t FPIndex::kDereferenceLockSpins;
 
   void Index::setCachePolicy(std::unique_ptr<CachePolicy> cachePolicy)
   { 
     cachePolicy_ = std::move(cachePolicy);
   }
 
+  void Index::initValidAndLocks(IndexCheckpoint::SectionEnum validSection)
+  {
+    Config &config = Config::getInstance();
+    bool embeddedLocks = config.isMultiThreadingEnabled() &&
+      config.getBucketLock() == tEmbeddedLock;
+    // An embedded lock takes bit nSlotsPerBucket_ of the valid bitmap,
+    // CLOCK keeps the reference bits of the slots behind (see clock.h)
+    referenceBitsOffset_ = (nSlotsPerBucket_ + (embeddedLocks ? 1 : 0) + 7) / 8;
+    nBytesPerBucketForValid_ = referenceBitsOffset_;
+    if (!config.isCompactCachePolicyEnabled() && config.isClockCachePolicyEnabled()) {
+      nBytesPerBucketForValid_ += (nSlotsPerBucket_ + 7) / 8;
+    }
+    // Padding for the word-sized loads of SignatureScan
+    valid_ = IndexCheckpoint::getInstance().allocate(validSection, getValidSize());
+    if (embeddedLocks) {
+      locks_ = std::make_unique<BucketLockTable>(valid_.get(), nBuckets_,
+          nBytesPerBucketForValid_, nSlotsPerBucket_);
+    } else if (config.isMultiThreadingEnabled()) {
+      locks_ = std::make_unique<BucketLockTable>(nBuckets_, config.getnLockStripes());
+    }
+  }
+
+  uint64_t Index::getMemoryUsage()
+  {
+    uint64_t validMemoryUsage = 1ull * nBytesPerBucketForValid_ * nBuckets_;
+    // Embedded locks are in the valid bitmaps, getLockMemoryUsage() has them
+    if (locks_ != nullptr && !locks_->isVersioned()) {
+      validMemoryUsage -= locks_->getMemoryUsage();
+    }
+    return 1ull * nBytesPerBucket_ * nBuckets_ + validMemoryUsage;
+  }
+
+  uint64_t Index::getPolicyMemoryUsage()
+  {
+    return cachePolicy_->getMemoryUsage();
+  }
+
+  uint64_t Index::getLockMemoryUsage()
+  {
+    return locks_ == nullptr ? 0 : locks_->getMemoryUsage();
+  }
+
+  bool Index::hasVersionedLocks()
+  {
+    return locks_ == nullptr || locks_->isVersioned();
+  }
+
+  bool Index::sharesLock(uint64_t hash, uint64_t otherHash)
+  {
+    if (locks_ == nullptr) {
+      return true;
+    }
+    return locks_->getStripe(getLockedBucketId(hash))
+      == locks_->getStripe(getLockedBucketId(otherHash));
+  }
+
+  BucketLock Index::lock(uint64_t hash)
+  {
+    if (locks_ == nullptr) {
+      return BucketLock();
+    }
+    return locks_->lock(getLockedBucketId(hash));
+  }
+
+  uint32_t Index::readBegin(uint64_t hash)
+  {
+    if (locks_ == nullptr) {
+      return 0;
+    }
+    return locks_->readBegin(getLockedBucketId(hash));
+  }
+
+  bool Index::readValidate(uint64_t hash, uint32_t version)
+  {
+    if (locks_ == nullptr) {
+      return true;
+    }
+    return locks_->readValidate(getLockedBucketId(hash), version);
+  }
+
+  BucketLock Index::tryUpgrade(uint64_t hash, uint32_t version)
+  {
+    if (locks_ == nullptr) {
+      return BucketLock();
+    }
+    return locks_->tryUpgrade(getLockedBucketId(hash), version);
+  }
+
+  bool Index::tryLock(uint64_t hash, uint32_t maxSpins, BucketLock &lock)
+  {
+    if (locks_ == nullptr) {
+      return true;
+    }
+    lock = locks_->tryLock(getLockedBucketId(hash), maxSpins);
+    return lock.ownsLock();
+  }
+
   LBAIndex::LBAIndex(std::shared_ptr<FPIndex> fpIndex):
     fpIndex_(std::move(fpIndex))
   {
-    nBitsPerKey_ = Config::getInstance().getnBitsPerLbaSignature();
-    nBitsPerValue_ = Config::getInstance().getnBitsPerFpSignature() + Config::getInstance().getnBitsPerFpBucketId();
-    nSlotsPerBucket_ = Config::getInstance().getnLBASlotsPerBucket();
-    nBuckets_ = Config::getInstance().getnLbaBuckets();
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    nBitsPerKey_ = geometry.nBitsPerLbaSignature_;
+    nBitsPerValue_ = geometry.nBitsPerFpSignature_ + geometry.nBitsPerFpBucketId_;
+    nSlotsPerBucket_ = geometry.nSlotsPerLbaBucket_;
+    nBuckets_ = geometry.nLbaBuckets_;
+
+    nBytesPerBucket_ = Bucket::computeBytesPerBucket(nBitsPerKey_, nBitsPerValue_, nSlotsPerBucket_);
+    // Padding for the word-sized loads of SignatureScan
+    data_ = IndexCheckpoint::getInstance().allocate(IndexCheckpoint::tLbaData, getDataSize());
+    initValidAndLocks(IndexCheckpoint::tLbaValid);
 
-    nBytesPerBucket_ = ((nBitsPerKey_ + nBitsPerValue_) * nSlotsPerBucket_ + 7) / 8;
-    nBytesPerBucketForValid_ = (1 * nSlotsPerBucket_ + 7) / 8;
-    data_ = std::make_unique<uint8_t[]>(nBytesPerBucket_ * nBuckets_ + 1);
-    valid_ = std::make_unique<uint8_t[]>(nBytesPerBucketForValid_ * nBuckets_ + 1);
-    if (Config::getInstance().isMultiThreadingEnabled()) {
-      mutexes_ = std::make_unique<std::mutex[]>(nBuckets_);
+    if (nBitsPerKey_ == 16 && nSlotsPerBucket_ == 128) {
+      lookupImpl_ = &LBAIndex::lookupWithShape<FixedBucketShape<16, 128>>;
+    } else if (nBitsPerKey_ == 16 && nSlotsPerBucket_ == 64) {
+      lookupImpl_ = &LBAIndex::lookupWithShape<FixedBucketShape<16, 64>>;
+    } else if (nBitsPerKey_ == 12 && nSlotsPerBucket_ == 128) {
+      lookupImpl_ = &LBAIndex::lookupWithShape<FixedBucketShape<12, 128>>;
+    } else {
+      lookupImpl_ = &LBAIndex::lookupWithShape<RuntimeLBABucketShape>;
     }
 
-    if (Config::getInstance().isCompactCachePolicyEnabled()) {
-      setCachePolicy(std::move(std::make_unique<BucketAwareLRU>()));
+    if (Config::getInstance().isCompactCachePolicyEnabled()
+        && Config::getInstance().isRankedBucketAwareLRUEnabled()
+        && nSlotsPerBucket_ <= 256) {
+      setCachePolicy(std::move(std::make_unique<RankedBucketAwareLRU>(nBuckets_, nSlotsPerBucket_, fpIndex_)));
+    } else if (Config::getInstance().isCompactCachePolicyEnabled()) {
+      setCachePolicy(std::move(std::make_unique<BucketAwareLRU>(fpIndex_)));
+    } else if (Config::getInstance().isClockCachePolicyEnabled()) {
+      setCachePolicy(std::move(std::make_unique<Clock>(nBuckets_, nSlotsPerBucket_, referenceBitsOffset_, true)));
     } else {
       // setting the cache policy for fp index as LRU means that we disable the acdc cache policy
       setCachePolicy(std::move(std::make_unique<LRU>(nBuckets_)));
     }
   }
 
-  bool LBAIndex::lookup(uint64_t lbaHash, uint64_t &fpHash)
+  // Lookups do not touch the cache policy, so the bucket is built without
+  // an executor and the whole path inlines with the shape as constants
+  template <class BucketShape>
+  bool LBAIndex::lookupWithShape(uint64_t lbaHash, uint64_t &fpHash)
   {
-    uint32_t bucketId = lbaHash >> nBitsPerKey_;
-    uint32_t signature = lbaHash & ((1u << nBitsPerKey_) - 1);
-    return getLBABucket(bucketId)->lookup(signature, fpHash) != ~((uint32_t)0);
+    const BucketShape shape{};
+    uint32_t bucketId = lbaHash >> shape.nBitsPerKey;
+    uint32_t signature = lbaHash & ((1u << shape.nBitsPerKey) - 1);
+    LBABucket bucket(shape.nBitsPerKey, nBitsPerValue_, shape.nSlots,
+        data_.get() + nBytesPerBucket_ * bucketId,
+        valid_.get() + nBytesPerBucketForValid_ * bucketId,
+        nullptr, bucketId);
+    return bucket.lookup(signature, fpHash) != ~((uint32_t)0);
   }
 
   void LBAIndex::promote(uint64_t lbaHash)
   {
     uint32_t bucketId = lbaHash >> nBitsPerKey_;
     uint32_t signature = lbaHash & ((1u << nBitsPerKey_) - 1);
-    getLBABucket(bucketId)->promote(signature);
+    getLBABucket(bucketId).promote(signature);
   }
 
   // If the request modify an existing LBA, return the previous fingerprint
@@ -63,7 +186,7 @@ namespace cache {
   {
     uint32_t bucketId = lbaHash >> nBitsPerKey_;
     uint32_t signature = lbaHash & ((1u << nBitsPerKey_) - 1);
-    uint64_t evictedFPHash = getLBABucket(bucketId)->update(signature, fpHash, fpIndex_);
+    uint64_t evictedFPHash = getLBABucket(bucketId).update(signature, fpHash, fpIndex_);
 
 
     return evictedFPHash;
@@ -71,21 +194,49 @@ namespace cache {
 
   FPIndex::FPIndex()
   {
-    nBitsPerKey_ = Config::getInstance().getnBitsPerFpSignature();
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    nBitsPerKey_ = geometry.nBitsPerFpSignature_;
     nBitsPerValue_ = 4;
-    nSlotsPerBucket_ = Config::getInstance().getnFPSlotsPerBucket();
-    nBuckets_ = Config::getInstance().getnFpBuckets();
+    nSlotsPerBucket_ = geometry.nSlotsPerFpBucket_;
+    nBuckets_ = geometry.nFpBuckets_;
+    twoChoicePlacement_ = Config::getInstance().isTwoChoiceFPPlacementEnabled();
+    if (twoChoicePlacement_) {
+      lockedBucketMask_ = ~(kBucketsPerPlacementGroup - 1);
+    }
+    embeddedReferenceCounts_ = Config::getInstance().isEmbeddedRFEnabled();
+    // Bit 0 is the two-choice flag, the overflow flag of the embedded
+    // counts comes next
+    embeddedCountShift_ = twoChoicePlacement_ ? 1 : 0;
+    if (embeddedReferenceCounts_) {
+      embeddedOverflowFlag_ = 1u << embeddedCountShift_;
+      ++embeddedCountShift_;
+    }
+    maxEmbeddedReferenceCount_ = (1u << (nBitsPerValue_ - embeddedCountShift_)) - 1;
+
+    nBytesPerBucket_ = Bucket::computeBytesPerBucket(nBitsPerKey_, nBitsPerValue_, nSlotsPerBucket_);
+    // Padding for the word-sized loads of SignatureScan
+    data_ = IndexCheckpoint::getInstance().allocate(IndexCheckpoint::tFpData, getDataSize());
+    initValidAndLocks(IndexCheckpoint::tFpValid);
 
-    nBytesPerBucket_ = ((nBitsPerKey_ + nBitsPerValue_) * nSlotsPerBucket_ + 7) / 8;
-    nBytesPerBucketForValid_ = (1 * nSlotsPerBucket_ + 7) / 8;
-    data_ = std::make_unique<uint8_t[]>(nBytesPerBucket_ * nBuckets_ + 1);
-    valid_ = std::make_unique<uint8_t[]>(nBytesPerBucketForValid_ * nBuckets_ + 1);
-    if (Config::getInstance().isMultiThreadingEnabled()) {
-      mutexes_ = std::make_unique<std::mutex[]>(nBuckets_);
+    if (nBitsPerKey_ == 16 && nSlotsPerBucket_ == 128) {
+      lookupImpl_ = &FPIndex::lookupWithShape<FixedBucketShape<16, 128>>;
+    } else if (nBitsPerKey_ == 16 && nSlotsPerBucket_ == 64) {
+      lookupImpl_ = &FPIndex::lookupWithShape<FixedBucketShape<16, 64>>;
+    } else if (nBitsPerKey_ == 12 && nSlotsPerBucket_ == 128) {
+      lookupImpl_ = &FPIndex::lookupWithShape<FixedBucketShape<12, 128>>;
+    } else {
+      lookupImpl_ = &FPIndex::lookupWithShape<RuntimeFPBucketShape>;
     }
 
     if (Config::getInstance().isCompactCachePolicyEnabled()) {
-      cachePolicy_ = std::move(std::make_unique<LeastReferenceCount>());
+      if (embeddedReferenceCounts_) {
+        cachePolicy_ = std::move(std::make_unique<LeastReferenceCount>(
+              nBuckets_, nSlotsPerBucket_, embeddedCountShift_));
+      } else {
+        cachePolicy_ = std::move(std::make_unique<LeastReferenceCount>(nBuckets_, nSlotsPerBucket_));
+      }
+    } else if (Config::getInstance().isClockCachePolicyEnabled()) {
+      cachePolicy_ = std::move(std::make_unique<Clock>(nBuckets_, nSlotsPerBucket_, referenceBitsOffset_, false));
     } else {
       cachePolicy_ = std::move(std::make_unique<LRU>(nBuckets_));
     }
@@ -93,35 +244,54 @@ namespace cache {
 
   uint64_t FPIndex::computeCachedataLocation(uint32_t bucketId, uint32_t slotId)
   {
-    return (bucketId * Config::getInstance().getnFPSlotsPerBucket() + slotId) *
-      1ull * Config::getInstance().getSubchunkSize() + 1ull *
-      Config::getInstance().getnFpBuckets() *
-      Config::getInstance().getnFPSlotsPerBucket() *
-      Config::getInstance().getMetadataSize();
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    uint64_t location = (bucketId * geometry.nSlotsPerFpBucket_ + slotId) * geometry.slotStride_
+      + geometry.metadataRegionSize_;
+    return geometry.colocatedMetadata_ ? location + geometry.metadataSize_ : location;
   }
 
   uint64_t FPIndex::computeMetadataLocation(uint32_t bucketId, uint32_t slotId)
   {
-    return (bucketId * Config::getInstance().getnFPSlotsPerBucket() + slotId)
-      * 1ull * Config::getInstance().getMetadataSize();
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    uint64_t slot = bucketId * geometry.nSlotsPerFpBucket_ + slotId;
+    return geometry.colocatedMetadata_ ? slot * geometry.slotStride_ : slot * geometry.metadataSize_;
   }
 
   uint64_t FPIndex::cachedataLocationToMetadataLocation(uint64_t cachedataLocation)
   {
-    return (cachedataLocation - 1ull *
-        Config::getInstance().getnFPSlotsPerBucket() *
-        Config::getInstance().getMetadataSize() *
-        Config::getInstance().getnFpBuckets()) /
-      Config::getInstance().getSubchunkSize() *
-      Config::getInstance().getMetadataSize();
+    const IndexGeometry &geometry = IndexGeometry::getInstance();
+    if (geometry.colocatedMetadata_) {
+      return cachedataLocation - geometry.metadataSize_;
+    }
+    return (cachedataLocation - geometry.metadataRegionSize_) /
+      geometry.subchunkSize_ * geometry.metadataSize_;
   }
 
-  bool FPIndex::lookup(uint64_t fpHash, uint32_t &nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation)
+  template <class BucketShape>
+  bool FPIndex::lookupWithShape(uint64_t fpHash, uint32_t &nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation)
   {
-    uint32_t bucketId = fpHash >> nBitsPerKey_,
-             signature = fpHash & ((1u << nBitsPerKey_) - 1),
+    const BucketShape shape{};
+    uint32_t bucketId = fpHash >> shape.nBitsPerKey,
+             signature = fpHash & ((1u << shape.nBitsPerKey) - 1),
              nSlotsOccupied = 0;
-    uint32_t index = getFPBucket(bucketId)->lookup(signature, nSlotsOccupied);
+    FPBucket bucket(shape.nBitsPerKey, nBitsPerValue_, shape.nSlots,
+        data_.get() + nBytesPerBucket_ * bucketId,
+        valid_.get() + nBytesPerBucketForValid_ * bucketId,
+        nullptr, bucketId);
+    uint32_t index;
+    if (!twoChoicePlacement_) {
+      index = bucket.lookup(signature, nSlotsOccupied);
+    } else {
+      index = bucket.lookup(signature, false, nSlotsOccupied);
+      if (index == ~0u) {
+        bucketId = getAlternateBucketId(bucketId, signature);
+        FPBucket alternateBucket(shape.nBitsPerKey, nBitsPerValue_, shape.nSlots,
+            data_.get() + nBytesPerBucket_ * bucketId,
+            valid_.get() + nBytesPerBucketForValid_ * bucketId,
+            nullptr, bucketId);
+        index = alternateBucket.lookup(signature, true, nSlotsOccupied);
+      }
+    }
     if (index == ~0u) return false;
 
     nSubchunks = nSlotsOccupied;
@@ -135,7 +305,16 @@ namespace cache {
   {
     uint32_t bucketId = fpHash >> nBitsPerKey_,
              signature = fpHash & ((1u << nBitsPerKey_) - 1);
-    getFPBucket(bucketId)->promote(signature);
+    if (!twoChoicePlacement_) {
+      getFPBucket(bucketId).promote(signature);
+      return;
+    }
+    uint32_t nSlotsOccupied = 0;
+    bool inAlternateBucket = getFPBucket(bucketId).lookup(signature, false, nSlotsOccupied) == ~0u;
+    if (inAlternateBucket) {
+      bucketId = getAlternateBucketId(bucketId, signature);
+    }
+    getFPBucket(bucketId).promote(signature, inAlternateBucket);
   }
 
   void FPIndex::update(uint64_t fpHash, uint32_t nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation)
@@ -144,51 +323,303 @@ namespace cache {
              signature = fpHash & ((1u << nBitsPerKey_) - 1),
              nSlotsToOccupy = nSubchunks;
 
-    uint32_t slotId = getFPBucket(bucketId)->update(signature, nSlotsToOccupy);
+    // A rewritten chunk keeps its count
+    uint32_t referenceCount = 0;
+    bool overflowed = false;
+    if (embeddedReferenceCounts_) {
+      uint32_t nSlotsOccupied = 0;
+      uint32_t slotId = locate(fpHash, bucketId, nSlotsOccupied);
+      if (slotId != ~0u) {
+        FPBucket bucket = getFPBucket(bucketId);
+        referenceCount = getEmbeddedReferenceCount(bucket, slotId);
+        overflowed = hasEmbeddedOverflow(bucket, slotId);
+      } else {
+        // Deferred updates still pending for fpHash were for an entry
+        // evicted since, they must not land on the new one
+        dropDeferredReferenceCounts(fpHash);
+      }
+      bucketId = fpHash >> nBitsPerKey_;
+    }
+
+    uint32_t slotId;
+    if (!twoChoicePlacement_) {
+      slotId = getFPBucket(bucketId).update(signature, nSlotsToOccupy);
+    } else {
+      // Drop the previous entry wherever it is, then pick a bucket with room
+      // for the chunk, the less loaded one if both have
+      uint32_t alternateBucketId = getAlternateBucketId(bucketId, signature);
+      FPBucket bucket = getFPBucket(bucketId),
+               alternateBucket = getFPBucket(alternateBucketId);
+      bucket.remove(signature, false);
+      alternateBucket.remove(signature, true);
+      bool inAlternateBucket = false;
+      if (alternateBucketId != bucketId
+          && alternateBucket.findFreeSlots(nSlotsToOccupy) != ~0u) {
+        inAlternateBucket = bucket.findFreeSlots(nSlotsToOccupy) == ~0u
+          || alternateBucket.countValid() < bucket.countValid();
+      }
+      if (inAlternateBucket) {
+        bucketId = alternateBucketId;
+      }
+      slotId = getFPBucket(bucketId).update(signature, nSlotsToOccupy, inAlternateBucket);
+    }
+    if (embeddedReferenceCounts_) {
+      FPBucket bucket = getFPBucket(bucketId);
+      setEmbeddedReferenceCount(bucket, slotId, nSlotsToOccupy, referenceCount, overflowed);
+    } else if (cachePolicy_->getType() == tLeastReferenceCountPolicy) {
+      static_cast<LeastReferenceCount *>(cachePolicy_.get())->setReferenceCount(
+          bucketId, slotId, nSlotsToOccupy, ReferenceCounter::getInstance().query(fpHash));
+    }
     cachedataLocation = computeCachedataLocation(bucketId, slotId);
     metadataLocation = computeMetadataLocation(bucketId, slotId);
   }
 
-  std::unique_ptr<std::lock_guard<std::mutex>> LBAIndex::lock(uint64_t lbaHash)
+  bool FPIndex::restore(uint64_t fpHash, uint32_t bucketId, uint32_t slotId, uint32_t nSlots)
   {
-    uint32_t bucketId = lbaHash >> nBitsPerKey_;
-    if (Config::getInstance().isMultiThreadingEnabled()) {
-      return std::move(
-          std::make_unique<std::lock_guard<std::mutex>>(
-            mutexes_[bucketId]));
+    uint32_t primaryBucketId = fpHash >> nBitsPerKey_,
+             signature = fpHash & ((1u << nBitsPerKey_) - 1),
+             nSlotsOccupied = 0, locatedBucketId;
+    bool inAlternateBucket = bucketId != primaryBucketId;
+    if (inAlternateBucket && (!twoChoicePlacement_
+          || getAlternateBucketId(primaryBucketId, signature) != bucketId)) {
+      return false;
+    }
+    if (slotId + nSlots > nSlotsPerBucket_
+        || locate(fpHash, locatedBucketId, nSlotsOccupied) != ~0u) {
+      return false;
+    }
+    FPBucket bucket = getFPBucket(bucketId);
+    for (uint32_t i = slotId; i < slotId + nSlots; ++i) {
+      if (bucket.isValid(i)) return false;
+    }
+
+    for (uint32_t i = slotId; i < slotId + nSlots; ++i) {
+      bucket.setKey(i, signature);
+      bucket.setValue(i, inAlternateBucket ? 1 : 0);
+      bucket.setValid(i);
+    }
+    if (twoChoicePlacement_) {
+      bucket.promote(signature, inAlternateBucket);
     } else {
-      return nullptr;
+      bucket.promote(signature);
     }
+    // Counts start over, the restored LBA mappings reference their fingerprints
+    if (!embeddedReferenceCounts_ && cachePolicy_->getType() == tLeastReferenceCountPolicy) {
+      static_cast<LeastReferenceCount *>(cachePolicy_.get())->setReferenceCount(
+          bucketId, slotId, nSlots, ReferenceCounter::getInstance().query(fpHash));
+    }
+    return true;
   }
 
   void LBAIndex::getFingerprints(std::set<uint64_t> &fpSet) {
     for (uint32_t i = 0; i < nBuckets_; ++i) {
-      getLBABucket(i)->getFingerprints(fpSet);
+      getLBABucket(i).getFingerprints(fpSet);
     }
   }
   void FPIndex::getFingerprints(std::set<uint64_t> &fpSet) {
     for (uint32_t i = 0; i < nBuckets_; ++i) {
-      getFPBucket(i)->getFingerprints(fpSet);
+      if (!twoChoicePlacement_) {
+        getFPBucket(i).getFingerprints(fpSet);
+        continue;
+      }
+      FPBucket bucket = getFPBucket(i);
+      for (uint32_t slotId = 0; slotId < bucket.getnSlots(); ++slotId) {
+        if (bucket.isValid(slotId)) {
+          uint32_t signature = bucket.getKey(slotId);
+          uint64_t bucketId = bucket.isInAlternateBucket(slotId) ?
+            getPrimaryBucketId(i, signature) : i;
+          fpSet.insert((bucketId << nBitsPerKey_) | signature);
+        }
+      }
     }
   }
 
-  std::unique_ptr<std::lock_guard<std::mutex>> FPIndex::lock(uint64_t fpHash)
+  void FPIndex::reference(uint64_t fpHash) {
+    if (embeddedReferenceCounts_) {
+      updateEmbeddedReferenceCount(fpHash, true, fpHash);
+      return;
+    }
+    updateReferenceCount(fpHash, ReferenceCounter::getInstance().reference(fpHash));
+  }
+  void FPIndex::dereference(uint64_t fpHash, uint64_t callerFpHash) {
+    if (embeddedReferenceCounts_) {
+      updateEmbeddedReferenceCount(fpHash, false, callerFpHash);
+      return;
+    }
+    updateReferenceCount(fpHash, ReferenceCounter::getInstance().dereference(fpHash));
+  }
+
+  // The value bits share bytes (and in the bit-packed layout words) with the
+  // neighbouring slots, so unlike the cached counts of LeastReferenceCount
+  // they are only written under the bucket lock, see metadata/index.h.
+  void FPIndex::updateEmbeddedReferenceCount(uint64_t fpHash, bool increment, uint64_t callerFpHash)
   {
-    uint32_t bucketId = fpHash >> nBitsPerKey_;
-    if (Config::getInstance().isMultiThreadingEnabled()) {
-      return std::move(
-          std::make_unique<std::lock_guard<std::mutex>>(
-            mutexes_[bucketId]));
-    } else {
-      return nullptr;
+    BucketLock lock;
+    if (!sharesLock(fpHash, callerFpHash)
+        && !tryLock(fpHash, kDereferenceLockSpins, lock)) {
+      std::lock_guard<std::mutex> guard(deferredMutex_);
+      int32_t &delta = deferredReferenceCounts_[fpHash];
+      delta += increment ? 1 : -1;
+      if (delta == 0) {
+        deferredReferenceCounts_.erase(fpHash);
+      }
+      nDeferredReferenceCounts_.store(deferredReferenceCounts_.size(), std::memory_order_relaxed);
+      return;
     }
+    applyEmbeddedReferenceCount(fpHash, increment);
   }
 
-  void FPIndex::reference(uint64_t fpHash) {
-    ReferenceCounter::getInstance().reference(fpHash);
+  void FPIndex::applyDeferredReferenceCounts()
+  {
+    applyDeferredReferenceCounts(false, 0);
+  }
+
+  void FPIndex::tryApplyDeferredReferenceCounts(uint64_t callerFpHash)
+  {
+    applyDeferredReferenceCounts(true, callerFpHash);
+  }
+
+  // The bucket lock of a deferred update is taken before deferredMutex_, the
+  // order of the threads deferring updates, and the update is only taken out
+  // of deferredReferenceCounts_ under that lock, so that dropDeferredReferenceCounts
+  // (under the same lock) sees every update not yet applied.
+  void FPIndex::applyDeferredReferenceCounts(bool holdsLock, uint64_t callerFpHash)
+  {
+    if (nDeferredReferenceCounts_.load(std::memory_order_relaxed) == 0) return;
+    std::vector<uint64_t> fpHashes;
+    {
+      std::lock_guard<std::mutex> guard(deferredMutex_);
+      fpHashes.reserve(deferredReferenceCounts_.size());
+      for (const auto &deferred : deferredReferenceCounts_) {
+        fpHashes.push_back(deferred.first);
+      }
+    }
+    for (uint64_t fpHash : fpHashes) {
+      BucketLock lock;
+      if (!holdsLock) {
+        lock = Index::lock(fpHash);
+      } else if (!sharesLock(fpHash, callerFpHash)
+          && !tryLock(fpHash, 1, lock)) {
+        // Still busy, left to a later update or to releaseLocks
+        continue;
+      }
+      int32_t delta;
+      {
+        std::lock_guard<std::mutex> guard(deferredMutex_);
+        auto it = deferredReferenceCounts_.find(fpHash);
+        if (it == deferredReferenceCounts_.end()) continue;
+        delta = it->second;
+        deferredReferenceCounts_.erase(it);
+        nDeferredReferenceCounts_.store(deferredReferenceCounts_.size(), std::memory_order_relaxed);
+      }
+      for (; delta > 0; --delta) {
+        applyEmbeddedReferenceCount(fpHash, true);
+      }
+      for (; delta < 0; ++delta) {
+        applyEmbeddedReferenceCount(fpHash, false);
+      }
+    }
   }
-  void FPIndex::dereference(uint64_t fpHash) {
-    ReferenceCounter::getInstance().dereference(fpHash);
+
+  void FPIndex::dropDeferredReferenceCounts(uint64_t fpHash)
+  {
+    if (nDeferredReferenceCounts_.load(std::memory_order_relaxed) == 0) return;
+    std::lock_guard<std::mutex> guard(deferredMutex_);
+    deferredReferenceCounts_.erase(fpHash);
+    nDeferredReferenceCounts_.store(deferredReferenceCounts_.size(), std::memory_order_relaxed);
   }
 
+  void FPIndex::applyEmbeddedReferenceCount(uint64_t fpHash, bool increment)
+  {
+    uint32_t bucketId, nSlotsOccupied = 0;
+    uint32_t slotId = locate(fpHash, bucketId, nSlotsOccupied);
+    if (slotId == ~0u) return;
+
+    FPBucket bucket = getFPBucket(bucketId);
+    uint32_t referenceCount = getEmbeddedReferenceCount(bucket, slotId);
+    bool overflowed = hasEmbeddedOverflow(bucket, slotId);
+    // A saturated count continues in the ReferenceCounter
+    if (increment) {
+      if (referenceCount == maxEmbeddedReferenceCount_) {
+        ReferenceCounter::getInstance().reference(fpHash);
+        if (!overflowed) {
+          setEmbeddedReferenceCount(bucket, slotId, nSlotsOccupied, referenceCount, true);
+        }
+      } else {
+        setEmbeddedReferenceCount(bucket, slotId, nSlotsOccupied, referenceCount + 1, false);
+      }
+    } else if (overflowed) {
+      // The flag stays until the ReferenceCounter holds no more references
+      // of the fingerprint (or so it estimates)
+      if (ReferenceCounter::getInstance().dereference(fpHash) == 0) {
+        setEmbeddedReferenceCount(bucket, slotId, nSlotsOccupied, referenceCount, false);
+      }
+    } else if (referenceCount > 0) {
+      setEmbeddedReferenceCount(bucket, slotId, nSlotsOccupied, referenceCount - 1, false);
+    }
+  }
+
+  void FPIndex::setEmbeddedReferenceCount(FPBucket &bucket, uint32_t slotId,
+      uint32_t nSlotsOccupied, uint32_t referenceCount, bool overflowed)
+  {
+    // The flags below the overflow flag (two-choice placement) are kept
+    uint32_t flagMask = embeddedOverflowFlag_ - 1;
+    uint32_t value = (referenceCount << embeddedCountShift_) | (overflowed ? embeddedOverflowFlag_ : 0);
+    for (uint32_t i = slotId; i < slotId + nSlotsOccupied; ++i) {
+      bucket.setValue(i, value | (bucket.getValue(i) & flagMask));
+    }
+  }
+
+  // Keep the count cached by LeastReferenceCount current. The LBA index
+  // references fingerprints without holding the FP bucket lock, the cached
+  // counts are atomics for that (see least_reference_count.h).
+  void FPIndex::updateReferenceCount(uint64_t fpHash, uint32_t referenceCount)
+  {
+    if (cachePolicy_->getType() != tLeastReferenceCountPolicy) return;
+    uint32_t bucketId, nSlotsOccupied = 0;
+    uint32_t slotId = locate(fpHash, bucketId, nSlotsOccupied);
+    if (slotId != ~0u) {
+      static_cast<LeastReferenceCount *>(cachePolicy_.get())->setReferenceCount(
+          bucketId, slotId, nSlotsOccupied, referenceCount);
+    }
+  }
+
+  // The alternate bucket is another bucket of the same aligned group, at an
+  // offset picked by the signature (itself a hash of the fingerprint)
+  uint32_t FPIndex::getAlternateBucketId(uint32_t bucketId, uint32_t signature)
+  {
+    uint32_t groupBase = bucketId & ~(kBucketsPerPlacementGroup - 1),
+             groupSize = std::min(kBucketsPerPlacementGroup, nBuckets_ - groupBase);
+    if (groupSize == 1) {
+      return bucketId;
+    }
+    uint32_t offset = 1 + ((signature * 0x9E3779B1u) >> 16u) % (groupSize - 1);
+    return groupBase + (bucketId - groupBase + offset) % groupSize;
+  }
+
+  uint32_t FPIndex::getPrimaryBucketId(uint32_t alternateBucketId, uint32_t signature)
+  {
+    uint32_t groupBase = alternateBucketId & ~(kBucketsPerPlacementGroup - 1),
+             groupSize = std::min(kBucketsPerPlacementGroup, nBuckets_ - groupBase);
+    if (groupSize == 1) {
+      return alternateBucketId;
+    }
+    uint32_t offset = 1 + ((signature * 0x9E3779B1u) >> 16u) % (groupSize - 1);
+    return groupBase + (alternateBucketId - groupBase + groupSize - offset) % groupSize;
+  }
+
+  uint32_t FPIndex::locate(uint64_t fpHash, uint32_t &bucketId, uint32_t &nSlotsOccupied)
+  {
+    uint32_t signature = fpHash & ((1u << nBitsPerKey_) - 1);
+    bucketId = fpHash >> nBitsPerKey_;
+    if (!twoChoicePlacement_) {
+      return getFPBucket(bucketId).lookup(signature, nSlotsOccupied);
+    }
+    uint32_t slotId = getFPBucket(bucketId).lookup(signature, false, nSlotsOccupied);
+    if (slotId == ~0u) {
+      bucketId = getAlternateBucketId(bucketId, signature);
+      slotId = getFPBucket(bucketId).lookup(signature, true, nSlotsOccupied);
+    }
+    return slotId;
+  }
 }
@@ -3,11 +3,45 @@
  *   This file contains declarations of our designed LBAIndex and FPIndex.
  *
  *   1. Each Index instance manages the memory of bucket slots mappings, bucket valid bits,
- *      and mutexes, and corresponding cache policy functions.
+ *      and bucket locks, and corresponding cache policy functions.
  *   2. Bucket access is in the form of functions with pointers to slots, valid bits, and mutex.
  *      Index implements a getBucketManipulator function that wraps and returns a bucket manipulator.
  *   3. Index exposes lookup, promote, and update for caller to query/update the index structure,
- *      it also expose mutex lock and unlock for concurrency control.
+ *      it also exposes the per-bucket sequence locks (common/bucket_lock.h) for concurrency
+ *      control: writers lock a bucket, lookups may run lock-free and validate afterwards.
+ *   4. Lookups are compiled for a bucket shape (signature width, slots per bucket).
+ *      The common shapes get their own instantiation with the shape as constants,
+ *      the index picks one at construction and falls back to the runtime shape.
+ *   5. FPIndex optionally places fingerprints with two choices: besides its own bucket
+ *      (fpHash >> nBitsPerKey) a fingerprint has an alternate bucket derived from its
+ *      signature within the same aligned group of kBucketsPerPlacementGroup buckets,
+ *      and goes to the alternate one if only that one has room for the chunk, or
+ *      both have and it holds fewer valid slots. Value bit 0 of the slots
+ *      marks entries in their alternate bucket. All buckets of a group share the lock
+ *      of the first one, so that a chunk holding the lock of its fingerprint covers
+ *      both candidates. Cache device locations still follow (bucket, slot).
+ *   6. With embeddedReferenceCounter, FPIndex keeps the reference count of each
+ *      resident fingerprint in the value bits of its slots (the bits above the
+ *      two-choice flag and an overflow flag), saturating at 7 (3 with two-choice
+ *      placement). Only the references beyond that go to the ReferenceCounter,
+ *      and the overflow flag of the entry records that some did: the
+ *      ReferenceCounter is approximate, so it cannot tell by itself whether a
+ *      fingerprint has references there. A count lives and dies with its
+ *      entry: references to fingerprints that are not resident are dropped.
+ *      A reference comes from the chunk of the fingerprint and holds its
+ *      bucket lock. A dereference is of another fingerprint, it takes that
+ *      lock unless the caller holds it already (the same lock stripe); as the
+ *      caller holds a bucket lock, it only tries for a while, then the update
+ *      is deferred rather than deadlock. Deferred updates are kept per
+ *      fingerprint in the FPIndex, applied by the next update whose lock is
+ *      free at the end of MetadataModule::update, and by any thread once it
+ *      released its locks. They are dropped when the fingerprint is inserted
+ *      anew, as they were for the entry evicted before.
+ *   7. With an index checkpoint, data_ and valid_ are mapped from the checkpoint
+ *      file instead of allocated, see metadata/index_checkpoint.h.
+ *   8. With the CLOCK policy, the valid bitmap of a bucket is followed by the
+ *      reference bits of its slots (after the embedded lock bit, if any), so
+ *      that a promotion or allocation touches the cache line of the valid bits.
  */
 #ifndef __INDEX_H__
 #define __INDEX_H__
@@ -18,26 +52,95 @@
 #include <mutex>
 #include <map>
 #include <list>
+#include <atomic>
 #include "bucket.h"
 #include "cache_policies/cache_policy.h"
+#include "common/bucket_lock.h"
 #include "common/config.h"
+#include "common/flat_hash_map.h"
+#include "common/index_geometry.h"
 #include "metadata/cachededup/common.h"
+#include "metadata/index_checkpoint.h"
 namespace cache {
+  /**
+   * @brief Bucket shape known at compile time
+   */
+  template <uint32_t N_BITS_PER_KEY, uint32_t N_SLOTS>
+  struct FixedBucketShape {
+    static constexpr uint32_t nBitsPerKey = N_BITS_PER_KEY;
+    static constexpr uint32_t nSlots = N_SLOTS;
+  };
+
+  /**
+   * @brief Bucket shape read from IndexGeometry, for the other configurations
+   */
+  struct RuntimeLBABucketShape {
+    uint32_t nBitsPerKey = IndexGeometry::getInstance().nBitsPerLbaSignature_;
+    uint32_t nSlots = IndexGeometry::getInstance().nSlotsPerLbaBucket_;
+  };
+  struct RuntimeFPBucketShape {
+    uint32_t nBitsPerKey = IndexGeometry::getInstance().nBitsPerFpSignature_;
+    uint32_t nSlots = IndexGeometry::getInstance().nSlotsPerFpBucket_;
+  };
+
   class Index {
     public:
       Index();
       ~Index() = default;
 
       void setCachePolicy(std::unique_ptr<CachePolicy> cachePolicy);
+
+      // Bucket locks of the bucket addressed by an lba/fp hash.
+      // Without multithreading lock() and tryUpgrade() return an empty lock
+      // and readValidate() always succeeds.
+      BucketLock lock(uint64_t hash);
+      uint32_t readBegin(uint64_t hash);
+      bool readValidate(uint64_t hash, uint32_t version);
+      BucketLock tryUpgrade(uint64_t hash, uint32_t version);
+      // Take the lock unless it stays held for maxSpins attempts. True
+      // with the lock in lock, or without multithreading.
+      bool tryLock(uint64_t hash, uint32_t maxSpins, BucketLock &lock);
+      // False for embedded bit locks, whose lookups must take the lock
+      bool hasVersionedLocks();
+      // Whether the buckets of two hashes are guarded by the same lock,
+      // always true without multithreading
+      bool sharesLock(uint64_t hash, uint64_t otherHash);
+
+      // Bytes of slots and valid bitmaps (with the CLOCK reference bits), of
+      // the cache policy besides them, and of the bucket locks
+      uint64_t getMemoryUsage();
+      uint64_t getPolicyMemoryUsage();
+      uint64_t getLockMemoryUsage();
     protected:
+      friend class IndexCheckpoint;
+      // valid_ comes from validSection of the checkpoint, if one was loaded
+      void initValidAndLocks(IndexCheckpoint::SectionEnum validSection);
+      // Bytes of data_ and valid_, with the padding
+      inline uint64_t getDataSize()
+      {
+        return 1ull * nBytesPerBucket_ * nBuckets_ + sizeof(uint32_t);
+      }
+      inline uint64_t getValidSize()
+      {
+        return 1ull * nBytesPerBucketForValid_ * nBuckets_ + 1;
+      }
+      // Bucket whose lock guards the bucket of hash
+      inline uint32_t getLockedBucketId(uint64_t hash)
+      {
+        return (hash >> nBitsPerKey_) & lockedBucketMask_;
+      }
+
       uint32_t nBitsPerSlot_{}, nSlotsPerBucket_{},
                nBitsPerKey_{}, nBitsPerValue_{},
                nBytesPerBucket_{}, nBuckets_{},
                nBytesPerBucketForValid_{};
-      std::unique_ptr< uint8_t[] > data_;
-      std::unique_ptr< uint8_t[] > valid_;
+      // Offset of the CLOCK reference bits within the valid bitmap of a bucket
+      uint32_t referenceBitsOffset_{};
+      IndexArray data_;
+      IndexArray valid_;
       std::unique_ptr< CachePolicy > cachePolicy_;
-      std::unique_ptr< std::mutex[] > mutexes_;
+      std::unique_ptr< BucketLockTable > locks_;
+      uint32_t lockedBucketMask_ = ~0u;
   };
 
   class FPIndex;
@@ -45,22 +148,37 @@ namespace cache {
     public:
       explicit LBAIndex(std::shared_ptr<FPIndex> fpIndex);
       ~LBAIndex();
-      bool lookup(uint64_t lbaHash, uint64_t &fpHash);
+      inline bool lookup(uint64_t lbaHash, uint64_t &fpHash)
+      {
+        return (this->*lookupImpl_)(lbaHash, fpHash);
+      }
       void promote(uint64_t lbaHash);
       uint64_t update(uint64_t lbaHash, uint64_t fpHash);
-      std::unique_ptr<std::lock_guard<std::mutex>> lock(uint64_t lbaHash);
+      using Index::lock;
+      using Index::readBegin;
+      using Index::readValidate;
+      using Index::tryUpgrade;
+      using Index::hasVersionedLocks;
+      using Index::getMemoryUsage;
+      using Index::getPolicyMemoryUsage;
+      using Index::getLockMemoryUsage;
 
-      std::unique_ptr<LBABucket> getLBABucket(uint32_t bucketId)
+      LBABucket getLBABucket(uint32_t bucketId)
       {
-        return std::move(std::make_unique<LBABucket>(
+        return LBABucket(
             nBitsPerKey_, nBitsPerValue_, nSlotsPerBucket_,
             data_.get() + nBytesPerBucket_ * bucketId,
             valid_.get() + nBytesPerBucketForValid_ * bucketId,
-            cachePolicy_.get(), bucketId));
+            cachePolicy_.get(), bucketId);
       }
 
       void getFingerprints(std::set<uint64_t> &fpSet);
     private:
+      friend class IndexCheckpoint;
+      template <class BucketShape>
+      bool lookupWithShape(uint64_t lbaHash, uint64_t &fpHash);
+
+      bool (LBAIndex::*lookupImpl_)(uint64_t lbaHash, uint64_t &fpHash);
       std::shared_ptr<FPIndex> fpIndex_;
   };
 
@@ -69,26 +187,94 @@ namespace cache {
       // n_bits_per_key = 12, n_bits_per_value = 0
       FPIndex();
       ~FPIndex();
-      bool lookup(uint64_t fpHash, uint32_t &nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation);
+      inline bool lookup(uint64_t fpHash, uint32_t &nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation)
+      {
+        return (this->*lookupImpl_)(fpHash, nSubchunks, cachedataLocation, metadataLocation);
+      }
       void promote(uint64_t fpHash);
       void update(uint64_t fpHash, uint32_t nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation);
-      std::unique_ptr<std::lock_guard<std::mutex>> lock(uint64_t fpHash);
+      /**
+       * @brief Put a fingerprint back at the slots it occupied (WarmRestart)
+       *
+       * @return false if bucketId is none of the buckets of fpHash, a slot is
+       *         taken or fpHash is indexed already
+       */
+      bool restore(uint64_t fpHash, uint32_t bucketId, uint32_t slotId, uint32_t nSlots);
+      using Index::lock;
+      using Index::readBegin;
+      using Index::readValidate;
+      using Index::tryUpgrade;
+      using Index::hasVersionedLocks;
+      using Index::getMemoryUsage;
+      using Index::getPolicyMemoryUsage;
+      using Index::getLockMemoryUsage;
 
       void getFingerprints(std::set<uint64_t> &fpSet);
 
-      std::unique_ptr<FPBucket> getFPBucket(uint32_t bucketId) {
-        return std::move(std::make_unique<FPBucket>(
+      FPBucket getFPBucket(uint32_t bucketId) {
+        return FPBucket(
             nBitsPerKey_, nBitsPerValue_, nSlotsPerBucket_,
             data_.get() + nBytesPerBucket_ * bucketId,
             valid_.get() + nBytesPerBucketForValid_ * bucketId,
-            cachePolicy_.get(), bucketId));
+            cachePolicy_.get(), bucketId);
       }
       static uint64_t computeCachedataLocation(uint32_t bucketId, uint32_t slotId);
       static uint64_t computeMetadataLocation(uint32_t bucketId, uint32_t slotId);
       static uint64_t cachedataLocationToMetadataLocation(uint64_t cachedataLocation);
 
+      // The caller of reference holds the bucket lock of fpHash, the one of
+      // dereference holds the lock of callerFpHash (its chunk's fingerprint)
       void reference(uint64_t fpHash);
-      void dereference(uint64_t fpHash);
+      void dereference(uint64_t fpHash, uint64_t callerFpHash);
+      // Apply the embedded count updates deferred by any thread: with no
+      // bucket lock held, or by the holder of the lock of callerFpHash, which
+      // leaves the updates whose lock is still busy
+      void applyDeferredReferenceCounts();
+      void tryApplyDeferredReferenceCounts(uint64_t callerFpHash);
+      static constexpr uint32_t kBucketsPerPlacementGroup = 8;
+      // Attempts of an embedded count update at a busy bucket lock before
+      // it is deferred
+      static constexpr uint32_t kDereferenceLockSpins = 256;
+    private:
+      friend class IndexCheckpoint;
+      void updateReferenceCount(uint64_t fpHash, uint32_t referenceCount);
+      // Embedded reference counts
+      void updateEmbeddedReferenceCount(uint64_t fpHash, bool increment, uint64_t callerFpHash);
+      // With the bucket lock of fpHash held
+      void applyEmbeddedReferenceCount(uint64_t fpHash, bool increment);
+      void applyDeferredReferenceCounts(bool holdsLock, uint64_t callerFpHash);
+      // With the bucket lock of fpHash held, when it is inserted anew
+      void dropDeferredReferenceCounts(uint64_t fpHash);
+      inline uint32_t getEmbeddedReferenceCount(FPBucket &bucket, uint32_t slotId)
+      {
+        return bucket.getValue(slotId) >> embeddedCountShift_;
+      }
+      // Whether references beyond the saturated count went to the ReferenceCounter
+      inline bool hasEmbeddedOverflow(FPBucket &bucket, uint32_t slotId)
+      {
+        return (bucket.getValue(slotId) & embeddedOverflowFlag_) != 0;
+      }
+      void setEmbeddedReferenceCount(FPBucket &bucket, uint32_t slotId,
+          uint32_t nSlotsOccupied, uint32_t referenceCount, bool overflowed);
+      // Two-choice placement
+      uint32_t getAlternateBucketId(uint32_t bucketId, uint32_t signature);
+      uint32_t getPrimaryBucketId(uint32_t alternateBucketId, uint32_t signature);
+      // The bucket holding fpHash (set in bucketId) and the slot within it
+      uint32_t locate(uint64_t fpHash, uint32_t &bucketId, uint32_t &nSlotsOccupied);
+
+      template <class BucketShape>
+      bool lookupWithShape(uint64_t fpHash, uint32_t &nSubchunks, uint64_t &cachedataLocation, uint64_t &metadataLocation);
+
+      bool (FPIndex::*lookupImpl_)(uint64_t fpHash, uint32_t &nSubchunks,
+          uint64_t &cachedataLocation, uint64_t &metadataLocation);
+      bool twoChoicePlacement_ = false;
+      bool embeddedReferenceCounts_ = false;
+      uint32_t embeddedCountShift_ = 0, maxEmbeddedReferenceCount_ = 0,
+               embeddedOverflowFlag_ = 0;
+      // Net increments of the embedded counts whose bucket lock was busy
+      std::mutex deferredMutex_;
+      FlatHashMap<uint64_t, int32_t> deferredReferenceCounts_;
+      std::atomic<uint64_t> nDeferredReferenceCounts_{0};
   };
 }
 #endif
@@ -0,0 +1,278 @@
+#include "index_checkpoint.h"
+#include "index.h"
+#include "reference_counter.h"
+#include "common/config.h"
+#include "common/index_geometry.h"
+#include "io/io_module.h"
+#include "utils/xxhash.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cache {
+
+constexpr uint32_t IndexCheckpoint::kNumSections;
+constexpr uint64_t IndexCheckpoint::kMagic;
+constexpr uint32_t IndexCheckpoint::kVersion;
+constexpr uint64_t IndexCheckpoint::kSectionAlignment;
+
+void IndexArrayDeleter::operator()(uint8_t *array) const
+{
+  if (mappedLength_ != 0) {
+    munmap(array, mappedLength_);
+  } else {
+    delete[] array;
+  }
+}
+
+IndexCheckpoint& IndexCheckpoint::getInstance()
+{
+  static IndexCheckpoint instance;
+  return instance;
+}
+
+IndexCheckpoint::IndexCheckpoint()
+{
+  path_ = Config::getInstance().getIndexCheckpoint();
+  enabled_ = !path_.empty();
+  if (enabled_ && Config::getInstance().getCacheMode() == tWriteBack) {
+    std::cout << "Index checkpoint needs the write-through mode, disabled" << std::endl;
+    enabled_ = false;
+  }
+}
+
+void IndexCheckpoint::recover()
+{
+  // See 6., the cache device changes from here on
+  uint64_t checkpointId = readCheckpointBlock();
+  if (checkpointId != 0) {
+    writeCheckpointBlock(0);
+  }
+  if (enabled_) {
+    loaded_ = load(checkpointId);
+  }
+}
+
+uint64_t IndexCheckpoint::readCheckpointBlock()
+{
+  alignas(512) uint8_t block[512];
+  CheckpointBlock checkpointBlock{};
+  IOModule::getInstance().read(CACHE_DEVICE, IndexGeometry::getInstance().checkpointBlockOffset_, block, 512);
+  memcpy(&checkpointBlock, block, sizeof(checkpointBlock));
+  return checkpointBlock.magic_ == kMagic ? checkpointBlock.checkpointId_ : 0;
+}
+
+void IndexCheckpoint::writeCheckpointBlock(uint64_t checkpointId)
+{
+  alignas(512) uint8_t block[512] = {0};
+  CheckpointBlock checkpointBlock{kMagic, checkpointId};
+  memcpy(block, &checkpointBlock, sizeof(checkpointBlock));
+  IOModule::getInstance().write(CACHE_DEVICE, IndexGeometry::getInstance().checkpointBlockOffset_, block, 512);
+}
+
+IndexCheckpoint::Geometry IndexCheckpoint::getGeometry()
+{
+  Config &config = Config::getInstance();
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  Geometry g{};
+  g.chunkSize_ = geometry.chunkSize_;
+  g.subchunkSize_ = geometry.subchunkSize_;
+  g.metadataSize_ = geometry.metadataSize_;
+  g.colocatedMetadata_ = geometry.colocatedMetadata_;
+  g.compactMetadata_ = geometry.compactMetadata_;
+  g.nBitsPerLbaSignature_ = geometry.nBitsPerLbaSignature_;
+  g.nLbaBuckets_ = geometry.nLbaBuckets_;
+  g.nSlotsPerLbaBucket_ = geometry.nSlotsPerLbaBucket_;
+  g.nBitsPerFpSignature_ = geometry.nBitsPerFpSignature_;
+  g.nFpBuckets_ = geometry.nFpBuckets_;
+  g.nSlotsPerFpBucket_ = geometry.nSlotsPerFpBucket_;
+  g.compactCachePolicy_ = config.isCompactCachePolicyEnabled();
+  g.clockCachePolicy_ = config.isClockCachePolicyEnabled();
+  g.rankedBucketAwareLRU_ = config.isRankedBucketAwareLRUEnabled();
+  g.twoChoiceFPPlacement_ = config.isTwoChoiceFPPlacementEnabled();
+  g.embeddedRF_ = config.isEmbeddedRFEnabled();
+  g.sketchRF_ = config.isSketchRFEnabled();
+  g.embeddedLocks_ = config.isMultiThreadingEnabled() && config.getBucketLock() == tEmbeddedLock;
+  return g;
+}
+
+bool IndexCheckpoint::isMapped(SectionEnum section)
+{
+  return section == tLbaData || section == tLbaValid
+    || section == tFpData || section == tFpValid;
+}
+
+bool IndexCheckpoint::load(uint64_t checkpointId)
+{
+  fd_ = open(path_.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    std::cout << "Index checkpoint: none at " << path_ << ", the indexes start empty" << std::endl;
+    return false;
+  }
+
+  bool valid = false;
+  struct stat st{};
+  Geometry expected = getGeometry();
+  if (pread(fd_, &header_, sizeof(header_), 0) != (ssize_t)sizeof(header_)
+      || fstat(fd_, &st) != 0
+      || header_.magic_ != kMagic || header_.version_ != kVersion
+      || header_.checksum_ != XXH64(&header_, offsetof(Header, checksum_), 0)) {
+    std::cout << "Index checkpoint: " << path_ << " is not a valid checkpoint, ignored" << std::endl;
+  } else if (memcmp(&header_.geometry_, &expected, sizeof(Geometry)) != 0) {
+    std::cout << "Index checkpoint: " << path_ << " was saved with another geometry, ignored" << std::endl;
+  } else if (checkpointId == 0 || header_.checkpointId_ != checkpointId) {
+    std::cout << "Index checkpoint: the cache device was used since " << path_ << " was saved, ignored" << std::endl;
+  } else {
+    valid = true;
+    for (uint32_t i = 0; i < kNumSections && valid; ++i) {
+      const Section &section = header_.sections_[i];
+      valid = section.offset_ % kSectionAlignment == 0
+        && section.offset_ + section.size_ <= (uint64_t)st.st_size;
+      if (!valid || isMapped((SectionEnum)i)) continue;
+      states_[i].resize(section.size_);
+      valid = pread(fd_, states_[i].data(), section.size_, section.offset_) == (ssize_t)section.size_
+        && XXH64(states_[i].data(), section.size_, 0) == section.checksum_;
+    }
+    if (!valid) {
+      std::cout << "Index checkpoint: " << path_ << " is truncated or corrupted, ignored" << std::endl;
+    }
+  }
+
+  if (!valid) {
+    for (auto &state : states_) {
+      std::vector<uint8_t>().swap(state);
+    }
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  // See 2., the mappings keep the data of the file
+  unlink(path_.c_str());
+  std::cout << "Index checkpoint: loaded from " << path_ << std::endl;
+  return true;
+}
+
+IndexArray IndexCheckpoint::allocate(SectionEnum section, uint64_t size)
+{
+  if (fd_ >= 0) {
+    const Section &s = header_.sections_[section];
+    if (s.size_ != size) {
+      std::cout << "Index checkpoint: section " << section << " does not fit the index!" << std::endl;
+      exit(-1);
+    }
+    void *array = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_, s.offset_);
+    if (array == MAP_FAILED) {
+      std::cout << "Index checkpoint: cannot map section " << section << "!" << std::endl;
+      exit(-1);
+    }
+    return IndexArray(reinterpret_cast<uint8_t *>(array), IndexArrayDeleter{size});
+  }
+  return IndexArray(new uint8_t[size]());
+}
+
+void IndexCheckpoint::restoreState(FPIndex &fpIndex, LBAIndex &lbaIndex)
+{
+  if (fd_ < 0) {
+    return;
+  }
+  Index &lba = lbaIndex, &fp = fpIndex;
+  if (!lba.cachePolicy_->restoreState(states_[tLbaPolicy].data(), states_[tLbaPolicy].size())
+      || !fp.cachePolicy_->restoreState(states_[tFpPolicy].data(), states_[tFpPolicy].size())
+      || !ReferenceCounter::getInstance().restoreState(
+        states_[tReferenceCounter].data(), states_[tReferenceCounter].size())) {
+    std::cout << "Index checkpoint: the policy states do not fit the indexes!" << std::endl;
+    exit(-1);
+  }
+  for (auto &state : states_) {
+    std::vector<uint8_t>().swap(state);
+  }
+  // The mappings stay
+  close(fd_);
+  fd_ = -1;
+}
+
+void IndexCheckpoint::save(FPIndex &fpIndex, LBAIndex &lbaIndex)
+{
+  auto start = std::chrono::steady_clock::now();
+  Index &lba = lbaIndex, &fp = fpIndex;
+  const uint8_t *arrays[kNumSections] = {};
+  uint64_t sizes[kNumSections] = {};
+  arrays[tLbaData] = lba.data_.get(); sizes[tLbaData] = lba.getDataSize();
+  arrays[tLbaValid] = lba.valid_.get(); sizes[tLbaValid] = lba.getValidSize();
+  arrays[tFpData] = fp.data_.get(); sizes[tFpData] = fp.getDataSize();
+  arrays[tFpValid] = fp.valid_.get(); sizes[tFpValid] = fp.getValidSize();
+  lba.cachePolicy_->saveState(states_[tLbaPolicy]);
+  fp.cachePolicy_->saveState(states_[tFpPolicy]);
+  ReferenceCounter::getInstance().saveState(states_[tReferenceCounter]);
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic_ = kMagic;
+  header.version_ = kVersion;
+  header.geometry_ = getGeometry();
+  std::random_device randomDevice;
+  do {
+    header.checkpointId_ = ((uint64_t)randomDevice() << 32u | randomDevice())
+      ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+  } while (header.checkpointId_ == 0);
+  uint64_t offset = (sizeof(Header) + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+  for (uint32_t i = 0; i < kNumSections; ++i) {
+    Section &section = header.sections_[i];
+    if (!isMapped((SectionEnum)i)) {
+      arrays[i] = states_[i].data();
+      sizes[i] = states_[i].size();
+      section.checksum_ = XXH64(arrays[i], sizes[i], 0);
+    }
+    section.offset_ = offset;
+    section.size_ = sizes[i];
+    offset = (offset + sizes[i] + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+  }
+  header.checksum_ = XXH64(&header, offsetof(Header, checksum_), 0);
+
+  std::string tmpPath = path_ + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0 && ftruncate(fd, offset) == 0;
+  for (uint32_t i = 0; i <= kNumSections && ok; ++i) {
+    // The header goes last
+    const uint8_t *bytes = i < kNumSections ? arrays[i] : reinterpret_cast<uint8_t *>(&header);
+    uint64_t len = i < kNumSections ? sizes[i] : sizeof(header);
+    uint64_t pos = i < kNumSections ? header.sections_[i].offset_ : 0;
+    while (len > 0) {
+      ssize_t n = pwrite(fd, bytes, std::min(len, (uint64_t)1 << 30), pos);
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      bytes += n; len -= n; pos += n;
+    }
+  }
+  ok = ok && fsync(fd) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  ok = ok && rename(tmpPath.c_str(), path_.c_str()) == 0;
+  for (auto &state : states_) {
+    std::vector<uint8_t>().swap(state);
+  }
+  if (!ok) {
+    unlink(tmpPath.c_str());
+    std::cout << "Index checkpoint: cannot write " << path_ << std::endl;
+    return;
+  }
+  // Last, so that a crash before leaves a checkpoint that does not match
+  writeCheckpointBlock(header.checkpointId_);
+
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "Index checkpoint: saved " << offset << " bytes to " << path_ << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << " ms" << std::endl;
+}
+}
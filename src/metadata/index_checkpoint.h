@@ -0,0 +1,130 @@
+/* File: metadata/index_checkpoint.h
+ * Description:
+ *   This file contains IndexCheckpoint, a file holding the LBA and FP indexes
+ *   as of the last clean shutdown (Config::getIndexCheckpoint()), so that a
+ *   restarted cache has its indexes right away, whatever their size.
+ *
+ *   1. The file starts with a Header: the version, the Config geometry the
+ *      indexes were built with, the offset and size of each section and an
+ *      XXH64 checksum of the header. A file with another version, a wrong
+ *      checksum or another geometry is ignored and the indexes start empty.
+ *   2. The slots (data_) and valid bits (valid_) of both indexes are sections
+ *      aligned to kSectionAlignment, which the index constructors map
+ *      privately (copy-on-write) in place of allocating them (allocate()), so
+ *      that they page in lazily as buckets are accessed. The file is unlinked
+ *      once opened: a crash never leaves a checkpoint lagging behind the cache.
+ *   3. The cache policy states and the ReferenceCounter are copied at startup
+ *      (restoreState()) and have a checksum of their own in the header. The
+ *      mapped sections are not checked, that would read them in full; save()
+ *      writes a temporary file, syncs and renames it instead.
+ *   4. save() runs at shutdown, when no request is in flight, so the embedded
+ *      bucket locks in the valid bits are all released.
+ *   5. Write-through only, like WarmRestart: the dirty list is not saved.
+ *      With warm restart too, a loaded checkpoint replaces the rebuild.
+ *   6. The geometry does not tell whether the cache device was used since
+ *      the save, e.g. by a run without the checkpoint. save() therefore puts
+ *      a random checkpoint id in the header and in the checkpoint block of
+ *      the cache device (IndexGeometry). recover() clears that block once
+ *      read, whether the checkpoint is enabled or not, as a run without it
+ *      (or in write-back) changes the device all the same: a checkpoint
+ *      whose id is not the one of the block is ignored. Index-only users
+ *      never call recover() and allocate() then gives them zeroed arrays.
+ */
+#ifndef __INDEX_CHECKPOINT_H__
+#define __INDEX_CHECKPOINT_H__
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cache {
+  // Index arrays are either allocated with new[] or mapped from an IndexCheckpoint
+  struct IndexArrayDeleter {
+    uint64_t mappedLength_ = 0;
+    void operator()(uint8_t *array) const;
+  };
+  using IndexArray = std::unique_ptr<uint8_t[], IndexArrayDeleter>;
+
+  class FPIndex;
+  class LBAIndex;
+
+  class IndexCheckpoint {
+    public:
+      static IndexCheckpoint& getInstance();
+      inline bool isEnabled() const { return enabled_; }
+      // Whether a valid checkpoint was found at startup
+      inline bool isLoaded() const { return loaded_; }
+      // At startup, once the cache device is open and before the indexes
+      // are constructed, see 6.
+      void recover();
+
+      enum SectionEnum {
+        tLbaData, tLbaValid, tFpData, tFpValid,
+        tLbaPolicy, tFpPolicy, tReferenceCounter
+      };
+      static constexpr uint32_t kNumSections = 7;
+      static constexpr uint64_t kMagic = 0x54504b4358444e49ull;
+      static constexpr uint32_t kVersion = 4;
+      // A multiple of the page sizes, so that sections can be mapped
+      static constexpr uint64_t kSectionAlignment = 64 * 1024;
+
+      /**
+       * @brief The array of an index section: mapped from the checkpoint if
+       *        one was loaded, zeroed memory otherwise
+       */
+      IndexArray allocate(SectionEnum section, uint64_t size);
+      /**
+       * @brief Copy the cache policy states and the ReferenceCounter, once
+       *        both indexes are constructed
+       */
+      void restoreState(FPIndex &fpIndex, LBAIndex &lbaIndex);
+      void save(FPIndex &fpIndex, LBAIndex &lbaIndex);
+
+      // The configuration the indexes are built with
+      struct Geometry {
+        uint32_t chunkSize_, subchunkSize_, metadataSize_, colocatedMetadata_, compactMetadata_;
+        uint32_t nBitsPerLbaSignature_, nLbaBuckets_, nSlotsPerLbaBucket_;
+        uint32_t nBitsPerFpSignature_, nFpBuckets_, nSlotsPerFpBucket_;
+        uint32_t compactCachePolicy_, clockCachePolicy_, rankedBucketAwareLRU_;
+        uint32_t twoChoiceFPPlacement_, embeddedRF_, sketchRF_, embeddedLocks_;
+      };
+      struct Section {
+        uint64_t offset_, size_;
+        // XXH64 of the copied sections, 0 for the mapped ones
+        uint64_t checksum_;
+      };
+      struct Header {
+        uint64_t magic_;
+        uint32_t version_;
+        Geometry geometry_;
+        Section sections_[kNumSections];
+        // The one of the checkpoint block, see 6.
+        uint64_t checkpointId_;
+        // XXH64 of the header up to here
+        uint64_t checksum_;
+      };
+      // The checkpoint block on the cache device, zeroed at startup
+      struct CheckpointBlock {
+        uint64_t magic_;
+        uint64_t checkpointId_;
+      };
+
+    private:
+      IndexCheckpoint();
+      static Geometry getGeometry();
+      static bool isMapped(SectionEnum section);
+      bool load(uint64_t checkpointId);
+      // The checkpoint id on the cache device, 0 if none
+      static uint64_t readCheckpointBlock();
+      static void writeCheckpointBlock(uint64_t checkpointId);
+
+      bool enabled_;
+      bool loaded_ = false;
+      std::string path_;
+      // The opened checkpoint, until restoreState()
+      int fd_ = -1;
+      Header header_{};
+      std::vector<uint8_t> states_[kNumSections];
+  };
+}
+#endif //__INDEX_CHECKPOINT_H__
@@ -1,9 +1,284 @@
 #include "meta_journal.h"
+#include "common/config.h"
+#include "common/index_geometry.h"
+#include "metadata_codec.h"
+#include "utils/xxhash.h"
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
 namespace cache {
 
-MetaJournal::MetaJournal() = default;
+constexpr uint32_t MetaJournal::kBatchSize;
+constexpr uint32_t MetaJournal::kMaxPendingBlocks;
+constexpr uint32_t MetaJournal::kMaxBlocksPerApply;
+constexpr uint32_t MetaJournal::kMagic;
+
+MetaJournal& MetaJournal::getInstance()
+{
+  static MetaJournal instance;
+  return instance;
+}
+
+MetaJournal::MetaJournal()
+{
+  enabled_ = Config::getInstance().isMetaJournalEnabled();
+  if (!enabled_) {
+    return;
+  }
+  if (posix_memalign(reinterpret_cast<void **>(&batch_), 512, kBatchSize) != 0 ||
+      posix_memalign(reinterpret_cast<void **>(&applyBuffer_), 512,
+                     sizeof(MetadataBlock) * kMaxBlocksPerApply) != 0) {
+    std::cout << "Cannot allocate memory!" << std::endl;
+    exit(-1);
+  }
+  memset(batch_, 0, kBatchSize);
+  pending_.reserve(kMaxPendingBlocks);
+  applied_.reserve(kMaxPendingBlocks);
+}
+
+void MetaJournal::addUpdate(const Chunk &c, const MetadataBlock &block)
+{
+  // Records are packed, the metadata location in units of 512 bytes
+  uint8_t record[1 + 4 + 8 + 4 + 20];
+  uint32_t len = 0, blockNumber = c.metadataLocation_ / 512;
+  uint64_t lba = c.addr_;
+  const Metadata &metadata = c.metadata_;
+
+  if (c.dedupResult_ == NOT_DUP) {
+    record[len++] = tNewFingerprint;
+    memcpy(record + len, &blockNumber, 4); len += 4;
+    memcpy(record + len, &lba, 8); len += 8;
+    memcpy(record + len, &metadata.compressedLen_, 4); len += 4;
+    memcpy(record + len, metadata.fingerprint_, 20); len += 20;
+  } else {
+    record[len++] = tAddLba;
+    memcpy(record + len, &blockNumber, 4); len += 4;
+    memcpy(record + len, &lba, 8); len += 8;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The record goes first: if its batch commit applies everything pending,
+  // the block belongs to the next epoch along with the record
+  appendRecord(record, len, lock);
+  pending_[c.metadataLocation_] = block;
+  if (pending_.size() >= kMaxPendingBlocks && !applying_) {
+    applyPending(lock);
+  }
+}
+
+bool MetaJournal::lookup(uint64_t metadataLocation, MetadataBlock &block)
+{
+  std::lock_guard<std::mutex> l(mutex_);
+  auto it = pending_.find(metadataLocation);
+  if (it == pending_.end()) {
+    it = applied_.find(metadataLocation);
+    if (it == applied_.end()) {
+      return false;
+    }
+  }
+  block = it->second;
+  return true;
+}
+
+void MetaJournal::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  applyPending(lock);
+}
+
+void MetaJournal::recover()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t journalRegionSize = IndexGeometry::getInstance().journalRegionSize_;
+  uint32_t nBatches = 0;
+  // The epoch of the first batch is the current one, the batches behind
+  // the last one committed in it are of earlier epochs
+  for (uint64_t offset = 0; offset + kBatchSize <= journalRegionSize; offset += kBatchSize) {
+    IOModule::getInstance().read(JOURNAL, offset, batch_, kBatchSize);
+    BatchHeader header;
+    memcpy(&header, batch_, sizeof(header));
+    if (header.magic_ != kMagic || (offset != 0 && header.epoch_ != epoch_)
+        || header.nBytes_ < sizeof(header) || header.nBytes_ > kBatchSize
+        || header.checksum_ != XXH32(batch_ + sizeof(header), header.nBytes_ - sizeof(header), header.epoch_)) {
+      break;
+    }
+    epoch_ = header.epoch_;
+    replayBatch(header.nBytes_);
+    ++nBatches;
+  }
+  memset(batch_, 0, kBatchSize);
+  batchOffset_ = sizeof(BatchHeader);
+
+  if (pending_.empty()) {
+    // Nothing left to apply, the next epoch starts over the closed one
+    if (nBatches > 0) {
+      ++epoch_;
+    }
+    return;
+  }
+  std::cout << "Meta journal: replayed " << nBatches << " batches, "
+            << pending_.size() << " metadata blocks" << std::endl;
+  journalOffset_ = nBatches * kBatchSize;
+  applyPending(lock);
+}
+
+void MetaJournal::replayBatch(uint32_t nBytes)
+{
+  uint32_t nMaxLBAs = IndexGeometry::getInstance().nMaxLBAsPerChunk_;
+  const uint8_t *p = batch_ + sizeof(BatchHeader), *end = batch_ + nBytes;
+  Metadata metadata;
+  while (p < end) {
+    uint8_t type = *p;
+    uint32_t len = type == tNewFingerprint ? 1 + 4 + 8 + 4 + 20 : 1 + 4 + 8;
+    if ((type != tNewFingerprint && type != tAddLba) || p + len > end) {
+      break;
+    }
+    uint32_t blockNumber;
+    uint64_t lba;
+    memcpy(&blockNumber, p + 1, 4);
+    memcpy(&lba, p + 5, 8);
+    MetadataBlock &block = getBlockForReplay((uint64_t)blockNumber * 512);
+
+    // See 4., the block may have the record applied already
+    if (type == tNewFingerprint) {
+      metadata.clear();
+      memcpy(&metadata.compressedLen_, p + 13, 4);
+      memcpy(metadata.fingerprint_, p + 17, 20);
+      metadata.LBAs_[0] = lba;
+      metadata.numLBAs_ = 1;
+    } else if (MetadataCodec::decode(block, metadata)) {
+      moveToNewest(metadata, lba, nMaxLBAs);
+      uint32_t nOverflowing = MetadataCodec::nLBAsOverflowing(metadata);
+      if (nOverflowing > 0) {
+        MetadataCodec::dropOldest(metadata, nOverflowing);
+      }
+    } else {
+      p += len;
+      continue;
+    }
+    MetadataCodec::encode(metadata, block);
+    p += len;
+  }
+}
+
+void MetaJournal::moveToNewest(Metadata &metadata, uint64_t lba, uint32_t nMaxLBAs)
+{
+  // Oldest first, without lba
+  uint64_t LBAs[MAX_NUM_LBAS_PER_CACHED_CHUNK + 1];
+  uint32_t first = metadata.numLBAs_ == nMaxLBAs ? metadata.nextEvict_ : 0, nLBAs = 0;
+  for (uint32_t j = 0; j < metadata.numLBAs_; ++j) {
+    uint64_t other = metadata.LBAs_[(first + j) % nMaxLBAs];
+    if (other != lba) {
+      LBAs[nLBAs++] = other;
+    }
+  }
+  LBAs[nLBAs++] = lba;
+  // A full list drops its oldest LBA
+  uint32_t nDropped = nLBAs > nMaxLBAs ? 1 : 0;
+  memcpy(metadata.LBAs_, LBAs + nDropped, (nLBAs - nDropped) * sizeof(uint64_t));
+  metadata.numLBAs_ = nLBAs - nDropped;
+  metadata.nextEvict_ = 0;
+}
+
+MetadataBlock &MetaJournal::getBlockForReplay(uint64_t metadataLocation)
+{
+  auto it = pending_.find(metadataLocation);
+  if (it != pending_.end()) {
+    return it->second;
+  }
+  alignas(512) MetadataBlock block;
+  IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &block, sizeof(block));
+  MetadataBlock &pending = pending_[metadataLocation];
+  pending = block;
+  return pending;
+}
+
+void MetaJournal::appendRecord(const uint8_t *record, uint32_t len, std::unique_lock<std::mutex> &lock)
+{
+  while (batchOffset_ + len > kBatchSize) {
+    if (applying_) {
+      // The commit would overwrite the batches of the epoch being applied
+      appliedCondition_.wait(lock);
+    } else {
+      commitBatch(lock);
+    }
+  }
+  memcpy(batch_ + batchOffset_, record, len);
+  batchOffset_ += len;
+}
+
+void MetaJournal::commitBatch(std::unique_lock<std::mutex> &lock)
+{
+  // The last batch of the region is left to applyPending
+  if (journalOffset_ + 2 * kBatchSize > IndexGeometry::getInstance().journalRegionSize_) {
+    // The journal is full, the batch is applied along with everything pending
+    applyPending(lock);
+    return;
+  }
+  sealBatch(batch_, epoch_, batchOffset_, kBatchSize);
+  IOModule::getInstance().write(JOURNAL, journalOffset_, batch_, kBatchSize);
+  journalOffset_ += kBatchSize;
+  batchOffset_ = sizeof(BatchHeader);
+}
 
-void MetaJournal::addUpdate(const cache::Chunk &c)
+void MetaJournal::sealBatch(uint8_t *batch, uint32_t epoch, uint32_t nBytes, uint32_t len)
 {
+  BatchHeader header{kMagic, epoch, nBytes,
+    XXH32(batch + sizeof(BatchHeader), nBytes - sizeof(BatchHeader), epoch)};
+  memcpy(batch, &header, sizeof(header));
+  memset(batch + nBytes, 0, len - nBytes);
+}
+
+void MetaJournal::applyPending(std::unique_lock<std::mutex> &lock)
+{
+  while (applying_) {
+    appliedCondition_.wait(lock);
+  }
+  // Everything journaled so far goes to the metadata region, the open
+  // batch is committed first so that the applied blocks hold exactly the
+  // records recover() replays onto them
+  if (batchOffset_ > sizeof(BatchHeader)) {
+    sealBatch(batch_, epoch_, batchOffset_, kBatchSize);
+    IOModule::getInstance().write(JOURNAL, journalOffset_, batch_, kBatchSize);
+    journalOffset_ += kBatchSize;
+  }
+  applied_.swap(pending_);
+  bool closeEpoch = journalOffset_ > 0;
+  batchOffset_ = sizeof(BatchHeader);
+  journalOffset_ = 0;
+  uint32_t epoch = ++epoch_;
+  applying_ = true;
+  lock.unlock();
+
+  uint32_t metadataSize = Config::getInstance().getMetadataSize();
+  std::vector<uint64_t> locations;
+  locations.reserve(applied_.size());
+  for (auto &pr : applied_) {
+    locations.push_back(pr.first);
+  }
+  std::sort(locations.begin(), locations.end());
+
+  for (uint32_t i = 0; i < locations.size(); ) {
+    uint32_t n = 0;
+    do {
+      applyBuffer_[n] = applied_.find(locations[i + n])->second;
+      ++n;
+    } while (n < kMaxBlocksPerApply && i + n < locations.size()
+             && locations[i + n] == locations[i + n - 1] + metadataSize);
+    IOModule::getInstance().writeMetadata(locations[i], applyBuffer_, n * metadataSize);
+    i += n;
+  }
+  if (closeEpoch) {
+    // An empty batch of the next epoch, recover() no longer replays the applied one
+    uint8_t *batch = reinterpret_cast<uint8_t *>(applyBuffer_);
+    sealBatch(batch, epoch, sizeof(BatchHeader), sizeof(MetadataBlock));
+    IOModule::getInstance().write(JOURNAL, 0, batch, sizeof(MetadataBlock));
+  }
+
+  lock.lock();
+  applied_.clear();
+  applying_ = false;
+  appliedCondition_.notify_all();
 }
 }
@@ -1,15 +1,113 @@
+/* File: metadata/meta_journal.h
+ * Description:
+ *   This file contains MetaJournal, which turns the random 512-byte metadata
+ *   block writes of MetaVerification::update into sequential journal writes
+ *   (Config::isMetaJournalEnabled()).
+ *
+ *   1. Each update appends a compact record to the open batch: a new
+ *      fingerprint (tNewFingerprint) or an LBA added to the LBA list of a
+ *      fingerprint (tAddLba). A full batch of kBatchSize bytes is committed
+ *      with one write to the journal region (IOModule, JOURNAL), behind a
+ *      BatchHeader with the epoch and a checksum of the records.
+ *   2. The updated metadata blocks stay pending in memory until they are
+ *      applied to the metadata region, all at once and in location order,
+ *      adjacent blocks in one write. This happens when kMaxPendingBlocks
+ *      blocks are pending or the journal region is full; the journal then
+ *      starts over at its beginning with the next epoch. The blocks are
+ *      written without holding the lock of the journal, updates and reads go
+ *      on meanwhile; only a batch commit of the next epoch waits for them,
+ *      as it overwrites the batches of the applied one. Once applied, an
+ *      empty batch of the next epoch closes the applied one.
+ *   3. Reads of metadata blocks (MetaVerification::readMetadata) go to the
+ *      pending blocks first, then to the ones being applied, the metadata
+ *      region only has the applied ones.
+ *   4. flush() applies the pending blocks, at shutdown. A crash loses at
+ *      most the updates of the open batch: at startup, before the indexes are
+ *      used (WarmRestart), recover() reads the committed batches of the epoch
+ *      of the first one back, re-applies their records to the metadata blocks
+ *      and applies these to the metadata region. An apply commits the open
+ *      batch first, in the last batch of the region if need be, so a crash
+ *      during an apply leaves each block either without the records of the
+ *      epoch or with all of them. Replaying a tAddLba record therefore moves
+ *      its LBA to the newest end of the list instead of adding it once more:
+ *      both end up with the LBAs of the records in the same order, once each.
+  */
 #ifndef __METAJOURNAL_H__
 #define __METAJOURNAL_H__
 
+#include <mutex>
+#include <condition_variable>
 #include "chunking/chunk_module.h"
 #include "io/io_module.h"
+#include "common/flat_hash_map.h"
 
 namespace cache {
 
 class MetaJournal {
  public:
+  static MetaJournal& getInstance();
+  inline bool isEnabled() const { return enabled_; }
+
+  /**
+   * @brief Journal the metadata block of the chunk, as updated by
+   *        MetaVerification::update and encoded into block, instead of writing it
+   */
+  void addUpdate(const Chunk &c, const MetadataBlock &block);
+  /**
+   * @brief Copy the pending metadata block at metadataLocation, if any
+   */
+  bool lookup(uint64_t metadataLocation, MetadataBlock &block);
+  void flush();
+  // At startup, after the devices are opened
+  void recover();
+
+  enum RecordType {
+    tNewFingerprint = 1, tAddLba = 2
+  };
+  // Leads every committed batch, records follow up to nBytes_
+  struct BatchHeader {
+    uint32_t magic_;
+    uint32_t epoch_;
+    uint32_t nBytes_;
+    // XXH32 of the records, seeded with the epoch
+    uint32_t checksum_;
+  };
+
+  // Changed with the record layout, batches of another one are not replayed
+  static constexpr uint32_t kMagic = 0x324e524a;
+
+  static constexpr uint32_t kBatchSize = 4096;
+  static constexpr uint32_t kMaxPendingBlocks = 8192;
+  // Longest run of adjacent blocks applied in one write
+  static constexpr uint32_t kMaxBlocksPerApply = 128;
+
+ private:
   MetaJournal();
-  void addUpdate(const Chunk &c);
+  // Callers hold mutex_ through lock, applyPending releases it while writing
+  void appendRecord(const uint8_t *record, uint32_t len, std::unique_lock<std::mutex> &lock);
+  void commitBatch(std::unique_lock<std::mutex> &lock);
+  void applyPending(std::unique_lock<std::mutex> &lock);
+  // Fill in the header of a batch of nBytes, zeroing it up to len
+  static void sealBatch(uint8_t *batch, uint32_t epoch, uint32_t nBytes, uint32_t len);
+  // Re-apply the records of a committed batch to the pending blocks
+  void replayBatch(uint32_t nBytes);
+  // Make lba the newest LBA of metadata, see 4.
+  static void moveToNewest(Metadata &metadata, uint64_t lba, uint32_t nMaxLBAs);
+  MetadataBlock &getBlockForReplay(uint64_t metadataLocation);
+
+  bool enabled_;
+  std::mutex mutex_;
+  FlatHashMap<uint64_t, MetadataBlock> pending_;
+  // The blocks written to the metadata region by applyPending, read-only
+  // until it is done (applying_ false)
+  FlatHashMap<uint64_t, MetadataBlock> applied_;
+  bool applying_ = false;
+  std::condition_variable appliedCondition_;
+  uint8_t *batch_ = nullptr;
+  uint32_t batchOffset_ = sizeof(BatchHeader);
+  uint32_t epoch_ = 0;
+  uint64_t journalOffset_ = 0;
+  MetadataBlock *applyBuffer_ = nullptr;
 };
 }
 
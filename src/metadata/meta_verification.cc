@@ -1,11 +1,16 @@
 #include "meta_verification.h"
+#include "metadata_cache.h"
+#include "meta_journal.h"
+#include "metadata_codec.h"
+#include "common/index_geometry.h"
 #include "manage/dirtylist.h"
+#include "manage/manage_module.h"
 #include <cstring>
 
 namespace cache {
   MetaVerification::MetaVerification() {}
 
-  VerificationResult MetaVerification::verify(Chunk &chunk)
+  VerificationResult MetaVerification::verify(Chunk &chunk, bool withCachedata)
   {
     // read metadata from ioModule_
     uint64_t &lba = chunk.addr_;
@@ -13,7 +18,11 @@ namespace cache {
     uint64_t &metadataLocation = chunk.metadataLocation_;
     Metadata &metadata = chunk.metadata_;
 
-    IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &metadata, 512);
+    if (withCachedata && IndexGeometry::getInstance().colocatedMetadata_) {
+      readMetadataAndCachedata(chunk);
+    } else {
+      readMetadata(metadataLocation, metadata);
+    }
 
     // check lba
     bool validLBA = false;
@@ -44,41 +53,124 @@ namespace cache {
       return BOTH_LBA_AND_FP_NOT_VALID;
   }
 
+  void MetaVerification::readMetadata(uint64_t metadataLocation, Metadata &metadata)
+  {
+    alignas(512) MetadataBlock block;
+    readMetadataBlock(metadataLocation, block);
+    MetadataCodec::decode(block, metadata);
+  }
+
+  void MetaVerification::readMetadataBlock(uint64_t metadataLocation, MetadataBlock &block)
+  {
+    MetaJournal &metaJournal = MetaJournal::getInstance();
+    if (metaJournal.isEnabled() && metaJournal.lookup(metadataLocation, block)) {
+      return;
+    }
+
+    MetadataCache &metadataCache = MetadataCache::getInstance();
+    if (!metadataCache.isEnabled()) {
+      IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &block, sizeof(block));
+      return;
+    }
+
+    uint64_t fillVersion;
+    if (metadataCache.lookup(metadataLocation, block, fillVersion)) {
+      Stats::getInstance().add_metadata_cache_hit();
+      return;
+    }
+    Stats::getInstance().add_metadata_cache_miss();
+    IOModule::getInstance().read(CACHE_DEVICE, metadataLocation, &block, sizeof(block));
+    metadataCache.fill(metadataLocation, block, fillVersion);
+  }
+
+  void MetaVerification::readMetadataAndCachedata(Chunk &chunk)
+  {
+    alignas(512) MetadataBlock block;
+    MetaJournal &metaJournal = MetaJournal::getInstance();
+    if (metaJournal.isEnabled() && metaJournal.lookup(chunk.metadataLocation_, block)) {
+      MetadataCodec::decode(block, chunk.metadata_);
+      return;
+    }
+
+    MetadataCache &metadataCache = MetadataCache::getInstance();
+    uint64_t fillVersion;
+    if (metadataCache.isEnabled()) {
+      // The data alone is read later on a hit
+      if (metadataCache.lookup(chunk.metadataLocation_, block, fillVersion)) {
+        Stats::getInstance().add_metadata_cache_hit();
+        MetadataCodec::decode(block, chunk.metadata_);
+        return;
+      }
+      Stats::getInstance().add_metadata_cache_miss();
+    }
+    ManageModule::getInstance().readWithMetadata(chunk, block);
+    if (metadataCache.isEnabled()) {
+      metadataCache.fill(chunk.metadataLocation_, block, fillVersion);
+    }
+  }
+
+  void MetaVerification::writeMetadata(Chunk &chunk)
+  {
+    alignas(512) MetadataBlock block;
+    MetadataCodec::encode(chunk.metadata_, block);
+    if (MetaJournal::getInstance().isEnabled()) {
+      MetaJournal::getInstance().addUpdate(chunk, block);
+    } else {
+      IOModule::getInstance().write(CACHE_DEVICE, chunk.metadataLocation_, &block, sizeof(block));
+    }
+    if (MetadataCache::getInstance().isEnabled()) {
+      MetadataCache::getInstance().update(chunk.metadataLocation_, block);
+    }
+  }
+
   void MetaVerification::update(Chunk &chunk)
   {
     uint64_t &lba = chunk.addr_;
     auto &ca = chunk.fingerprint_;
-    uint64_t &metadataLocation = chunk.metadataLocation_;
     Metadata &metadata = chunk.metadata_;
 
     if (chunk.dedupResult_ == DUP_CONTENT) {
       // The chunk is duplicate
       // We update the chunk metadata
-      if (metadata.numLBAs_ == MAX_NUM_LBAS_PER_CACHED_CHUNK) {
+      uint32_t nMaxLBAs = IndexGeometry::getInstance().nMaxLBAsPerChunk_;
+      if (metadata.numLBAs_ == nMaxLBAs) {
         if (Config::getInstance().getCacheMode() == tWriteBack) {
           DirtyList::getInstance().flushOneLba(metadata.LBAs_[metadata.nextEvict_], 
               chunk.cachedataLocation_, metadata);
         }
         metadata.LBAs_[metadata.nextEvict_++] = chunk.addr_;
-        if (metadata.nextEvict_ == MAX_NUM_LBAS_PER_CACHED_CHUNK) {
+        if (metadata.nextEvict_ == nMaxLBAs) {
           metadata.nextEvict_ = 0;
         }
       } else {
         metadata.LBAs_[metadata.numLBAs_] = chunk.addr_;
         metadata.numLBAs_++;
       }
+      // A compact block fits fewer LBAs when they are far apart
+      uint32_t nOverflowing = MetadataCodec::nLBAsOverflowing(metadata);
+      if (nOverflowing > 0) {
+        if (Config::getInstance().getCacheMode() == tWriteBack) {
+          // Oldest first, the list is full or starts at 0
+          uint32_t first = metadata.numLBAs_ == nMaxLBAs ? metadata.nextEvict_ : 0;
+          for (uint32_t j = 0; j < nOverflowing; ++j) {
+            DirtyList::getInstance().flushOneLba(metadata.LBAs_[(first + j) % nMaxLBAs],
+                chunk.cachedataLocation_, metadata);
+          }
+        }
+        MetadataCodec::dropOldest(metadata, nOverflowing);
+      }
 
-      IOModule::getInstance().write(CACHE_DEVICE, metadataLocation, &chunk.metadata_, 512);
+      writeMetadata(chunk);
     } else if (chunk.dedupResult_ == NOT_DUP) {
       // The data is not duplicate
       // We need to create a new chunk metadata
-      memset(&metadata, 0, sizeof(metadata));
+      metadata.clear();
       memcpy(metadata.fingerprint_, chunk.fingerprint_, Config::getInstance().getFingerprintLength());
       metadata.LBAs_[0] = chunk.addr_;
       metadata.numLBAs_ = 1;
       metadata.nextEvict_ = 0;
       metadata.compressedLen_ = chunk.compressedLen_;
-      IOModule::getInstance().write(CACHE_DEVICE, metadataLocation, &chunk.metadata_, 512);
+      writeMetadata(chunk);
     }
   }
 }
@@ -10,9 +10,30 @@ namespace cache {
   class MetaVerification {
    public:
     MetaVerification();
-    VerificationResult verify(Chunk &chunk);
+    /**
+     * @brief Check the metadata block of the chunk against its LBA and fingerprint
+     *
+     * @param withCachedata the chunk is looked up for a read: with the colocated
+     *        layout, read the cached data in the same I/O (see Chunk::hasCachedata_)
+     */
+    VerificationResult verify(Chunk &chunk, bool withCachedata = false);
     void clean(Chunk &chunk);
     void update(Chunk &chunk);
+
+    /**
+     * @brief Read the metadata block at metadataLocation, from the
+     *        MetadataCache when it holds the block
+     */
+    static void readMetadata(uint64_t metadataLocation, Metadata &metadata);
+
+   private:
+    // readMetadata, without decoding the block
+    static void readMetadataBlock(uint64_t metadataLocation, MetadataBlock &block);
+    // readMetadata, reading the cached data along on a MetadataCache miss
+    static void readMetadataAndCachedata(Chunk &chunk);
+    // Write the updated metadata block of the chunk, through the MetadataCache
+    // and, if enabled, the MetaJournal
+    static void writeMetadata(Chunk &chunk);
   };
 }
 #endif
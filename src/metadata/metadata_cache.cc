@@ -0,0 +1,113 @@
+#include "metadata_cache.h"
+#include "common/config.h"
+
+namespace cache {
+  constexpr uint32_t MetadataCache::kShards;
+
+  MetadataCache::MetadataCache()
+  {
+    uint64_t shardBudget = Config::getInstance().getMetadataCacheSize() / kShards;
+    uint64_t slotSize = sizeof(FlatHashMap<uint64_t, uint32_t>::value_type) + 1;
+    // The index is reserved for twice the entries, so that rehashing away its
+    // tombstones never grows it (see common/flat_hash_map.h)
+    auto getShardSize = [&](uint64_t nEntries) {
+      uint64_t capacity = FlatHashMap<uint64_t, uint32_t>::kGroupSize;
+      while (capacity / 8 * 7 < 2 * nEntries) {
+        capacity <<= 1u;
+      }
+      return nEntries * sizeof(Entry) + capacity * slotSize;
+    };
+    uint64_t nEntries = shardBudget / (sizeof(Entry) + 2 * slotSize);
+    while (nEntries > 0 && getShardSize(nEntries) > shardBudget) {
+      nEntries -= nEntries / 64 + 1;
+    }
+    nEntriesPerShard_ = nEntries;
+    if (nEntriesPerShard_ == 0) {
+      return;
+    }
+
+    shards_ = std::make_unique<Shard[]>(kShards);
+    for (uint32_t i = 0; i < kShards; ++i) {
+      shards_[i].entries_ = std::make_unique<Entry[]>(nEntriesPerShard_);
+      shards_[i].index_.reserve(2 * nEntriesPerShard_);
+    }
+  }
+
+  bool MetadataCache::lookup(uint64_t metadataLocation, MetadataBlock &block, uint64_t &fillVersion)
+  {
+    Shard &shard = getShard(metadataLocation);
+    std::lock_guard<std::mutex> l(shard.mutex_);
+    auto it = shard.index_.find(metadataLocation);
+    if (it == shard.index_.end()) {
+      // Concurrent misses share the pending fill, they read the same block
+      uint64_t &pendingFill = shard.pendingFills_[metadataLocation];
+      if (pendingFill == 0) {
+        pendingFill = shard.nextFillVersion_++;
+      }
+      fillVersion = pendingFill;
+      return false;
+    }
+    Entry &entry = shard.entries_[it->second];
+    entry.referenced_ = true;
+    block = entry.block_;
+    return true;
+  }
+
+  void MetadataCache::fill(uint64_t metadataLocation, const MetadataBlock &block, uint64_t fillVersion)
+  {
+    Shard &shard = getShard(metadataLocation);
+    std::lock_guard<std::mutex> l(shard.mutex_);
+    // A write-through of the location since the miss may have installed a
+    // newer block, or installed and evicted it again
+    auto it = shard.pendingFills_.find(metadataLocation);
+    if (it == shard.pendingFills_.end() || it->second != fillVersion) {
+      return;
+    }
+    shard.pendingFills_.erase(it);
+    install(shard, metadataLocation, block);
+  }
+
+  void MetadataCache::update(uint64_t metadataLocation, const MetadataBlock &block)
+  {
+    Shard &shard = getShard(metadataLocation);
+    std::lock_guard<std::mutex> l(shard.mutex_);
+    shard.pendingFills_.erase(metadataLocation);
+    install(shard, metadataLocation, block);
+  }
+
+  void MetadataCache::install(Shard &shard, uint64_t metadataLocation, const MetadataBlock &block)
+  {
+    auto it = shard.index_.find(metadataLocation);
+    uint32_t entryId;
+    if (it != shard.index_.end()) {
+      entryId = it->second;
+    } else {
+      if (shard.nEntries_ < nEntriesPerShard_) {
+        entryId = shard.nEntries_++;
+      } else {
+        // CLOCK: the first entry not referenced since the hand last passed it
+        while (shard.entries_[shard.clockHand_].referenced_) {
+          shard.entries_[shard.clockHand_].referenced_ = false;
+          shard.clockHand_ = (shard.clockHand_ + 1) % nEntriesPerShard_;
+        }
+        entryId = shard.clockHand_;
+        shard.clockHand_ = (shard.clockHand_ + 1) % nEntriesPerShard_;
+        shard.index_.erase(shard.entries_[entryId].metadataLocation_);
+      }
+      shard.index_[metadataLocation] = entryId;
+      shard.entries_[entryId].metadataLocation_ = metadataLocation;
+      shard.entries_[entryId].referenced_ = false;
+    }
+    shard.entries_[entryId].block_ = block;
+  }
+
+  uint64_t MetadataCache::getMemoryUsage()
+  {
+    uint64_t memoryUsage = 0;
+    for (uint32_t i = 0; shards_ != nullptr && i < kShards; ++i) {
+      memoryUsage += nEntriesPerShard_ * sizeof(Entry) + shards_[i].index_.getMemoryUsage()
+        + shards_[i].pendingFills_.getMemoryUsage();
+    }
+    return memoryUsage;
+  }
+}
@@ -0,0 +1,99 @@
+/* File: metadata/metadata_cache.h
+ * Description:
+ *   This file contains MetadataCache, a bounded DRAM cache of the on-SSD
+ *   Metadata blocks in front of the metadata region, so that a hit in the FP
+ *   index does not cost a metadata read before the cached data is read.
+ *
+ *   1. It is keyed by metadata location and split into kShards shards, each
+ *      with its own mutex, FlatHashMap (location -> entry) and fixed array of
+ *      entries. A full shard evicts with CLOCK, a hit only sets a flag.
+ *   2. The capacity follows Config::getMetadataCacheSize(), a DRAM budget in
+ *      bytes covering the entries and the hash maps. 0 disables the cache.
+ *   3. MetaVerification writes through: every metadata block written to the
+ *      cache device is also (re)installed here, so a cached block is never older
+ *      than the one on the SSD.
+ *   4. A miss is filled after the block was read from the SSD. Readers that
+ *      do not hold the FP bucket lock (optimistic lookups, the dirty list) may
+ *      race with a write-through of the same block, so a miss is recorded as a
+ *      pending fill of its location, with a version. A write-through of the
+ *      location cancels its pending fill, and a fill without its pending entry
+ *      is dropped; writes to other locations of the shard do not matter.
+ *      Every miss is filled (or dropped), so the pending fills of a shard are
+ *      bounded by the concurrent readers.
+ *   5. Entries hold the blocks as encoded on the SSD (MetadataCodec), whatever
+ *      the number of LBAs a decoded Metadata may hold.
+ */
+#ifndef __METADATA_CACHE_H__
+#define __METADATA_CACHE_H__
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "common/common.h"
+#include "common/flat_hash_map.h"
+
+namespace cache {
+  class MetadataCache {
+    public:
+      static MetadataCache& getInstance() {
+        static MetadataCache instance;
+        return instance;
+      }
+
+      inline bool isEnabled() const { return nEntriesPerShard_ != 0; }
+
+      /**
+       * @brief Copy the cached metadata block at metadataLocation into block
+       *
+       * @param fillVersion on a miss, the version of the pending fill to pass
+       *        to fill()
+       *
+       * @return whether the block is cached
+       */
+      bool lookup(uint64_t metadataLocation, MetadataBlock &block, uint64_t &fillVersion);
+      /**
+       * @brief Cache a block read from the SSD after lookup() missed
+       */
+      void fill(uint64_t metadataLocation, const MetadataBlock &block, uint64_t fillVersion);
+      /**
+       * @brief Cache a block that has just been written to the SSD
+       */
+      void update(uint64_t metadataLocation, const MetadataBlock &block);
+
+      // Bytes of the entries and hash maps of all shards
+      uint64_t getMemoryUsage();
+
+      static constexpr uint32_t kShards = 16;
+
+    private:
+      MetadataCache();
+
+      struct Entry {
+        MetadataBlock block_;
+        uint64_t metadataLocation_;
+        bool referenced_;
+      };
+
+      struct Shard {
+        std::mutex mutex_;
+        FlatHashMap<uint64_t, uint32_t> index_;
+        std::unique_ptr<Entry[]> entries_;
+        uint32_t nEntries_ = 0;
+        uint32_t clockHand_ = 0;
+        // Location -> version of its pending fill, see 4.
+        FlatHashMap<uint64_t, uint64_t> pendingFills_;
+        uint64_t nextFillVersion_ = 1;
+      };
+
+      inline Shard &getShard(uint64_t metadataLocation)
+      {
+        return shards_[FlatHash<uint64_t>()(metadataLocation) % kShards];
+      }
+      // Caller holds the shard mutex
+      void install(Shard &shard, uint64_t metadataLocation, const MetadataBlock &block);
+
+      uint32_t nEntriesPerShard_ = 0;
+      std::unique_ptr<Shard[]> shards_;
+  };
+}
+#endif
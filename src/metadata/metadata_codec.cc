@@ -0,0 +1,211 @@
+#include "metadata_codec.h"
+#include "common/index_geometry.h"
+#include <algorithm>
+
+namespace cache {
+
+constexpr uint8_t MetadataCodec::kCompactVersion;
+
+namespace {
+  // The historical on-SSD layout
+  struct PlainMetadata {
+    uint64_t LBAs_[MAX_NUM_LBAS_PER_PLAIN_METADATA];
+    uint8_t  fingerprint_[20];
+    uint32_t nextEvict_;
+    uint32_t numLBAs_;
+    uint32_t compressedLen_;
+  };
+  static_assert(sizeof(PlainMetadata) == sizeof(MetadataBlock), "a plain metadata block");
+
+  inline uint32_t getVarintSize(uint64_t value)
+  {
+    uint32_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7u;
+      ++size;
+    }
+    return size;
+  }
+
+  inline uint8_t *putVarint(uint8_t *p, uint64_t value)
+  {
+    while (value >= 0x80) {
+      *p++ = (uint8_t)(value | 0x80);
+      value >>= 7u;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+  }
+
+  inline bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+  {
+    value = 0;
+    for (uint32_t shift = 0; p < end && shift < 64; shift += 7) {
+      uint8_t byte = *p++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Deltas between LBA units, small in magnitude either way
+  inline uint64_t zigzag(uint64_t delta)
+  {
+    return (delta << 1u) ^ (uint64_t)((int64_t)delta >> 63);
+  }
+
+  inline uint64_t unzigzag(uint64_t value)
+  {
+    return (value >> 1u) ^ (0 - (value & 1u));
+  }
+}
+
+uint32_t MetadataCodec::getOldest(const Metadata &metadata)
+{
+  return metadata.numLBAs_ == IndexGeometry::getInstance().nMaxLBAsPerChunk_ ?
+    metadata.nextEvict_ : 0;
+}
+
+uint32_t MetadataCodec::getLbaShift(const Metadata &metadata)
+{
+  uint32_t maxShift = __builtin_ctz(IndexGeometry::getInstance().chunkSize_);
+  uint64_t bits = 0;
+  for (uint32_t i = 0; i < metadata.numLBAs_; ++i) {
+    bits |= metadata.LBAs_[i];
+  }
+  return bits == 0 ? maxShift : std::min<uint32_t>(__builtin_ctzll(bits), maxShift);
+}
+
+void MetadataCodec::encode(const Metadata &metadata, MetadataBlock &block)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  memset(block.bytes_, 0, sizeof(block.bytes_));
+  if (!geometry.compactMetadata_) {
+    PlainMetadata plain;
+    memcpy(plain.LBAs_, metadata.LBAs_, sizeof(plain.LBAs_));
+    memcpy(plain.fingerprint_, metadata.fingerprint_, sizeof(plain.fingerprint_));
+    plain.nextEvict_ = metadata.nextEvict_;
+    plain.numLBAs_ = metadata.numLBAs_;
+    plain.compressedLen_ = metadata.compressedLen_;
+    memcpy(block.bytes_, &plain, sizeof(plain));
+    return;
+  }
+
+  CompactHeader header{};
+  header.version_ = kCompactVersion;
+  header.lbaShift_ = getLbaShift(metadata);
+  header.numLBAs_ = metadata.numLBAs_;
+  memcpy(header.fingerprint_, metadata.fingerprint_, sizeof(header.fingerprint_));
+  memcpy(block.bytes_, &header, sizeof(header));
+
+  uint8_t *p = block.bytes_ + sizeof(header), *end = block.bytes_ + sizeof(block.bytes_);
+  p = putVarint(p, metadata.compressedLen_);
+  // MetaVerification::update dropped the LBAs that do not fit, skip them otherwise
+  uint32_t nDropped = nLBAsOverflowing(metadata);
+  uint32_t first = getOldest(metadata) + nDropped;
+  uint64_t previous = 0;
+  uint32_t j = 0;
+  for (; j < metadata.numLBAs_ - nDropped; ++j) {
+    uint64_t unit = metadata.LBAs_[(first + j) % geometry.nMaxLBAsPerChunk_] >> header.lbaShift_;
+    uint64_t value = j == 0 ? unit : zigzag(unit - previous);
+    // Never past the block, whatever nLBAsOverflowing() said
+    if (p + getVarintSize(value) > end) {
+      break;
+    }
+    p = putVarint(p, value);
+    previous = unit;
+  }
+  if (j != header.numLBAs_) {
+    header.numLBAs_ = j;
+    memcpy(block.bytes_, &header, sizeof(header));
+  }
+}
+
+bool MetadataCodec::decode(const MetadataBlock &block, Metadata &metadata)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  metadata.clear();
+  if (!geometry.compactMetadata_) {
+    PlainMetadata plain;
+    memcpy(&plain, block.bytes_, sizeof(plain));
+    if (plain.numLBAs_ > MAX_NUM_LBAS_PER_PLAIN_METADATA
+        || plain.nextEvict_ >= MAX_NUM_LBAS_PER_PLAIN_METADATA) {
+      return false;
+    }
+    memcpy(metadata.LBAs_, plain.LBAs_, sizeof(plain.LBAs_));
+    memcpy(metadata.fingerprint_, plain.fingerprint_, sizeof(plain.fingerprint_));
+    metadata.nextEvict_ = plain.nextEvict_;
+    metadata.numLBAs_ = plain.numLBAs_;
+    metadata.compressedLen_ = plain.compressedLen_;
+    return true;
+  }
+
+  CompactHeader header;
+  memcpy(&header, block.bytes_, sizeof(header));
+  if (header.version_ != kCompactVersion || header.lbaShift_ >= 64
+      || header.numLBAs_ > geometry.nMaxLBAsPerChunk_) {
+    return false;
+  }
+  const uint8_t *p = block.bytes_ + sizeof(header), *end = block.bytes_ + sizeof(block.bytes_);
+  uint64_t value, unit = 0;
+  bool valid = getVarint(p, end, value) && value <= UINT32_MAX;
+  metadata.compressedLen_ = value;
+  for (uint32_t j = 0; j < header.numLBAs_ && valid; ++j) {
+    valid = getVarint(p, end, value);
+    unit = j == 0 ? value : unit + unzigzag(value);
+    metadata.LBAs_[j] = unit << header.lbaShift_;
+  }
+  if (!valid) {
+    metadata.clear();
+    return false;
+  }
+  memcpy(metadata.fingerprint_, header.fingerprint_, sizeof(metadata.fingerprint_));
+  metadata.numLBAs_ = header.numLBAs_;
+  metadata.nextEvict_ = 0;
+  return true;
+}
+
+uint32_t MetadataCodec::nLBAsOverflowing(const Metadata &metadata)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  if (!geometry.compactMetadata_ || metadata.numLBAs_ == 0) {
+    return 0;
+  }
+  // The LBA unit may only grow as LBAs are dropped, this is an upper bound
+  uint32_t lbaShift = getLbaShift(metadata), first = getOldest(metadata);
+  uint64_t units[MAX_NUM_LBAS_PER_CACHED_CHUNK];
+  for (uint32_t j = 0; j < metadata.numLBAs_; ++j) {
+    units[j] = metadata.LBAs_[(first + j) % geometry.nMaxLBAsPerChunk_] >> lbaShift;
+  }
+  // Without the k oldest LBAs, LBA k is stored as is and the others as deltas
+  uint64_t fixedSize = sizeof(CompactHeader) + getVarintSize(metadata.compressedLen_),
+           deltasSize = 0;
+  for (uint32_t j = 1; j < metadata.numLBAs_; ++j) {
+    deltasSize += getVarintSize(zigzag(units[j] - units[j - 1]));
+  }
+  uint32_t k = 0;
+  for (; k + 1 < metadata.numLBAs_; ++k) {
+    if (fixedSize + getVarintSize(units[k]) + deltasSize <= sizeof(MetadataBlock)) {
+      break;
+    }
+    deltasSize -= getVarintSize(zigzag(units[k + 1] - units[k]));
+  }
+  return k;
+}
+
+void MetadataCodec::dropOldest(Metadata &metadata, uint32_t n)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  uint64_t LBAs[MAX_NUM_LBAS_PER_CACHED_CHUNK];
+  uint32_t first = getOldest(metadata), nLBAs = 0;
+  for (uint32_t j = n; j < metadata.numLBAs_; ++j) {
+    LBAs[nLBAs++] = metadata.LBAs_[(first + j) % geometry.nMaxLBAsPerChunk_];
+  }
+  memset(metadata.LBAs_, 0, geometry.nMaxLBAsPerChunk_ * sizeof(uint64_t));
+  memcpy(metadata.LBAs_, LBAs, nLBAs * sizeof(uint64_t));
+  metadata.numLBAs_ = nLBAs;
+  metadata.nextEvict_ = 0;
+}
+}
@@ -0,0 +1,62 @@
+/* File: metadata/metadata_codec.h
+ * Description:
+ *   This file contains MetadataCodec, which turns a Metadata into the
+ *   MetadataBlock written to the cache device and back
+ *   (Config::getMetadataFormat()).
+ *
+ *   1. Plain: the historical layout, LBAs as 60 raw 64-bit words
+ *      (MAX_NUM_LBAS_PER_PLAIN_METADATA). A chunk with more LBAs evicts them
+ *      round-robin.
+ *   2. Compact: a CompactHeader with the format version, the LBA unit and the
+ *      fingerprint, then varints: the compressed length, the first LBA and the
+ *      zigzag delta of each following one, all in LBA units, oldest LBA first.
+ *      The unit is the largest power of two dividing every LBA, up to the
+ *      chunk size, so the LBAs of aligned chunks are chunk numbers and nearby
+ *      chunks cost a byte or two. A block keeps as many LBAs as it fits, up
+ *      to MAX_NUM_LBAS_PER_CACHED_CHUNK: MetaVerification::update drops the
+ *      oldest ones that do not fit (nLBAsOverflowing()).
+ *   3. A compact block decodes with its LBAs oldest first (nextEvict_ 0).
+ *      A block that does not decode, e.g. never written or written in the
+ *      other format, gives an empty Metadata.
+ */
+#ifndef __METADATA_CODEC_H__
+#define __METADATA_CODEC_H__
+#include <cstdint>
+#include "common/common.h"
+
+namespace cache {
+
+class MetadataCodec {
+ public:
+  // A compact block leaves out the oldest LBAs that do not fit
+  static void encode(const Metadata &metadata, MetadataBlock &block);
+  /**
+   * @brief Decode a block, metadata is empty (all zeros) if it does not decode
+   *
+   * @return false if the block holds no metadata of the configured format
+   */
+  static bool decode(const MetadataBlock &block, Metadata &metadata);
+  /**
+   * @brief Number of the oldest LBAs to drop so that metadata fits a block
+   */
+  static uint32_t nLBAsOverflowing(const Metadata &metadata);
+  // Drop the n oldest LBAs, the others are left oldest first
+  static void dropOldest(Metadata &metadata, uint32_t n);
+
+  static constexpr uint8_t kCompactVersion = 1;
+  struct CompactHeader {
+    uint8_t version_;
+    // LBAs are stored in units of 1 << lbaShift_ bytes
+    uint8_t lbaShift_;
+    uint16_t numLBAs_;
+    uint8_t fingerprint_[20];
+  };
+
+ private:
+  // Index of the oldest LBA of metadata
+  static uint32_t getOldest(const Metadata &metadata);
+  static uint32_t getLbaShift(const Metadata &metadata);
+};
+}
+
+#endif //__METADATA_CODEC_H__
@@ -2,6 +2,7 @@
 #include "metadata_module.h"
 #include "meta_verification.h"
 #include "meta_journal.h"
+#include "reference_counter.h"
 
 #include "common/config.h"
 #include "common/stats.h"
@@ -19,9 +20,19 @@ namespace cache {
     fpIndex_ = std::make_shared<FPIndex>();
     lbaIndex_ = std::make_shared<LBAIndex>(fpIndex_);
     metaVerification_ = std::make_unique<MetaVerification>();
-    metaJournal_ = std::make_unique<MetaJournal>();
+    IndexCheckpoint::getInstance().restoreState(*fpIndex_, *lbaIndex_);
     std::cout << "Number of LBA buckets: " << Config::getInstance().getnLbaBuckets() << std::endl;
     std::cout << "Number of Fingerprint buckets: " << Config::getInstance().getnFpBuckets() << std::endl;
+    std::cout << "LBA index memory: " << lbaIndex_->getMemoryUsage()
+      << " bytes, cache policy: " << lbaIndex_->getPolicyMemoryUsage()
+      << " bytes, bucket locks: " << lbaIndex_->getLockMemoryUsage() << " bytes" << std::endl;
+    std::cout << "Fingerprint index memory: " << fpIndex_->getMemoryUsage()
+      << " bytes, cache policy: " << fpIndex_->getPolicyMemoryUsage()
+      << " bytes, bucket locks: " << fpIndex_->getLockMemoryUsage() << " bytes" << std::endl;
+    if (Config::getInstance().isSketchRFEnabled()) {
+      std::cout << "Reference counter sketch memory: "
+        << SketchReferenceCounter::getInstance().getMemoryUsage() << " bytes" << std::endl;
+    }
   }
 
   MetadataModule::~MetadataModule() {
@@ -53,13 +64,13 @@ namespace cache {
   void MetadataModule::dedup(Chunk &chunk)
   {
     uint64_t fpHash = ~0ull;
-    if (chunk.lbaBucketLock_ == nullptr) {
-      chunk.lbaBucketLock_ = std::move(lbaIndex_->lock(chunk.lbaHash_));
+    if (!chunk.lbaBucketLock_.ownsLock()) {
+      chunk.lbaBucketLock_ = lbaIndex_->lock(chunk.lbaHash_);
     }
     chunk.hitLBAIndex_ = lbaIndex_->lookup(chunk.lbaHash_, fpHash) && (fpHash == chunk.fingerprintHash_);
 
-    if (chunk.fpBucketLock_ == nullptr) {
-      chunk.fpBucketLock_ = std::move(fpIndex_->lock(chunk.fingerprintHash_));
+    if (!chunk.fpBucketLock_.ownsLock()) {
+      chunk.fpBucketLock_ = fpIndex_->lock(chunk.fingerprintHash_);
     }
     chunk.hitFPIndex_ = fpIndex_->lookup(chunk.fingerprintHash_, chunk.nSubchunks_, chunk.cachedataLocation_, chunk.metadataLocation_);
 
@@ -78,16 +89,88 @@ namespace cache {
     }
   }
 
+  // Note:
+  // With multithreading and sequence bucket locks (the default), lookup
+  // runs without taking the bucket locks.
+  // It records the versions of the LBA and FP buckets it reads, and a HIT
+  // is only final after validateLookup() found both versions unchanged,
+  // i.e., no writer modified the buckets in the meantime (including while
+  // the cached data was read). Validating writes nothing, so readers of a
+  // hot bucket do not invalidate each other; the promote of the hit in
+  // update() is best-effort and skipped if the buckets changed meanwhile.
+  // A NOT_HIT chunk proceeds to dedup and update, so it leaves lookup
+  // holding the LBA lock.
+  // The lock-free reads race with writers on the bucket bytes; like any
+  // sequence lock reader, whatever they read is discarded unless the
+  // version validates (common/bucket_lock.h).
+
   void MetadataModule::lookup(Chunk &chunk)
+  {
+    if (!Config::getInstance().isMultiThreadingEnabled()
+        || !lbaIndex_->hasVersionedLocks()) {
+      lockedLookup(chunk);
+      return;
+    }
+
+    chunk.lbaBucketVersion_ = lbaIndex_->readBegin(chunk.lbaHash_);
+    chunk.hitLBAIndex_ = lbaIndex_->lookup(chunk.lbaHash_, chunk.fingerprintHash_);
+    if (chunk.hitLBAIndex_) {
+      chunk.fpBucketVersion_ = fpIndex_->readBegin(chunk.fingerprintHash_);
+      chunk.hitFPIndex_ = fpIndex_->lookup(chunk.fingerprintHash_, chunk.nSubchunks_, chunk.cachedataLocation_, chunk.metadataLocation_);
+      if (chunk.hitFPIndex_) {
+        chunk.verficationResult_ = metaVerification_->verify(chunk, true);
+      }
+    }
+
+    if (chunk.verficationResult_ == VerificationResult::ONLY_LBA_VALID) {
+      chunk.compressedLen_ = chunk.metadata_.compressedLen_;
+      chunk.lookupResult_ = HIT;
+      return;
+    }
+
+    // The miss holds if neither bucket changed while it was looked up
+    if (!chunk.hitLBAIndex_ ||
+        fpIndex_->readValidate(chunk.fingerprintHash_, chunk.fpBucketVersion_)) {
+      chunk.lbaBucketLock_ = lbaIndex_->tryUpgrade(chunk.lbaHash_, chunk.lbaBucketVersion_);
+    }
+    if (chunk.lbaBucketLock_.ownsLock()) {
+      chunk.lookupResult_ = NOT_HIT;
+    } else {
+      resetLookup(chunk);
+      lockedLookup(chunk);
+    }
+  }
+
+  bool MetadataModule::validateLookup(Chunk &chunk)
+  {
+    if (!Config::getInstance().isMultiThreadingEnabled()
+        || !lbaIndex_->hasVersionedLocks()
+        || chunk.lbaBucketLock_.ownsLock()) {
+      return true;
+    }
+
+    if (lbaIndex_->readValidate(chunk.lbaHash_, chunk.lbaBucketVersion_)
+        && fpIndex_->readValidate(chunk.fingerprintHash_, chunk.fpBucketVersion_)) {
+      return true;
+    }
+
+    // A writer got in between, look up again under the bucket locks.
+    // This does not retry optimistically, so a chunk reads at most twice.
+    resetLookup(chunk);
+    lockedLookup(chunk);
+    return false;
+  }
+
+  void MetadataModule::lockedLookup(Chunk &chunk)
   {
     // Obtain LBA bucket lock
-    chunk.lbaBucketLock_ = std::move(lbaIndex_->lock(chunk.lbaHash_));
+    chunk.lbaBucketLock_ = lbaIndex_->lock(chunk.lbaHash_);
     chunk.hitLBAIndex_ = lbaIndex_->lookup(chunk.lbaHash_, chunk.fingerprintHash_);
     if (chunk.hitLBAIndex_) {
-      chunk.fpBucketLock_ = std::move(fpIndex_->lock(chunk.fingerprintHash_));
+      chunk.fpBucketLock_ = fpIndex_->lock(chunk.fingerprintHash_);
       chunk.hitFPIndex_ = fpIndex_->lookup(chunk.fingerprintHash_, chunk.nSubchunks_, chunk.cachedataLocation_, chunk.metadataLocation_);
       if (chunk.hitFPIndex_) {
-        chunk.verficationResult_ = metaVerification_->verify(chunk);
+        chunk.verficationResult_ = metaVerification_->verify(chunk, true);
       }
     }
 
@@ -95,21 +178,57 @@ namespace cache {
       chunk.compressedLen_ = chunk.metadata_.compressedLen_;
       chunk.lookupResult_ = HIT;
     } else {
-      chunk.fpBucketLock_.reset();
-      assert(chunk.fpBucketLock_.get() == nullptr);
+      chunk.fpBucketLock_.unlock();
+      assert(!chunk.fpBucketLock_.ownsLock());
       chunk.lookupResult_ = NOT_HIT;
     }
   }
 
+  bool MetadataModule::lockHitBuckets(Chunk &chunk)
+  {
+    if (!Config::getInstance().isMultiThreadingEnabled()
+        || !lbaIndex_->hasVersionedLocks()
+        || chunk.lbaBucketLock_.ownsLock()) {
+      return true;
+    }
+    chunk.lbaBucketLock_ = lbaIndex_->tryUpgrade(chunk.lbaHash_, chunk.lbaBucketVersion_);
+    if (chunk.lbaBucketLock_.ownsLock()) {
+      chunk.fpBucketLock_ = fpIndex_->tryUpgrade(chunk.fingerprintHash_, chunk.fpBucketVersion_);
+      if (chunk.fpBucketLock_.ownsLock()) {
+        return true;
+      }
+      chunk.lbaBucketLock_.unlock();
+    }
+    return false;
+  }
+
+  void MetadataModule::resetLookup(Chunk &chunk)
+  {
+    chunk.hitLBAIndex_ = false;
+    chunk.hitFPIndex_ = false;
+    chunk.verficationResult_ = VERIFICATION_UNKNOWN;
+    chunk.lookupResult_ = LOOKUP_UNKNOWN;
+    chunk.hasCachedata_ = false;
+  }
+
   void MetadataModule::update(Chunk &chunk)
   {
     uint64_t removedFingerprintHash = ~0ull;
     BEGIN_TIMER();
 
     if (chunk.lookupResult_ == HIT) {
-      fpIndex_->promote(chunk.fingerprintHash_);
-      lbaIndex_->promote(chunk.lbaHash_);
+      if (lockHitBuckets(chunk)) {
+        fpIndex_->promote(chunk.fingerprintHash_);
+        lbaIndex_->promote(chunk.lbaHash_);
+      }
     } else {
+      // The fingerprint goes in first, so that the references
+      // below find it when the counts are embedded in the FP index
+      if (chunk.dedupResult_ == DUP_CONTENT) {
+        fpIndex_->promote(chunk.fingerprintHash_);
+      } else {
+        fpIndex_->update(chunk.fingerprintHash_, chunk.nSubchunks_, chunk.cachedataLocation_, chunk.metadataLocation_);
+      }
       // Note that for a cache-candidate chunk, hitLBAIndex indicates both hit in the LBA index and fpHash match
       // deduplication focus on the fingerprint part
       if (chunk.hitLBAIndex_) {
@@ -118,15 +237,8 @@ namespace cache {
         removedFingerprintHash = lbaIndex_->update(chunk.lbaHash_, chunk.fingerprintHash_);
         fpIndex_->reference(chunk.fingerprintHash_);
       }
-      if (chunk.dedupResult_ == DUP_CONTENT) {
-        fpIndex_->promote(chunk.fingerprintHash_);
-      } else {
-        fpIndex_->update(chunk.fingerprintHash_, chunk.nSubchunks_, chunk.cachedataLocation_, chunk.metadataLocation_);
-      }
     }
 
-    metaJournal_->addUpdate(chunk);
-
     END_TIMER(update_index);
 
     // Cases when an on-ssd metadata update is needed
@@ -141,12 +253,14 @@ namespace cache {
     if (Config::getInstance().getCacheMode() == tWriteBack) {
       DirtyList::getInstance().addLatestUpdate(chunk.addr_,
           chunk.cachedataLocation_,
-          (chunk.nSubchunks_ + 1) *
+          chunk.nSubchunks_ *
           Config::getInstance().getSubchunkSize());
     }
 #endif
     if (removedFingerprintHash != ~0ull && removedFingerprintHash != chunk.fingerprintHash_) {
-      fpIndex_->dereference(removedFingerprintHash);
+      fpIndex_->dereference(removedFingerprintHash, chunk.fingerprintHash_);
     }
+    // Count updates deferred (here or by other chunks) whose lock is free by now
+    fpIndex_->tryApplyDeferredReferenceCounts(chunk.fingerprintHash_);
   }
 }
@@ -14,15 +14,21 @@ class MetadataModule {
   ~MetadataModule();
   void dedup(Chunk &chunk);
   void lookup(Chunk &chunk);
+  // Confirm a lock-free lookup result, false if it had to be looked up again
+  bool validateLookup(Chunk &chunk);
   void update(Chunk &chunk);
   void dumpStats();
 
   std::shared_ptr<LBAIndex> lbaIndex_;
   std::shared_ptr<FPIndex> fpIndex_;
   std::unique_ptr<MetaVerification> metaVerification_;
-  std::unique_ptr<MetaJournal> metaJournal_;
  private:
   MetadataModule();
+  void lockedLookup(Chunk &chunk);
+  // Take the bucket locks of a lock-free hit to promote it, false (and no
+  // locks) if a writer modified either bucket since it was looked up
+  bool lockHitBuckets(Chunk &chunk);
+  void resetLookup(Chunk &chunk);
 };
 
 }
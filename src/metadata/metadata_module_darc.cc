@@ -41,6 +41,13 @@ namespace cache {
       else
         c.lookupResult_ = NOT_HIT;
     }
+
+    // Lookups here do not run lock-free, the result is final
+    bool MetadataModule::validateLookup(Chunk &c)
+    {
+      return true;
+    }
+
     void MetadataModule::update(Chunk &c)
     {
       DARCLBAIndex::getInstance().adjust_adaptive_factor(c.addr_);
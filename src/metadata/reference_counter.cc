@@ -2,7 +2,7 @@
 #include "reference_counter.h"
 #include "common/config.h"
 #include "utils/xxhash.h"
-#include "bitmap.h"
+#include <algorithm>
 #include <iostream>
 #include <cassert>
 #include <cstring>
@@ -14,90 +14,261 @@ namespace cache {
   }
 
   uint32_t MapReferenceCounter::query(uint64_t key) {
-    if (counters_.find(key) == counters_.end()) {
+    auto it = counters_.find(key);
+    if (it == counters_.end()) {
       return 0;
     } else {
-      return counters_[key];
+      return it->second;
     }
   }
 
-  bool MapReferenceCounter::reference(uint64_t key) {
-    if (counters_.find(key) == counters_.end()) {
-      counters_[key] = 0;
+  uint32_t MapReferenceCounter::reference(uint64_t key) {
+    // A new key starts at 0
+    return counters_[key] += 1;
+  }
+
+  uint32_t MapReferenceCounter::dereference(uint64_t key) {
+    auto it = counters_.find(key);
+    assert(it != counters_.end());
+    uint32_t count = it->second -= 1;
+    if (count == 0) {
+      counters_.erase(it);
+    }
+    return count;
+  }
+
+  void MapReferenceCounter::saveState(std::vector<uint8_t> &state) {
+    uint8_t entry[sizeof(uint64_t) + sizeof(uint32_t)];
+    state.reserve(state.size() + counters_.size() * sizeof(entry));
+    for (auto &pr : counters_) {
+      memcpy(entry, &pr.first, sizeof(uint64_t));
+      memcpy(entry + sizeof(uint64_t), &pr.second, sizeof(uint32_t));
+      state.insert(state.end(), entry, entry + sizeof(entry));
     }
-    counters_[key] += 1;
   }
 
-  bool MapReferenceCounter::dereference(uint64_t key) {
-    assert(counters_.find(key) != counters_.end());
-    counters_[key] -= 1;
-    if (counters_[key] == 0) {
-      counters_.erase(key);
+  bool MapReferenceCounter::restoreState(const uint8_t *state, uint64_t len) {
+    constexpr uint32_t kEntrySize = sizeof(uint64_t) + sizeof(uint32_t);
+    if (len % kEntrySize != 0) {
+      return false;
+    }
+    counters_.clear();
+    counters_.reserve(len / kEntrySize);
+    for (uint64_t offset = 0; offset < len; offset += kEntrySize) {
+      uint64_t key;
+      uint32_t count;
+      memcpy(&key, state + offset, sizeof(key));
+      memcpy(&count, state + offset + sizeof(key), sizeof(count));
+      counters_[key] = count;
     }
+    return true;
   }
 
+  constexpr uint32_t SketchReferenceCounter::kCountersPerWord;
+  constexpr uint32_t SketchReferenceCounter::kCountersPerOverflowSlot;
+  constexpr uint32_t SketchReferenceCounter::kMaxOverflowProbes;
+  constexpr uint32_t SketchReferenceCounter::kOverflowShards;
+
   SketchReferenceCounter::SketchReferenceCounter() {
     height_ = 4;
     width_ = Config::getInstance().getnLbaBuckets() * Config::getInstance().getnLBASlotsPerBucket();
-    sketch_ = new uint8_t[4 * 4 * width_ / 8];
-    memset(sketch_, 0, 4 * 4 * width_ / 8);
+    // 4 bits per counter, as many bytes as the bit-packed sketch
+    uint32_t nWords = (height_ * width_ + kCountersPerWord - 1) / kCountersPerWord;
+    sketch_ = std::make_unique< std::atomic<uint64_t>[] >(nWords);
+    for (uint32_t i = 0; i < nWords; ++i) {
+      sketch_[i].store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t nOverflowSlots = kMaxOverflowProbes;
+    while (nOverflowSlots < width_ / kCountersPerOverflowSlot) {
+      nOverflowSlots <<= 1;
+    }
+    overflow_ = std::make_unique< std::atomic<uint64_t>[] >(nOverflowSlots);
+    for (uint32_t i = 0; i < nOverflowSlots; ++i) {
+      overflow_[i].store(0, std::memory_order_relaxed);
+    }
+    overflowMask_ = nOverflowSlots - 1;
+    overflowMutexes_ = std::make_unique< std::mutex[] >(kOverflowShards);
+    nOverflowed_.store(0, std::memory_order_relaxed);
   }
 
   void SketchReferenceCounter::clear() {}
 
-  uint32_t SketchReferenceCounter::query(uint64_t key) {
-    uint32_t minVal = ~0u;
-    uint32_t hashVal = 0;
-    for (int i = 0; i < height_; ++i) {
-      hashVal = XXH32(&key, 8, i * 1003 + 7);
-      uint32_t bucketId = i * width_ + hashVal % width_;
-      uint32_t overflowValue = 0;
-      uint32_t countValue = Bitmap::Manipulator(sketch_).getBits(bucketId * 4, bucketId * 4 + 4);
-      if (mp_.find(bucketId) != mp_.end()) {
-        overflowValue = mp_[bucketId];
+  uint64_t SketchReferenceCounter::getMemoryUsage() {
+    return (height_ * width_ + kCountersPerWord - 1) / kCountersPerWord * sizeof(uint64_t)
+      + (overflowMask_ + 1ull) * sizeof(uint64_t);
+  }
+
+  void SketchReferenceCounter::saveState(std::vector<uint8_t> &state) {
+    uint32_t nWords = (height_ * width_ + kCountersPerWord - 1) / kCountersPerWord;
+    state.reserve(state.size() + getMemoryUsage());
+    for (uint32_t i = 0; i < nWords; ++i) {
+      uint64_t word = sketch_[i].load(std::memory_order_relaxed);
+      state.insert(state.end(), (uint8_t *)&word, (uint8_t *)&word + sizeof(word));
+    }
+    for (uint32_t i = 0; i <= overflowMask_; ++i) {
+      uint64_t entry = overflow_[i].load(std::memory_order_relaxed);
+      state.insert(state.end(), (uint8_t *)&entry, (uint8_t *)&entry + sizeof(entry));
+    }
+  }
+
+  bool SketchReferenceCounter::restoreState(const uint8_t *state, uint64_t len) {
+    uint32_t nWords = (height_ * width_ + kCountersPerWord - 1) / kCountersPerWord;
+    if (len != getMemoryUsage()) {
+      return false;
+    }
+    uint64_t word;
+    for (uint32_t i = 0; i < nWords; ++i, state += sizeof(word)) {
+      memcpy(&word, state, sizeof(word));
+      sketch_[i].store(word, std::memory_order_relaxed);
+    }
+    uint32_t nOverflowed = 0;
+    for (uint32_t i = 0; i <= overflowMask_; ++i, state += sizeof(word)) {
+      memcpy(&word, state, sizeof(word));
+      overflow_[i].store(word, std::memory_order_relaxed);
+      nOverflowed += (uint32_t)word != 0;
+    }
+    nOverflowed_.store(nOverflowed, std::memory_order_relaxed);
+    return true;
+  }
+
+  uint64_t SketchReferenceCounter::hashKey(uint64_t key) {
+    return XXH64(&key, 8, 7);
+  }
+
+  uint32_t SketchReferenceCounter::findOverflow(uint32_t counterId) {
+    uint64_t tag = (uint64_t)(counterId + 1) << 32u;
+    uint32_t slot = (counterId * 0x9E3779B1u) & overflowMask_;
+    for (uint32_t i = 0; i < kMaxOverflowProbes; ++i, slot = (slot + 1) & overflowMask_) {
+      uint64_t entry = overflow_[slot].load(std::memory_order_acquire);
+      if (entry == 0) {
+        break;
+      }
+      if ((entry & ~0xffffffffull) == tag) {
+        return slot;
       }
-      minVal = (countValue + overflowValue < minVal) ? countValue + overflowValue : minVal;
     }
-    return minVal;
+    return ~0u;
   }
 
-  void SketchReferenceCounter::reference(uint64_t key) {
-    uint32_t minVal = ~0u;
-    uint32_t hashVal = 0;
-    uint32_t width = width_;
-    for (int i = 0; i < height_; ++i) {
-      hashVal = XXH32(&key, 8, i * 1003 + 7);
-      uint32_t bucketId = i * width_ + hashVal % width_;
-      uint32_t countValue = Bitmap::Manipulator(sketch_).getBits(bucketId * 4, bucketId * 4 + 4);
-      if (countValue == 15) {
-        if (mp_.find(bucketId) == mp_.end()) {
-          mp_[bucketId] = 1;
-        } else {
-          mp_[bucketId] += 1;
+  uint32_t SketchReferenceCounter::queryCounter(uint32_t counterId) {
+    uint32_t shift = counterId % kCountersPerWord * 4;
+    uint32_t countValue = (sketch_[counterId / kCountersPerWord].load(
+          std::memory_order_relaxed) >> shift) & 15u;
+    // Only a saturated counter has an overflow
+    if (countValue == 15 && nOverflowed_.load(std::memory_order_acquire) != 0) {
+      uint32_t slot = findOverflow(counterId);
+      if (slot != ~0u) {
+        countValue += (uint32_t)overflow_[slot].load(std::memory_order_relaxed);
+      }
+    }
+    return countValue;
+  }
+
+  uint32_t SketchReferenceCounter::incrementCounter(uint32_t counterId) {
+    std::atomic<uint64_t> &word = sketch_[counterId / kCountersPerWord];
+    uint32_t shift = counterId % kCountersPerWord * 4;
+    uint64_t v = word.load(std::memory_order_relaxed);
+    while (((v >> shift) & 15u) != 15u) {
+      if (word.compare_exchange_weak(v, v + (1ull << shift), std::memory_order_relaxed)) {
+        return ((v >> shift) & 15u) + 1;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(overflowMutexes_[counterId % kOverflowShards]);
+    uint64_t tag = (uint64_t)(counterId + 1) << 32u;
+    // Entries of other counters may change under us, start over when a CAS fails
+    while (true) {
+      uint32_t slot = findOverflow(counterId);
+      if (slot != ~0u) {
+        uint64_t entry = overflow_[slot].load(std::memory_order_relaxed);
+        if ((entry & ~0xffffffffull) == tag &&
+            overflow_[slot].compare_exchange_strong(entry, entry + 1, std::memory_order_acq_rel)) {
+          if ((uint32_t)entry == 0) {
+            nOverflowed_.fetch_add(1, std::memory_order_release);
+          }
+          return 15 + (uint32_t)entry + 1;
         }
-      } else {
-        Bitmap::Manipulator(sketch_).storeBits(bucketId * 4, bucketId * 4 + 4, countValue + 1);
+        continue;
+      }
+
+      // Take the first never used or drained slot of the probe window
+      bool raced = false;
+      slot = (counterId * 0x9E3779B1u) & overflowMask_;
+      for (uint32_t i = 0; i < kMaxOverflowProbes && !raced; ++i, slot = (slot + 1) & overflowMask_) {
+        uint64_t entry = overflow_[slot].load(std::memory_order_relaxed);
+        if (entry != 0 && (uint32_t)entry != 0) {
+          continue;
+        }
+        if (overflow_[slot].compare_exchange_strong(entry, tag | 1u, std::memory_order_acq_rel)) {
+          nOverflowed_.fetch_add(1, std::memory_order_release);
+          return 16;
+        }
+        raced = true;
+      }
+      if (!raced) {
+        // The window is full, the count saturates
+        return 15;
       }
     }
   }
 
-  void SketchReferenceCounter::dereference(uint64_t key) {
-    uint32_t minVal = ~0u;
-    uint32_t hashVal = 0;
-    uint32_t width = width_;
-    uint32_t a = mp_.size();
-    for (int i = 0; i < height_; ++i) {
-      hashVal = XXH32(&key, 8, i * 1003 + 7);
-      uint32_t bucketId = i * width_ + hashVal % width_;
-      if (mp_.find(bucketId) != mp_.end()) {
-        mp_[bucketId] -= 1;
-        if (mp_[bucketId] == 0) {
-          mp_.erase(bucketId);
+  uint32_t SketchReferenceCounter::decrementCounter(uint32_t counterId) {
+    // The overflow goes first, as long as there is one the counter stays at 15
+    if (nOverflowed_.load(std::memory_order_acquire) != 0) {
+      std::lock_guard<std::mutex> lock(overflowMutexes_[counterId % kOverflowShards]);
+      uint64_t tag = (uint64_t)(counterId + 1) << 32u;
+      uint32_t slot;
+      while ((slot = findOverflow(counterId)) != ~0u) {
+        uint64_t entry = overflow_[slot].load(std::memory_order_relaxed);
+        if ((entry & ~0xffffffffull) != tag || (uint32_t)entry == 0) {
+          break;
+        }
+        if (overflow_[slot].compare_exchange_strong(entry, entry - 1, std::memory_order_acq_rel)) {
+          if ((uint32_t)entry == 1) {
+            nOverflowed_.fetch_sub(1, std::memory_order_relaxed);
+          }
+          return 15 + (uint32_t)entry - 1;
         }
-      } else {
-        uint32_t countValue = Bitmap::Manipulator(sketch_).getBits(bucketId * 4, bucketId * 4 + 4);
-        Bitmap::Manipulator(sketch_).storeBits(bucketId * 4, bucketId * 4 + 4, countValue - 1);
       }
     }
+
+    std::atomic<uint64_t> &word = sketch_[counterId / kCountersPerWord];
+    uint32_t shift = counterId % kCountersPerWord * 4;
+    uint64_t v = word.load(std::memory_order_relaxed), countValue;
+    do {
+      // A counter at 0 wraps around to 15 like the bit-packed one did,
+      // without borrowing from its neighbour
+      countValue = (((v >> shift) & 15u) - 1) & 15u;
+    } while (!word.compare_exchange_weak(v,
+          (v & ~(15ull << shift)) | (countValue << shift), std::memory_order_relaxed));
+    return countValue;
+  }
+
+  uint32_t SketchReferenceCounter::query(uint64_t key) {
+    uint32_t minVal = ~0u;
+    uint64_t hash = hashKey(key);
+    for (uint32_t i = 0; i < height_; ++i) {
+      minVal = std::min(minVal, queryCounter(getCounterId(hash, i)));
+    }
+    return minVal;
+  }
+
+  uint32_t SketchReferenceCounter::reference(uint64_t key) {
+    uint32_t minVal = ~0u;
+    uint64_t hash = hashKey(key);
+    for (uint32_t i = 0; i < height_; ++i) {
+      minVal = std::min(minVal, incrementCounter(getCounterId(hash, i)));
+    }
+    return minVal;
+  }
+
+  uint32_t SketchReferenceCounter::dereference(uint64_t key) {
+    uint32_t minVal = ~0u;
+    uint64_t hash = hashKey(key);
+    for (uint32_t i = 0; i < height_; ++i) {
+      minVal = std::min(minVal, decrementCounter(getCounterId(hash, i)));
+    }
+    return minVal;
   }
 }
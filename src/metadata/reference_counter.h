@@ -2,22 +2,28 @@
 #define AUSTERECACHE_REFERENCECOUNTER_H
 
 
-#include <map>
+#include <atomic>
+#include <memory>
 #include <common/config.h>
+#include <common/flat_hash_map.h>
 #include <cstring>
 #include <mutex>
+#include <vector>
 
 namespace cache {
 
   class MapReferenceCounter {
 
-    std::map<uint64_t, uint32_t> counters_;
+    FlatHashMap<uint64_t, uint32_t> counters_;
 
     public:
     bool clear();
     uint32_t query(uint64_t key);
-    bool reference(uint64_t key);
-    bool dereference(uint64_t key);
+    uint32_t reference(uint64_t key);
+    uint32_t dereference(uint64_t key);
+    // Index checkpoint: (key, count) pairs
+    void saveState(std::vector<uint8_t> &state);
+    bool restoreState(const uint8_t *state, uint64_t len);
 
     static MapReferenceCounter& getInstance() {
       static MapReferenceCounter instance;
@@ -25,21 +31,72 @@ namespace cache {
     }
   };
 
+  /**
+   * @brief Count-min sketch of 4-bit counters (height_ rows of width_ counters),
+   *        the part of a count above 15 is kept in an overflow table.
+   *
+   *        1. Counters are packed 16 to an atomic 64-bit word and updated with
+   *           compare-and-swap, so that concurrent updates never wait on each other.
+   *        2. The overflow table is open-addressed with linear probing, one
+   *           atomic word per entry: (counter id + 1) << 32 | overflow. It has a
+   *           slot per kCountersPerOverflowSlot counters of a row and is probed
+   *           at most kMaxOverflowProbes slots from a counter's home slot, so
+   *           memory and access time are bounded. Slots are never emptied: an
+   *           entry whose overflow drops to 0 stays in place for the probe chains
+   *           and may be taken over by another counter. When the probe window
+   *           has no free slot, the increment is dropped (the count saturates).
+   *        3. Updates to the overflow of a counter are serialized by one of
+   *           kOverflowShards mutexes; the table is only touched once a counter
+   *           saturates, and not at all while nOverflowed_ is 0. A decrement
+   *           racing with the increment that saturates a counter may leave an
+   *           overflow next to a counter below 15, the sum stays right and
+   *           query() misses the overflow until it drains.
+   */
   class SketchReferenceCounter {
-    uint8_t *sketch_;
+    static constexpr uint32_t kCountersPerWord = 16;
+    static constexpr uint32_t kCountersPerOverflowSlot = 16;
+    static constexpr uint32_t kMaxOverflowProbes = 64;
+    static constexpr uint32_t kOverflowShards = 64;
+
+    std::unique_ptr< std::atomic<uint64_t>[] > sketch_;
     uint32_t width_, height_;
-    std::map<uint32_t, uint16_t> mp_;
+    std::unique_ptr< std::atomic<uint64_t>[] > overflow_;
+    uint32_t overflowMask_;
+    std::unique_ptr< std::mutex[] > overflowMutexes_;
+    // Counters with a non-zero overflow
+    std::atomic<uint32_t> nOverflowed_;
 
     SketchReferenceCounter();
+    // One 64-bit hash of the key gives the counters of all rows: row i takes
+    // h1 + i * h2 (double hashing), mapped onto the row by a multiply-shift
+    // instead of a modulo
+    static uint64_t hashKey(uint64_t key);
+    inline uint32_t getCounterId(uint64_t hash, uint32_t row)
+    {
+      uint32_t h = (uint32_t)hash + row * ((uint32_t)(hash >> 32u) | 1u);
+      return row * width_ + (uint32_t)(((uint64_t)h * width_) >> 32u);
+    }
+    // Slot of the overflow table holding counterId, ~0 if there is none
+    uint32_t findOverflow(uint32_t counterId);
+    // Value of a counter including its overflow
+    uint32_t queryCounter(uint32_t counterId);
+    // Return the value of the counter after the update
+    uint32_t incrementCounter(uint32_t counterId);
+    uint32_t decrementCounter(uint32_t counterId);
     public:
       void clear();
       uint32_t query(uint64_t key);
-      void reference(uint64_t key);
-      void dereference(uint64_t key);
+      uint32_t reference(uint64_t key);
+      uint32_t dereference(uint64_t key);
       static SketchReferenceCounter& getInstance() {
         static SketchReferenceCounter instance;
         return instance;
       }
+      // Bytes of the counters and of the overflow table
+      uint64_t getMemoryUsage();
+      // Index checkpoint: the counter words, then the overflow table
+      void saveState(std::vector<uint8_t> &state);
+      bool restoreState(const uint8_t *state, uint64_t len);
   };
 
   class ReferenceCounter {
@@ -49,30 +106,49 @@ namespace cache {
         static ReferenceCounter instance;
         return instance;
       }
+      // The sketch synchronizes by itself, rfMutex_ only guards the map
       uint32_t query(uint64_t key) {
-        std::lock_guard<std::mutex> lock(rfMutex_);
         if (Config::getInstance().isSketchRFEnabled()) {
           return SketchReferenceCounter::getInstance().query(key);
         } else {
+          std::lock_guard<std::mutex> lock(rfMutex_);
           return MapReferenceCounter::getInstance().query(key);
         }
       }
 
-      void reference(uint64_t key) {
-        std::lock_guard<std::mutex> lock(rfMutex_);
+      // reference and dereference return the count of key after the update
+      uint32_t reference(uint64_t key) {
+        if (Config::getInstance().isSketchRFEnabled()) {
+          return SketchReferenceCounter::getInstance().reference(key);
+        } else {
+          std::lock_guard<std::mutex> lock(rfMutex_);
+          return MapReferenceCounter::getInstance().reference(key);
+        }
+      }
+
+      uint32_t dereference(uint64_t key) {
+        if (Config::getInstance().isSketchRFEnabled()) {
+          return SketchReferenceCounter::getInstance().dereference(key);
+        } else {
+          std::lock_guard<std::mutex> lock(rfMutex_);
+          return MapReferenceCounter::getInstance().dereference(key);
+        }
+      }
+
+      // Index checkpoint (metadata/index_checkpoint.h), without concurrent updates
+      void saveState(std::vector<uint8_t> &state) {
         if (Config::getInstance().isSketchRFEnabled()) {
-          SketchReferenceCounter::getInstance().reference(key);
+          SketchReferenceCounter::getInstance().saveState(state);
         } else {
-          MapReferenceCounter::getInstance().reference(key);
+          MapReferenceCounter::getInstance().saveState(state);
         }
       }
 
-      void dereference(uint64_t key) {
-        std::lock_guard<std::mutex> lock(rfMutex_);
+      bool restoreState(const uint8_t *state, uint64_t len) {
         if (Config::getInstance().isSketchRFEnabled()) {
-          SketchReferenceCounter::getInstance().dereference(key);
+          return SketchReferenceCounter::getInstance().restoreState(state, len);
         } else {
-          MapReferenceCounter::getInstance().dereference(key);
+          return MapReferenceCounter::getInstance().restoreState(state, len);
         }
       }
       std::mutex rfMutex_;
@@ -0,0 +1,304 @@
+/* File: metadata/signature_scan.h
+ * Description:
+ *   This file contains the signature matching kernels behind LBABucket::lookup
+ *   and FPBucket::lookup.
+ *
+ *   1. A bucket is scanned in groups of 64 slots. For each group the kernel
+ *      compares the target signature against all slots at once and produces a
+ *      64-bit match mask (bit i set if slot i holds the signature), which is
+ *      then masked with the valid bits of the group.
+ *   2. In the bit-packed layout (nBitsPerSlot bits per slot, key first), each
+ *      lane loads the 32-bit word starting at the byte holding its key and
+ *      shifts the key down, so keys of up to 25 bits go through the vector
+ *      kernels (AVX-512, AVX2 or SSE2, picked at compile time by -march);
+ *      wider keys use the scalar kernel.
+ *   3. In the byte-aligned layout keys are a plain 8/16/32-bit array and are
+ *      compared with ordinary vector loads (matchGroupAligned).
+ *   4. find() returns the first matching valid slot together with the length
+ *      of the contiguous run of matching valid slots starting there, which is
+ *      the number of slots occupied by a (compressed) chunk in FPBucket.
+ *
+ *   Note: the bit-packed kernels may read up to 3 bytes past the key of the
+ *         last slot, the owner of the slot memory (Index) pads its arrays for it.
+ */
+#ifndef __SIGNATURE_SCAN_H__
+#define __SIGNATURE_SCAN_H__
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "bitmap.h"
+
+namespace cache {
+  class SignatureScan {
+    public:
+      static constexpr uint32_t kMaxVectorKeyBits = 25;
+
+      static inline uint32_t loadKey(const uint8_t *data, uint32_t slotId,
+          uint32_t nBitsPerSlot, uint32_t keyMask)
+      {
+        uint32_t b = slotId * nBitsPerSlot, w;
+        memcpy(&w, data + (b >> 3u), sizeof(w));
+        return (w >> (b & 7u)) & keyMask;
+      }
+
+      /**
+       * @brief Compare key against the keys of slots [firstSlot, firstSlot + nSlots)
+       *
+       * @param nSlots number of slots in the group, at most 64
+       *
+       * @return a mask with bit i set if slot firstSlot + i holds key
+       */
+      static inline uint64_t matchGroup(const uint8_t *data, uint32_t firstSlot, uint32_t nSlots,
+          uint32_t nBitsPerSlot, uint32_t nBitsPerKey, uint32_t key)
+      {
+        if (nBitsPerKey > kMaxVectorKeyBits) {
+          return matchGroupScalar(data, firstSlot, nSlots, nBitsPerSlot, nBitsPerKey, key);
+        }
+        uint32_t keyMask = (1u << nBitsPerKey) - 1;
+        // Lanes past the end of the group are clamped to its last slot so that
+        // no load goes beyond the bucket; their bits are dropped below.
+        uint32_t lastBit = (firstSlot + nSlots - 1) * nBitsPerSlot;
+        uint64_t mask = 0;
+#if defined(__AVX512F__)
+        const __m512i vKey = _mm512_set1_epi32(key), vKeyMask = _mm512_set1_epi32(keyMask),
+                      vLastBit = _mm512_set1_epi32(lastBit), vSeven = _mm512_set1_epi32(7),
+                      vStep = _mm512_set1_epi32(16 * nBitsPerSlot);
+        __m512i vBits = _mm512_mullo_epi32(
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+            _mm512_set1_epi32(nBitsPerSlot));
+        vBits = _mm512_add_epi32(vBits, _mm512_set1_epi32(firstSlot * nBitsPerSlot));
+        // The zero-masking forms: the plain ones take an undefined source,
+        // which GCC reports as used uninitialized
+        const __mmask16 kAll = 0xffff;
+        for (uint32_t i = 0; i < nSlots; i += 16) {
+          __m512i bits = _mm512_maskz_min_epu32(kAll, vBits, vLastBit);
+          __m512i words = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), kAll,
+              _mm512_maskz_srli_epi32(kAll, bits, 3), data, 1);
+          __m512i keys = _mm512_and_si512(
+              _mm512_maskz_srlv_epi32(kAll, words, _mm512_and_si512(bits, vSeven)), vKeyMask);
+          mask |= (uint64_t)_mm512_cmpeq_epi32_mask(keys, vKey) << i;
+          vBits = _mm512_add_epi32(vBits, vStep);
+        }
+#elif defined(__AVX2__)
+        const __m256i vKey = _mm256_set1_epi32(key), vKeyMask = _mm256_set1_epi32(keyMask),
+                      vLastBit = _mm256_set1_epi32(lastBit), vSeven = _mm256_set1_epi32(7),
+                      vStep = _mm256_set1_epi32(8 * nBitsPerSlot);
+        __m256i vBits = _mm256_mullo_epi32(
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(nBitsPerSlot));
+        vBits = _mm256_add_epi32(vBits, _mm256_set1_epi32(firstSlot * nBitsPerSlot));
+        for (uint32_t i = 0; i < nSlots; i += 8) {
+          __m256i bits = _mm256_min_epu32(vBits, vLastBit);
+          __m256i words = _mm256_i32gather_epi32((const int *)data, _mm256_srli_epi32(bits, 3), 1);
+          __m256i keys = _mm256_and_si256(
+              _mm256_srlv_epi32(words, _mm256_and_si256(bits, vSeven)), vKeyMask);
+          uint32_t m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(keys, vKey)));
+          mask |= (uint64_t)m << i;
+          vBits = _mm256_add_epi32(vBits, vStep);
+        }
+#elif defined(__SSE2__)
+        // No gather and no per-lane shifts before AVX2: extract four keys with
+        // scalar loads and compare them at once.
+        const __m128i vKey = _mm_set1_epi32(key);
+        uint32_t lastSlot = firstSlot + nSlots - 1;
+        for (uint32_t i = 0; i < nSlots; i += 4) {
+          uint32_t s = firstSlot + i;
+          __m128i keys = _mm_setr_epi32(
+              loadKey(data, std::min(s, lastSlot), nBitsPerSlot, keyMask),
+              loadKey(data, std::min(s + 1, lastSlot), nBitsPerSlot, keyMask),
+              loadKey(data, std::min(s + 2, lastSlot), nBitsPerSlot, keyMask),
+              loadKey(data, std::min(s + 3, lastSlot), nBitsPerSlot, keyMask));
+          uint32_t m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(keys, vKey)));
+          mask |= (uint64_t)m << i;
+        }
+#else
+        for (uint32_t i = 0; i < nSlots; ++i) {
+          mask |= (uint64_t)(loadKey(data, firstSlot + i, nBitsPerSlot, keyMask) == key) << i;
+        }
+        (void)lastBit;
+#endif
+        return nSlots < 64 ? mask & ((1ull << nSlots) - 1) : mask;
+      }
+
+      static inline uint64_t matchGroupScalar(const uint8_t *data, uint32_t firstSlot, uint32_t nSlots,
+          uint32_t nBitsPerSlot, uint32_t nBitsPerKey, uint32_t key)
+      {
+        Bitmap::Manipulator manipulator(const_cast<uint8_t *>(data));
+        uint64_t mask = 0;
+        for (uint32_t i = 0; i < nSlots; ++i) {
+          uint32_t b = (firstSlot + i) * nBitsPerSlot;
+          mask |= (uint64_t)(manipulator.getBits(b, b + nBitsPerKey) == key) << i;
+        }
+        return mask;
+      }
+
+      // Valid bits of slots [firstSlot, firstSlot + nSlots), firstSlot is a multiple of 64
+      static inline uint64_t validGroup(const uint8_t *valid, uint32_t firstSlot, uint32_t nSlots)
+      {
+        uint64_t v = 0;
+        memcpy(&v, valid + (firstSlot >> 3u), (nSlots + 7) >> 3u);
+        return nSlots < 64 ? v & ((1ull << nSlots) - 1) : v;
+      }
+
+      /**
+       * @brief Compare key against the keys of slots [firstSlot, firstSlot + nSlots)
+       *        of a byte-aligned key array (KeyT is uint8_t, uint16_t, or uint32_t)
+       *
+       * @return a mask with bit i set if slot firstSlot + i holds key
+       */
+      template <typename KeyT>
+      static inline uint64_t matchGroupAligned(const uint8_t *keys, uint32_t firstSlot,
+          uint32_t nSlots, uint32_t key)
+      {
+        const uint8_t *p = keys + firstSlot * sizeof(KeyT);
+        uint64_t mask = 0;
+        uint32_t i = 0;
+#if defined(__AVX512BW__)
+        constexpr uint32_t kLanes = 64 / sizeof(KeyT);
+        for ( ; i + kLanes <= nSlots; i += kLanes) {
+          __m512i v = _mm512_loadu_si512((const void *)(p + i * sizeof(KeyT)));
+          uint64_t m;
+          if (sizeof(KeyT) == 1) {
+            m = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8((char)key));
+          } else if (sizeof(KeyT) == 2) {
+            m = _mm512_cmpeq_epi16_mask(v, _mm512_set1_epi16((short)key));
+          } else {
+            m = _mm512_cmpeq_epi32_mask(v, _mm512_set1_epi32((int)key));
+          }
+          mask |= kLanes == 64 ? m : m << i;
+        }
+#elif defined(__AVX2__)
+        constexpr uint32_t kLanes = 32 / sizeof(KeyT);
+        for ( ; i + kLanes <= nSlots; i += kLanes) {
+          __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * sizeof(KeyT)));
+          uint64_t m;
+          if (sizeof(KeyT) == 1) {
+            m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)key)));
+          } else if (sizeof(KeyT) == 2) {
+            // Narrow the 16-bit lanes to bytes, packs works per 128-bit half
+            __m256i eq = _mm256_cmpeq_epi16(v, _mm256_set1_epi16((short)key));
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(eq, eq), 0xd8);
+            m = (uint32_t)_mm256_movemask_epi8(packed) & 0xffffu;
+          } else {
+            m = (uint32_t)_mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)key))));
+          }
+          mask |= m << i;
+        }
+#elif defined(__SSE2__)
+        constexpr uint32_t kLanes = 16 / sizeof(KeyT);
+        for ( ; i + kLanes <= nSlots; i += kLanes) {
+          __m128i v = _mm_loadu_si128((const __m128i *)(p + i * sizeof(KeyT)));
+          uint64_t m;
+          if (sizeof(KeyT) == 1) {
+            m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)key)));
+          } else if (sizeof(KeyT) == 2) {
+            __m128i eq = _mm_cmpeq_epi16(v, _mm_set1_epi16((short)key));
+            m = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(eq, eq)) & 0xffu;
+          } else {
+            m = (uint32_t)_mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_set1_epi32((int)key))));
+          }
+          mask |= m << i;
+        }
+#endif
+        // Tail (and the whole group without SIMD)
+        for ( ; i < nSlots; ++i) {
+          KeyT k;
+          memcpy(&k, p + i * sizeof(KeyT), sizeof(KeyT));
+          mask |= (uint64_t)(k == (KeyT)key) << i;
+        }
+        return mask;
+      }
+
+      /**
+       * @brief Find the first valid slot holding key
+       *
+       * @param runLength number of contiguous valid slots holding key, starting
+       *                  from the returned slot
+       *
+       * @return ~0 if no valid slot holds key, otherwise the first such slot
+       */
+      static inline uint32_t find(const uint8_t *data, const uint8_t *valid, uint32_t nSlots,
+          uint32_t nBitsPerSlot, uint32_t nBitsPerKey, uint32_t key, uint32_t &runLength)
+      {
+        return findWith(valid, nSlots, runLength,
+            [=](uint32_t firstSlot, uint32_t n) {
+              return matchGroup(data, firstSlot, n, nBitsPerSlot, nBitsPerKey, key);
+            });
+      }
+
+      template <typename KeyT>
+      static inline uint32_t findAligned(const uint8_t *keys, const uint8_t *valid, uint32_t nSlots,
+          uint32_t key, uint32_t &runLength)
+      {
+        return findWith(valid, nSlots, runLength,
+            [=](uint32_t firstSlot, uint32_t n) {
+              return matchGroupAligned<KeyT>(keys, firstSlot, n, key);
+            });
+      }
+
+      /**
+       * @brief Reference implementation of find(), one slot at a time
+       */
+      static inline uint32_t findScalar(const uint8_t *data, const uint8_t *valid, uint32_t nSlots,
+          uint32_t nBitsPerSlot, uint32_t nBitsPerKey, uint32_t key, uint32_t &runLength)
+      {
+        Bitmap::Manipulator dataManipulator(const_cast<uint8_t *>(data));
+        Bitmap::Manipulator validManipulator(const_cast<uint8_t *>(valid));
+        runLength = 0;
+        for (uint32_t slotId = 0; slotId < nSlots; ++slotId) {
+          uint32_t b = slotId * nBitsPerSlot;
+          if (!validManipulator.get(slotId)
+              || dataManipulator.getBits(b, b + nBitsPerKey) != key) {
+            continue;
+          }
+          uint32_t firstSlotId = slotId;
+          while (slotId < nSlots && validManipulator.get(slotId)
+                 && dataManipulator.getBits(slotId * nBitsPerSlot,
+                                            slotId * nBitsPerSlot + nBitsPerKey) == key) {
+            ++runLength;
+            ++slotId;
+          }
+          return firstSlotId;
+        }
+        return ~((uint32_t)0);
+      }
+
+      static inline uint32_t countTrailingOnes(uint64_t v)
+      {
+        return ~v == 0 ? 64 : __builtin_ctzll(~v);
+      }
+
+    private:
+      template <typename Matcher>
+      static inline uint32_t findWith(const uint8_t *valid, uint32_t nSlots,
+          uint32_t &runLength, Matcher matchGroupOf)
+      {
+        runLength = 0;
+        for (uint32_t base = 0; base < nSlots; base += 64) {
+          uint32_t n = std::min(64u, nSlots - base);
+          uint64_t hits = matchGroupOf(base, n) & validGroup(valid, base, n);
+          if (hits == 0) continue;
+
+          uint32_t offset = __builtin_ctzll(hits);
+          uint32_t slotId = base + offset;
+          runLength = countTrailingOnes(hits >> offset);
+          // A run may continue into the following groups
+          for (uint32_t next = base + 64;
+               next < nSlots && slotId + runLength == next;
+               next += 64) {
+            uint32_t m = std::min(64u, nSlots - next);
+            runLength += countTrailingOnes(matchGroupOf(next, m) & validGroup(valid, next, m));
+          }
+          return slotId;
+        }
+        return ~((uint32_t)0);
+      }
+  };
+}
+#endif
@@ -0,0 +1,285 @@
+#include "warm_restart.h"
+#include "metadata_module.h"
+#include "index_checkpoint.h"
+#include "metadata_codec.h"
+#include "common/config.h"
+#include "common/index_geometry.h"
+#include "common/flat_hash_map.h"
+#include "io/io_module.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+namespace cache {
+
+constexpr uint32_t WarmRestart::kScanThreads;
+constexpr uint32_t WarmRestart::kScanReadSize;
+constexpr uint64_t WarmRestart::kMagic;
+
+WarmRestart& WarmRestart::getInstance()
+{
+  static WarmRestart instance;
+  return instance;
+}
+
+WarmRestart::WarmRestart()
+{
+  enabled_ = Config::getInstance().isWarmRestartEnabled();
+  if (enabled_ && Config::getInstance().getCacheMode() == tWriteBack) {
+    std::cout << "Warm restart needs the write-through mode, disabled" << std::endl;
+    enabled_ = false;
+  }
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  blockStride_ = geometry.colocatedMetadata_ ? geometry.slotStride_ : geometry.metadataSize_;
+}
+
+void WarmRestart::recover()
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  auto start = std::chrono::steady_clock::now();
+
+  alignas(512) uint8_t block[512];
+  RestartBlock restartBlock{}, expected = getRestartBlock(true);
+  IOModule::getInstance().read(CACHE_DEVICE, geometry.restartBlockOffset_, block, 512);
+  memcpy(&restartBlock, block, sizeof(restartBlock));
+  // From here on the blocks change, a crash leaves them behind the cached data
+  writeRestartBlock(false);
+  if (IndexCheckpoint::getInstance().isLoaded()) {
+    std::cout << "Warm restart: the indexes come from the index checkpoint" << std::endl;
+    return;
+  }
+  if (restartBlock.magic_ != kMagic || !restartBlock.clean_) {
+    std::cout << "Warm restart: no clean shutdown recorded, cold start" << std::endl;
+    return;
+  }
+  if (memcmp(&restartBlock, &expected, sizeof(restartBlock)) != 0) {
+    std::cout << "Warm restart: the cache device was written with another geometry, cold start" << std::endl;
+    return;
+  }
+
+  // (slot, fpHash, nSlots) of the chunks and (lba, slot) of their LBAs
+  struct ChunkEntry {
+    uint64_t slot_, fpHash_;
+    uint32_t nSlots_;
+  };
+  std::vector<ChunkEntry> chunks;
+  std::vector<std::pair<uint64_t, uint64_t>> lbas;
+  std::mutex mutex;
+  scan([&](uint64_t firstSlot, uint32_t nSlots, uint8_t *blocks, std::vector<bool> &dirty) {
+    std::vector<ChunkEntry> localChunks;
+    std::vector<std::pair<uint64_t, uint64_t>> localLbas;
+    Metadata metadata;
+    for (uint32_t i = 0; i < nSlots; ++i) {
+      const MetadataBlock &block = *reinterpret_cast<MetadataBlock *>(blocks + i * blockStride_);
+      uint64_t fpHash;
+      uint32_t nSlotsOccupied;
+      if (!MetadataCodec::decode(block, metadata) || !parse(metadata, fpHash, nSlotsOccupied)) continue;
+      localChunks.push_back({firstSlot + i, fpHash, nSlotsOccupied});
+      for (uint32_t j = 0; j < metadata.numLBAs_; ++j) {
+        localLbas.emplace_back(metadata.LBAs_[j], firstSlot + i);
+      }
+    }
+    std::lock_guard<std::mutex> l(mutex);
+    chunks.insert(chunks.end(), localChunks.begin(), localChunks.end());
+    lbas.insert(lbas.end(), localLbas.begin(), localLbas.end());
+  });
+
+  MetadataModule &metadataModule = MetadataModule::getInstance();
+  FPIndex &fpIndex = *metadataModule.fpIndex_;
+  LBAIndex &lbaIndex = *metadataModule.lbaIndex_;
+  FlatHashMap<uint64_t, uint64_t> slotToFpHash;
+  slotToFpHash.reserve(chunks.size());
+  for (const ChunkEntry &chunk : chunks) {
+    if (fpIndex.restore(chunk.fpHash_,
+          chunk.slot_ / geometry.nSlotsPerFpBucket_, chunk.slot_ % geometry.nSlotsPerFpBucket_,
+          chunk.nSlots_)) {
+      slotToFpHash[chunk.slot_] = chunk.fpHash_;
+    }
+  }
+
+  // The shutdown scan leaves every LBA in the list of one chunk, an LBA
+  // listed by several anyway is left out rather than guessed
+  FlatHashMap<uint64_t, uint64_t> lbaToSlot;
+  lbaToSlot.reserve(lbas.size());
+  for (auto &pr : lbas) {
+    auto it = lbaToSlot.find(pr.first);
+    if (it == lbaToSlot.end()) {
+      lbaToSlot[pr.first] = pr.second;
+    } else if (it->second != pr.second) {
+      it->second = ~0ull;
+    }
+  }
+  uint64_t nRestoredLbas = 0;
+  for (auto &pr : lbaToSlot) {
+    auto it = slotToFpHash.find(pr.second);
+    if (pr.second == ~0ull || it == slotToFpHash.end()) continue;
+    uint64_t fpHash = it->second;
+    uint64_t removedFingerprintHash = lbaIndex.update(Chunk::computeLBAHash(pr.first), fpHash);
+    fpIndex.reference(fpHash);
+    if (removedFingerprintHash != ~0ull && removedFingerprintHash != fpHash) {
+      fpIndex.dereference(removedFingerprintHash, fpHash);
+    }
+    ++nRestoredLbas;
+  }
+
+  std::cout << "Warm restart: " << slotToFpHash.size() << " chunks and "
+            << nRestoredLbas << " LBAs restored in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count()
+            << " ms" << std::endl;
+}
+
+void WarmRestart::shutdown()
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  MetadataModule &metadataModule = MetadataModule::getInstance();
+  FPIndex &fpIndex = *metadataModule.fpIndex_;
+  LBAIndex &lbaIndex = *metadataModule.lbaIndex_;
+  bool fakeIO = Config::getInstance().isFakeIOEnabled();
+
+  scan([&](uint64_t firstSlot, uint32_t nSlots, uint8_t *blocks, std::vector<bool> &dirty) {
+    Metadata metadata;
+    for (uint32_t i = 0; i < nSlots; ++i) {
+      MetadataBlock &block = *reinterpret_cast<MetadataBlock *>(blocks + i * blockStride_);
+      uint64_t fpHash;
+      uint32_t nSlotsOccupied;
+      if (!MetadataCodec::decode(block, metadata) || !parse(metadata, fpHash, nSlotsOccupied)) continue;
+
+      uint32_t bucketId = (firstSlot + i) / geometry.nSlotsPerFpBucket_,
+               slotId = (firstSlot + i) % geometry.nSlotsPerFpBucket_,
+               nSubchunks;
+      uint64_t cachedataLocation, metadataLocation;
+      bool indexed = fpIndex.lookup(fpHash, nSubchunks, cachedataLocation, metadataLocation)
+        && metadataLocation == FPIndex::computeMetadataLocation(bucketId, slotId);
+      if (indexed) {
+        // Keep the LBAs mapped to the chunk, oldest first
+        uint64_t LBAs[MAX_NUM_LBAS_PER_CACHED_CHUNK];
+        uint32_t nLBAs = 0,
+                 first = metadata.numLBAs_ == geometry.nMaxLBAsPerChunk_ ? metadata.nextEvict_ : 0;
+        for (uint32_t j = 0; j < metadata.numLBAs_; ++j) {
+          uint64_t lba = metadata.LBAs_[(first + j) % geometry.nMaxLBAsPerChunk_], mappedFpHash;
+          if (lbaIndex.lookup(Chunk::computeLBAHash(lba), mappedFpHash) && mappedFpHash == fpHash) {
+            LBAs[nLBAs++] = lba;
+          }
+        }
+        if (nLBAs == metadata.numLBAs_) continue;
+        if (nLBAs != 0) {
+          memset(metadata.LBAs_, 0, geometry.nMaxLBAsPerChunk_ * sizeof(uint64_t));
+          memcpy(metadata.LBAs_, LBAs, nLBAs * sizeof(uint64_t));
+          metadata.numLBAs_ = nLBAs;
+          metadata.nextEvict_ = 0;
+          MetadataCodec::encode(metadata, block);
+          dirty[i] = true;
+          continue;
+        }
+      } else if (geometry.colocatedMetadata_ && !fakeIO
+          && fpIndex.getFPBucket(bucketId).isValid(slotId)) {
+        // Within the data of a cached chunk
+        continue;
+      }
+      memset(&block, 0, sizeof(MetadataBlock));
+      dirty[i] = true;
+    }
+  });
+  writeRestartBlock(true);
+}
+
+void WarmRestart::scan(const std::function<void(uint64_t firstSlot, uint32_t nSlots,
+      uint8_t *blocks, std::vector<bool> &dirty)> &visit)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  uint64_t nSlots = 1ull * geometry.nFpBuckets_ * geometry.nSlotsPerFpBucket_;
+  uint32_t nSlotsPerRead = std::max<uint64_t>(1, kScanReadSize / blockStride_);
+  uint32_t nThreads = std::min<uint64_t>(kScanThreads, (nSlots + nSlotsPerRead - 1) / nSlotsPerRead);
+  std::atomic<uint64_t> nextSlot(0);
+
+  auto worker = [&]() {
+    uint8_t *blocks;
+    if (posix_memalign(reinterpret_cast<void **>(&blocks), 512, nSlotsPerRead * blockStride_) != 0) {
+      std::cout << "Cannot allocate memory!" << std::endl;
+      exit(-1);
+    }
+    std::vector<bool> dirty(nSlotsPerRead);
+    while (true) {
+      uint64_t firstSlot = nextSlot.fetch_add(nSlotsPerRead);
+      if (firstSlot >= nSlots) break;
+      uint32_t n = std::min<uint64_t>(nSlotsPerRead, nSlots - firstSlot);
+      // Up to the end of the last metadata block
+      uint64_t addr = firstSlot * blockStride_;
+      uint32_t len = (n - 1) * blockStride_ + geometry.metadataSize_;
+      IOModule::getInstance().readMetadata(addr, blocks, len);
+      std::fill(dirty.begin(), dirty.end(), false);
+      visit(firstSlot, n, blocks, dirty);
+      if (std::find(dirty.begin(), dirty.end(), true) == dirty.end()) continue;
+      if (!geometry.colocatedMetadata_) {
+        IOModule::getInstance().writeMetadata(addr, blocks, len);
+        continue;
+      }
+      for (uint32_t i = 0; i < n; ++i) {
+        if (dirty[i]) {
+          IOModule::getInstance().writeMetadata(addr + i * blockStride_,
+              blocks + i * blockStride_, geometry.metadataSize_);
+        }
+      }
+    }
+    free(blocks);
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < nThreads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+bool WarmRestart::parse(const Metadata &metadata, uint64_t &fpHash, uint32_t &nSlots)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  if (metadata.numLBAs_ == 0 || metadata.numLBAs_ > geometry.nMaxLBAsPerChunk_
+      || metadata.nextEvict_ >= geometry.nMaxLBAsPerChunk_
+      || metadata.compressedLen_ > geometry.chunkSize_) {
+    return false;
+  }
+  // As CompressionModule::compress sizes the chunk
+  if (metadata.compressedLen_ == 0) {
+    nSlots = geometry.chunkSize_ / geometry.subchunkSize_;
+  } else {
+    nSlots = (metadata.compressedLen_ + geometry.subchunkSize_ - 1) / geometry.subchunkSize_;
+  }
+  uint8_t fingerprint[sizeof(metadata.fingerprint_)];
+  memcpy(fingerprint, metadata.fingerprint_, sizeof(fingerprint));
+  fpHash = Chunk::computeFingerprintHash(fingerprint);
+  return true;
+}
+
+WarmRestart::RestartBlock WarmRestart::getRestartBlock(bool clean)
+{
+  const IndexGeometry &geometry = IndexGeometry::getInstance();
+  RestartBlock restartBlock{};
+  restartBlock.magic_ = kMagic;
+  restartBlock.clean_ = clean;
+  restartBlock.chunkSize_ = geometry.chunkSize_;
+  restartBlock.subchunkSize_ = geometry.subchunkSize_;
+  restartBlock.metadataSize_ = geometry.metadataSize_;
+  restartBlock.nFpBuckets_ = geometry.nFpBuckets_;
+  restartBlock.nSlotsPerFpBucket_ = geometry.nSlotsPerFpBucket_;
+  restartBlock.nBitsPerFpSignature_ = geometry.nBitsPerFpSignature_;
+  restartBlock.colocatedMetadata_ = geometry.colocatedMetadata_;
+  restartBlock.compactMetadata_ = geometry.compactMetadata_;
+  return restartBlock;
+}
+
+void WarmRestart::writeRestartBlock(bool clean)
+{
+  alignas(512) uint8_t block[512] = {0};
+  RestartBlock restartBlock = getRestartBlock(clean);
+  memcpy(block, &restartBlock, sizeof(restartBlock));
+  IOModule::getInstance().write(CACHE_DEVICE, IndexGeometry::getInstance().restartBlockOffset_, block, 512);
+}
+}
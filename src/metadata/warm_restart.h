@@ -0,0 +1,83 @@
+/* File: metadata/warm_restart.h
+ * Description:
+ *   This file contains WarmRestart, which rebuilds the LBA and FP indexes
+ *   from the metadata blocks on the cache device at startup, so that a
+ *   restarted cache serves hits right away (Config::isWarmRestartEnabled()).
+ *
+ *   1. The metadata blocks alone do not tell which chunks are still cached:
+ *      a slot reused by a later chunk may keep the block of an evicted one,
+ *      and an LBA stays in the list of a chunk it no longer maps to. A clean
+ *      shutdown therefore makes the blocks follow the indexes first
+ *      (shutdown()): the block of every indexed chunk only keeps the LBAs that
+ *      still map to the chunk, the others are zeroed. It then marks the
+ *      restart block after the cached data (IndexGeometry) clean.
+ *   2. recover() rebuilds the indexes only if the restart block is clean and
+ *      was written with the same geometry, and marks it dirty before the
+ *      cache is used, so that after a crash the cache starts cold instead of
+ *      trusting blocks that lag behind the cached data.
+ *   3. Both scan the metadata blocks with kScanThreads threads, each reading
+ *      kScanReadSize bytes of the cache device at a time (the whole extents
+ *      with the colocated layout). The indexes are then filled by one thread:
+ *      every chunk goes back to its slots (FPIndex::restore), every LBA to its
+ *      chunk, which references the fingerprint as MetadataModule::update does.
+ *   4. Write-through only: the dirty list of write-back is not persisted.
+ */
+#ifndef __WARMRESTART_H__
+#define __WARMRESTART_H__
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "common/common.h"
+
+namespace cache {
+
+class WarmRestart {
+ public:
+  static WarmRestart& getInstance();
+  inline bool isEnabled() const { return enabled_; }
+
+  // At startup, after the devices are opened
+  void recover();
+  // At shutdown, after the MetaJournal is flushed
+  void shutdown();
+
+  static constexpr uint32_t kScanThreads = 8;
+  static constexpr uint32_t kScanReadSize = 4 * 1024 * 1024;
+  static constexpr uint64_t kMagic = 0x5452415453455241ull;
+
+  // The restart block, the geometry fields decide whether the metadata
+  // blocks can be read with the current configuration
+  struct RestartBlock {
+    uint64_t magic_;
+    uint32_t clean_;
+    uint32_t chunkSize_, subchunkSize_, metadataSize_;
+    uint32_t nFpBuckets_, nSlotsPerFpBucket_, nBitsPerFpSignature_;
+    uint32_t colocatedMetadata_, compactMetadata_;
+  };
+
+ private:
+  WarmRestart();
+  /**
+   * @brief Read the metadata blocks of all FP slots in parallel
+   *
+   * @param visit called on each read with the first slot, the number of slots
+   *        and the blocks; the block of slot firstSlot + i is at
+   *        blocks + i * blockStride_. The blocks it marks dirty are written back.
+   */
+  void scan(const std::function<void(uint64_t firstSlot, uint32_t nSlots,
+        uint8_t *blocks, std::vector<bool> &dirty)> &visit);
+  /**
+   * @brief Whether the block looks like the one of a cached chunk
+   *
+   * @param nSlots the number of slots of the chunk
+   */
+  bool parse(const Metadata &metadata, uint64_t &fpHash, uint32_t &nSlots);
+  RestartBlock getRestartBlock(bool clean);
+  void writeRestartBlock(bool clean);
+
+  bool enabled_;
+  uint64_t blockStride_;
+};
+}
+
+#endif //__WARMRESTART_H__